@@ -31,6 +31,7 @@
 
 #include <linux/types.h>			/* size_t */
 #include <linux/slab.h>				/* kmalloc */
+#include <linux/vmalloc.h>			/* vmalloc */
 
 #include "fistree.h"
 #include "tftree.h"
@@ -43,10 +44,67 @@ typedef union {
 	fisnode_t	f;			/* 32 bytes item */
 } afree_t;
 
+/* Memory left for port tables in the FIS-tree being made.
+ * FIS-trees are made one at a time from the ioctl handler.
+ */
+static size_t	fistree_portmem;
+
+/* Memory left for address tries in the FIS-tree being made */
+static size_t	fistree_triemem;
+
+int		fistree_addrtrie = 0;	/**< Make address tries? */
+
+/* Rule tables of the FIS-tree being made. Rule i belongs to table t if
+ * fistree_tablebase[t] <= i < fistree_tablebase[t + 1].
+ */
+static int		fistree_ntable;
+static int		fistree_tablebase[FISTREE_MAXTABLE + 1];
+
+/* fistree_tableof(): Table of a rule index */
+static inline int fistree_tableof(int i)
+{
+	int		t = 0;
+
+	while (t < fistree_ntable - 1 && i >= fistree_tablebase[t + 1]) {
+		t++;
+	}
+
+	return t;
+}
+
+/* fistree_scratchalloc(): Allocate a scratch array of the build. Trees are
+ * made in process context with no spinlock held, so the allocation may
+ * sleep, and arrays too large for kmalloc() come from vmalloc().
+ */
+static inline void *fistree_scratchalloc(size_t size)
+{
+	if (size > FISTREE_SCRATCHMAX) {
+		return vmalloc(size);
+	}
+
+	return kmalloc(size, GFP_KERNEL);
+}
+
+/* fistree_scratchfree(): Free an array of fistree_scratchalloc() */
+static inline void fistree_scratchfree(void *p, size_t size)
+{
+	if (size > FISTREE_SCRATCHMAX) {
+		vfree(p);
+	}
+	else {
+		kfree(p);
+	}
+}
+
 
-static tfnode_t *fistree_makeRL(fisrule_t *rule, int *proj, int dim, int maxdim);
-static int *fistree_makenextproj(fisrule_t *rule, int *proj, int dim, uint32_t begin, uint32_t end);
-static tfnode_t *fistree_setfistree(fisrule_t *rule, int *proj, int dim, int maxdim, uint32_t begin, uint32_t end, tfnode_t *node, fisnode_t *rootf);
+static tfnode_t *fistree_makeRL(fisrule_t **rule, int *proj, int dim, int maxdim);
+static int *fistree_makenextproj(fisrule_t **rule, int *proj, int dim, uint32_t begin, uint32_t end);
+static tfnode_t *fistree_setfistree(fisrule_t **rule, int *proj, int dim, int maxdim, uint32_t begin, uint32_t end, tfnode_t *node, fisnode_t *rootf);
+static tfnode_t *fistree_makedirect(tfnode_t *rootRL);
+static tfnode_t *fistree_makeport(tfnode_t *rootRL);
+static void fistree_cleanport(fisport_t *pt);
+static tfnode_t *fistree_maketrie(tfnode_t *rootRL);
+static void fistree_cleantrie(fistrie_t *tr);
 static void fistree_cleanRL(tfnode_t *node);
 static void fistree_cleanfistree(fisnode_t *node);
 static void ruleset_clean(fisruleset_t *set);
@@ -114,12 +172,51 @@ static inline int interval_include_range(fistree_interval_t * interval, uint32_t
  *---------------------------------------------------------------------------
  */
 void *fistree_make(fisrule_t *rule, int maxdim, int nelem)
+{
+	return fistree_makemulti(&rule, &nelem, 1, maxdim);
+}
+
+
+/**
+ *---------------------------------------------------------------------------
+ *
+ * @fn     void *fistree_makemulti(fisrule_t *table[], int nelem[], int ntable, int maxdim)
+ * @brief  Make a FIS-tree shared by several rule tables
+ * @param  table: rule tables
+ * @param  nelem: number of rules of each table
+ * @param  ntable: number of tables (<= FISTREE_MAXTABLE)
+ * @param  maxdim: maximum dimension
+ * @return Returns a pointer to FIS-tree if normal, NULL if abnormal.
+ * @date   18 Oct, 2026
+ * @see    fistree_make(), fistree_querymulti()
+ *
+ *  Make one FIS-tree out of the rules of several tables, so that a single
+ *  query locates the ranges of every dimension once and returns the best
+ *  rule of each table. Every node keeps the best cost of each table, and
+ *  the leaves of the top dimension the best rule of each table.
+ *
+ *---------------------------------------------------------------------------
+ */
+void *fistree_makemulti(fisrule_t *table[], int nelem[], int ntable, int maxdim)
 {
 	tfnode_t		*rootRL;
+	fisrule_t		**rule;
 	int				*proj;
-	int				i, j;
+	int				total = 0;
+	int				i, j, k, t;
 
-	if (nelem == 0) {
+	for (t = 0; t < ntable; t++) {
+		total += nelem[t];
+	}
+
+	if (total == 0 || ntable > FISTREE_MAXTABLE) {
+		return NULL;
+	}
+
+	/* Rules of every table are referred through one array of pointers,
+	 * so that projection tables may keep a single index.
+	 */
+	if ((rule = (fisrule_t **)fistree_scratchalloc(sizeof(fisrule_t *) * total)) == NULL) {
 		return NULL;
 	}
 
@@ -129,30 +226,44 @@ void *fistree_make(fisrule_t *rule, int maxdim, int nelem)
 	 * of nelem in order to deal with bidirectional rules.
 	 */
 
-/*    KMALLOCS(proj, int *, sizeof(int) * (nelem * 2 + 1));*/
-	proj = (int *)kmalloc(sizeof(int) * (nelem * 2 + 1), GFP_ATOMIC);
+	proj = (int *)fistree_scratchalloc(sizeof(int) * (total * 2 + 1));
 	if (proj == NULL) {
+		fistree_scratchfree(rule, sizeof(fisrule_t *) * total);
 		return NULL;
 	}
 
 	j = 1;
+	k = 0;
+
+	fistree_ntable = ntable;
+
+	for (t = 0; t < ntable; t++) {
+		fistree_tablebase[t] = k;
 
-	/* Static rule has a value range from 1 to (2^31 - 1) */
+		/* Static rule has a value range from 1 to (2^31 - 1) */
 
-	for (i = 0; i < nelem; i++) {
-		if (rule[i].cost > 0) {
-			proj[j++] = i;
-			proj[j++] = INVERT(i);
+		for (i = 0; i < nelem[t]; i++, k++) {
+			rule[k] = &table[t][i];
+
+			if (rule[k]->cost > 0) {
+				proj[j++] = k;
+				proj[j++] = INVERT(k);
+			}
 		}
 	}
 
+	fistree_tablebase[ntable] = k;
+
 	proj[0] = (j - 1);
 
 	/* Make a FIS-tree and get a root of (2,4)-tree for the RL problem. */
+	fistree_portmem = FISTREE_PORTMEM;
+	fistree_triemem = fistree_addrtrie ? FISTREE_TRIEMEM : 0;
 	rootRL = fistree_makeRL(rule, proj, 0, maxdim);
 
 	/* Remove the first projection rule table */
-	kfree(proj);
+	fistree_scratchfree(proj, sizeof(int) * (total * 2 + 1));
+	fistree_scratchfree(rule, sizeof(fisrule_t *) * total);
 
 	return (void *)rootRL;
 }
@@ -161,9 +272,9 @@ void *fistree_make(fisrule_t *rule, int maxdim, int nelem)
 /**
  *---------------------------------------------------------------------------
  *
- * @fn     static fisnode_t *fistree_makefistree(fisrule_t *rule, int *proj, int dim, int maxdim, uint32_t begin, uint32_t end, fisnode_t *parent)
+ * @fn     static fisnode_t *fistree_makefistree(fisrule_t **rule, int *proj, int dim, int maxdim, uint32_t begin, uint32_t end, fisnode_t *parent)
  * @brief  Make a FIS-tree node within the given range.
- * @param  fisrule_t *rule: 
+ * @param  fisrule_t **rule: 
  * @param  int *proj:
  * @param  int dim:
  * @param  int maxdim:
@@ -178,44 +289,73 @@ void *fistree_make(fisrule_t *rule, int maxdim, int nelem)
  *
  *---------------------------------------------------------------------------
  */
-static fisnode_t *fistree_makefistree(fisrule_t *rule, int *proj, int dim, int maxdim, uint32_t begin, uint32_t end, fisnode_t *parent)
+static fisnode_t *fistree_makefistree(fisrule_t **rule, int *proj, int dim, int maxdim, uint32_t begin, uint32_t end, fisnode_t *parent)
 {
 	fisnode_t		*node;
 	int				*nextproj;
+	int				found = 0;
+	int				i, r, t;
 
 	/* Get a new node */
-	if ((node = (fisnode_t *)kmalloc(sizeof(fisnode_t), GFP_ATOMIC)) == NULL) {
+	if ((node = (fisnode_t *)kmalloc(sizeof(fisnode_t), GFP_KERNEL)) == NULL) {
 		return NULL;
 	}
 
+	memset(node, 0x00, sizeof(fisnode_t));
+
 	/* Get a rule table to be projected onto the next dimension. */
 	nextproj = fistree_makenextproj(rule, proj, dim, begin, end);
 	if (nextproj == NULL) {
 		kfree(node);
+		return NULL;
+	}
+
+	/* If rule tables exist, record the highest cost among them,
+	 * for each rule table and over all tables. Projections keep the
+	 * order of each table, so the first rule of a table is its best one.
+	 */
+
+	node->cost = node->basecost = WORST_COST;
+
+	for (t = 0; t < FISTREE_MAXTABLE; t++) {
+		node->tcost[t] = WORST_COST;
 	}
 
-	/* If rule tables exist, record the highest cost among them. */
+	for (i = 1; i <= nextproj[0]; i++) {
+		r = INDEX(nextproj[i]);
+		t = fistree_tableof(r);
 
-	if (nextproj[0] > 0) {
-		node->cost = node->basecost = rule[INDEX(nextproj[1])].cost;
+		if ((found & (1 << t))) {
+			continue;
+		}
+
+		found |= (1 << t);
+
+		node->tcost[t] = rule[r]->cost;
 
-		/* If it is not the top dimension,
-		 * make a tree for the RL problem of next dimension.
-		 */
 		if (dim == maxdim) {
-			node->rule = node->baserule = &rule[INDEX(nextproj[1])];
-			rule[INDEX(nextproj[1])].refcnt++;
+			node->trule[t] = rule[r];
+			rule[r]->refcnt++;
 		}
-		else {
-			node->nextRL = fistree_makeRL(rule, nextproj, dim + 1, maxdim);
+
+		if (rule[r]->cost < node->cost) {
+			node->cost = node->basecost = rule[r]->cost;
+
+			if (dim == maxdim) {
+				node->rule = node->baserule = rule[r];
+			}
 		}
 	}
-	else {
-		node->cost = node->basecost = WORST_COST;
+
+	/* If it is not the top dimension,
+	 * make a tree for the RL problem of next dimension.
+	 */
+	if (nextproj[0] > 0 && dim != maxdim) {
+		node->nextRL = fistree_makeRL(rule, nextproj, dim + 1, maxdim);
 	}
 
 	/* Deallocate memories of nextproj since it is not needed any more. */
-	kfree(nextproj);
+	fistree_scratchfree(nextproj, sizeof(int) * (nextproj[0] + 1));
 
 	/* Assign the parent node pointer */
 	if (parent != NULL) {
@@ -236,9 +376,9 @@ static fisnode_t *fistree_makefistree(fisrule_t *rule, int *proj, int dim, int m
 /**
  *---------------------------------------------------------------------------
  *
- * @fn     static int *fistree_makenextproj(fisrule_t *rule, int *proj, int dim, uint32_t begin, uint32_t end)
+ * @fn     static int *fistree_makenextproj(fisrule_t **rule, int *proj, int dim, uint32_t begin, uint32_t end)
  * @brief  Make a rule table to be projected onto the next dimension
- * @param  fisrule_t *rule: 
+ * @param  fisrule_t **rule: 
  * @param  int *proj:
  * @param  int dim:
  * @param  uint32_t begin:
@@ -251,7 +391,7 @@ static fisnode_t *fistree_makefistree(fisrule_t *rule, int *proj, int dim, int m
  *
  *---------------------------------------------------------------------------
  */
-static int *fistree_makenextproj(fisrule_t *rule, int *proj, int dim, uint32_t begin, uint32_t end)
+static int *fistree_makenextproj(fisrule_t **rule, int *proj, int dim, uint32_t begin, uint32_t end)
 {
 	int			*nextproj;
 	int			nextsize = 0;
@@ -266,7 +406,7 @@ static int *fistree_makenextproj(fisrule_t *rule, int *proj, int dim, uint32_t b
 	}
 
 	/* Make a projection rule table */
-	if ((nextproj = (int *)kmalloc(sizeof(int) * (nextsize + 1), GFP_ATOMIC)) == NULL) {
+	if ((nextproj = (int *)fistree_scratchalloc(sizeof(int) * (nextsize + 1))) == NULL) {
 		return NULL;
 	}
 
@@ -292,9 +432,9 @@ static int *fistree_makenextproj(fisrule_t *rule, int *proj, int dim, uint32_t b
 /**
  *---------------------------------------------------------------------------
  *
- * @fn     static tfnode_t *fistree_makeRL(fisrule_t *rule, int *proj, int dim, int maxdim)
+ * @fn     static tfnode_t *fistree_makeRL(fisrule_t **rule, int *proj, int dim, int maxdim)
  * @brief  Make a (2,4)-tree
- * @param  fisrule_t *rule: 
+ * @param  fisrule_t **rule: 
  * @param  int *proj:
  * @param  int dim:
  * @param  int maxdim:
@@ -306,7 +446,7 @@ static int *fistree_makenextproj(fisrule_t *rule, int *proj, int dim, uint32_t b
  *
  *---------------------------------------------------------------------------
  */
-static tfnode_t *fistree_makeRL(fisrule_t *rule, int *proj, int dim, int maxdim)
+static tfnode_t *fistree_makeRL(fisrule_t **rule, int *proj, int dim, int maxdim)
 {
 	fisnode_t	*rootf;
 	tfnode_t	*rootRL = NULL, *hold;
@@ -374,16 +514,499 @@ static tfnode_t *fistree_makeRL(fisrule_t *rule, int *proj, int dim, int maxdim)
 
 	/* Do fistree_setfistree() at all leaves of next dimension's projection */
 
-	return fistree_setfistree(rule, proj, dim, maxdim, 0, 0, rootRL, rootf);
+	rootRL = fistree_setfistree(rule, proj, dim, maxdim, 0, 0, rootRL, rootf);
+
+	/* Small dense dimensions, port dimensions and address dimensions
+	 * are looked up in a table or a trie instead */
+
+	if ((hold = fistree_makedirect(rootRL)) == rootRL) {
+		if (dim >= DIM_SRCPORT) {
+			hold = fistree_makeport(rootRL);
+		}
+		else if (dim == DIM_SRCADDR || dim == DIM_DSTADDR) {
+			hold = fistree_maketrie(rootRL);
+		}
+	}
+
+	return hold;
 }
 
 
 /**
  *---------------------------------------------------------------------------
  *
- * @fn     static tfnode_t *fistree_setfistree(fisrule_t *rule, int *proj, int dim, int maxdim, uint32_t begin, uint32_t end, tfnode_t *node, fisnode_t *rootf)
+ * @fn     static tfnode_t *fistree_makedirect(tfnode_t *rootRL)
+ * @brief  Replace a (2,4)-tree of a small dense dimension by a direct table
+ * @param  rootRL: root of (2,4)-tree whose leaves are all set
+ * @return Returns the direct table, or rootRL if a table does not fit.
+ * @date   18 Oct, 2026
+ * @see    fistree_makeRL(), fistree_query()
+ *
+ *  If every key of the (2,4)-tree is below FISTREE_DIRECTMAX, make a table
+ *  holding the FIS-tree leaf of each value from 0 to the largest key, so
+ *  that the RL problem costs a single load. Interface ids. are small and
+ *  dense, and the interface is the first dimension of every query.
+ *  Larger values share the leaf of the largest key, so devices registered
+ *  later with a higher ifindex need no slot of their own.
+ *
+ *---------------------------------------------------------------------------
+ */
+static tfnode_t *fistree_makedirect(tfnode_t *rootRL)
+{
+	tfnode_t		*node, *RL;
+	fisnode_t		**table;
+	uint32_t		maxkey, value;
+
+	/* The largest key lies in the rightmost leaf */
+	for (RL = rootRL; !TFNODE_ISLEAF(RL); RL = TFNODE_NEXTCHILD(RL, 0xffffffff));
+
+	if ((RL->flag & TFNODE_FLAG_3KEY)) {
+		maxkey = RL->RKEY;
+	}
+	else if ((RL->flag & TFNODE_FLAG_2KEY)) {
+		maxkey = RL->MKEY;
+	}
+	else {
+		maxkey = RL->LKEY;
+	}
+
+	if (maxkey >= FISTREE_DIRECTMAX) {
+		return rootRL;
+	}
+
+	if ((node = (tfnode_t *)kmalloc(sizeof(tfnode_t), GFP_KERNEL)) == NULL) {
+		return rootRL;
+	}
+
+	/* Bounded by FISTREE_DIRECTMAX, so it always fits kmalloc() */
+	if ((table = (fisnode_t **)kmalloc(sizeof(fisnode_t *) * (maxkey + 1), GFP_KERNEL)) == NULL) {
+		kfree(node);
+		return rootRL;
+	}
+
+	/* Solve the RL problem of every value once, here */
+	for (value = 0; value <= maxkey; value++) {
+		for (RL = rootRL; !TFNODE_ISLEAF(RL); RL = TFNODE_NEXTCHILD(RL, value));
+
+		table[value] = (fisnode_t *)TFNODE_NEXTCHILD(RL, value);
+	}
+
+	memset(node, 0x00, sizeof(tfnode_t));
+
+	node->LLC	= (void *)table;
+	node->LMC	= (void *)rootRL;
+	node->LKEY	= maxkey + 1;
+	node->flag	= TFNODE_FLAG_DIRECT;
+
+	return node;
+}
+
+
+/* fistree_walkRL(): Collect the keys and the FIS-tree leaves of a
+ * (2,4)-tree in order. Leaf i covers [keys[i - 1], keys[i]). Either array
+ * may be NULL to count the keys only.
+ */
+static void fistree_walkRL(tfnode_t *node, uint32_t *keys, fisnode_t **leaves, int *n)
+{
+	void		*child[4];
+	uint32_t	key[3];
+	int			nkey, i;
+
+	child[0] = node->LLC;
+	child[1] = node->LMC;
+	child[2] = node->RMC;
+	child[3] = node->RRC;
+
+	key[0] = node->LKEY;
+	key[1] = node->MKEY;
+	key[2] = node->RKEY;
+
+	nkey = (node->flag & TFNODE_FLAG_1KEY) ? 1 : ((node->flag & TFNODE_FLAG_2KEY) ? 2 : 3);
+
+	for (i = 0; i <= nkey; i++) {
+		if (TFNODE_ISLEAF(node)) {
+			if (leaves != NULL) {
+				leaves[*n] = (fisnode_t *)child[i];
+			}
+		}
+		else {
+			fistree_walkRL((tfnode_t *)child[i], keys, leaves, n);
+		}
+
+		if (i < nkey) {
+			if (keys != NULL) {
+				keys[*n] = key[i];
+			}
+
+			(*n)++;
+		}
+	}
+}
+
+/* fistree_portidx(): Interval of a value, i.e. the number of keys <= value */
+static inline uint16_t fistree_portidx(uint32_t *keys, int nkey, uint32_t value)
+{
+	int		lo = 0, hi = nkey, mid;
+
+	while (lo < hi) {
+		mid = (lo + hi) >> 1;
+
+		if (keys[mid] <= value) {
+			lo = mid + 1;
+		}
+		else {
+			hi = mid;
+		}
+	}
+
+	return (uint16_t)lo;
+}
+
+/* fistree_portalloc(): Allocate a part of a port table within the budget.
+ * The leaves grow with the keys, so parts come from
+ * fistree_scratchalloc(), and fistree_cleanport() frees them by size.
+ */
+static inline void *fistree_portalloc(size_t size)
+{
+	void	*p;
+
+	if (size > fistree_portmem) {
+		return NULL;
+	}
+
+	if ((p = fistree_scratchalloc(size)) != NULL) {
+		fistree_portmem -= size;
+	}
+
+	return p;
+}
+
+
+/**
+ *---------------------------------------------------------------------------
+ *
+ * @fn     static tfnode_t *fistree_makeport(tfnode_t *rootRL)
+ * @brief  Replace a (2,4)-tree of a port dimension by a port table
+ * @param  rootRL: root of (2,4)-tree whose leaves are all set
+ * @return Returns the port table, or rootRL if a table does not fit.
+ * @date   18 Oct, 2026
+ * @see    fistree_makeRL(), fistree_query()
+ *
+ *  Make a three-level table of a port dimension, indexed by the protocol
+ *  and the two bytes of the port, so that the RL problem costs at most
+ *  three loads within a couple of cache lines. Only the levels where keys
+ *  fall are allocated, so a port range rule costs a few pages at most.
+ *  Tables of one FIS-tree share FISTREE_PORTMEM; beyond that, and for
+ *  trees with more than 65535 keys, the (2,4)-tree is kept.
+ *
+ *---------------------------------------------------------------------------
+ */
+static tfnode_t *fistree_makeport(tfnode_t *rootRL)
+{
+	tfnode_t		*node = NULL;
+	fisport_t		*pt = NULL;
+	fisportproto_t	*pp;
+	fisportpage_t	*pg;
+	uint32_t		*keys = NULL;
+	uint32_t		base;
+	size_t			keysize;
+	int				nkey = 0;
+	int				p, hi, lo, k;
+
+	fistree_walkRL(rootRL, NULL, NULL, &nkey);
+
+	if (nkey >= 65535) {
+		return rootRL;
+	}
+
+	keysize = sizeof(uint32_t) * nkey;
+
+	if ((keys = (uint32_t *)fistree_scratchalloc(keysize)) == NULL) {
+		return rootRL;
+	}
+
+	if ((pt = (fisport_t *)fistree_portalloc(sizeof(fisport_t))) == NULL) {
+		goto fail;
+	}
+
+	memset(pt, 0x00, sizeof(fisport_t));
+
+	pt->nleaf = nkey + 1;
+
+	if ((pt->leaf = (fisnode_t **)fistree_portalloc(sizeof(fisnode_t *) * pt->nleaf)) == NULL) {
+		goto fail;
+	}
+
+	nkey = 0;
+	fistree_walkRL(rootRL, keys, pt->leaf, &nkey);
+
+	/* Keys are no greater than the end of the last protocol */
+	if (keys[nkey - 1] > FISPORT_MAXKEY) {
+		goto fail;
+	}
+
+	for (p = 0; p < FISPORT_NPROTO; p++) {
+		base = p << DIM_PROTOSHIFT;
+
+		pt->one[p] = fistree_portidx(keys, nkey, base);
+
+		if (pt->one[p] == fistree_portidx(keys, nkey, base | 0xffff)) {
+			continue;
+		}
+
+		if ((pp = (fisportproto_t *)fistree_portalloc(sizeof(fisportproto_t))) == NULL) {
+			goto fail;
+		}
+
+		memset(pp, 0x00, sizeof(fisportproto_t));
+		pt->proto[p] = pp;
+
+		for (hi = 0; hi < 256; hi++) {
+			pp->one[hi] = fistree_portidx(keys, nkey, base | (hi << 8));
+
+			if (pp->one[hi] == fistree_portidx(keys, nkey, base | (hi << 8) | 0xff)) {
+				continue;
+			}
+
+			if ((pg = (fisportpage_t *)fistree_portalloc(sizeof(fisportpage_t))) == NULL) {
+				goto fail;
+			}
+
+			pp->page[hi] = pg;
+
+			/* Walk the keys along with the ports */
+			for (lo = 0, k = pp->one[hi]; lo < 256; lo++) {
+				while (k < nkey && keys[k] <= (base | (hi << 8) | lo)) {
+					k++;
+				}
+
+				pg->idx[lo] = (uint16_t)k;
+			}
+		}
+	}
+
+	if ((node = (tfnode_t *)kmalloc(sizeof(tfnode_t), GFP_KERNEL)) == NULL) {
+		goto fail;
+	}
+
+	memset(node, 0x00, sizeof(tfnode_t));
+
+	node->LLC	= (void *)pt;
+	node->LMC	= (void *)rootRL;
+	node->flag	= TFNODE_FLAG_PORT;
+
+	fistree_scratchfree(keys, keysize);
+
+	return node;
+
+fail:
+	if (pt != NULL) {
+		fistree_cleanport(pt);
+	}
+
+	fistree_scratchfree(keys, keysize);
+
+	return rootRL;
+}
+
+
+/* fistree_cleanport(): Free a port table (not the leaves) */
+static void fistree_cleanport(fisport_t *pt)
+{
+	fisportproto_t	*pp;
+	int				p, hi;
+
+	for (p = 0; p < FISPORT_NPROTO; p++) {
+		if ((pp = pt->proto[p]) == NULL) {
+			continue;
+		}
+
+		for (hi = 0; hi < 256; hi++) {
+			if (pp->page[hi] != NULL) {
+				fistree_scratchfree(pp->page[hi], sizeof(fisportpage_t));
+			}
+		}
+
+		fistree_scratchfree(pp, sizeof(fisportproto_t));
+	}
+
+	if (pt->leaf != NULL) {
+		fistree_scratchfree(pt->leaf, sizeof(fisnode_t *) * pt->nleaf);
+	}
+
+	fistree_scratchfree(pt, sizeof(fisport_t));
+}
+
+
+/* fistree_trieentry(): Fill the entry covering [begin, begin + span).
+ * *k is the first key above begin and is advanced past the range. A new
+ * chunk of the next level is made when a key falls inside the range;
+ * -1 is returned if it can not be.
+ */
+static int fistree_trieentry(fistrie_t *tr, uint32_t *keys, int nkey, int *k, uint32_t begin, uint32_t span, uint32_t *entry)
+{
+	fistriechunk_t	*c;
+	uint32_t		last = begin + (span - 1);
+	int				i;
+
+	/* Skip keys at the beginning; they start this very range */
+	while (*k < nkey && keys[*k] <= begin) {
+		(*k)++;
+	}
+
+	if (*k >= nkey || keys[*k] > last) {
+		*entry = *k;
+		return 0;
+	}
+
+	if (span == 1 || sizeof(fistriechunk_t) > fistree_triemem) {
+		return -1;
+	}
+
+	if ((c = (fistriechunk_t *)kmalloc(sizeof(fistriechunk_t), GFP_KERNEL)) == NULL) {
+		return -1;
+	}
+
+	fistree_triemem -= sizeof(fistriechunk_t);
+
+	tr->chunk[tr->nchunk] = c;
+	*entry = TRIE_CHUNK | tr->nchunk++;
+
+	for (i = 0; i < 256; i++) {
+		if (fistree_trieentry(tr, keys, nkey, k, begin + i * (span >> 8), span >> 8, &c->e[i]) < 0) {
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+
+/**
+ *---------------------------------------------------------------------------
+ *
+ * @fn     static tfnode_t *fistree_maketrie(tfnode_t *rootRL)
+ * @brief  Replace a (2,4)-tree of an address dimension by a multibit trie
+ * @param  rootRL: root of (2,4)-tree whose leaves are all set
+ * @return Returns the trie, or rootRL if a trie does not fit.
+ * @date   18 Oct, 2026
+ * @see    fistree_makeRL(), fistree_query()
+ *
+ *  Make a 16-8-8 trie of an address dimension, so that the RL problem is
+ *  bounded by three loads however deep the (2,4)-tree would be. Chunks of
+ *  the lower levels are only made where keys fall inside them, at most
+ *  two per key. The first level alone takes 256KB, so tries are only
+ *  made if fistree_addrtrie is set, and within FISTREE_TRIEMEM per
+ *  FIS-tree; beyond that the (2,4)-tree is kept.
+ *
+ *---------------------------------------------------------------------------
+ */
+static tfnode_t *fistree_maketrie(tfnode_t *rootRL)
+{
+	tfnode_t		*node;
+	fistrie_t		*tr;
+	uint32_t		*keys;
+	size_t			size, keysize;
+	int				nkey = 0;
+	int				t, k;
+
+	fistree_walkRL(rootRL, NULL, NULL, &nkey);
+
+	size = sizeof(fistrie_t) + sizeof(uint32_t) * TRIE_L1SIZE +
+		sizeof(fisnode_t *) * (nkey + 1) + sizeof(fistriechunk_t *) * nkey * 2;
+
+	if (size > fistree_triemem) {
+		return rootRL;
+	}
+
+	keysize = sizeof(uint32_t) * nkey;
+
+	if ((keys = (uint32_t *)fistree_scratchalloc(keysize)) == NULL) {
+		return rootRL;
+	}
+
+	if ((tr = (fistrie_t *)kmalloc(sizeof(fistrie_t), GFP_KERNEL)) == NULL) {
+		fistree_scratchfree(keys, keysize);
+		return rootRL;
+	}
+
+	memset(tr, 0x00, sizeof(fistrie_t));
+
+	fistree_triemem -= size;
+
+	/* The leaves and the chunks grow with the keys, and may not fit
+	 * kmalloc(); the first level never does */
+	tr->nleaf	= nkey + 1;
+	tr->leaf	= (fisnode_t **)fistree_scratchalloc(TRIE_LEAFSIZE(tr));
+	tr->chunk	= (fistriechunk_t **)fistree_scratchalloc(TRIE_CHUNKSIZE(tr));
+	tr->l1		= (uint32_t *)vmalloc(sizeof(uint32_t) * TRIE_L1SIZE);
+
+	if (tr->leaf == NULL || tr->chunk == NULL || tr->l1 == NULL) {
+		goto fail;
+	}
+
+	nkey = 0;
+	fistree_walkRL(rootRL, keys, tr->leaf, &nkey);
+
+	for (t = 0, k = 0; t < TRIE_L1SIZE; t++) {
+		if (fistree_trieentry(tr, keys, nkey, &k, (uint32_t)t << 16, 1 << 16, &tr->l1[t]) < 0) {
+			goto fail;
+		}
+	}
+
+	if ((node = (tfnode_t *)kmalloc(sizeof(tfnode_t), GFP_KERNEL)) == NULL) {
+		goto fail;
+	}
+
+	memset(node, 0x00, sizeof(tfnode_t));
+
+	node->LLC	= (void *)tr;
+	node->LMC	= (void *)rootRL;
+	node->flag	= TFNODE_FLAG_TRIE;
+
+	fistree_scratchfree(keys, keysize);
+
+	return node;
+
+fail:
+	fistree_cleantrie(tr);
+	fistree_scratchfree(keys, keysize);
+
+	return rootRL;
+}
+
+
+/* fistree_cleantrie(): Free an address trie (not the leaves) */
+static void fistree_cleantrie(fistrie_t *tr)
+{
+	uint32_t	i;
+
+	for (i = 0; i < tr->nchunk; i++) {
+		kfree(tr->chunk[i]);
+	}
+
+	if (tr->chunk != NULL) {
+		fistree_scratchfree(tr->chunk, TRIE_CHUNKSIZE(tr));
+	}
+
+	if (tr->leaf != NULL) {
+		fistree_scratchfree(tr->leaf, TRIE_LEAFSIZE(tr));
+	}
+
+	if (tr->l1 != NULL) {
+		vfree(tr->l1);
+	}
+
+	kfree(tr);
+}
+
+
+/**
+ *---------------------------------------------------------------------------
+ *
+ * @fn     static tfnode_t *fistree_setfistree(fisrule_t **rule, int *proj, int dim, int maxdim, uint32_t begin, uint32_t end, tfnode_t *node, fisnode_t *rootf)
  * @brief  Assign each leaf of FIS-tree into each leaf of (2,4)-tree
- * @param  fisrule_t *rule: 
+ * @param  fisrule_t **rule: 
  * @param  int *proj:
  * @param  int dim:
  * @param  int maxdim:
@@ -399,7 +1022,7 @@ static tfnode_t *fistree_makeRL(fisrule_t *rule, int *proj, int dim, int maxdim)
  *
  *---------------------------------------------------------------------------
  */
-static tfnode_t *fistree_setfistree(fisrule_t *rule, int *proj, int dim, int maxdim, uint32_t begin, uint32_t end, tfnode_t *node, fisnode_t *rootf)
+static tfnode_t *fistree_setfistree(fisrule_t **rule, int *proj, int dim, int maxdim, uint32_t begin, uint32_t end, tfnode_t *node, fisnode_t *rootf)
 {
 	if (TFNODE_ISLEAF(node)) {
 		/* Connect each leaf of FIS-tree into each leaf of (2,4)-tree. */
@@ -498,7 +1121,21 @@ static void fistree_cleanfistree(fisnode_t *node)
  */
 static void fistree_cleanRL(tfnode_t *node)
 {
-	if (TFNODE_ISLEAF(node)) {
+	if (TFNODE_ISDIRECT(node)) {
+		/* The leaves belong to the (2,4)-tree kept in LMC */
+
+		kfree(node->LLC);
+		fistree_cleanRL((tfnode_t *)node->LMC);
+	}
+	else if (TFNODE_ISPORT(node)) {
+		fistree_cleanport((fisport_t *)node->LLC);
+		fistree_cleanRL((tfnode_t *)node->LMC);
+	}
+	else if (TFNODE_ISTRIE(node)) {
+		fistree_cleantrie((fistrie_t *)node->LLC);
+		fistree_cleanRL((tfnode_t *)node->LMC);
+	}
+	else if (TFNODE_ISLEAF(node)) {
 
 		/* Remove each node of FIS-trees */
 
@@ -562,14 +1199,14 @@ void fistree_clean(void *node)
 	if (TFNODE_ISNULL((tfnode_t *)node)) {
 		if (((tfnode_t *)node)->LLC != NULL) {
 			fistree_cleanfistree((fisnode_t *)((tfnode_t *)node)->LLC);
+		}
 
-			/* Remove myself */
+		/* Remove myself */
 
-			kfree(node);
-		}
-		else {
-			fistree_cleanRL((tfnode_t *)node);
-		}
+		kfree(node);
+	}
+	else {
+		fistree_cleanRL((tfnode_t *)node);
 	}
 }
 
@@ -582,9 +1219,9 @@ void fistree_clean(void *node)
  * @param  root: Root of FIS-tree
  * @param  value: Value to be used with query
  * @param  maxdim: Maximum dimension of FIS-tree
- * @return NONE
+ * @return the best rule of the first table, NULL if nothing matches.
  * @date   28 Jul, 2005
- * @see    NONE
+ * @see    fistree_querymulti()
  *
  *  Query rule in FIS-tree with an input value
  *
@@ -592,12 +1229,76 @@ void fistree_clean(void *node)
  */
 fisrule_t *fistree_query(void *root, uint32_t value[], int maxdim)
 {
-	fisrule_t		*rule = NULL;
+	fisrule_t		*rule[FISTREE_MAXTABLE];
+
+	fistree_querymulti(root, value, maxdim, rule, 1);
+
+	return rule[0];
+}
+
+
+/* fistree_better(): Can the node hold a better rule of any table asked? */
+static inline int fistree_better(fisnode_t *node, int cost[], int mask)
+{
+	int		t;
+
+	for (t = 0; t < FISTREE_MAXTABLE; t++) {
+		if ((mask & (1 << t)) && node->tcost[t] < cost[t]) {
+			return 1;
+		}
+	}
+
+	return 0;
+}
+
+/* fistree_take(): Take the better rules of a leaf of the top dimension */
+static inline void fistree_take(fisnode_t *node, int cost[], fisrule_t *rule[], int mask)
+{
+	int		t;
+
+	for (t = 0; t < FISTREE_MAXTABLE; t++) {
+		if ((mask & (1 << t)) && node->tcost[t] < cost[t]) {
+			cost[t] = node->tcost[t];
+			rule[t] = node->trule[t];
+		}
+	}
+}
+
+
+/**
+ *---------------------------------------------------------------------------
+ *
+ * @fn     int fistree_querymulti(void *root, uint32_t value[], int maxdim, fisrule_t *rule[], int mask)
+ * @brief  Query the best rule of several tables in one traversal
+ * @param  root: Root of FIS-tree made by fistree_makemulti()
+ * @param  value: Value to be used with query
+ * @param  maxdim: Maximum dimension of FIS-tree
+ * @param  rule: (out) the best rule of each table, NULL if none matches
+ * @param  mask: tables to be asked, (1 << table) each
+ * @return number of tables with a matching rule
+ * @date   18 Oct, 2026
+ * @see    fistree_makemulti(), fistree_query()
+ *
+ *  Query the FIS-tree with an input value, and return the best rule of
+ *  every table in the mask at once. The range of each dimension is located
+ *  once for all tables, and a sub-tree is only skipped when it can improve
+ *  none of them.
+ *
+ *---------------------------------------------------------------------------
+ */
+int fistree_querymulti(void *root, uint32_t value[], int maxdim, fisrule_t *rule[], int mask)
+{
 	fisnode_t		*parent[MAX_FISTREE_DIM] = { NULL };
 	fisnode_t		*leaf;
 	tfnode_t		*RL;
-	int				cost = WORST_COST;
+	int				cost[FISTREE_MAXTABLE];
 	int				dim = 0;
+	int				t, n = 0;
+
+	for (t = 0; t < FISTREE_MAXTABLE; t++) {
+		cost[t] = WORST_COST;
+		rule[t] = NULL;
+	}
 
 	RL = (tfnode_t *)root;
 
@@ -610,10 +1311,9 @@ fisrule_t *fistree_query(void *root, uint32_t value[], int maxdim)
 			leaf = parent[dim];
 			parent[dim] = NULL;
 
-			if (leaf->cost < cost) {
+			if (fistree_better(leaf, cost, mask)) {
 				if (dim == maxdim) {
-					cost = leaf->cost;
-					rule = leaf->rule;
+					fistree_take(leaf, cost, rule, mask);
 					RL = NULL;
 					dim--;
 				}
@@ -638,10 +1338,9 @@ fisrule_t *fistree_query(void *root, uint32_t value[], int maxdim)
 
 			leaf = (fisnode_t *)RL->LLC;
 
-			if (leaf->cost < cost) {
+			if (fistree_better(leaf, cost, mask)) {
 				if (dim == maxdim) {
-					cost = leaf->cost;
-					rule = leaf->rule;
+					fistree_take(leaf, cost, rule, mask);
 					RL = NULL;
 					dim--;
 				}
@@ -657,11 +1356,22 @@ fisrule_t *fistree_query(void *root, uint32_t value[], int maxdim)
 		}
 		else {
 			/* Now we solve the RL(Range Location) problem. */
-			while (!TFNODE_ISLEAF(RL)) {
-				RL = TFNODE_NEXTCHILD(RL, value[dim]);
+			if (TFNODE_ISDIRECT(RL)) {
+				leaf = DIRECT_LEAF(RL, value[dim]);
+			}
+			else if (TFNODE_ISPORT(RL)) {
+				leaf = port_leaf(RL, value[dim]);
 			}
+			else if (TFNODE_ISTRIE(RL)) {
+				leaf = trie_leaf(RL, value[dim]);
+			}
+			else {
+				while (!TFNODE_ISLEAF(RL)) {
+					RL = TFNODE_NEXTCHILD(RL, value[dim]);
+				}
 
-			leaf = (fisnode_t *)TFNODE_NEXTCHILD(RL, value[dim]);
+				leaf = (fisnode_t *)TFNODE_NEXTCHILD(RL, value[dim]);
+			}
 
 			/* Record parent node on the parent stack */
 
@@ -669,10 +1379,9 @@ fisrule_t *fistree_query(void *root, uint32_t value[], int maxdim)
 
 			/* Query a rule into FIS-tree */
 
-			if (leaf->cost < cost) {
+			if (fistree_better(leaf, cost, mask)) {
 				if (dim == maxdim) {
-					cost = leaf->cost;
-					rule = leaf->rule;
+					fistree_take(leaf, cost, rule, mask);
 				}
 				else {
 					RL = leaf->nextRL;
@@ -683,7 +1392,13 @@ fisrule_t *fistree_query(void *root, uint32_t value[], int maxdim)
 
 	}/* while(dim) */
 
-	return rule;
+	for (t = 0; t < FISTREE_MAXTABLE; t++) {
+		if (rule[t] != NULL) {
+			n++;
+		}
+	}
+
+	return n;
 }
 
 
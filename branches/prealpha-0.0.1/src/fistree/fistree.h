@@ -93,6 +93,9 @@
 #define FISTREE_INSERT(root, rule)	fistree_insert((root), (rule), 0, DIM_DSTPORT)
 #define FISTREE_DELETE(root, rule)	fistree_delete((root), (rule), 0, DIM_DSTPORT)
 
+#define FISTREE_MAKEMULTI(table, nelem, ntable)	fistree_makemulti((table), (nelem), (ntable), DIM_DSTPORT)
+#define FISTREE_QUERYMULTI(root, id, rule, mask)	fistree_querymulti((root), (id), DIM_DSTPORT, (rule), (mask))
+
 /* range of addresses, ..., etc. */
 
 typedef struct fistree_range {
@@ -129,6 +132,8 @@ typedef struct fistree_interval {
 #define MAX_FISTREE_DIM		5
 #endif
 
+#define FISTREE_MAXTABLE	3	/**< Rule tables one FIS-tree can hold */
+
 /*
  * Each static rule have to be included in an arbitrary SPD structure
  * as an array. This array is assumed to be sorted by ascending order of
@@ -155,6 +160,10 @@ typedef struct fisrule {
 void *fistree_make(fisrule_t *rule, int maxdim, int nelem);
 void fistree_clean(void *node);
 fisrule_t *fistree_query(void *root, uint32_t value[], int maxdim);
+void *fistree_makemulti(fisrule_t *table[], int nelem[], int ntable, int maxdim);
+int fistree_querymulti(void *root, uint32_t value[], int maxdim, fisrule_t *rule[], int mask);
+
+extern int	fistree_addrtrie;	/* Make address tries? (internal.h) */
 
 
 /*
@@ -74,6 +74,9 @@ typedef struct fisnode {
 	fisrule_t		*baserule;	/**< The rule chosen by base canonical set. */
 
 	int				refcnt;		/**< Reference count */
+
+	int				tcost[FISTREE_MAXTABLE];	/**< The best cost of each rule table */
+	fisrule_t		*trule[FISTREE_MAXTABLE];	/**< The best rule of each table (top dimension only) */
 } fisnode_t;
 
 
@@ -82,8 +85,143 @@ typedef struct fisnode {
  */
 #define INVERT(idx)			(-(idx) - 1)
 #define INDEX(idx)			(((idx) >= 0) ? (idx) : -((idx) + 1))
-#define FIELD(rule, dim, idx)	(((idx) >= 0) ? &((rule)[(idx)]).field[(dim)] : &((rule)[-((idx) + 1)]).inversefield[(dim)])
+#define FIELD(rule, dim, idx)	(((idx) >= 0) ? &((rule)[(idx)])->field[(dim)] : &((rule)[-((idx) + 1)])->inversefield[(dim)])
 
 #define WORST_COST		2147483647		/**< (2^31 - 1) */
 
+/*
+ * Direct tables
+ *
+ * A dimension whose keys are all below FISTREE_DIRECTMAX (the interface
+ * id. in practice) is resolved with a table indexed by the value instead
+ * of a (2,4)-tree. The table is a tfnode_t flagged TFNODE_FLAG_DIRECT,
+ * whose LLC points to the FIS-tree leaf of every value up to the largest
+ * key, LKEY is the number of slots, and LMC keeps the (2,4)-tree it was
+ * made from. Values beyond the table fall into the last interval.
+ */
+
+#define FISTREE_DIRECTMAX	1024
+
+#define DIRECT_LEAF(node, value)	(((fisnode_t **)(node)->LLC)[((value) < (node)->LKEY) ? (value) : (node)->LKEY - 1])
+
+/*
+ * Port tables
+ *
+ * Port dimensions hold (protocol << DIM_PROTOSHIFT | port), so their keys
+ * are never small. Their (2,4)-trees are replaced by a table indexed with
+ * the protocol, then the high byte and the low byte of the port. A level
+ * is only allocated where keys fall inside it; elsewhere a single
+ * interval covers the whole range. The tfnode_t is flagged
+ * TFNODE_FLAG_PORT, LLC points to the fisport_t and LMC keeps the (2,4)-tree.
+ */
+
+#define FISPORT_NPROTO		256
+#define FISPORT_MAXKEY		(FISPORT_NPROTO << DIM_PROTOSHIFT)
+
+#define FISTREE_PORTMEM		(8 * 1024 * 1024)	/**< Memory for port tables per FIS-tree */
+#define FISTREE_SCRATCHMAX	(32 * 1024)			/**< Larger scratch arrays come from vmalloc() */
+
+/* fisportpage_t: interval of each low byte of the port */
+
+typedef struct fisportpage {
+	uint16_t		idx[256];
+} fisportpage_t;
+
+/* fisportproto_t: interval of each high byte of the port in a protocol */
+
+typedef struct fisportproto {
+	fisportpage_t	*page[256];	/**< NULL if one interval covers the high byte */
+	uint16_t		one[256];	/**< interval of a high byte without a page */
+} fisportproto_t;
+
+/* fisport_t */
+
+typedef struct fisport {
+	fisnode_t		**leaf;		/**< FIS-tree leaves in the order of intervals */
+	uint32_t		nleaf;		/**< number of leaves */
+	fisportproto_t	*proto[FISPORT_NPROTO];	/**< NULL if one interval covers the protocol */
+	uint16_t		one[FISPORT_NPROTO];	/**< interval of a protocol without a table */
+} fisport_t;
+
+/* port_leaf(): Solve the RL problem of a port dimension with a port table */
+
+static inline fisnode_t *port_leaf(tfnode_t *node, uint32_t value)
+{
+	fisport_t		*pt = (fisport_t *)node->LLC;
+	fisportproto_t	*pp;
+	fisportpage_t	*pg;
+	uint32_t		p = value >> DIM_PROTOSHIFT;
+	uint32_t		hi = (value >> 8) & 0xff;
+
+	if (p >= FISPORT_NPROTO) {
+		return pt->leaf[pt->nleaf - 1];
+	}
+
+	if ((pp = pt->proto[p]) == NULL) {
+		return pt->leaf[pt->one[p]];
+	}
+
+	if ((pg = pp->page[hi]) == NULL) {
+		return pt->leaf[pp->one[hi]];
+	}
+
+	return pt->leaf[pg->idx[value & 0xff]];
+}
+
+/*
+ * Address tries
+ *
+ * If fistree_addrtrie is set, the (2,4)-trees of address dimensions are
+ * replaced by a 16-8-8 multibit trie, so that an address is located in
+ * at most three loads however many keys there are. An entry either holds
+ * the interval of its whole range, or TRIE_CHUNK and the number of the
+ * chunk of the next level. The tfnode_t is flagged TFNODE_FLAG_TRIE, LLC
+ * points to the fistrie_t and LMC keeps the (2,4)-tree.
+ */
+
+#define TRIE_CHUNK			0x80000000
+#define TRIE_L1SIZE			65536
+
+#define FISTREE_TRIEMEM		(16 * 1024 * 1024)	/**< Memory for tries per FIS-tree */
+
+/* fistriechunk_t: a chunk of the second or the third level */
+
+typedef struct fistriechunk {
+	uint32_t		e[256];
+} fistriechunk_t;
+
+/* fistrie_t */
+
+typedef struct fistrie {
+	fisnode_t		**leaf;		/**< FIS-tree leaves in the order of intervals */
+	uint32_t		nleaf;		/**< number of leaves */
+	uint32_t		*l1;		/**< first level, by the upper 16 bits */
+	fistriechunk_t	**chunk;	/**< chunks of the lower levels */
+	uint32_t		nchunk;		/**< number of chunks */
+} fistrie_t;
+
+/* Sizes of the leaf and chunk arrays; at most two chunks per key */
+#define TRIE_LEAFSIZE(tr)	(sizeof(fisnode_t *) * (tr)->nleaf)
+#define TRIE_CHUNKSIZE(tr)	(sizeof(fistriechunk_t *) * ((tr)->nleaf - 1) * 2)
+
+/* trie_leaf(): Solve the RL problem of an address dimension with a trie */
+
+static inline fisnode_t *trie_leaf(tfnode_t *node, uint32_t value)
+{
+	fistrie_t		*tr = (fistrie_t *)node->LLC;
+	uint32_t		e;
+
+	e = tr->l1[value >> 16];
+
+	if ((e & TRIE_CHUNK)) {
+		e = tr->chunk[e & ~TRIE_CHUNK]->e[(value >> 8) & 0xff];
+
+		if ((e & TRIE_CHUNK)) {
+			e = tr->chunk[e & ~TRIE_CHUNK]->e[value & 0xff];
+		}
+	}
+
+	return tr->leaf[e];
+}
+
 #endif	/* __FISTREE_INTERNAL_H__ */
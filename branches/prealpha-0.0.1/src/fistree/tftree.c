@@ -191,11 +191,11 @@ tfnode_t *tftree_merge(tfnode_t *parent, tfnode_t *child)
 	else {
 		/* If the memory allocation failed, quit this function immediately */
 
-		if ((lchild = (tfnode_t *)kmalloc(sizeof(tfnode_t), GFP_ATOMIC)) == NULL) {
+		if ((lchild = (tfnode_t *)kmalloc(sizeof(tfnode_t), GFP_KERNEL)) == NULL) {
 			return parent;
 		}
 
-		if ((rchild = (tfnode_t *)kmalloc(sizeof(tfnode_t), GFP_ATOMIC)) == NULL) {
+		if ((rchild = (tfnode_t *)kmalloc(sizeof(tfnode_t), GFP_KERNEL)) == NULL) {
 			return parent;
 		}
 
@@ -321,7 +321,7 @@ tfnode_t *tftree_insert(tfnode_t *root, uint32_t key)
 	tfnode_t		*hold;
 
 	/* First make a node for a new key */
-	if ((hold = (tfnode_t *)kmalloc(sizeof(tfnode_t), GFP_ATOMIC)) == NULL) {
+	if ((hold = (tfnode_t *)kmalloc(sizeof(tfnode_t), GFP_KERNEL)) == NULL) {
 		return NULL;
 	}
 
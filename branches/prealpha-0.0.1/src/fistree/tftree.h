@@ -56,9 +56,15 @@ typedef struct tfnode {
 #define TFNODE_FLAG_2KEY	0x00000040
 #define TFNODE_FLAG_3KEY	0x00000080
 #define TFNODE_FLAG_NKEY	0x000000f0
+#define TFNODE_FLAG_DIRECT	0x00000100	/* a direct table, not a (2,4)-tree node */
+#define TFNODE_FLAG_PORT	0x00000200	/* a port table, not a (2,4)-tree node */
+#define TFNODE_FLAG_TRIE	0x00000400	/* an address trie, not a (2,4)-tree node */
 
 #define TFNODE_ISNULL(node)	((node)->flag & TFNODE_FLAG_NULL)
 #define TFNODE_ISLEAF(node)	((node)->flag & TFNODE_FLAG_LEAF)
+#define TFNODE_ISDIRECT(node)	((node)->flag & TFNODE_FLAG_DIRECT)
+#define TFNODE_ISPORT(node)		((node)->flag & TFNODE_FLAG_PORT)
+#define TFNODE_ISTRIE(node)		((node)->flag & TFNODE_FLAG_TRIE)
 
 #define TFNODE_NEXTCHILD(node, key) (((key) < (node)->LKEY) ? (node)->LLC \
 									: (((node)->flag & TFNODE_FLAG_1KEY) ? (node)->LMC \
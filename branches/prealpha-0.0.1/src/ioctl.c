@@ -31,10 +31,18 @@
 
 #include <linux/kernel.h>			/* printk() */
 #include <asm/uaccess.h>			/* copy_to_user(), copy_from_user() */
+#include <linux/vmalloc.h>			/* vmalloc(), vfree() */
+#include <linux/tqueue.h>			/* schedule_task() */
 #include <linux/netfilter_ipv4/lockhelp.h>	/* *_LOCK, *_UNLOCK */
+#include <asm/semaphore.h>			/* DECLARE_MUTEX() */
 
 #include "zelkova.h"
+#include "zkfilter.h"
+#include "zknat.h"
 #include "zksession.h"
+#include "zkfrag.h"
+#include "zkstat.h"
+#include "zkctl.h"
 #include "fistree/fistree.h"
 
 
@@ -51,7 +59,8 @@ typedef struct zk_filter_stat {
  * Global variables
  */
 
-zk_filter_stat_t	zkfr_stat;	/* inbound/outbound filter statistics */
+zk_filter_stat_t	zkfr_stat;	/* inbound/outbound filter statistics
+								 * (counters are summed from zkstat_cpu[]) */
 
 #ifdef __KERNEL__
 DECLARE_RWLOCK_EXTERN(spd_lock);	/* R/W lock with SPD root and static SPD */
@@ -63,10 +72,1192 @@ DECLARE_RWLOCK_EXTERN(spd_lock);	/* R/W lock with SPD root and static SPD */
 extern void		*spdroot;		/* FIS-tree root */
 extern zkspd_t	staticspd;		/* static SPD (in zkfilter.c) */
 
+static zkdfrule_t	*prerule = NULL;	/* default allow rules to be set */
+static int			precnt = 0;			/* number of prerule */
+
+/* Writers of the static SPD and the NAT tables
+ * The big kernel lock is dropped whenever ioctl() sleeps in copy_from_user()
+ * or vmalloc(), so every filter ioctl() command, every filter message of
+ * DEV_CTL and the background rebuild hold zkfr_sem instead. It also guards
+ * the upload and transaction states below. spd_lock only keeps the
+ * datapath away while a writer switches the tables.
+ */
+
+static DECLARE_MUTEX(zkfr_sem);			/**< Serializes the SPD writers */
+
+/* State of the chunked upload of static rules (SIOCBEGINFR ~ SIOCCOMMITFR) */
+
+static zkspd_t		zkfr_up;			/* SPD being uploaded */
+static uint32_t		zkfr_total;			/* rules to be uploaded (without prerule) */
+static uint32_t		zkfr_done;			/* rules uploaded so far */
+static int			zkfr_lastcost;		/* cost of the last active rule */
+static int			zkfr_active = 0;	/* is an upload in progress? */
+
+/* Rule transactions (SIOCTXBEGIN ~ SIOCTXCOMMIT)
+ * Operations are staged in zkfr_txop[]. A committed transaction which
+ * needs a new FIS-tree is handed to zkfr_txpend[] and rebuilt by keventd.
+ */
+
+static zkfrop_t		*zkfr_txop = NULL;	/* staged operations */
+static uint32_t		zkfr_txnelem;		/* number of staged operations */
+static uint32_t		zkfr_txsize;		/* size of zkfr_txop[] */
+static int			zkfr_txactive = 0;	/* is a transaction open? */
+
+static zkfrop_t		*zkfr_txpend = NULL;	/* operations of the pending rebuild */
+static uint32_t		zkfr_txnpend;			/* number of them */
+static int			zkfr_txerror = 0;		/* result of the last rebuild */
+static struct tq_struct	zkfr_txtask;		/* background rebuild */
+
+static uint32_t		zkfr_gen = 0;		/* generation of the static SPD */
+
+#define ZKFR_MAXRULE		(1 << 20)	/**< Rules of a chunked upload */
+#define ZKFR_MAXRANGE		65536		/**< Ranges of a range set of an uploaded rule */
+#define ZKFR_MAXTXOP		4096		/**< Operations of a transaction */
+
+
+/**
+ *---------------------------------------------------------------------------
+ *
+ * @fn     static void zkfr_copyprerule(fisrule_t *rule)
+ * @brief  Copy the default allow rules to the head of a rule table
+ * @param  rule: rule table with room for precnt rules at the head
+ * @return NONE
+ * @date   18 Oct, 2026
+ * @see    zkfr_install()
+ *
+ *  We should interate index by reverse order because prerule is
+ *  constructed as a linked list of stack-type
+ *
+ *---------------------------------------------------------------------------
+ */
+
+static void zkfr_copyprerule(fisrule_t *rule)
+{
+	zkdfrule_t		*zkdfrule = prerule;
+	int				i;
+
+	for (i = precnt - 1; i >= 0; i--) {
+		memcpy(&rule[i], &zkdfrule->dfrule_rule, sizeof(fisrule_t));
+
+		/* Traverse linked list with link to brother nodes */
+		zkdfrule = zkdfrule->dfrule_bnext;
+	}
+}
+
+
+/**
+ *---------------------------------------------------------------------------
+ *
+ * @fn     static int zkfr_install(zkspd_t *spd)
+ * @brief  Make a FIS-tree of a new static SPD and put it in service
+ * @param  spd: static SPD with the rules, the actions, the policies and
+ *              the counters filled in
+ * @return 0 if normal, <0 if abnormal (spd has been cleaned).
+ * @date   18 Oct, 2026
+ * @see    SIOCSETFR, SIOCCOMMITFR
+ *
+ *  Link the rules and the actions, make the FIS-tree with the NAT rules,
+ *  and replace the current static SPD with the new one. An empty SPD
+ *  (every rule deleted by a transaction) is allowed.
+ *
+ *---------------------------------------------------------------------------
+ */
+
+static int zkfr_install(zkspd_t *spd)
+{
+	fisrule_t			*rule = spd->spd_table;
+	zkact_t				*zkact = spd->spd_act;
+	zk_policy_t			*po = (zk_policy_t *)spd->spd_policy;
+	zkactstat_t			*stat = spd->spd_stat;
+	zkspd_t				zkspd, oldspd;
+	zkspd_t				*nat[2];
+	void				*root, *oldroot;
+	int					i, j;
+
+	memcpy(&zkspd, spd, sizeof(zkspd_t));
+
+	nat[NAT_REDIR]	= &staticnat[NAT_REDIR];
+	nat[NAT_NORMAL]	= &staticnat[NAT_NORMAL];
+
+	/* If rangeset is not allocated since it ran out of memory,
+	 * Clean SPD correctly and return an error.
+	 */
+
+	for (i = zkspd.spd_precnt; i < zkspd.spd_nelem; i++) {
+		/* Skip inactivated rules */
+		if (rule[i].cost == 0) {
+			continue;
+		}
+
+		for (j = 0; j < MAX_FISTREE_DIM; j++) {
+			if (rule[i].field[j].type == 0) {
+				zkspd_clean(&zkspd);
+				return -ENOMEM;
+			}
+		}
+
+		/* Link each policy table. */
+		zkact[i].act_policy = &po[i - zkspd.spd_precnt];
+	}
+
+	/* Initialize for rule[] and act[] arrays */
+
+	for (i = 0; i < zkspd.spd_nelem; i++) {
+		rule[i].refcnt = 0;
+		rule[i].action = &zkact[i];
+
+		zkact[i].act_rule	= &rule[i];
+		zkact[i].act_parent	= NULL;
+		zkact[i].act_hits	= 0;
+		zkact[i].act_pkts	= 0;
+		zkact[i].act_bytes	= 0;
+		zkact[i].act_stat	= stat + i;
+		zkact[i].act_nstat	= zkspd.spd_nelem;
+	}
+
+	/* Index of the actions by policy IDs for zkdfrule_syncrule()
+	 * (the linear scan is used if it fails) */
+	zkspd_makeindex(&zkspd);
+
+	/* Now we make a FIS-tree for static rules and the NAT rules */
+	root = zkfilter_makeroot(&zkspd, nat);
+	if (root == NULL && zkspd.spd_nelem + nat[NAT_REDIR]->spd_nelem + nat[NAT_NORMAL]->spd_nelem > 0) {
+		zkspd_clean(&zkspd);
+		return -ENOMEM;
+	}
+
+	/* Counts of live sessions go to the old rules before they are freed */
+	ipsess_foldstat();
+
+	WRITE_LOCK(&spd_lock);
+
+	/* Reassign the root of FIS-tree and the SPD table */
+
+	oldroot = spdroot;
+	spdroot = root;
+
+	zkdfrule_syncrule(&zkspd);	/* Relink dynamic rules to the new SPD */
+	ipsess_syncrule(1);		/* Make the session table be compatible with the new FIS-tree */
+
+	/* Set a new static SPD, and remove the old one out of the lock */
+
+	memcpy(&oldspd, &staticspd, sizeof(zkspd_t));
+
+	memcpy(&staticspd, &zkspd, sizeof(zkspd));
+	staticspd.spd_prerule = prerule;
+
+	zkfr_gen++;
+
+	WRITE_UNLOCK(&spd_lock);
+
+	/* The old FIS-tree is vfree()d, which may not be done under the lock */
+	if (oldroot != NULL) {
+		FISTREE_CLEAN(oldroot);
+	}
+
+	zkspd_clean(&oldspd);
+
+	prerule = NULL;
+	precnt = 0;
+
+	zkctl_notifygen(zkfr_gen, 0);
+
+	return 0;
+}
+
+
+/**
+ *---------------------------------------------------------------------------
+ *
+ * @fn     static void zkfr_freeranges(fisrule_t *rule, int ndim)
+ * @brief  Free the range sets of the first dimensions of a rule
+ * @param  rule: rule
+ * @param  ndim: number of dimensions
+ * @return NONE
+ * @date   18 Oct, 2026
+ * @see    zkfr_copyranges(), zkfr_abort()
+ *
+ *  Free the range sets of the first dimensions of a rule
+ *
+ *---------------------------------------------------------------------------
+ */
+
+static void zkfr_freeranges(fisrule_t *rule, int ndim)
+{
+	int		j;
+
+	for (j = 0; j < ndim; j++) {
+		if (rule->field[j].type == INTERVAL_RANGESET) {
+			KFREES(rule->field[j].r.set.table);
+		}
+	}
+}
+
+
+/**
+ *---------------------------------------------------------------------------
+ *
+ * @fn     static int zkfr_copyranges(fisrule_t *rule)
+ * @brief  Validate the intervals of a rule and copy its range sets
+ * @param  rule: rule copied from user memory, whose range sets still
+ *               point to user memory
+ * @return 0 if normal, <0 if abnormal (no range set is left allocated).
+ * @date   18 Oct, 2026
+ * @see    zkfr_append(), zkfr_txappend()
+ *
+ *  The intervals have to be of a known type, and range sets have to be
+ *  of a sane size. Range sets are copied to kernel memory.
+ *
+ *---------------------------------------------------------------------------
+ */
+
+static int zkfr_copyranges(fisrule_t *rule)
+{
+	fistree_interval_t	*field;
+	fistree_range_t		*rangetable;
+	size_t				rangesize;
+	int					j;
+
+	for (j = 0; j < MAX_FISTREE_DIM; j++) {
+		field = &rule->field[j];
+
+		if (field->type == INTERVAL_ANYTOANY || field->type == INTERVAL_RANGEONE) {
+			continue;
+		}
+
+		if (field->type != INTERVAL_RANGESET ||
+				field->r.set.nelem == 0 || field->r.set.nelem > ZKFR_MAXRANGE) {
+			break;
+		}
+
+		rangesize = sizeof(fistree_range_t) * field->r.set.nelem;
+
+		if ((rangetable = (fistree_range_t *)kmalloc(rangesize, GFP_KERNEL)) == NULL) {
+			break;
+		}
+
+		if (copy_from_user(rangetable, field->r.set.table, rangesize)) {
+			kfree(rangetable);
+			break;
+		}
+
+		field->r.set.table = rangetable;
+	}
+
+	if (j < MAX_FISTREE_DIM) {
+		zkfr_freeranges(rule, j);
+		return -EINVAL;
+	}
+
+	return 0;
+}
+
+
+/**
+ *---------------------------------------------------------------------------
+ *
+ * @fn     static void zkfr_abort(void)
+ * @brief  Discard the chunked upload in progress
+ * @param  NONE
+ * @return NONE
+ * @date   18 Oct, 2026
+ * @see    SIOCABORTFR
+ *
+ *  Free the rules uploaded so far.
+ *
+ *---------------------------------------------------------------------------
+ */
+
+static void zkfr_abort(void)
+{
+	int		i;
+
+	if (!zkfr_active) {
+		return;
+	}
+
+	/* The default allow rules at the head are still owned by prerule */
+	for (i = zkfr_up.spd_precnt; i < zkfr_up.spd_nelem; i++) {
+		zkfr_freeranges(&zkfr_up.spd_table[i], MAX_FISTREE_DIM);
+	}
+
+	vfree(zkfr_up.spd_table);
+	vfree(zkfr_up.spd_act);
+	vfree(zkfr_up.spd_policy);
+	zkstat_free(zkfr_up.spd_stat);
+
+	memset(&zkfr_up, 0x00, sizeof(zkfr_up));
+
+	zkfr_active = 0;
+}
+
+
+/**
+ *---------------------------------------------------------------------------
+ *
+ * @fn     static int zkfr_begin(zkfrupload_t *up)
+ * @brief  Start a chunked upload of static rules
+ * @param  up: fru_total is the number of rules to be uploaded
+ * @return 0 if normal, <0 if abnormal.
+ * @date   18 Oct, 2026
+ * @see    zkfr_append(), SIOCBEGINFR
+ *
+ *  Allocate the tables of the whole SPD with vmalloc(), which may sleep
+ *  and needs no physically contiguous memory, so that neither a large
+ *  policy nor the atomic reserves of the datapath are at stake.
+ *  An upload in progress is discarded.
+ *
+ *---------------------------------------------------------------------------
+ */
+
+static int zkfr_begin(zkfrupload_t *up)
+{
+	uint32_t		nelem = up->fru_total + precnt;
+
+	zkfr_abort();
+
+	if (nelem == 0 || up->fru_total > ZKFR_MAXRULE) {
+		return -EINVAL;
+	}
+
+	memset(&zkfr_up, 0x00, sizeof(zkfr_up));
+
+	zkfr_up.spd_flag	= SPD_VMALLOC;
+	zkfr_up.spd_precnt	= precnt;
+	zkfr_up.spd_table	= (fisrule_t *)vmalloc(sizeof(fisrule_t) * nelem);
+	zkfr_up.spd_act		= (zkact_t *)vmalloc(sizeof(zkact_t) * nelem);
+	zkfr_up.spd_stat	= zkstat_alloc(nelem);
+
+	if (up->fru_total > 0) {
+		zkfr_up.spd_policy = vmalloc(sizeof(zk_policy_t) * up->fru_total);
+	}
+
+	zkfr_active = 1;
+
+	if (zkfr_up.spd_table == NULL || zkfr_up.spd_act == NULL || zkfr_up.spd_stat == NULL ||
+			(up->fru_total > 0 && zkfr_up.spd_policy == NULL)) {
+		zkfr_abort();
+		return -ENOMEM;
+	}
+
+	zkfr_copyprerule(zkfr_up.spd_table);
+
+	zkfr_up.spd_nelem	= precnt;
+	zkfr_total			= up->fru_total;
+	zkfr_done			= 0;
+	zkfr_lastcost		= 0;
+
+	up->fru_done = 0;
+
+	return 0;
+}
+
+
+/**
+ *---------------------------------------------------------------------------
+ *
+ * @fn     static int zkfr_append(zkfrupload_t *up)
+ * @brief  Append a chunk of rules to the upload in progress
+ * @param  up: fru_nelem rules of fru_table[], fru_act[] and fru_policy[]
+ * @return 0 if normal, <0 if abnormal.
+ * @date   18 Oct, 2026
+ * @see    zkfr_begin(), zkfr_commit(), SIOCADDFR
+ *
+ *  Copy a chunk and validate it: the intervals have to be of a known
+ *  type, range sets have to be of a sane size, and the costs of active
+ *  rules have to be in ascending order. A bad chunk is refused as a
+ *  whole, and leaves the upload as it was before the chunk. fru_done
+ *  returns the number of rules uploaded so far.
+ *
+ *---------------------------------------------------------------------------
+ */
+
+static int zkfr_append(zkfrupload_t *up)
+{
+	fisrule_t			*rule;
+	uint32_t			base;
+	int					lastcost = zkfr_lastcost;
+	int					i, k;
+
+	if (!zkfr_active) {
+		return -EINVAL;
+	}
+
+	if (up->fru_nelem > zkfr_total - zkfr_done) {
+		return -EINVAL;
+	}
+
+	base = zkfr_up.spd_precnt + zkfr_done;
+	rule = zkfr_up.spd_table + base;
+
+	if (copy_from_user(rule, up->fru_table, sizeof(fisrule_t) * up->fru_nelem) ||
+			copy_from_user(zkfr_up.spd_act + base, up->fru_act, sizeof(zkact_t) * up->fru_nelem) ||
+			copy_from_user((zk_policy_t *)zkfr_up.spd_policy + zkfr_done, up->fru_policy,
+				sizeof(zk_policy_t) * up->fru_nelem)) {
+		return -EFAULT;
+	}
+
+	for (i = 0; i < up->fru_nelem; i++) {
+		/* Costs of active rules are in ascending order */
+		if (rule[i].cost < 0 || (rule[i].cost > 0 && rule[i].cost < lastcost)) {
+			break;
+		}
+
+		if (rule[i].cost > 0) {
+			lastcost = rule[i].cost;
+		}
+
+		if (zkfr_copyranges(&rule[i]) < 0) {
+			break;
+		}
+	}
+
+	if (i < up->fru_nelem) {
+		/* Roll back the chunk */
+		for (k = 0; k < i; k++) {
+			zkfr_freeranges(&rule[k], MAX_FISTREE_DIM);
+		}
+
+		return -EINVAL;
+	}
+
+	zkfr_lastcost		= lastcost;
+	zkfr_done			+= up->fru_nelem;
+	zkfr_up.spd_nelem	= zkfr_up.spd_precnt + zkfr_done;
+
+	up->fru_done = zkfr_done;
+
+	return 0;
+}
+
+
+/**
+ *---------------------------------------------------------------------------
+ *
+ * @fn     static int zkfr_commit(void)
+ * @brief  Finish the chunked upload and put the rules in service
+ * @param  NONE
+ * @return 0 if normal, <0 if abnormal.
+ * @date   18 Oct, 2026
+ * @see    zkfr_begin(), SIOCCOMMITFR
+ *
+ *  Finish the chunked upload and put the rules in service, once all the
+ *  rules announced by SIOCBEGINFR have arrived.
+ *
+ *---------------------------------------------------------------------------
+ */
+
+static int zkfr_commit(void)
+{
+	zkspd_t		zkspd;
+
+	if (!zkfr_active || zkfr_done != zkfr_total) {
+		return -EINVAL;
+	}
+
+	/* The default allow rules have been changed during the upload */
+	if (zkfr_up.spd_precnt != precnt) {
+		zkfr_abort();
+		return -EAGAIN;
+	}
+
+	memcpy(&zkspd, &zkfr_up, sizeof(zkspd_t));
+	memset(&zkfr_up, 0x00, sizeof(zkfr_up));
+
+	zkfr_active = 0;
+
+	return zkfr_install(&zkspd);
+}
+
+
+/**
+ *---------------------------------------------------------------------------
+ *
+ * @fn     static void zkfr_txfree(zkfrop_t *op, uint32_t nelem)
+ * @brief  Free operations of a transaction
+ * @param  op: operations
+ * @param  nelem: number of operations
+ * @return NONE
+ * @date   18 Oct, 2026
+ * @see    zkfr_txabort(), zkfr_txrebuild()
+ *
+ *  Free the range sets of the new rules, and the operations themselves.
+ *
+ *---------------------------------------------------------------------------
+ */
+
+static void zkfr_txfree(zkfrop_t *op, uint32_t nelem)
+{
+	uint32_t	i;
+
+	if (op == NULL) {
+		return;
+	}
+
+	for (i = 0; i < nelem; i++) {
+		zkfr_freeranges(&op[i].fro_rule, MAX_FISTREE_DIM);
+	}
+
+	vfree(op);
+}
+
+
+/**
+ *---------------------------------------------------------------------------
+ *
+ * @fn     static void zkfr_txabort(void)
+ * @brief  Discard the open transaction
+ * @param  NONE
+ * @return NONE
+ * @date   18 Oct, 2026
+ * @see    SIOCTXABORT
+ *
+ *  Discard the operations staged so far.
+ *
+ *---------------------------------------------------------------------------
+ */
+
+static void zkfr_txabort(void)
+{
+	zkfr_txfree(zkfr_txop, zkfr_txnelem);
+
+	zkfr_txop		= NULL;
+	zkfr_txnelem	= 0;
+	zkfr_txsize		= 0;
+	zkfr_txactive	= 0;
+}
+
+
+/**
+ *---------------------------------------------------------------------------
+ *
+ * @fn     static void zkfr_txbegin(void)
+ * @brief  Open a transaction
+ * @param  NONE
+ * @return NONE
+ * @date   18 Oct, 2026
+ * @see    SIOCTXBEGIN, ZKMSG_TXBEGIN
+ *
+ *  Open a transaction. The open one is discarded.
+ *
+ *---------------------------------------------------------------------------
+ */
+
+static void zkfr_txbegin(void)
+{
+	zkfr_txabort();
+
+	zkfr_txactive = 1;
+}
+
+
+/**
+ *---------------------------------------------------------------------------
+ *
+ * @fn     static void zkfr_txstatus(zkfrtxreq_t *req)
+ * @brief  Get the state of rule transactions
+ * @param  req: the current generation, whether a background rebuild is
+ *              pending, and the result of the last one are filled in
+ * @return NONE
+ * @date   18 Oct, 2026
+ * @see    SIOCTXSTATUS, ZKMSG_TXSTATUS
+ *
+ *  Get the state of rule transactions.
+ *
+ *---------------------------------------------------------------------------
+ */
+
+static void zkfr_txstatus(zkfrtxreq_t *req)
+{
+	memset(req, 0x00, sizeof(zkfrtxreq_t));
+
+	req->ftx_gen		= zkfr_gen;
+	req->ftx_pending	= (zkfr_txpend != NULL);
+	req->ftx_error		= zkfr_txerror;
+}
+
+
+/**
+ *---------------------------------------------------------------------------
+ *
+ * @fn     static int zkfr_txappend(zkfrtxreq_t *req)
+ * @brief  Stage operations on the open transaction
+ * @param  req: ftx_nelem operations of ftx_op[]
+ * @return 0 if normal, <0 if abnormal.
+ * @date   18 Oct, 2026
+ * @see    zkfr_txcommit(), SIOCTXOP
+ *
+ *  Copy and validate operations. Each rule is named by its policy ID,
+ *  which is given to the action and the policy of a new rule as well.
+ *  A bad request is refused as a whole.
+ *
+ *---------------------------------------------------------------------------
+ */
+
+static int zkfr_txappend(zkfrtxreq_t *req)
+{
+	zkfrop_t		*op, *newop;
+	uint32_t		size;
+	int				i, k;
+
+	if (!zkfr_txactive) {
+		return -EINVAL;
+	}
+
+	if (req->ftx_nelem > ZKFR_MAXTXOP - zkfr_txnelem) {
+		return -E2BIG;
+	}
+
+	/* Grow the staging table by doubling */
+	if (zkfr_txnelem + req->ftx_nelem > zkfr_txsize) {
+		for (size = zkfr_txsize ? zkfr_txsize : 16; size < zkfr_txnelem + req->ftx_nelem; size <<= 1)
+			;
+
+		if ((newop = (zkfrop_t *)vmalloc(sizeof(zkfrop_t) * size)) == NULL) {
+			return -ENOMEM;
+		}
+
+		if (zkfr_txop != NULL) {
+			memcpy(newop, zkfr_txop, sizeof(zkfrop_t) * zkfr_txnelem);
+			vfree(zkfr_txop);
+		}
+
+		zkfr_txop	= newop;
+		zkfr_txsize	= size;
+	}
+
+	op = zkfr_txop + zkfr_txnelem;
+
+	if (copy_from_user(op, req->ftx_op, sizeof(zkfrop_t) * req->ftx_nelem)) {
+		return -EFAULT;
+	}
+
+	for (i = 0; i < req->ftx_nelem; i++) {
+		if (op[i].fro_type == FROP_DELETE) {
+			/* No rule comes with a deletion */
+			memset(&op[i].fro_rule, 0x00, sizeof(fisrule_t));
+			continue;
+		}
+
+		if ((op[i].fro_type != FROP_ADD && op[i].fro_type != FROP_MODIFY) ||
+				op[i].fro_rule.cost < 0) {
+			break;
+		}
+
+		if (zkfr_copyranges(&op[i].fro_rule) < 0) {
+			break;
+		}
+
+		op[i].fro_act.act_pid	= op[i].fro_pid;
+		op[i].fro_policy.id		= op[i].fro_pid;
+	}
+
+	if (i < req->ftx_nelem) {
+		/* Roll back the request */
+		for (k = 0; k < i; k++) {
+			zkfr_freeranges(&op[k].fro_rule, MAX_FISTREE_DIM);
+		}
+
+		return -EINVAL;
+	}
+
+	zkfr_txnelem += req->ftx_nelem;
+
+	return 0;
+}
+
+
+/**
+ *---------------------------------------------------------------------------
+ *
+ * @fn     static zkfrop_t *zkfr_txfind(zkfrop_t *op, uint32_t nelem, uint32_t pid)
+ * @brief  Find the operation on a policy ID in a transaction
+ * @param  op: operations
+ * @param  nelem: number of operations
+ * @param  pid: policy id.
+ * @return operation if found, NULL otherwise.
+ * @date   18 Oct, 2026
+ * @see    zkfr_txcheck(), zkfr_txbuild()
+ *
+ *  Transactions are small, so they are scanned linearly.
+ *
+ *---------------------------------------------------------------------------
+ */
+
+static zkfrop_t *zkfr_txfind(zkfrop_t *op, uint32_t nelem, uint32_t pid)
+{
+	uint32_t	i;
+
+	for (i = 0; i < nelem; i++) {
+		if (op[i].fro_pid == pid) {
+			return &op[i];
+		}
+	}
+
+	return NULL;
+}
+
+
+/**
+ *---------------------------------------------------------------------------
+ *
+ * @fn     static int zkfr_txcheck(zkfrop_t *op, uint32_t nelem)
+ * @brief  Check operations of a transaction against the static SPD
+ * @param  op: operations
+ * @param  nelem: number of operations
+ * @return 1 if they can be applied in place, 0 if the FIS-tree has to be
+ *         rebuilt, <0 if they are invalid.
+ * @date   18 Oct, 2026
+ * @see    zkfr_txcommit()
+ *
+ *  A policy ID appears once in a transaction. A new rule must not exist
+ *  yet, and a deleted or modified one must exist. A modification which
+ *  changes neither the intervals, the direction, nor the cost of an
+ *  active rule leaves the FIS-tree as it is, and is applied in place.
+ *  The intervals of the inverse rule count for a bidirectional rule.
+ *  Range sets are never compared, so rules with one are rebuilt.
+ *
+ *---------------------------------------------------------------------------
+ */
+
+static int zkfr_txcheck(zkfrop_t *op, uint32_t nelem)
+{
+	zkact_t			*act;
+	fisrule_t		*rule;
+	int				inplace = 1;
+	int				i, j;
+
+	for (i = 0; i < nelem; i++) {
+		if (zkfr_txfind(op, i, op[i].fro_pid) != NULL) {
+			return -EINVAL;
+		}
+
+		act = zkspd_getactbyid(&staticspd, op[i].fro_pid);
+
+		if (op[i].fro_type == FROP_ADD) {
+			if (act != NULL) {
+				return -EEXIST;
+			}
+
+			inplace = 0;
+			continue;
+		}
+
+		if (act == NULL) {
+			return -ENOENT;
+		}
+
+		if (op[i].fro_type == FROP_DELETE || act->act_policy == NULL) {
+			inplace = 0;
+			continue;
+		}
+
+		rule = act->act_rule;
+
+		if (rule->cost != op[i].fro_rule.cost ||
+				rule->is_bidirect != op[i].fro_rule.is_bidirect) {
+			inplace = 0;
+			continue;
+		}
+
+		for (j = 0; j < MAX_FISTREE_DIM; j++) {
+			if (rule->field[j].type == INTERVAL_RANGESET ||
+					memcmp(&rule->field[j], &op[i].fro_rule.field[j], sizeof(fistree_interval_t))) {
+				inplace = 0;
+				break;
+			}
+
+			if (!rule->is_bidirect) {
+				continue;
+			}
+
+			if (rule->inversefield[j].type == INTERVAL_RANGESET ||
+					memcmp(&rule->inversefield[j], &op[i].fro_rule.inversefield[j],
+						sizeof(fistree_interval_t))) {
+				inplace = 0;
+				break;
+			}
+		}
+	}
+
+	return inplace;
+}
+
+
+/**
+ *---------------------------------------------------------------------------
+ *
+ * @fn     static int zkfr_txbuild(zkspd_t *spd, zkfrop_t *op, uint32_t nelem)
+ * @brief  Make a new static SPD from the current one and a transaction
+ * @param  spd: new static SPD to be filled in
+ * @param  op: operations (the rules are moved into spd)
+ * @param  nelem: number of operations
+ * @return 0 if normal, <0 if abnormal.
+ * @date   18 Oct, 2026
+ * @see    zkfr_txrebuild(), zkfr_install()
+ *
+ *  Rules kept from the current SPD stay in their order. A new or modified
+ *  rule goes after the active rules which do not cost more. The default
+ *  allow rules at the head are laid out as SIOCSETFR does.
+ *  Range sets of the kept rules are copied, and those of the operations
+ *  are moved, even on failure (spd is cleaned by zkfr_install() then).
+ *  The tables are sized and filled from one copy of staticspd, which
+ *  no one changes while zkfr_sem is held, though zkstat_alloc() and
+ *  vmalloc() sleep in between.
+ *
+ *---------------------------------------------------------------------------
+ */
+
+static int zkfr_txbuild(zkspd_t *spd, zkfrop_t *op, uint32_t nelem)
+{
+	zkspd_t				cur;
+	fisrule_t			*rule;
+	zkact_t				*zkact;
+	zk_policy_t			*po;
+	fistree_interval_t	*field;
+	fistree_range_t		*rangetable;
+	size_t				rangesize;
+	uint32_t			nnew, n;
+	int					i, j, k, pos;
+
+	memcpy(&cur, &staticspd, sizeof(zkspd_t));
+
+	/* Count the kept rules and the new ones */
+
+	nnew = 0;
+
+	for (i = cur.spd_precnt; i < cur.spd_nelem; i++) {
+		if (zkfr_txfind(op, nelem, cur.spd_act[i].act_pid) == NULL) {
+			nnew++;
+		}
+	}
+
+	for (i = 0; i < nelem; i++) {
+		if (op[i].fro_type != FROP_DELETE) {
+			nnew++;
+		}
+	}
+
+	memset(spd, 0x00, sizeof(zkspd_t));
+
+	spd->spd_flag	= SPD_VMALLOC;
+	spd->spd_nelem	= nnew + precnt;
+	spd->spd_precnt	= precnt;
+
+	if (spd->spd_nelem == 0) {
+		return 0;
+	}
+
+	/* A large policy does not fit in kmalloc() */
+	rule	= (fisrule_t *)vmalloc(sizeof(fisrule_t) * spd->spd_nelem);
+	zkact	= (zkact_t *)vmalloc(sizeof(zkact_t) * spd->spd_nelem);
+	po		= NULL;
+
+	if (nnew > 0) {
+		po = (zk_policy_t *)vmalloc(sizeof(zk_policy_t) * nnew);
+	}
+
+	spd->spd_table	= rule;
+	spd->spd_act	= zkact;
+	spd->spd_policy	= po;
+	spd->spd_stat	= zkstat_alloc(spd->spd_nelem);
+
+	if (rule == NULL || zkact == NULL || (nnew > 0 && po == NULL) || spd->spd_stat == NULL) {
+		vfree(rule);
+		vfree(zkact);
+		vfree(po);
+		zkstat_free(spd->spd_stat);
+		memset(spd, 0x00, sizeof(zkspd_t));
+		return -ENOMEM;
+	}
+
+	/* pre-static rule table */
+	zkfr_copyprerule(rule);
+
+	/* Rules kept from the current SPD */
+
+	n = precnt;
+
+	for (i = cur.spd_precnt; i < cur.spd_nelem; i++) {
+		if (zkfr_txfind(op, nelem, cur.spd_act[i].act_pid) != NULL) {
+			continue;
+		}
+
+		memcpy(&rule[n], &cur.spd_table[i], sizeof(fisrule_t));
+		memcpy(&zkact[n], &cur.spd_act[i], sizeof(zkact_t));
+
+		if (cur.spd_act[i].act_policy != NULL) {
+			memcpy(&po[n - precnt], cur.spd_act[i].act_policy, sizeof(zk_policy_t));
+		}
+		else {
+			memset(&po[n - precnt], 0x00, sizeof(zk_policy_t));
+		}
+
+		for (j = 0; j < MAX_FISTREE_DIM; j++) {
+			field = &rule[n].field[j];
+
+			if (field->type != INTERVAL_RANGESET) {
+				continue;
+			}
+
+			rangesize = sizeof(fistree_range_t) * field->r.set.nelem;
+
+			KMALLOCS(rangetable, fistree_range_t *, rangesize);
+			if (rangetable == NULL) {
+				/* zkfr_install() fails on it */
+				field->type = 0;
+				continue;
+			}
+
+			memcpy(rangetable, field->r.set.table, rangesize);
+			field->r.set.table = rangetable;
+		}
+
+		n++;
+	}
+
+	/* New and modified rules */
+
+	for (i = 0; i < nelem; i++) {
+		if (op[i].fro_type == FROP_DELETE) {
+			continue;
+		}
+
+		for (pos = n; pos > precnt; pos--) {
+			if (rule[pos - 1].cost > 0 && rule[pos - 1].cost <= op[i].fro_rule.cost) {
+				break;
+			}
+		}
+
+		k = n - pos;
+
+		memmove(&rule[pos + 1], &rule[pos], sizeof(fisrule_t) * k);
+		memmove(&zkact[pos + 1], &zkact[pos], sizeof(zkact_t) * k);
+		memmove(&po[pos - precnt + 1], &po[pos - precnt], sizeof(zk_policy_t) * k);
+
+		memcpy(&rule[pos], &op[i].fro_rule, sizeof(fisrule_t));
+		memcpy(&zkact[pos], &op[i].fro_act, sizeof(zkact_t));
+		memcpy(&po[pos - precnt], &op[i].fro_policy, sizeof(zk_policy_t));
+
+		/* The range sets belong to the new SPD */
+		memset(&op[i].fro_rule, 0x00, sizeof(fisrule_t));
+
+		n++;
+	}
+
+	return 0;
+}
+
+
+/**
+ *---------------------------------------------------------------------------
+ *
+ * @fn     static void zkfr_txrebuild(void *data)
+ * @brief  Rebuild the static SPD with a committed transaction
+ * @param  data: NOT USED
+ * @return NONE
+ * @date   18 Oct, 2026
+ * @see    zkfr_txcommit()
+ *
+ *  Run by keventd, so that the FIS-tree of a large policy is not made in
+ *  the ioctl() call. zkfr_sem serializes it with the other SPD
+ *  writers. The result is reported by SIOCTXSTATUS, and a failure is
+ *  notified on DEV_CTL as well.
+ *
+ *---------------------------------------------------------------------------
+ */
+
+static void zkfr_txrebuild(void *data)
+{
+	zkspd_t		zkspd;
+	int			error;
+
+	down(&zkfr_sem);
+
+	if (zkfr_txpend == NULL) {
+		up(&zkfr_sem);
+		return;
+	}
+
+	/* Policy IDs may have gone by a SIOCSETFR meanwhile */
+	if ((error = zkfr_txcheck(zkfr_txpend, zkfr_txnpend)) >= 0) {
+		if ((error = zkfr_txbuild(&zkspd, zkfr_txpend, zkfr_txnpend)) == 0) {
+			error = zkfr_install(&zkspd);
+		}
+	}
+
+	zkfr_txerror = error < 0 ? error : 0;
+
+	if (zkfr_txerror < 0) {
+		zkctl_notifygen(zkfr_gen, zkfr_txerror);
+	}
+
+	zkfr_txfree(zkfr_txpend, zkfr_txnpend);
+
+	zkfr_txpend		= NULL;
+	zkfr_txnpend	= 0;
+
+	up(&zkfr_sem);
+}
+
+
+/**
+ *---------------------------------------------------------------------------
+ *
+ * @fn     static int zkfr_txcommit(zkfrtxreq_t *req)
+ * @brief  Commit the open transaction
+ * @param  req: ftx_gen returns the generation of the static SPD which
+ *              carries the transaction
+ * @return 0 if normal, <0 if abnormal.
+ * @date   18 Oct, 2026
+ * @see    zkfr_txcheck(), zkfr_txrebuild(), SIOCTXCOMMIT
+ *
+ *  A transaction switches the static SPD to a new generation at once.
+ *  Modifications of actions and policies alone (zkfr_txcheck()) are
+ *  applied in place under spd_lock. Otherwise the FIS-tree is rebuilt in the background,
+ *  and the generation is reached when SIOCTXSTATUS no longer reports the
+ *  rebuild as pending. An invalid transaction is discarded.
+ *
+ *---------------------------------------------------------------------------
+ */
+
+static int zkfr_txcommit(zkfrtxreq_t *req)
+{
+	zkfrop_t		*op = zkfr_txop;
+	zkact_t			*act;
+	int				inplace;
+	int				i;
+
+	if (!zkfr_txactive) {
+		return -EINVAL;
+	}
+
+	if (zkfr_txpend != NULL) {
+		return -EBUSY;
+	}
+
+	if ((inplace = zkfr_txcheck(op, zkfr_txnelem)) < 0) {
+		zkfr_txabort();
+		return inplace;
+	}
+
+	if (inplace) {
+		WRITE_LOCK(&spd_lock);
+
+		for (i = 0; i < zkfr_txnelem; i++) {
+			act = zkspd_getactbyid(&staticspd, op[i].fro_pid);
+
+			act->act_pass = op[i].fro_act.act_pass;
+			memcpy(act->act_policy, &op[i].fro_policy, sizeof(zk_policy_t));
+		}
+
+		ipsess_syncrule(0);	/* Sessions follow the new actions */
+
+		req->ftx_gen = ++zkfr_gen;
+
+		WRITE_UNLOCK(&spd_lock);
+
+		zkfr_txabort();
+		zkctl_notifygen(zkfr_gen, 0);
+		return 0;
+	}
+
+	zkfr_txpend		= zkfr_txop;
+	zkfr_txnpend	= zkfr_txnelem;
+
+	zkfr_txop		= NULL;
+	zkfr_txabort();
+
+	req->ftx_gen = zkfr_gen + 1;
+
+	INIT_TQUEUE(&zkfr_txtask, zkfr_txrebuild, NULL);
+	schedule_task(&zkfr_txtask);
+
+	return 0;
+}
+
+
+/**
+ *---------------------------------------------------------------------------
+ *
+ * @fn     static int zkfr_pinhole(zkpinhole_t *ph)
+ * @brief  Open a pinhole
+ * @param  ph: pinhole, whose handle is returned in ph_id
+ * @return 0 if normal, <0 if abnormal.
+ * @date   18 Oct, 2026
+ * @see    zkdfrule_insert(), zkdfrule_removeid()
+ *
+ *  Make a dynamic rule of a pinhole, and put it under its parent rule.
+ *  Range sets would have to be copied from user memory and freed with
+ *  the rule, so they are refused.
+ *
+ *---------------------------------------------------------------------------
+ */
+
+static int zkfr_pinhole(zkpinhole_t *ph)
+{
+	zkdfrule_t		*dfrule;
+	int				i, ret;
+
+	for (i = 0; i < MAX_FISTREE_DIM; i++) {
+		if (ph->ph_rule.field[i].type == INTERVAL_RANGESET ||
+				(ph->ph_rule.is_bidirect && ph->ph_rule.inversefield[i].type == INTERVAL_RANGESET)) {
+			return -EINVAL;
+		}
+	}
+
+	KMALLOCS(dfrule, zkdfrule_t *, sizeof(zkdfrule_t));
+	if (dfrule == NULL) {
+		return -ENOMEM;
+	}
+
+	memset(dfrule, 0x00, sizeof(zkdfrule_t));
+	memcpy(&dfrule->dfrule_rule, &ph->ph_rule, sizeof(fisrule_t));
+
+	dfrule->dfrule_act.act_pass	= ph->ph_pass;
+	dfrule->dfrule_act.act_pid	= ph->ph_pid;
+
+	if ((ret = zkdfrule_insert(dfrule, &ph->ph_id)) < 0) {
+		KFREES(dfrule);
+		return ret;
+	}
+
+	return 0;
+}
+
+
+/**
+ *---------------------------------------------------------------------------
+ *
+ * @fn     void zelkova_ioctl_clean(void)
+ * @brief  Release what ioctl() operations hold
+ * @param  NONE
+ * @return NONE
+ * @date   18 Oct, 2026
+ * @see    zelkova_detach()
+ *
+ *  Discard the chunked upload in progress and the open transaction, and
+ *  wait for the pending rebuild.
+ *
+ *---------------------------------------------------------------------------
+ */
+
+void zelkova_ioctl_clean(void)
+{
+	down(&zkfr_sem);
+	zkfr_abort();
+	zkfr_txabort();
+	up(&zkfr_sem);
+
+	/* zkfr_txrebuild() takes zkfr_sem */
+	flush_scheduled_tasks();
+}
+
+
 /**
  *---------------------------------------------------------------------------
  *
- * @fn static int zelkova_ioctl_filter(uint cmd, void *data, int mode)
+ * @fn static int zkfr_ioctl(uint cmd, void *data, int mode)
  * @brief Process data exchange operations
  * @param uint cmd
  * @param void *data
@@ -74,25 +1265,30 @@ extern zkspd_t	staticspd;		/* static SPD (in zkfilter.c) */
  * @date 25 Jul, 2005
  *
  *  Process data exchange operations between kernel module and
- *  another applications.
+ *  another applications. zkfr_sem is held.
  *
  *---------------------------------------------------------------------------
  */
 
-int zelkova_ioctl_filter(uint cmd, void *data, int mode)
+static int zkfr_ioctl(uint cmd, void *data, int mode)
 {
-	static zkdfrule_t	*prerule = NULL;
-	static int			precnt = 0;
-
 	fisrule_t			*rule, frule;
-	zkspd_t				zkspd;
+	zkspd_t				zkspd, oldnat;
+	zkspd_t				*nat[2];
 	zkact_t				*zkact;
+	zknat_t				*zknat;
+	zknatmap_t			*map, *oldmap;
+	zkactstat_t			*stat, sum;
+	zkrulestatreq_t		req;
+	zkrulestat_t		*rs;
 	zk_policy_t			*po;
-	zkdfrule_t			*zkdfrule;
+	zkfrupload_t		up;
+	zkfrtxreq_t			tx;
+	zkpinhole_t			ph;
 	void				*root, *oldroot;
 	fistree_range_t		*rangetable;
 	size_t				rangesize;
-	int					i, j;
+	int					i, j, n;
 
 	ZKDEBUG("'%c'/0x%02x\n", (char)_IOC_TYPE(cmd), (unsigned int)_IOC_NR(cmd));
 
@@ -100,81 +1296,356 @@ int zelkova_ioctl_filter(uint cmd, void *data, int mode)
 	case SIOCGETFR:
 		/* copy filter rule informations from kernel-level to user-level */
 
+		zkstat_sumfilter(zkfr_stat.zkfs_nallow, zkfr_stat.zkfs_ndrop);
+
 		copy_to_user(data, &zkfr_stat, sizeof(zkfr_stat));
 		break;
 
+	case SIOCGETRULEST:
+		/* Counters of static rules summed over all CPUs */
+
+		if (copy_from_user(&req, data, sizeof(req))) {
+			return -EFAULT;
+		}
+
+		if (req.zrq_nelem == 0) {
+			break;
+		}
+
+		/* Never allocate more than the rules there are */
+		READ_LOCK(&spd_lock);
+		n = staticspd.spd_nelem;
+		READ_UNLOCK(&spd_lock);
+
+		if (req.zrq_nelem > n) {
+			req.zrq_nelem = n;
+		}
+
+		if (req.zrq_nelem > ~0U / sizeof(zkrulestat_t)) {
+			return -EINVAL;
+		}
+
+		if (req.zrq_nelem == 0) {
+			if (copy_to_user(data, &req, sizeof(req))) {
+				return -EFAULT;
+			}
+			break;
+		}
+
+		/* The table can not be copied out with spd_lock held */
+		if ((rs = (zkrulestat_t *)vmalloc(sizeof(zkrulestat_t) * req.zrq_nelem)) == NULL) {
+			return -ENOMEM;
+		}
+
+		/* Counts of live sessions are not on the rules yet */
+		ipsess_foldstat();
+
+		READ_LOCK(&spd_lock);
+
+		/* The rules may have been replaced meanwhile */
+		if (req.zrq_nelem > staticspd.spd_nelem) {
+			req.zrq_nelem = staticspd.spd_nelem;
+		}
+
+		for (i = 0; i < req.zrq_nelem; i++) {
+			zkstat_sumrule(&staticspd.spd_act[i], &sum);
+
+			rs[i].zrs_pid		= staticspd.spd_act[i].act_pid;
+			rs[i].zrs_hits		= sum.as_hits;
+			rs[i].zrs_pkts		= sum.as_pkts;
+			rs[i].zrs_reserved	= 0;
+			rs[i].zrs_bytes		= sum.as_bytes;
+		}
+
+		READ_UNLOCK(&spd_lock);
+
+		if (copy_to_user(req.zrq_table, rs, sizeof(zkrulestat_t) * req.zrq_nelem) ||
+				copy_to_user(data, &req, sizeof(req))) {
+			vfree(rs);
+			return -EFAULT;
+		}
+
+		vfree(rs);
+		break;
+
 	case SIOCSETFR:
 		/* Set filter rules from user-level to kernel-level */
 
-		copy_from_user(&zkspd, data, sizeof(zkspd_t));
+		copy_from_user(&zkspd, data, sizeof(zkspd_t));
+
+		zkspd.spd_precnt	= 0;
+		zkspd.spd_flag		= 0;
+		zkspd.spd_pidhash	= NULL;
+
+		nat[NAT_REDIR]	= &staticnat[NAT_REDIR];
+		nat[NAT_NORMAL]	= &staticnat[NAT_NORMAL];
+
+		/* Remake spdroot only with the NAT rules if SPD entry doesn't exist
+		 * AND precnt == 0. Leave alone staticspd.
+		 */
+		if (zkspd.spd_nelem == 0 && precnt == 0) {
+			zkspd.spd_table = NULL;
+			root = zkfilter_makeroot(&zkspd, nat);
+
+			WRITE_LOCK(&spd_lock);
+
+			oldroot = spdroot;
+			spdroot = root;
+
+			ipsess_syncrule(0);
+
+			WRITE_UNLOCK(&spd_lock);
+
+			if (oldroot != NULL) {
+				FISTREE_CLEAN(oldroot);
+			}
+			break;
+		}
+
+		/* Allocate new memories for rule structures */
+		KMALLOCS(rule, fisrule_t *, sizeof(fisrule_t) * (zkspd.spd_nelem + precnt));
+		if (rule == NULL) {
+			return -ENOMEM;
+		}
+
+		KMALLOCS(zkact, zkact_t *, sizeof(zkact_t) * (zkspd.spd_nelem + precnt));
+		if (rule == NULL) {
+			KFREES(rule);
+			return -ENOMEM;
+		}
+
+		/* Rule counters of every CPU */
+		if ((stat = zkstat_alloc(zkspd.spd_nelem + precnt)) == NULL) {
+			KFREES(rule);
+			KFREES(zkact);
+			return -ENOMEM;
+		}
+
+		if (zkspd.spd_nelem > 0) {
+			KMALLOCS(po, zk_policy_t *, sizeof(zk_policy_t) * zkspd.spd_nelem);
+
+			if (po == NULL) {
+				KFREES(rule);
+				KFREES(zkact);
+				zkstat_free(stat);
+				return -ENOMEM;
+			}
+		}
+		else {
+			po = NULL;
+		}
+
+		/* pre-static rule table */
+		zkfr_copyprerule(rule);
+
+		/* Copy the real static rule table from user memory to kernel memory */
+
+		if (zkspd.spd_nelem > 0) {
+			copy_from_user(rule + precnt,  zkspd.spd_table, sizeof(fisrule_t) * zkspd.spd_nelem);
+			copy_from_user(zkact + precnt, zkspd.spd_act, sizeof(zkact_t) * zkspd.spd_nelem);
+			copy_from_user(po,             zkspd.spd_policy, sizeof(zk_policy_t) * zkspd.spd_nelem);
+		}
+
+		/* Increase the number of all rules */
+		zkspd.spd_nelem += precnt;
+
+		/* Process range with the type of INTERNVAL_RANGESET.
+		 * Here we assume that existing rules do not have INTERNAL_RANGESET
+		 * attributes at all.
+		 */
+
+		for (i = precnt; i < zkspd.spd_nelem; i++) {
+			for (j = 0; j < MAX_FISTREE_DIM; j++) {
+				if (rule[i].field[j].type == INTERVAL_RANGESET) {
+					rangesize = sizeof(fistree_range_t) * rule[i].field[j].r.set.nelem;
+
+					KMALLOCS(rangetable, fistree_range_t *, rangesize);
+					if (rangetable == NULL) {
+						rule[i].field[j].type = 0;
+						break;
+					}
+
+					copy_from_user(rangetable, rule[i].field[j].r.set.table, rangesize);
+					rule[i].field[j].r.set.table = rangetable;
+				}
+			} /* for(j) */
+		} /* for(i) */
+
+		/* Assign each member of zkspd */
+		zkspd.spd_table		= rule;
+		zkspd.spd_act		= zkact;
+		zkspd.spd_policy	= po;
+		zkspd.spd_prerule	= NULL;
+		zkspd.spd_precnt	= precnt;
+		zkspd.spd_stat		= stat;
+
+		if ((i = zkfr_install(&zkspd)) < 0) {
+			return i;
+		}
+
+		break;
+
+	case SIOCBEGINFR:
+		/* Start a chunked upload of static rules */
+
+		if (copy_from_user(&up, data, sizeof(up))) {
+			return -EFAULT;
+		}
+
+		if ((i = zkfr_begin(&up)) < 0) {
+			return i;
+		}
+
+		if (copy_to_user(data, &up, sizeof(up))) {
+			return -EFAULT;
+		}
+		break;
+
+	case SIOCADDFR:
+		/* Append a chunk of static rules, and report the progress */
+
+		if (copy_from_user(&up, data, sizeof(up))) {
+			return -EFAULT;
+		}
+
+		if ((i = zkfr_append(&up)) < 0) {
+			return i;
+		}
+
+		if (copy_to_user(data, &up, sizeof(up))) {
+			return -EFAULT;
+		}
+		break;
+
+	case SIOCCOMMITFR:
+		/* Put the uploaded rules in service */
+
+		if ((i = zkfr_commit()) < 0) {
+			return i;
+		}
+		break;
+
+	case SIOCABORTFR:
+		/* Discard the upload */
+
+		zkfr_abort();
+		break;
+
+	case SIOCTXBEGIN:
+		/* Open a transaction of rule operations */
+
+		zkfr_txbegin();
+		break;
+
+	case SIOCTXOP:
+		/* Stage rule operations */
+
+		if (copy_from_user(&tx, data, sizeof(tx))) {
+			return -EFAULT;
+		}
+
+		if ((i = zkfr_txappend(&tx)) < 0) {
+			return i;
+		}
+		break;
+
+	case SIOCTXCOMMIT:
+		/* Switch to a new generation with the staged operations */
+
+		if ((i = zkfr_txcommit(&tx)) < 0) {
+			return i;
+		}
+
+		if (copy_to_user(data, &tx, sizeof(tx))) {
+			return -EFAULT;
+		}
+		break;
+
+	case SIOCTXABORT:
+		/* Discard the staged operations */
+
+		zkfr_txabort();
+		break;
+
+	case SIOCTXSTATUS:
+		/* Report the generation and the background rebuild */
+
+		zkfr_txstatus(&tx);
 
-		zkspd.spd_precnt	= 0;
-		zkspd.spd_flag		= 0;
+		if (copy_to_user(data, &tx, sizeof(tx))) {
+			return -EFAULT;
+		}
+		break;
 
-		/* Set spdroot with NULL if SPD entry doesn't exist AND precnt == 0
-		 * Leave alone staticspd.
-		 */
-		if (zkspd.spd_nelem == 0 && precnt == 0) {
-			spdroot = NULL;
-			break;
+	case SIOCADDDFR:
+		/* Open a pinhole, and return its handle */
+
+		if (copy_from_user(&ph, data, sizeof(ph))) {
+			return -EFAULT;
 		}
 
-		/* Allocate new memories for rule structures */
-		KMALLOCS(rule, fisrule_t *, sizeof(fisrule_t) * (zkspd.spd_nelem + precnt));
-		if (rule == NULL) {
-			return -ENOMEM;
+		if ((i = zkfr_pinhole(&ph)) < 0) {
+			return i;
 		}
 
-		KMALLOCS(zkact, zkact_t *, sizeof(zkact_t) * (zkspd.spd_nelem + precnt));
-		if (rule == NULL) {
-			KFREES(rule);
-			return -ENOMEM;
+		if (copy_to_user(data, &ph, sizeof(ph))) {
+			return -EFAULT;
 		}
+		break;
 
-		if (zkspd.spd_nelem > 0) {
-			KMALLOCS(po, zk_policy_t *, sizeof(zk_policy_t) * zkspd.spd_nelem);
+	case SIOCDELDFR:
+		/* Close a pinhole */
 
-			if (po == NULL) {
-				KFREES(rule);
-				KFREES(zkact);
-				return -ENOMEM;
-			}
+		if (copy_from_user(&ph, data, sizeof(ph))) {
+			return -EFAULT;
 		}
-		else {
-			po = NULL;
+
+		if ((i = zkdfrule_removeid(ph.ph_id)) < 0) {
+			return i;
 		}
+		break;
 
-		/* pre-static rule table
-		 * We should interate index by reverse order because prerule is
-		 * constructed as a linked list of stack-type
+	case SIOCSETNAT:
+		/* Set NAT rules from user-level to kernel-level.
+		 * SPD_NORMALNAT of spd_flag selects the normal NAT rules,
+		 * otherwise the redirect NAT rules are set.
 		 */
-		zkdfrule = prerule;
-
-		for (i = precnt - 1; i >= 0; i--) {
-			memcpy(&rule[i], &zkdfrule->dfrule_rule, sizeof(fisrule_t));
-			memcpy(&rule[i], &zkdfrule->dfrule_rule, sizeof(fisrule_t));
 
-			/* Traverse linked list with link to brother nodes */
-			zkdfrule = zkdfrule->dfrule_bnext;
+		if (copy_from_user(&zkspd, data, sizeof(zkspd_t))) {
+			return -EFAULT;
 		}
 
-		/* Copy the real static rule table from user memory to kernel memory */
+		n = (zkspd.spd_flag & SPD_NORMALNAT) ? NAT_NORMAL : NAT_REDIR;
+
+		zkspd.spd_policy	= NULL;
+		zkspd.spd_prerule	= NULL;
+		zkspd.spd_precnt	= 0;
+		zkspd.spd_flag		= (zkspd.spd_flag & SPD_NORMALNAT) | SPD_NAT;
+		zkspd.spd_stat		= NULL;
+		zkspd.spd_pidhash	= NULL;
+
+		rule	= NULL;
+		zknat	= NULL;
 
 		if (zkspd.spd_nelem > 0) {
-			copy_from_user(rule + precnt,  zkspd.spd_table, sizeof(fisrule_t) * zkspd.spd_nelem);
-			copy_from_user(zkact + precnt, zkspd.spd_act, sizeof(zkact_t) * zkspd.spd_nelem);
-			copy_from_user(po,             zkspd.spd_policy, sizeof(zk_policy_t) * zkspd.spd_nelem);
-		}
+			KMALLOCS(rule, fisrule_t *, sizeof(fisrule_t) * zkspd.spd_nelem);
+			if (rule == NULL) {
+				return -ENOMEM;
+			}
 
-		/* Increase the number of all rules */
-		zkspd.spd_nelem += precnt;
+			KMALLOCS(zknat, zknat_t *, sizeof(zknat_t) * zkspd.spd_nelem);
+			if (zknat == NULL) {
+				KFREES(rule);
+				return -ENOMEM;
+			}
 
-		/* Process range with the type of INTERNVAL_RANGESET.
-		 * Here we assume that existing rules do not have INTERNAL_RANGESET
-		 * attributes at all.
-		 */
+			copy_from_user(rule,  zkspd.spd_table, sizeof(fisrule_t) * zkspd.spd_nelem);
+			copy_from_user(zknat, zkspd.spd_nat, sizeof(zknat_t) * zkspd.spd_nelem);
+		}
 
-		for (i = precnt; i < zkspd.spd_nelem; i++) {
+		/* Process range with the type of INTERNVAL_RANGESET. */
+
+		for (i = 0; i < zkspd.spd_nelem; i++) {
 			for (j = 0; j < MAX_FISTREE_DIM; j++) {
 				if (rule[i].field[j].type == INTERVAL_RANGESET) {
 					rangesize = sizeof(fistree_range_t) * rule[i].field[j].r.set.nelem;
@@ -186,22 +1657,23 @@ int zelkova_ioctl_filter(uint cmd, void *data, int mode)
 					}
 
 					copy_from_user(rangetable, rule[i].field[j].r.set.table, rangesize);
+					rule[i].field[j].r.set.table = rangetable;
 				}
 			} /* for(j) */
 		} /* for(i) */
 
-		/* Assign each member of zkspd */
-		zkspd.spd_table		= rule;
-		zkspd.spd_act		= zkact;
-		zkspd.spd_policy	= po;
-		zkspd.spd_prerule	= NULL;
-		zkspd.spd_precnt	= precnt;
+		zkspd.spd_table	= rule;
+		zkspd.spd_nat	= zknat;
 
-		/* If rangeset is not allocated since it ran out of memory,
-		 * Clean SPD correctly and return an error.
-		 */
+		for (i = 0; i < zkspd.spd_nelem; i++) {
+			rule[i].refcnt = 0;
+			rule[i].action = &zknat[i];
 
-		for (i = precnt; i < zkspd.spd_nelem; i++) {
+			zknat[i].nat_rule = &rule[i];
+			zknat[i].nat_napt = NULL;
+		}
+
+		for (i = 0; i < zkspd.spd_nelem; i++) {
 			/* Skip inactivated rules */
 			if (rule[i].cost == 0) {
 				continue;
@@ -213,64 +1685,421 @@ int zelkova_ioctl_filter(uint cmd, void *data, int mode)
 					return -ENOMEM;
 				}
 			}
-
-			/* Link each policy table. */
-			zkact[i].act_policy = &po[i - precnt];
 		}
 
-		/* Initialize for rule[] and act[] arrays */
+		/* Port allocators of NAPT rules */
 
 		for (i = 0; i < zkspd.spd_nelem; i++) {
-			rule[i].refcnt = 0;
-			rule[i].action = &zkact[i];
+			if (rule[i].cost == 0 || (zknat[i].nat_flag & NAT_ONETOONE)) {
+				continue;
+			}
 
-			zkact[i].act_rule	= &rule[i];
-			zkact[i].act_parent	= NULL;
-			zkact[i].act_hits	= 0;
-			zkact[i].act_pkts	= 0;
-			zkact[i].act_bytes	= 0;
+			if ((j = zknapt_init(&zknat[i])) < 0) {
+				zkspd_clean(&zkspd);
+				return j;
+			}
 		}
 
-		/* Now we make a FIS-tree for static rules */
-		root = FISTREE_MAKE(rule, zkspd.spd_nelem);
-		if (root == NULL) {
+		/* 1:1 mappings are translated without the FIS-tree, so they are
+		 * pulled out of the table before the tree is made */
+		map = zknatmap_make(&zkspd);
+
+		/* Remake the FIS-tree with the current filter rules and the NAT rules */
+
+		nat[NAT_REDIR]	= &staticnat[NAT_REDIR];
+		nat[NAT_NORMAL]	= &staticnat[NAT_NORMAL];
+		nat[n]			= &zkspd;
+
+		root = zkfilter_makeroot(&staticspd, nat);
+		if (root == NULL && (staticspd.spd_nelem + staticnat[!n].spd_nelem + zkspd.spd_nelem) > 0) {
+			zknatmap_clean(map);
 			zkspd_clean(&zkspd);
 			return -ENOMEM;
 		}
 
 		WRITE_LOCK(&spd_lock);
 
-		/* Reassign the root of FIS-tree and the SPD table */
-
 		oldroot = spdroot;
 		spdroot = root;
 
-		zkdfrule_syncrule(&zkspd);	/* Insert dynamic rules into the new FIS-tree */
-		ipsess_syncrule();		/* Make the session table be compatible with the new FIS-tree */
+		oldmap = natmap[n];
+		natmap[n] = map;
+
+		memcpy(&oldnat, &staticnat[n], sizeof(zkspd_t));
+		memcpy(&staticnat[n], &zkspd, sizeof(zkspd_t));
+
+		ipsess_syncrule(0);		/* Make the session table be compatible with the new FIS-tree */
+
+		WRITE_UNLOCK(&spd_lock);
 
-		/* Remove the old FIS-tree */
 		if (oldroot != NULL) {
 			FISTREE_CLEAN(oldroot);
 		}
 
-		/* Remove the old static SPD and set a new static SPD */
+		zknatmap_clean(oldmap);
+		zkspd_clean(&oldnat);
 
-		spd_clean(&staticspd);
+		break;
+
+	default:
+		break;
+	}
 
-		memcpy(&staticspd, &zkspd, sizeof(zkspd));
-		staticspd.spd_prerule = prerule;
+	return 0;
+}
 
-		WRITE_UNLOCK(&spd_lock);
 
-		prerule = NULL;
-		precnt = 0;
+/**
+ *---------------------------------------------------------------------------
+ *
+ * @fn     int zelkova_ioctl_filter(uint cmd, void *data, int mode)
+ * @brief  Process filter ioctl() commands
+ * @param  cmd: command
+ * @param  data: argument of the command (in user memory)
+ * @param  mode: mode of the file
+ * @return 0 if normal, <0 if abnormal.
+ * @date   18 Oct, 2026
+ * @see    zkfr_ioctl(), zelkova_ioctl()
+ *
+ *  Run a command under zkfr_sem.
+ *
+ *---------------------------------------------------------------------------
+ */
+
+int zelkova_ioctl_filter(uint cmd, void *data, int mode)
+{
+	int		ret;
+
+	if (down_interruptible(&zkfr_sem)) {
+		return -ERESTARTSYS;
+	}
+
+	ret = zkfr_ioctl(cmd, data, mode);
+
+	up(&zkfr_sem);
+
+	return ret;
+}
+
+
+/**
+ *---------------------------------------------------------------------------
+ *
+ * @fn     static int zkfr_msg(zkctl_t *ctl, zkmsghdr_t *req, void *data, uint32_t len)
+ * @brief  Process filter rule messages of the control channel
+ * @param  ctl: channel
+ * @param  req: request
+ * @param  data: data of the request (in user memory)
+ * @param  len: length of the data
+ * @return 0 if normal, <0 if abnormal.
+ * @date   18 Oct, 2026
+ * @see    zkfr_ioctl(), zelkova_msg_filter()
+ *
+ *  Process the messages which correspond to filter ioctl() commands.
+ *  Counters of the static rules are returned in parts, as many as fit in
+ *  a message each, so that one read() of the channel returns thousands
+ *  of them, from an optional start index, and so are the counters of the NAPT port allocators. zkfr_sem
+ *  is held.
+ *
+ *---------------------------------------------------------------------------
+ */
+
+static int zkfr_msg(zkctl_t *ctl, zkmsghdr_t *req, void *data, uint32_t len)
+{
+	zkfrtxreq_t			tx;
+	zkpinhole_t			ph;
+	zkmsggen_t			mg;
+	zkactstat_t			sum;
+	zkrulestat_t		*rs;
+	zknaptstat_t		*ns;
+	zkspd_t				*spd;
+	uint32_t			i, n, maxrec, id;
+	int					error = 0;
+
+	switch (req->zmh_type) {
+	case ZKMSG_GETRULEST:
+		/* An optional start index, so that a reader which stopped on a
+		 * full queue can go on from the last rule it got */
+
+		id = 0;
+
+		if (len != 0 && len != sizeof(id)) {
+			return -EINVAL;
+		}
+
+		if (len != 0 && copy_from_user(&id, data, sizeof(id))) {
+			return -EFAULT;
+		}
+
+		maxrec = ZKCTL_MAXDATA / sizeof(zkrulestat_t);
+
+		KMALLOCS(rs, zkrulestat_t *, sizeof(zkrulestat_t) * maxrec);
+		if (rs == NULL) {
+			return -ENOMEM;
+		}
+
+		/* Counts of live sessions are not on the rules yet */
+		ipsess_foldstat();
+
+		for (i = id; error == 0; i += n) {
+			READ_LOCK(&spd_lock);
+
+			for (n = 0; n < maxrec && i + n < staticspd.spd_nelem; n++) {
+				zkstat_sumrule(&staticspd.spd_act[i + n], &sum);
 
+				rs[n].zrs_pid		= staticspd.spd_act[i + n].act_pid;
+				rs[n].zrs_hits		= sum.as_hits;
+				rs[n].zrs_pkts		= sum.as_pkts;
+				rs[n].zrs_reserved	= 0;
+				rs[n].zrs_bytes		= sum.as_bytes;
+			}
+
+			READ_UNLOCK(&spd_lock);
+
+			if (n == 0) {
+				break;
+			}
+
+			error = zkctl_put(ctl, req, ZKMSG_GETRULEST, ZKMSG_F_MULTI, rs, sizeof(zkrulestat_t) * n);
+		}
+
+		KFREES(rs);
+		break;
+
+	case ZKMSG_TXBEGIN:
+		zkfr_txbegin();
+		break;
+
+	case ZKMSG_TXOP:
+		if (len % sizeof(zkfrop_t) != 0) {
+			return -EINVAL;
+		}
+
+		tx.ftx_nelem	= len / sizeof(zkfrop_t);
+		tx.ftx_op		= (zkfrop_t *)data;
+
+		error = zkfr_txappend(&tx);
+		break;
+
+	case ZKMSG_TXCOMMIT:
+		if ((error = zkfr_txcommit(&tx)) < 0) {
+			break;
+		}
+
+		mg.zmg_gen		= tx.ftx_gen;
+		mg.zmg_error	= 0;
+
+		error = zkctl_put(ctl, req, ZKMSG_TXCOMMIT, ZKMSG_F_MULTI, &mg, sizeof(mg));
+		break;
+
+	case ZKMSG_TXABORT:
+		zkfr_txabort();
+		break;
+
+	case ZKMSG_TXSTATUS:
+		zkfr_txstatus(&tx);
+
+		error = zkctl_put(ctl, req, ZKMSG_TXSTATUS, ZKMSG_F_MULTI, &tx, sizeof(tx));
+		break;
+
+	case ZKMSG_ADDDFR:
+		if (len != sizeof(ph)) {
+			return -EINVAL;
+		}
+
+		if (copy_from_user(&ph, data, sizeof(ph))) {
+			return -EFAULT;
+		}
+
+		if ((error = zkfr_pinhole(&ph)) < 0) {
+			break;
+		}
+
+		error = zkctl_put(ctl, req, ZKMSG_ADDDFR, ZKMSG_F_MULTI, &ph, sizeof(ph));
+		break;
+
+	case ZKMSG_DELDFR:
+		if (len != sizeof(id)) {
+			return -EINVAL;
+		}
+
+		if (copy_from_user(&id, data, sizeof(id))) {
+			return -EFAULT;
+		}
+
+		error = zkdfrule_removeid(id);
+		break;
+
+	case ZKMSG_GETNAPTST:
+		/* Port allocators of the NAT rules, in the order of the table.
+		 * Rules without one (1:1, inactivated) are all 0. */
+
+		if (len != sizeof(id)) {
+			return -EINVAL;
+		}
+
+		if (copy_from_user(&id, data, sizeof(id))) {
+			return -EFAULT;
+		}
+
+		spd = &staticnat[(id & SPD_NORMALNAT) ? NAT_NORMAL : NAT_REDIR];
+
+		maxrec = ZKCTL_MAXDATA / sizeof(zknaptstat_t);
+
+		KMALLOCS(ns, zknaptstat_t *, sizeof(zknaptstat_t) * maxrec);
+		if (ns == NULL) {
+			return -ENOMEM;
+		}
+
+		for (i = 0; error == 0; i += n) {
+			READ_LOCK(&spd_lock);
+
+			for (n = 0; n < maxrec && i + n < spd->spd_nelem; n++) {
+				zknapt_getstat(&spd->spd_nat[i + n], &ns[n]);
+			}
+
+			READ_UNLOCK(&spd_lock);
+
+			if (n == 0) {
+				break;
+			}
+
+			error = zkctl_put(ctl, req, ZKMSG_GETNAPTST, ZKMSG_F_MULTI, ns, sizeof(zknaptstat_t) * n);
+		}
+
+		KFREES(ns);
 		break;
 
 	default:
+		return -EINVAL;
+	}
+
+	return error;
+}
+
+
+/**
+ *---------------------------------------------------------------------------
+ *
+ * @fn     int zelkova_msg_filter(zkctl_t *ctl, zkmsghdr_t *req, void *data, uint32_t len)
+ * @brief  Process a filter rule message of the control channel
+ * @param  ctl: channel
+ * @param  req: request
+ * @param  data: data of the request (in user memory)
+ * @param  len: length of the data
+ * @return 0 if normal, <0 if abnormal.
+ * @date   18 Oct, 2026
+ * @see    zkfr_msg(), zkctl_write()
+ *
+ *  Process a message under zkfr_sem, like the ioctl() commands.
+ *
+ *---------------------------------------------------------------------------
+ */
+
+int zelkova_msg_filter(zkctl_t *ctl, zkmsghdr_t *req, void *data, uint32_t len)
+{
+	int		ret;
+
+	if (down_interruptible(&zkfr_sem)) {
+		return -ERESTARTSYS;
+	}
+
+	ret = zkfr_msg(ctl, req, data, len);
+
+	up(&zkfr_sem);
+
+	return ret;
+}
+
+
+/**
+ *---------------------------------------------------------------------------
+ *
+ * @fn int zelkova_ioctl_session(uint cmd, void *data, int mode)
+ * @brief Process session table operations
+ * @param uint cmd
+ * @param void *data
+ * @param int mode
+ * @date 18 Oct, 2026
+ *
+ *  Process operations on the session table requested by
+ *  another applications.
+ *
+ *---------------------------------------------------------------------------
+ */
+
+int zelkova_ioctl_session(uint cmd, void *data, int mode)
+{
+	zk_sess_stat_t		st;
+	zksesssnap_t		hdr;
+	int					error;
+
+	ZKDEBUG("'%c'/0x%02x\n", (char)_IOC_TYPE(cmd), (unsigned int)_IOC_NR(cmd));
+
+	switch(cmd) {
+	case SIOCGETSESSST:
+		/* Statistics and the chain length histogram */
+
+		ipsess_getstat(&st);
+		zkfrag_getstat(&st.zss_nfraghold, &st.zss_nfragdrop);
+
+		if (copy_to_user(data, &st, sizeof(st))) {
+			return -EFAULT;
+		}
+		break;
+
+	case SIOCSNAPSESS:
+		/* Take a snapshot to be read through mmap() on DEV_SESSION */
+
+		if ((error = ipsess_snapshot(&hdr)) < 0) {
+			return error;
+		}
+
+		if (copy_to_user(data, &hdr, sizeof(hdr))) {
+			return -EFAULT;
+		}
 		break;
+
+	default:
+		return -EINVAL;
 	}
 
 	return 0;
 }
 
+
+/**
+ *---------------------------------------------------------------------------
+ *
+ * @fn     int zelkova_msg_session(zkctl_t *ctl, zkmsghdr_t *req, void *data, uint32_t len)
+ * @brief  Process session table messages of the control channel
+ * @param  ctl: channel
+ * @param  req: request
+ * @param  data: data of the request (in user memory)
+ * @param  len: length of the data
+ * @return 0 if normal, <0 if abnormal.
+ * @date   18 Oct, 2026
+ * @see    zelkova_ioctl_session(), zkctl_write()
+ *
+ *  Process the messages which correspond to session ioctl() commands.
+ *
+ *---------------------------------------------------------------------------
+ */
+
+int zelkova_msg_session(zkctl_t *ctl, zkmsghdr_t *req, void *data, uint32_t len)
+{
+	zk_sess_stat_t		st;
+
+	switch (req->zmh_type) {
+	case ZKMSG_GETSESSST:
+		ipsess_getstat(&st);
+		zkfrag_getstat(&st.zss_nfraghold, &st.zss_nfragdrop);
+
+		return zkctl_put(ctl, req, ZKMSG_GETSESSST, ZKMSG_F_MULTI, &st, sizeof(st));
+
+	default:
+		return -EINVAL;
+	}
+
+	return 0;
+}
@@ -49,10 +49,18 @@
 #include <linux/proc_fs.h>			/*  */
 #include <linux/netfilter.h>		/* nf_hook_ops */
 #include <linux/netfilter_ipv4.h>	/* NF_* */
+#include <linux/random.h>			/* get_random_bytes() */
 
 #include "zelkova.h"
 #include "zkuio.h"
 #include "zkpktinfo.h"				/* zkpktinfo_t */
+#include "zksession.h"				/* ipsess_init(), ipsess_clean() */
+#include "zkflow.h"					/* zkflow_check() */
+#include "zkstat.h"					/* zkstat_verdict() */
+#include "zkfilter.h"				/* zkfilter_early(), zkfilter_check() */
+#include "zkfrag.h"					/* zkfrag_init() */
+#include "zknat.h"					/* zknat_onetoone() */
+#include "zkctl.h"					/* zkctl_read(), zkctl_write() */
 
 
 /*
@@ -62,11 +70,31 @@ static int __init zelkova_init_module(void);
 static void __exit zelkova_cleanup_module(void);
 
 static ssize_t		zelkova_read(struct file *file, char *buf, size_t nbytes, loff_t *ppos);
+static ssize_t		zelkova_write(struct file *file, const char *buf, size_t nbytes, loff_t *ppos);
 static unsigned int	zelkova_poll(struct file *, struct poll_table_struct *);
 static int			zelkova_ioctl(struct inode *, struct file *, unsigned int, unsigned long);
+static int			zelkova_mmap(struct file *, struct vm_area_struct *);
 static int			zelkova_open(struct inode *, struct file *);
 static int			zelkova_release(struct inode *, struct file *);
 
+static unsigned int zkfv_prerouting_check (unsigned int hook,
+		struct sk_buff **pskb,
+		const struct net_device *in,
+		const struct net_device *out,
+		int (*okfn)(struct sk_buff *));
+
+static unsigned int zkfv_prerouting_nat (unsigned int hook,
+		struct sk_buff **pskb,
+		const struct net_device *in,
+		const struct net_device *out,
+		int (*okfn)(struct sk_buff *));
+
+static unsigned int zkfv_postrouting_nat (unsigned int hook,
+		struct sk_buff **pskb,
+		const struct net_device *in,
+		const struct net_device *out,
+		int (*okfn)(struct sk_buff *));
+
 static unsigned int zkfv_input_check (unsigned int hook,
 		struct sk_buff **pskb,
 		const struct net_device *in,
@@ -89,13 +117,16 @@ static unsigned int zkfv_output_check (unsigned int hook,
  * @var   zelkova_fops
  * @brief A file_operations interface into zelkova device driver
  *
- * Here we register 5 fops handlers such as read, poll, ioctl, open, release.
+ * Here we register 7 fops handlers such as read, write, poll, ioctl, mmap,
+ * open, release.
  */
 static struct file_operations zelkova_fops = {
 	.owner		= THIS_MODULE,
 	.read		= zelkova_read,
+	.write		= zelkova_write,
 	.poll		= zelkova_poll,
 	.ioctl		= zelkova_ioctl,
+	.mmap		= zelkova_mmap,
 	.open		= zelkova_open,
 	.release	= zelkova_release,
 };
@@ -134,6 +165,44 @@ static struct nf_hook_ops zkfv_ops[] = {
 	},
 };
 
+/**
+ * @var   zkfv_preops
+ * @brief An optional pre-routing handler which drops denied packets early
+ *
+ * Registered only if zelkova_earlydrop is set.
+ */
+static struct nf_hook_ops zkfv_preops = {
+	{ NULL, NULL },
+	.hook		= zkfv_prerouting_check,
+	.pf			= PF_INET,
+	.hooknum	= NF_IP_PRE_ROUTING,
+	.priority	= NF_IP_PRI_FILTER,
+};
+
+/**
+ * @var   zkfv_natops
+ * @brief Handlers of the 1:1 NAT mappings
+ *
+ * Destinations are translated before routing and before the filter sees
+ * the packet, sources after routing.
+ */
+static struct nf_hook_ops zkfv_natops[] = {
+	{
+		{ NULL, NULL },
+		.hook		= zkfv_prerouting_nat,
+		.pf			= PF_INET,
+		.hooknum	= NF_IP_PRE_ROUTING,
+		.priority	= NF_IP_PRI_NAT_DST,
+	},
+	{
+		{ NULL, NULL },
+		.hook		= zkfv_postrouting_nat,
+		.pf			= PF_INET,
+		.hooknum	= NF_IP_POST_ROUTING,
+		.priority	= NF_IP_PRI_NAT_SRC,
+	},
+};
+
 /**
  * @var   zelkova_run
  * @brief A global flag which indicates whether zelkova is running.
@@ -144,24 +213,45 @@ static int	zelkova_run = 0;
 
 int zelkova_major =		ZELKOVA_MAJOR;	/**< Major number of zelkova device file */
 int zelkova_nr_devs =	ZELKOVA_NR_DEVS;	/**< Number of total devices */
+int zelkova_sesspercpu =	0;	/**< Stripe the session table over one shard per CPU? */
+int zelkova_maxsess =	MAX_ZKIPSESS;	/**< Ceiling of the number of sessions */
+int zelkova_flowoffload =	1;	/**< Offload established flows? */
+int zelkova_earlydrop =	0;	/**< Drop denied packets before routing? */
+int zelkova_addrtrie =	0;	/**< Locate addresses with multibit tries? */
 
 MODULE_PARM(zelkova_major, "i");
 MODULE_PARM(zelkova_nr_devs, "i");
+MODULE_PARM(zelkova_sesspercpu, "i");
+MODULE_PARM(zelkova_maxsess, "i");
+MODULE_PARM(zelkova_flowoffload, "i");
+MODULE_PARM(zelkova_earlydrop, "i");
+MODULE_PARM(zelkova_addrtrie, "i");
 MODULE_PARM_DESC(zelkova_major, "Major number of zelkova device file");
 MODULE_PARM_DESC(zelkova_nr_devs, "Total number of zelkova device files");
+MODULE_PARM_DESC(zelkova_sesspercpu, "Split the session table into hash-striped shards, as many as CPUs (0/1)");
+MODULE_PARM_DESC(zelkova_maxsess, "Maximum number of sessions");
+MODULE_PARM_DESC(zelkova_flowoffload, "Let established flows skip classification (0/1)");
+MODULE_PARM_DESC(zelkova_earlydrop, "Drop denied packets on the pre-routing hook (0/1)");
+MODULE_PARM_DESC(zelkova_addrtrie, "Use 16-8-8 tries for address dimensions (0/1)");
 MODULE_AUTHOR("Dongsu Park");
 MODULE_DESCRIPTION("High-Traffic-Processible Firewall & IPS software");
 MODULE_LICENSE("GPL");
 
 void		*spdroot;		/* FIS-tree root */
 
-void zelkova_attach(void);
+uint32_t	zk_hashseed;	/* Seed of the keyed hash (zkhash.h) */
+
+int zelkova_attach(void);
 void zelkova_detach(void);
 
 /*
  * Extern Functions & Variables
  */
 extern int	zelkova_ioctl_filter(uint cmd, void *data, int mode);
+extern int	zelkova_ioctl_session(uint cmd, void *data, int mode);
+extern void	zelkova_ioctl_clean(void);
+extern void	filter_init(void);
+extern void	filter_clean(void);
 
 
 /**
@@ -184,7 +274,11 @@ static int __init zelkova_init_module(void)
 	int		ret;
 	int		result;
 
-	zelkova_attach();
+	ret = zelkova_attach();
+	if (ret < 0) {
+		ZKDEBUG("Error: zelkova_attach() failed.\n");
+		return ret;
+	}
 
 	/* Register an input hook */
 	ret = nf_register_hook(&zkfv_ops[0]);
@@ -207,11 +301,34 @@ static int __init zelkova_init_module(void)
 		goto cleanup_hook1;
 	}
 
+	/* Register a pre-routing hook */
+	if (zelkova_earlydrop) {
+		ret = nf_register_hook(&zkfv_preops);
+		if (ret < 0) {
+			ZKDEBUG("Error: nf_register_hook(&zkfv_preops) failed.\n");
+			goto cleanup_hook2;
+		}
+	}
+
+	/* Register 1:1 NAT hooks */
+	ret = nf_register_hook(&zkfv_natops[0]);
+	if (ret < 0) {
+		ZKDEBUG("Error: nf_register_hook(&zkfv_natops[0]) failed.\n");
+		goto cleanup_hook3;
+	}
+
+	ret = nf_register_hook(&zkfv_natops[1]);
+	if (ret < 0) {
+		ZKDEBUG("Error: nf_register_hook(&zkfv_natops[1]) failed.\n");
+		goto cleanup_hook4;
+	}
+
 	/* Register to the character device with major number zelkova_major. */
 	result = register_chrdev(zelkova_major, ZELKOVA_MODNAME, &zelkova_fops);
 	if (result < 0) {
 		ZKDEBUG("Error: unable to get a major number %d\n", zelkova_major);
-		return result;
+		ret = result;
+		goto cleanup_hook5;
 	}
     if (zelkova_major == 0) {
 		zelkova_major = result; /* dynamic */
@@ -224,13 +341,24 @@ static int __init zelkova_init_module(void)
 
 	return ret;
 
+cleanup_hook5:
+	nf_unregister_hook(&zkfv_natops[1]);
+cleanup_hook4:
+	nf_unregister_hook(&zkfv_natops[0]);
+cleanup_hook3:
+	if (zelkova_earlydrop) {
+		nf_unregister_hook(&zkfv_preops);
+	}
+cleanup_hook2:
+	nf_unregister_hook(&zkfv_ops[2]);
 cleanup_hook1:
 	nf_unregister_hook(&zkfv_ops[1]);
 cleanup_hook0:
 	nf_unregister_hook(&zkfv_ops[0]);
 cleanup_table:
+	zelkova_detach();
 
-	return -1;
+	return (ret < 0) ? ret : -1;
 }
 
 
@@ -257,6 +385,14 @@ static void __exit zelkova_cleanup_module(void)
 
 	unregister_chrdev(zelkova_major, ZELKOVA_MODNAME);
 
+	for (i = 0; i < sizeof(zkfv_natops) / sizeof(struct nf_hook_ops); i++) {
+		nf_unregister_hook(&zkfv_natops[i]);
+	}
+
+	if (zelkova_earlydrop) {
+		nf_unregister_hook(&zkfv_preops);
+	}
+
 	for (i = 0; i < sizeof(zkfv_ops) / sizeof(struct nf_hook_ops); i++) {
 		nf_unregister_hook(&zkfv_ops[i]);
 	}
@@ -268,10 +404,10 @@ static void __exit zelkova_cleanup_module(void)
 /**
  *---------------------------------------------------------------------------
  *
- * @fn void zelkova_attach(void)
+ * @fn int zelkova_attach(void)
  * @brief Initializes variables in the zelkova module
  * @param NONE
- * @return NONE
+ * @return 0 if normal, <0 if abnormal.
  * @date 19 Jul, 2005
  * @see zelkova_detach()
  *
@@ -280,8 +416,42 @@ static void __exit zelkova_cleanup_module(void)
  *---------------------------------------------------------------------------
  */
 
-void zelkova_attach(void)
+int zelkova_attach(void)
 {
+	int		ret;
+
+	/* A new seed on every load, so that bucket positions of flows
+	 * cannot be worked out from outside. */
+	get_random_bytes(&zk_hashseed, sizeof(zk_hashseed));
+
+	fistree_addrtrie = zelkova_addrtrie;
+
+	/* The default rules and the dynamic rule list */
+	filter_init();
+
+	ret = ipsess_init(zelkova_sesspercpu, zelkova_maxsess);
+	if (ret < 0) {
+		filter_clean();
+		return ret;
+	}
+
+	ret = zkfrag_init();
+	if (ret < 0) {
+		ipsess_clean();
+		filter_clean();
+		return ret;
+	}
+
+	if (zelkova_flowoffload) {
+		ret = zkflow_init();
+		if (ret < 0) {
+			zkfrag_clean();
+			ipsess_clean();
+			filter_clean();
+			return ret;
+		}
+	}
+
 #if 0
 	init_timer(&timer);
 
@@ -291,6 +461,8 @@ void zelkova_attach(void)
 
 	add_timer(&timer);
 #endif
+
+	return 0;
 }
 
 
@@ -314,6 +486,13 @@ void zelkova_detach(void)
 #if 0
 	del_timer(&timer);
 #endif
+
+	zelkova_ioctl_clean();
+	zkflow_clean();
+	zkfrag_clean();
+	ipsess_snapclean();
+	ipsess_clean();
+	filter_clean();
 }
 
 
@@ -349,6 +528,8 @@ static ssize_t zelkova_read(struct file *file, char *buf, size_t nbytes, loff_t
 	uio.uio_buff	= buf;
 
 	switch (unit) {
+		case DEV_CTL:
+			return zkctl_read(file, buf, nbytes);
 		case DEV_ACCT:
 			/* TODO: return zelkovalog_read(unit, &uio); */
 		default:
@@ -359,6 +540,43 @@ static ssize_t zelkova_read(struct file *file, char *buf, size_t nbytes, loff_t
 }
 
 
+/**
+ *---------------------------------------------------------------------------
+ *
+ * @fn     static ssize_t zelkova_write(struct file *file, const char *buf, size_t nbytes, loff_t *ppos)
+ * @brief  Send control messages to the zelkova device
+ * @param  struct file *file
+ * @param  const char *buf
+ * @param  size_t nbytes
+ * @param  loff_t *ppos
+ * @return Return data size written, <0 if abnormal
+ * @date   18 Oct, 2026
+ * @see    zelkova_read(), zkctl_write()
+ *
+ *  Send a batch of control messages. Only DEV_CTL can be written.
+ *
+ *---------------------------------------------------------------------------
+ */
+
+static ssize_t zelkova_write(struct file *file, const char *buf, size_t nbytes, loff_t *ppos)
+{
+	struct inode	*inode = file->f_dentry->d_inode;
+
+	if (!zelkova_run) {
+		return -ENXIO;
+	}
+
+	switch (minor(inode->i_rdev)) {
+	case DEV_CTL:
+		return zkctl_write(file, buf, nbytes);
+	default:
+		return -EINVAL;
+	}
+
+	return 0;
+}
+
+
 /**
  *---------------------------------------------------------------------------
  *
@@ -388,6 +606,8 @@ static unsigned int zelkova_poll(struct file *file, struct poll_table_struct *wa
 		return (POLLIN | POLLRDNORM);
 
 		break;
+	case DEV_CTL:
+		return zkctl_poll(file, wait);
 	default:
 		break;
 	}
@@ -439,6 +659,8 @@ static int zelkova_ioctl(struct inode *inode, struct file *file, unsigned int cm
 	switch(_IOC_TYPE(cmd)) {
 	case FILTER_IOCTL:	/* Filter rules */
 		return zelkova_ioctl_filter(cmd, (void *)arg, mode);
+	case SESSION_IOCTL:	/* Session table */
+		return zelkova_ioctl_session(cmd, (void *)arg, mode);
 	default:
 		return -EINVAL;
 	}
@@ -447,6 +669,42 @@ static int zelkova_ioctl(struct inode *inode, struct file *file, unsigned int cm
 }
 
 
+/**
+ *---------------------------------------------------------------------------
+ *
+ * @fn     static int zelkova_mmap(struct file *file, struct vm_area_struct *vma)
+ * @brief  Map device memory into user space
+ * @param  struct file *file
+ * @param  struct vm_area_struct *vma
+ * @return 0 if normal, <0 if abnormal.
+ * @date   18 Oct, 2026
+ * @see    zelkova_ioctl(), ipsess_snapmmap()
+ *
+ *  Map the latest session table snapshot taken by SIOCSNAPSESS.
+ *  Only DEV_SESSION can be mapped.
+ *
+ *---------------------------------------------------------------------------
+ */
+
+static int zelkova_mmap(struct file *file, struct vm_area_struct *vma)
+{
+	struct inode	*inode = file->f_dentry->d_inode;
+
+	if (!zelkova_run) {
+		return -ENXIO;
+	}
+
+	switch (minor(inode->i_rdev)) {
+	case DEV_SESSION:
+		return ipsess_snapmmap(file, vma);
+	default:
+		return -ENODEV;
+	}
+
+	return 0;
+}
+
+
 /**
  *---------------------------------------------------------------------------
  *
@@ -465,10 +723,16 @@ static int zelkova_ioctl(struct inode *inode, struct file *file, unsigned int cm
 
 static int zelkova_open(struct inode *inode, struct file *file)
 {
+	int		error;
+
 	if (minor(inode->i_rdev) > DEV_MAX) {
 		return -ENXIO;
 	}
 
+	if (minor(inode->i_rdev) == DEV_CTL && (error = zkctl_open(file)) < 0) {
+		return error;
+	}
+
 	MOD_INC_USE_COUNT;
 
 	return 0;
@@ -497,12 +761,105 @@ static int zelkova_release(struct inode *inode, struct file *file)
 		return -ENXIO;
 	}
 
+	if (minor(inode->i_rdev) == DEV_CTL) {
+		zkctl_release(file);
+	}
+
 	MOD_DEC_USE_COUNT;
 
 	return 0;
 }
 
 
+/**
+ *---------------------------------------------------------------------------
+ *
+ * @fn     static unsigned int zkfv_prerouting_check(unsigned int hook, struct sk_buff **pskb, const struct net_device *in, const struct net_device *out, int (*okfn)(struct sk_buff *))
+ * @brief  Check packets on the netfilter pre-routing hook
+ * @param  unsigned int hook
+ * @param  struct sk_buff **pskb
+ * @param  const struct net_device *in
+ * @param  const struct net_device *out
+ * @param  int (*okfn)(struct sk_buff *)
+ * @return NF_ACCEPT, NF_DROP, or etc.
+ * @date   18 Oct, 2026
+ * @see    zkfv_input_check(), zkfv_forward_check(), zkfilter_early()
+ *
+ *  Drop denied packets before the routing decision is made. Packets of
+ *  offloaded flows are left alone, as the later hooks let them through
+ *  at once anyway.
+ *
+ *---------------------------------------------------------------------------
+ */
+
+static unsigned int zkfv_prerouting_check (unsigned int hook,
+		struct sk_buff **pskb,
+		const struct net_device *in,
+		const struct net_device *out,
+		int (*okfn)(struct sk_buff *))
+{
+	return zkfilter_early(*pskb, in);
+}
+
+
+/**
+ *---------------------------------------------------------------------------
+ *
+ * @fn     static unsigned int zkfv_prerouting_nat(unsigned int hook, struct sk_buff **pskb, const struct net_device *in, const struct net_device *out, int (*okfn)(struct sk_buff *))
+ * @brief  Translate destinations by the 1:1 NAT mappings
+ * @param  unsigned int hook
+ * @param  struct sk_buff **pskb
+ * @param  const struct net_device *in
+ * @param  const struct net_device *out
+ * @param  int (*okfn)(struct sk_buff *)
+ * @return NF_ACCEPT, NF_DROP, or etc.
+ * @date   18 Oct, 2026
+ * @see    zkfv_postrouting_nat(), zknat_onetoone()
+ *
+ *  Translate the destination of an inbound packet to a mapped address.
+ *
+ *---------------------------------------------------------------------------
+ */
+
+static unsigned int zkfv_prerouting_nat (unsigned int hook,
+		struct sk_buff **pskb,
+		const struct net_device *in,
+		const struct net_device *out,
+		int (*okfn)(struct sk_buff *))
+{
+	return zknat_onetoone(pskb, 0);
+}
+
+
+/**
+ *---------------------------------------------------------------------------
+ *
+ * @fn     static unsigned int zkfv_postrouting_nat(unsigned int hook, struct sk_buff **pskb, const struct net_device *in, const struct net_device *out, int (*okfn)(struct sk_buff *))
+ * @brief  Translate sources by the 1:1 NAT mappings
+ * @param  unsigned int hook
+ * @param  struct sk_buff **pskb
+ * @param  const struct net_device *in
+ * @param  const struct net_device *out
+ * @param  int (*okfn)(struct sk_buff *)
+ * @return NF_ACCEPT, NF_DROP, or etc.
+ * @date   18 Oct, 2026
+ * @see    zkfv_prerouting_nat(), zknat_onetoone()
+ *
+ *  Translate the source of an outbound packet from a mapped address.
+ *
+ *---------------------------------------------------------------------------
+ */
+
+static unsigned int zkfv_postrouting_nat (unsigned int hook,
+		struct sk_buff **pskb,
+		const struct net_device *in,
+		const struct net_device *out,
+		int (*okfn)(struct sk_buff *))
+{
+	return zknat_onetoone(pskb, 1);
+}
+
+
 /**
  *---------------------------------------------------------------------------
  *
@@ -515,7 +872,7 @@ static int zelkova_release(struct inode *inode, struct file *file)
  * @param  int (*okfn)(struct sk_buff *)
  * @return NF_ACCEPT, NF_DROP, or etc.
  * @date   23 Jul, 2005
- * @see    zkfv_forward_check(), zkfv_output_check()
+ * @see    zkfv_forward_check(), zkfv_output_check(), zkfilter_check()
  *
  *  Check packets on the netfilter input hook
  *
@@ -528,7 +885,15 @@ static unsigned int zkfv_input_check (unsigned int hook,
 		const struct net_device *out,
 		int (*okfn)(struct sk_buff *))
 {
-	return NF_ACCEPT;
+	unsigned int	verdict;
+
+	/* Established flows skip the rest */
+	if (zkflow_check(*pskb, in, &verdict)) {
+		zkstat_verdict(0, verdict == NF_ACCEPT);
+		return verdict;
+	}
+
+	return zkfilter_check(*pskb, in, 0);
 }
 
 
@@ -544,7 +909,7 @@ static unsigned int zkfv_input_check (unsigned int hook,
  * @param  int (*okfn)(struct sk_buff *)
  * @return NF_ACCEPT, NF_DROP, or etc.
  * @date   23 Jul, 2005
- * @see    zkfv_input_check(), zkfv_output_check()
+ * @see    zkfv_input_check(), zkfv_output_check(), zkfilter_check()
  *
  *  Check packets on the netfilter forward hook
  *
@@ -557,7 +922,15 @@ static unsigned int zkfv_forward_check (unsigned int hook,
 		const struct net_device *out,
 		int (*okfn)(struct sk_buff *))
 {
-	return NF_ACCEPT;
+	unsigned int	verdict;
+
+	/* Established flows skip the rest */
+	if (zkflow_check(*pskb, in, &verdict)) {
+		zkstat_verdict(0, verdict == NF_ACCEPT);
+		return verdict;
+	}
+
+	return zkfilter_check(*pskb, in, 0);
 }
 
 
@@ -573,7 +946,7 @@ static unsigned int zkfv_forward_check (unsigned int hook,
  * @param  int (*okfn)(struct sk_buff *)
  * @return NF_ACCEPT, NF_DROP, or etc.
  * @date   23 Jul, 2005
- * @see    zkfv_input_check(), zkfv_forward_check()
+ * @see    zkfv_input_check(), zkfv_forward_check(), zkfilter_check()
  *
  *  Check packets on the netfilter output hook
  *
@@ -586,7 +959,7 @@ static unsigned int zkfv_output_check (unsigned int hook,
 		const struct net_device *out,
 		int (*okfn)(struct sk_buff *))
 {
-	return NF_ACCEPT;
+	return zkfilter_check(*pskb, out, 1);
 }
 
 module_init(zelkova_init_module);
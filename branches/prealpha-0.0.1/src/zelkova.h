@@ -32,6 +32,7 @@
 
 #include <linux/ioctl.h>
 #include <linux/slab.h>
+#include <asm/atomic.h>				/* atomic_t */
 
 #include "fistree/fistree.h"		/* fisrule_t */
 
@@ -63,7 +64,7 @@
 #endif
 
 #ifndef ZELKOVA_NR_DEVS
-#define ZELKOVA_NR_DEVS	2	/**< Number of device files */
+#define ZELKOVA_NR_DEVS	4	/**< Number of device files */
 #endif
 
 /*
@@ -91,6 +92,24 @@
 
 #define SIOCGETFR			_IOR(FILTER_IOCTL, 0x00, sizeof(int *))
 #define SIOCSETFR			_IOW(FILTER_IOCTL, 0x00, sizeof(int *))
+#define SIOCGETRULEST		_IOWR(FILTER_IOCTL, 0x01, sizeof(int *))
+#define SIOCSETNAT			_IOW(FILTER_IOCTL, 0x02, sizeof(int *))
+#define SIOCBEGINFR			_IOWR(FILTER_IOCTL, 0x03, sizeof(int *))
+#define SIOCADDFR			_IOWR(FILTER_IOCTL, 0x04, sizeof(int *))
+#define SIOCCOMMITFR		_IO(FILTER_IOCTL, 0x05)
+#define SIOCABORTFR			_IO(FILTER_IOCTL, 0x06)
+#define SIOCTXBEGIN			_IO(FILTER_IOCTL, 0x07)
+#define SIOCTXOP			_IOW(FILTER_IOCTL, 0x08, sizeof(int *))
+#define SIOCTXCOMMIT		_IOR(FILTER_IOCTL, 0x09, sizeof(int *))
+#define SIOCTXABORT			_IO(FILTER_IOCTL, 0x0a)
+#define SIOCTXSTATUS		_IOR(FILTER_IOCTL, 0x0b, sizeof(int *))
+#define SIOCADDDFR			_IOWR(FILTER_IOCTL, 0x0c, sizeof(int *))
+#define SIOCDELDFR			_IOW(FILTER_IOCTL, 0x0d, sizeof(int *))
+
+#define SESSION_IOCTL		's'
+
+#define SIOCGETSESSST		_IOR(SESSION_IOCTL, 0x00, sizeof(int *))
+#define SIOCSNAPSESS		_IOR(SESSION_IOCTL, 0x01, sizeof(int *))
 
 /*
  * Useful macros
@@ -108,8 +127,10 @@
 
 #define DEV_ZELKOVA			0
 #define DEV_ACCT			1
+#define DEV_SESSION			2	/**< mmap() of session snapshots */
+#define DEV_CTL				3	/**< message-based control channel (zkctl.h) */
 
-#define DEV_MAX				1
+#define DEV_MAX				3
 
 
 /* Policy variables */
@@ -157,10 +178,15 @@ typedef struct zkact {
 
 	struct zkact	*act_parent;	/* parent */
 
+	/* Shared counters are not updated by the kernel; the packet path
+	 * counts into act_stat, which SIOCGETRULEST sums. */
 	uint32_t		act_hits;		/* hit counts of FIS-tree queries */
 	uint32_t		act_pkts;		/* packet counts */
 	uint64_t		act_bytes;		/* byte counts */
 
+	struct zkactstat	*act_stat;	/* counters per CPU (zkstat.h), NULL if none */
+	uint32_t		act_nstat;		/* distance between the counters of two CPUs */
+
     zk_policy_t		*act_policy;	/* Policy fetched from DB */
 } zkact_t;
 
@@ -185,8 +211,31 @@ typedef struct zkdfrule {
 	struct zkdfrule	*dfrule_next;	/* Next node of linked list */
 
 	struct zkdfrule	*dfrule_bnext;	/* Brother node of linked list */
+
+	struct zkdfrule	*dfrule_hnext;	/* The next node of the overlay chain */
+	struct zkdfrule	**dfrule_hpprev;	/* dfrule_hnext of the previous node
+										 * (or the chain head) pointing to this node */
+
+	uint32_t		dfrule_id;		/* handle given by zkdfrule_insert() */
+	int				dfrule_dead;	/* taken out of the overlay */
+	atomic_t		dfrule_refcnt;	/* the overlay and the sessions on the rule */
 } zkdfrule_t;
 
+/* ZKDFRULE(): The dynamic rule of a rule, NULL if it is a static one.
+ * Only dynamic rules have a parent action.
+ */
+
+#define ZKDFRULE(rule) \
+	(((zkact_t *)(rule)->action)->act_parent != NULL ? (zkdfrule_t *)(rule) : NULL)
+
+/* Dynamic rules are kept out of the FIS-tree in a small overlay, queried
+ * alongside spdroot by zkdfrule_query(). Rules with one destination
+ * address and one destination port (most of pinholes) are hashed by them,
+ * and the others are kept on a wildcard list.
+ */
+
+#define ZKDFRULE_HASHSIZE	1024	/**< Buckets of the overlay (a power of 2) */
+
 
 /* zkspd_t
  * :Manages SPD(ruleset) in one structure
@@ -197,7 +246,7 @@ typedef struct zkspd {
 
 	union {
 		zkact_t	*act;			/* The action linked to the SPD entry */
-		struct nat	*nat;			/* The action linked to the NAT policy */
+		struct zknat	*nat;			/* The action linked to the NAT policy */
 	} spd_action;
 
 	void			*spd_policy;	/* Policy table fetched from DB */
@@ -206,8 +255,86 @@ typedef struct zkspd {
 	uint32_t		spd_nelem;		/* Size of the table (number of elements) */
 	uint32_t		spd_precnt;		/* Number of default allow rules (ex. TCP port #443 is opened */
 	uint32_t		spd_flag;		/* flags */
+
+	struct zkactstat	*spd_stat;	/* rule counters of all CPUs (zkstat_alloc()) */
+
+	uint32_t		*spd_pidhash;	/* index of spd_act[] by act_pid (zkspd_makeindex()),
+									 * 1 + index of each slot, 0 if empty */
+	uint32_t		spd_pidmask;	/* number of slots of spd_pidhash - 1 */
 } zkspd_t;
 
+/* zkfrupload_t
+ * :Argument of the chunked upload of static rules. SIOCBEGINFR takes
+ *  fru_total, the number of rules to come. Each SIOCADDFR appends the
+ *  fru_nelem rules of fru_table[], fru_act[] and fru_policy[] (0 only asks
+ *  the progress). fru_done returns the number of rules uploaded so far.
+ *  SIOCCOMMITFR puts them in service, and SIOCABORTFR discards them.
+ */
+
+typedef struct zkfrupload {
+	uint32_t		fru_total;		/* number of rules to be uploaded */
+	uint32_t		fru_nelem;		/* number of rules of this chunk */
+	uint32_t		fru_done;		/* number of rules uploaded so far */
+	uint32_t		fru_reserved;	/* NOT USED */
+
+	fisrule_t		*fru_table;		/* rules of this chunk */
+	zkact_t			*fru_act;		/* actions of this chunk */
+	zk_policy_t		*fru_policy;	/* policies of this chunk */
+} zkfrupload_t;
+
+/* zkfrop_t
+ * :One operation of a rule transaction (SIOCTXOP). Rules are named by
+ *  policy IDs. fro_rule, fro_act and fro_policy are the new rule of
+ *  FROP_ADD and FROP_MODIFY.
+ */
+
+typedef struct zkfrop {
+	uint32_t		fro_type;		/* FROP_* */
+	uint32_t		fro_pid;		/* policy id. of the rule */
+
+	fisrule_t		fro_rule;		/* new rule */
+	zkact_t			fro_act;		/* new action */
+	zk_policy_t		fro_policy;		/* new policy */
+} zkfrop_t;
+
+/* zkfrop_t::fro_type */
+
+#define FROP_ADD		1
+#define FROP_DELETE		2
+#define FROP_MODIFY		3
+
+/* zkfrtxreq_t
+ * :Argument of rule transactions. SIOCTXOP stages the ftx_nelem
+ *  operations of ftx_op[]. SIOCTXCOMMIT returns the generation of the
+ *  static SPD which carries the transaction, and SIOCTXSTATUS returns the
+ *  current generation, whether a background rebuild is pending, and the
+ *  result of the last one.
+ */
+
+typedef struct zkfrtxreq {
+	uint32_t		ftx_nelem;		/* number of operations */
+	uint32_t		ftx_gen;		/* generation of the static SPD */
+	uint32_t		ftx_pending;	/* a background rebuild is pending */
+	int32_t			ftx_error;		/* result of the last rebuild (0 or -errno) */
+
+	zkfrop_t		*ftx_op;		/* operations */
+} zkfrtxreq_t;
+
+/* zkpinhole_t
+ * :Argument of SIOCADDDFR and SIOCDELDFR. SIOCADDDFR opens a pinhole
+ *  (a dynamic rule) under the static rule of ph_pid and returns its
+ *  handle in ph_id; SIOCDELDFR closes the pinhole of ph_id. Fields of
+ *  ph_rule may not be INTERVAL_RANGESET.
+ */
+
+typedef struct zkpinhole {
+	fisrule_t		ph_rule;		/* rule */
+	uint32_t		ph_pass;		/* ACT_* */
+	uint32_t		ph_pid;			/* policy id. of the parent rule */
+	uint32_t		ph_id;			/* handle of the pinhole */
+	uint32_t		ph_reserved;	/* NOT USED */
+} zkpinhole_t;
+
 #define spd_act		spd_action.act
 #define spd_nat		spd_action.nat
 
@@ -215,15 +342,37 @@ typedef struct zkspd {
 
 #define SPD_NORMALNAT	0x000000001
 #define SPD_NAT			0x000000002
+#define SPD_VMALLOC		0x000000004		/* tables are from vmalloc() (SIOCBEGINFR, transactions) */
+
+/* Rule tables of the FIS-tree (spdroot)
+ * The filter rules and both kinds of NAT rules share one FIS-tree, so that
+ * a single query returns the rule of each table at once.
+ */
+
+#define SPD_FILTER		0				/* filter rules (staticspd) */
+#define SPD_NATTABLE(n)	(1 + (n))		/* NAT rules (staticnat[NAT_REDIR/NAT_NORMAL]) */
+#define SPD_NTABLE		3				/* number of rule tables */
+
+#define SPD_MASK(t)		(1 << (t))		/* table mask of FISTREE_QUERYMULTI() */
 
 /*
  * Function declarations
  */
 
 /* (in zkrule.c) */
+extern uint32_t	dfrule_gen;		/* moves on whenever a dynamic rule is taken out */
+
+void zkdfrule_init(void);
+void zkdfrule_clean(void);
 void zkdfrule_syncrule(zkspd_t *spd);
+int zkdfrule_insert(zkdfrule_t *dfrule, uint32_t *id);
+void zkdfrule_remove(zkdfrule_t *dfrule);
+int zkdfrule_removeid(uint32_t id);
 void zkdfrule_delete(zkdfrule_t *dfrule);
+void zkdfrule_put(zkdfrule_t *dfrule);
+fisrule_t *zkdfrule_query(uint32_t id[], fisrule_t *rule);
 void zkspd_clean(zkspd_t *spd);
 zkact_t *zkspd_getactbyid(zkspd_t *spd, uint32_t id);
+int zkspd_makeindex(zkspd_t *spd);
 
 #endif	/* __ZELKOVA_H__ */
@@ -0,0 +1,588 @@
+/*
+ *----------------------------------------------------------------------------
+ *
+ * Zelkova - A Firewall and Intrusion Prevention System on Linux Kernel
+ *
+ * Copyright (C) 2005 Dongsu Park <advance@dongsu.pe.kr>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111, USA.
+ *
+ * $Id$
+ *----------------------------------------------------------------------------
+ */
+
+/** @file zkctl.c
+ * Carries batches of control messages through DEV_CTL
+ */
+
+#define __NO_VERSION__
+
+#include <linux/kernel.h>			/* printk() */
+#include <linux/sched.h>			/* wait_event_interruptible() */
+#include <linux/slab.h>				/* kmalloc(), kfree() */
+#include <linux/smp_lock.h>			/* lock_kernel() */
+#include <asm/uaccess.h>			/* copy_to_user(), copy_from_user() */
+#include <asm/semaphore.h>			/* init_MUTEX(), DECLARE_MUTEX() */
+
+#include "zkctl.h"
+
+
+static DECLARE_MUTEX(zkctl_listsem);		/**< Lock of zkctl_list; zkctl_queue() may sleep under it */
+static zkctl_t		*zkctl_list = NULL;		/**< Open channels */
+
+
+/**
+ *---------------------------------------------------------------------------
+ *
+ * @fn     int zkctl_open(struct file *file)
+ * @brief  Open a control channel
+ * @param  file: file of DEV_CTL
+ * @return 0 if normal, <0 if abnormal.
+ * @date   18 Oct, 2026
+ * @see    zkctl_release(), zelkova_open()
+ *
+ *  Allocate a channel for the file. It receives no notification until
+ *  it subscribes with ZKMSG_SUBSCRIBE.
+ *
+ *---------------------------------------------------------------------------
+ */
+
+int zkctl_open(struct file *file)
+{
+	zkctl_t			*ctl;
+
+	KMALLOCS(ctl, zkctl_t *, sizeof(zkctl_t));
+	if (ctl == NULL) {
+		return -ENOMEM;
+	}
+
+	memset(ctl, 0x00, sizeof(zkctl_t));
+
+	spin_lock_init(&ctl->zc_lock);
+	init_waitqueue_head(&ctl->zc_wait);
+	init_MUTEX(&ctl->zc_sem);
+
+	down(&zkctl_listsem);
+
+	ctl->zc_next	= zkctl_list;
+	zkctl_list		= ctl;
+
+	up(&zkctl_listsem);
+
+	file->private_data = ctl;
+
+	return 0;
+}
+
+
+/**
+ *---------------------------------------------------------------------------
+ *
+ * @fn     int zkctl_release(struct file *file)
+ * @brief  Close a control channel
+ * @param  file: file of DEV_CTL
+ * @return 0 if normal, <0 if abnormal.
+ * @date   18 Oct, 2026
+ * @see    zkctl_open(), zelkova_release()
+ *
+ *  Free the channel and the responses nobody has read.
+ *
+ *---------------------------------------------------------------------------
+ */
+
+int zkctl_release(struct file *file)
+{
+	zkctl_t			*ctl = (zkctl_t *)file->private_data;
+	zkctl_t			**pp;
+	zkctlbuf_t		*cb;
+
+	if (ctl == NULL) {
+		return 0;
+	}
+
+	down(&zkctl_listsem);
+
+	for (pp = &zkctl_list; *pp != NULL; pp = &(*pp)->zc_next) {
+		if (*pp == ctl) {
+			*pp = ctl->zc_next;
+			break;
+		}
+	}
+
+	up(&zkctl_listsem);
+
+	while ((cb = ctl->zc_head) != NULL) {
+		ctl->zc_head = cb->cb_next;
+		KFREES(cb);
+	}
+
+	KFREES(ctl);
+
+	file->private_data = NULL;
+
+	return 0;
+}
+
+
+/**
+ *---------------------------------------------------------------------------
+ *
+ * @fn     static int zkctl_queue(zkctl_t *ctl, zkmsghdr_t *hdr, void *data, uint32_t len)
+ * @brief  Queue a message on a channel
+ * @param  ctl: channel
+ * @param  hdr: header (zmh_len is filled in here)
+ * @param  data: data of the message
+ * @param  len: length of the data
+ * @return 0 if normal, <0 if abnormal.
+ * @date   18 Oct, 2026
+ * @see    zkctl_put(), zkctl_read()
+ *
+ *  Append a message to the newest buffer, or to a new one if it does
+ *  not fit. A channel holds at most ZKCTL_MAXQUEUE bytes. ZKMSG_DONE
+ *  may also take ZKCTL_DONERESERVE bytes beyond it, so that a request
+ *  which filled the queue is still answered. A new buffer is allocated
+ *  with zc_lock dropped, since it may sleep, and the queue is looked at
+ *  again; it is freed if another message made room meanwhile.
+ *
+ *---------------------------------------------------------------------------
+ */
+
+static int zkctl_queue(zkctl_t *ctl, zkmsghdr_t *hdr, void *data, uint32_t len)
+{
+	zkctlbuf_t		*cb, *newcb = NULL;
+	char			*p;
+	uint32_t		size, limit;
+
+	if (len > ZKCTL_MAXDATA) {
+		return -EMSGSIZE;
+	}
+
+	hdr->zmh_len	= sizeof(zkmsghdr_t) + len;
+	size			= ZKMSG_ALIGN(hdr->zmh_len);
+	limit			= ZKCTL_MAXQUEUE;
+
+	if (hdr->zmh_type == ZKMSG_DONE) {
+		limit += ZKCTL_DONERESERVE;
+	}
+
+	for (;;) {
+		spin_lock_bh(&ctl->zc_lock);
+
+		if (ctl->zc_queued + size > limit) {
+			spin_unlock_bh(&ctl->zc_lock);
+
+			if (newcb != NULL) {
+				KFREES(newcb);
+			}
+			return -ENOBUFS;
+		}
+
+		cb = ctl->zc_tail;
+
+		if (cb != NULL && cb->cb_len + size <= ZKCTL_BUFSIZE - sizeof(zkctlbuf_t)) {
+			break;
+		}
+
+		if (newcb != NULL) {
+			cb		= newcb;
+			newcb	= NULL;
+
+			cb->cb_next	= NULL;
+			cb->cb_len	= 0;
+			cb->cb_off	= 0;
+
+			if (ctl->zc_tail != NULL) {
+				ctl->zc_tail->cb_next = cb;
+			}
+			else {
+				ctl->zc_head = cb;
+			}
+
+			ctl->zc_tail = cb;
+			break;
+		}
+
+		spin_unlock_bh(&ctl->zc_lock);
+
+		if ((newcb = (zkctlbuf_t *)kmalloc(ZKCTL_BUFSIZE, GFP_KERNEL)) == NULL) {
+			return -ENOMEM;
+		}
+	}
+
+	p = ZKCTLBUF_DATA(cb) + cb->cb_len;
+
+	memcpy(p, hdr, sizeof(zkmsghdr_t));
+	memcpy(p + sizeof(zkmsghdr_t), data, len);
+	memset(p + hdr->zmh_len, 0x00, size - hdr->zmh_len);
+
+	cb->cb_len		+= size;
+	ctl->zc_queued	+= size;
+
+	spin_unlock_bh(&ctl->zc_lock);
+
+	if (newcb != NULL) {
+		KFREES(newcb);
+	}
+
+	wake_up_interruptible(&ctl->zc_wait);
+
+	return 0;
+}
+
+
+/**
+ *---------------------------------------------------------------------------
+ *
+ * @fn     int zkctl_put(zkctl_t *ctl, zkmsghdr_t *req, uint16_t type, uint16_t flags, void *data, uint32_t len)
+ * @brief  Queue a response to a request
+ * @param  ctl: channel
+ * @param  req: request (NULL for a notification)
+ * @param  type: ZKMSG_*
+ * @param  flags: ZKMSG_F_*
+ * @param  data: data of the response (in kernel memory)
+ * @param  len: length of the data, at most ZKCTL_MAXDATA
+ * @return 0 if normal, <0 if abnormal.
+ * @date   18 Oct, 2026
+ * @see    zelkova_msg_filter(), zelkova_msg_session()
+ *
+ *  Queue a response with the sequence number of the request. Larger data
+ *  has to be split into parts flagged ZKMSG_F_MULTI. It may sleep, so no
+ *  spinlock may be held.
+ *
+ *---------------------------------------------------------------------------
+ */
+
+int zkctl_put(zkctl_t *ctl, zkmsghdr_t *req, uint16_t type, uint16_t flags, void *data, uint32_t len)
+{
+	zkmsghdr_t		hdr;
+
+	hdr.zmh_type	= type;
+	hdr.zmh_flags	= flags;
+	hdr.zmh_seq		= (req != NULL) ? req->zmh_seq : 0;
+	hdr.zmh_error	= 0;
+
+	return zkctl_queue(ctl, &hdr, data, len);
+}
+
+
+/**
+ *---------------------------------------------------------------------------
+ *
+ * @fn     void zkctl_notifygen(uint32_t gen, int error)
+ * @brief  Notify a new generation of the static SPD
+ * @param  gen: generation
+ * @param  error: 0, or the error of a failed background rebuild
+ * @return NONE
+ * @date   18 Oct, 2026
+ * @see    zkfr_install(), zkfr_txrebuild()
+ *
+ *  Queue ZKMSG_NOTIFYGEN on every channel subscribing ZKCTL_GRP_GEN.
+ *  A channel which cannot take it gets ZKMSG_OVERRUN as soon as it can.
+ *
+ *---------------------------------------------------------------------------
+ */
+
+void zkctl_notifygen(uint32_t gen, int error)
+{
+	zkctl_t			*ctl;
+	zkmsggen_t		mg;
+
+	mg.zmg_gen		= gen;
+	mg.zmg_error	= error;
+
+	down(&zkctl_listsem);
+
+	for (ctl = zkctl_list; ctl != NULL; ctl = ctl->zc_next) {
+		if (!(ctl->zc_groups & ZKCTL_GRP_GEN)) {
+			continue;
+		}
+
+		if (ctl->zc_overrun) {
+			if (zkctl_put(ctl, NULL, ZKMSG_OVERRUN, 0, NULL, 0) < 0) {
+				continue;
+			}
+
+			ctl->zc_overrun = 0;
+		}
+
+		if (zkctl_put(ctl, NULL, ZKMSG_NOTIFYGEN, 0, &mg, sizeof(mg)) < 0) {
+			ctl->zc_overrun = 1;
+		}
+	}
+
+	up(&zkctl_listsem);
+}
+
+
+/**
+ *---------------------------------------------------------------------------
+ *
+ * @fn     static int zkctl_dispatch(zkctl_t *ctl, zkmsghdr_t *req, void *data, uint32_t len)
+ * @brief  Process a request
+ * @param  ctl: channel
+ * @param  req: request
+ * @param  data: data of the request (in user memory)
+ * @param  len: length of the data
+ * @return 0 if normal, <0 if abnormal.
+ * @date   18 Oct, 2026
+ * @see    zkctl_write()
+ *
+ *  Process the messages of the channel itself, and hand the others to
+ *  the handlers of their groups.
+ *
+ *---------------------------------------------------------------------------
+ */
+
+static int zkctl_dispatch(zkctl_t *ctl, zkmsghdr_t *req, void *data, uint32_t len)
+{
+	uint32_t		groups;
+
+	switch (req->zmh_type & ZKMSG_TYPE_MASK) {
+	case ZKMSG_TYPE_CTL:
+		break;
+	case ZKMSG_TYPE_FILTER:
+		return zelkova_msg_filter(ctl, req, data, len);
+	case ZKMSG_TYPE_SESSION:
+		return zelkova_msg_session(ctl, req, data, len);
+	default:
+		return -EINVAL;
+	}
+
+	switch (req->zmh_type) {
+	case ZKMSG_NOOP:
+		break;
+
+	case ZKMSG_SUBSCRIBE:
+		if (len < sizeof(groups) || copy_from_user(&groups, data, sizeof(groups))) {
+			return -EINVAL;
+		}
+
+		ctl->zc_groups = groups;
+		break;
+
+	default:
+		return -EINVAL;
+	}
+
+	return 0;
+}
+
+
+/**
+ *---------------------------------------------------------------------------
+ *
+ * @fn     ssize_t zkctl_write(struct file *file, const char *buf, size_t nbytes)
+ * @brief  Process a batch of requests
+ * @param  file: file of DEV_CTL
+ * @param  buf: requests laid back to back
+ * @param  nbytes: length of buf
+ * @return bytes of the requests processed, -ENOBUFS if the queue is
+ *         full, <0 if none.
+ * @date   18 Oct, 2026
+ * @see    zkctl_read(), zelkova_write()
+ *
+ *  Process requests in order, and answer each of them by ZKMSG_DONE.
+ *  A request is not taken while the queue is full, so the responses
+ *  of one write() never grow the queue beyond ZKCTL_MAXQUEUE and the
+ *  reserve of ZKMSG_DONE; the caller has to read() and write the rest
+ *  again. If even ZKMSG_DONE cannot be queued, processing stops after
+ *  the request.
+ *  Requests run like ioctl() operations, and filter requests take the
+ *  same semaphore as the filter ioctl() commands. Processing stops at a
+ *  malformed header.
+ *
+ *---------------------------------------------------------------------------
+ */
+
+ssize_t zkctl_write(struct file *file, const char *buf, size_t nbytes)
+{
+	zkctl_t			*ctl = (zkctl_t *)file->private_data;
+	zkmsghdr_t		req;
+	size_t			off = 0;
+	uint32_t		len;
+	int				error;
+
+	while (off + sizeof(zkmsghdr_t) <= nbytes) {
+		if (copy_from_user(&req, buf + off, sizeof(req))) {
+			return (off > 0) ? off : -EFAULT;
+		}
+
+		if (req.zmh_len < sizeof(zkmsghdr_t) || req.zmh_len > nbytes - off) {
+			return (off > 0) ? off : -EINVAL;
+		}
+
+		len = req.zmh_len;
+
+		/* No room left for the responses */
+		if (ctl->zc_queued >= ZKCTL_MAXQUEUE) {
+			return (off > 0) ? off : -ENOBUFS;
+		}
+
+		lock_kernel();
+		error = zkctl_dispatch(ctl, &req, (char *)buf + off + sizeof(zkmsghdr_t),
+				len - sizeof(zkmsghdr_t));
+		unlock_kernel();
+
+		req.zmh_type	= ZKMSG_DONE;
+		req.zmh_flags	= 0;
+		req.zmh_error	= error;
+
+		off += ZKMSG_ALIGN(len);
+
+		if ((error = zkctl_queue(ctl, &req, NULL, 0)) < 0) {
+			break;
+		}
+	}
+
+	return (off > nbytes) ? nbytes : off;
+}
+
+
+/**
+ *---------------------------------------------------------------------------
+ *
+ * @fn     ssize_t zkctl_read(struct file *file, char *buf, size_t nbytes)
+ * @brief  Read responses and notifications
+ * @param  file: file of DEV_CTL
+ * @param  buf: buffer
+ * @param  nbytes: length of buf
+ * @return bytes read, <0 if abnormal.
+ * @date   18 Oct, 2026
+ * @see    zkctl_write(), zkctl_poll(), zelkova_read()
+ *
+ *  Copy as many whole messages as buf can hold. A buffer of ZKCTL_BUFSIZE
+ *  bytes always holds at least one. Block until a message arrives unless
+ *  the file is non-blocking.
+ *
+ *---------------------------------------------------------------------------
+ */
+
+ssize_t zkctl_read(struct file *file, char *buf, size_t nbytes)
+{
+	zkctl_t			*ctl = (zkctl_t *)file->private_data;
+	zkctlbuf_t		*cb, *freecb;
+	zkmsghdr_t		*hdr;
+	uint32_t		off, end;
+	size_t			done = 0;
+
+	if (down_interruptible(&ctl->zc_sem)) {
+		return -ERESTARTSYS;
+	}
+
+	while (ctl->zc_head == NULL) {
+		up(&ctl->zc_sem);
+
+		if ((file->f_flags & O_NONBLOCK)) {
+			return -EAGAIN;
+		}
+
+		if (wait_event_interruptible(ctl->zc_wait, ctl->zc_head != NULL)) {
+			return -ERESTARTSYS;
+		}
+
+		if (down_interruptible(&ctl->zc_sem)) {
+			return -ERESTARTSYS;
+		}
+	}
+
+	/* Only readers remove buffers, and we are the only reader now. Writers
+	 * append behind cb_len, so whole messages before it can be copied out
+	 * of the lock. */
+
+	while ((cb = ctl->zc_head) != NULL) {
+		spin_lock_bh(&ctl->zc_lock);
+		end = cb->cb_len;
+		spin_unlock_bh(&ctl->zc_lock);
+
+		for (off = cb->cb_off; off < end; off += ZKMSG_ALIGN(hdr->zmh_len)) {
+			hdr = (zkmsghdr_t *)(ZKCTLBUF_DATA(cb) + off);
+
+			if (done + (off - cb->cb_off) + ZKMSG_ALIGN(hdr->zmh_len) > nbytes) {
+				break;
+			}
+		}
+
+		if (off == cb->cb_off) {
+			break;
+		}
+
+		if (copy_to_user(buf + done, ZKCTLBUF_DATA(cb) + cb->cb_off, off - cb->cb_off)) {
+			up(&ctl->zc_sem);
+			return (done > 0) ? done : -EFAULT;
+		}
+
+		done += off - cb->cb_off;
+
+		freecb = NULL;
+
+		spin_lock_bh(&ctl->zc_lock);
+
+		ctl->zc_queued	-= off - cb->cb_off;
+		cb->cb_off		= off;
+
+		if (cb->cb_off == cb->cb_len) {
+			ctl->zc_head = cb->cb_next;
+
+			if (ctl->zc_tail == cb) {
+				ctl->zc_tail = NULL;
+			}
+
+			freecb = cb;
+		}
+
+		spin_unlock_bh(&ctl->zc_lock);
+
+		if (freecb == NULL) {
+			break;
+		}
+
+		KFREES(freecb);
+	}
+
+	up(&ctl->zc_sem);
+
+	return (done > 0) ? done : -EINVAL;
+}
+
+
+/**
+ *---------------------------------------------------------------------------
+ *
+ * @fn     unsigned int zkctl_poll(struct file *file, poll_table *wait)
+ * @brief  Poll a control channel
+ * @param  file: file of DEV_CTL
+ * @param  wait: poll table
+ * @return poll flags
+ * @date   18 Oct, 2026
+ * @see    zkctl_read(), zelkova_poll()
+ *
+ *  A channel is always writable, and readable while a message is queued.
+ *
+ *---------------------------------------------------------------------------
+ */
+
+unsigned int zkctl_poll(struct file *file, poll_table *wait)
+{
+	zkctl_t			*ctl = (zkctl_t *)file->private_data;
+	unsigned int	mask = (POLLOUT | POLLWRNORM);
+
+	poll_wait(file, &ctl->zc_wait, wait);
+
+	if (ctl->zc_head != NULL) {
+		mask |= (POLLIN | POLLRDNORM);
+	}
+
+	return mask;
+}
@@ -0,0 +1,166 @@
+/*
+ *----------------------------------------------------------------------------
+ *
+ * Zelkova - A Firewall and Intrusion Prevention System on Linux Kernel
+ *
+ * Copyright (C) 2005 Dongsu Park <advance@dongsu.pe.kr>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111, USA.
+ *
+ * $Id$
+ *----------------------------------------------------------------------------
+ */
+
+/** @file zkctl.h
+ * Define variables, constants, structures, and function declarations
+ * for the message-based control channel (DEV_CTL).
+ */
+
+#ifndef __ZKCTL_H__
+#define __ZKCTL_H__
+
+#include "zelkova.h"
+
+/* zkmsghdr_t
+ * :Header of a control message. One write() on DEV_CTL carries any
+ *  number of requests laid back to back, and read() returns whole
+ *  responses. Every request is answered by zero or more data messages
+ *  flagged ZKMSG_F_MULTI and one ZKMSG_DONE carrying the result, all with
+ *  the sequence number of the request. Notifications have zmh_seq 0.
+ *  A response cut short by a full queue ends with ZKMSG_DONE carrying
+ *  -ENOBUFS; ZKMSG_GETRULEST is asked again from the first rule missed.
+ */
+
+typedef struct zkmsghdr {
+	uint32_t		zmh_len;		/* length of the message with the header */
+	uint16_t		zmh_type;		/* ZKMSG_* */
+	uint16_t		zmh_flags;		/* ZKMSG_F_* */
+	uint32_t		zmh_seq;		/* sequence number given by the sender */
+	int32_t			zmh_error;		/* result of ZKMSG_DONE (0 or -errno) */
+} zkmsghdr_t;
+
+/* Messages are aligned to 8 bytes */
+#define ZKMSG_ALIGN(len)	(((len) + 7) & ~7)
+#define ZKMSG_DATA(hdr)		((void *)((char *)(hdr) + sizeof(zkmsghdr_t)))
+
+/* zkmsghdr_t::zmh_flags */
+
+#define ZKMSG_F_MULTI		0x0001		/* a part of a multipart response */
+
+/* zkmsghdr_t::zmh_type
+ * Types are grouped like the ioctl commands, and each group is handled
+ * by the module which handles the ioctl commands of the group.
+ */
+
+#define ZKMSG_TYPE_CTL		0x0000		/* channel itself (zkctl.c) */
+#define ZKMSG_TYPE_FILTER	0x0100		/* filter rules (zelkova_msg_filter()) */
+#define ZKMSG_TYPE_SESSION	0x0200		/* session table (zelkova_msg_session()) */
+#define ZKMSG_TYPE_MASK		0xff00
+
+#define ZKMSG_NOOP			(ZKMSG_TYPE_CTL | 0x00)		/* only answered by ZKMSG_DONE */
+#define ZKMSG_DONE			(ZKMSG_TYPE_CTL | 0x01)		/* end of a response */
+#define ZKMSG_SUBSCRIBE		(ZKMSG_TYPE_CTL | 0x02)		/* uint32_t: ZKCTL_GRP_* to receive */
+#define ZKMSG_NOTIFYGEN		(ZKMSG_TYPE_CTL | 0x03)		/* zkmsggen_t: new generation of the static SPD */
+#define ZKMSG_OVERRUN		(ZKMSG_TYPE_CTL | 0x04)		/* notifications have been lost */
+
+#define ZKMSG_GETRULEST		(ZKMSG_TYPE_FILTER | 0x00)	/* [uint32_t: first rule, 0 if omitted]
+														 * zkrulestat_t[] of the static rules from it */
+#define ZKMSG_TXBEGIN		(ZKMSG_TYPE_FILTER | 0x01)	/* SIOCTXBEGIN */
+#define ZKMSG_TXOP			(ZKMSG_TYPE_FILTER | 0x02)	/* zkfrop_t[]: SIOCTXOP */
+#define ZKMSG_TXCOMMIT		(ZKMSG_TYPE_FILTER | 0x03)	/* SIOCTXCOMMIT, answered by zkmsggen_t */
+#define ZKMSG_TXABORT		(ZKMSG_TYPE_FILTER | 0x04)	/* SIOCTXABORT */
+#define ZKMSG_TXSTATUS		(ZKMSG_TYPE_FILTER | 0x05)	/* SIOCTXSTATUS, answered by zkfrtxreq_t */
+#define ZKMSG_ADDDFR		(ZKMSG_TYPE_FILTER | 0x06)	/* zkpinhole_t: SIOCADDDFR, answered by zkpinhole_t */
+#define ZKMSG_DELDFR		(ZKMSG_TYPE_FILTER | 0x07)	/* uint32_t: handle of SIOCDELDFR */
+#define ZKMSG_GETNAPTST		(ZKMSG_TYPE_FILTER | 0x08)	/* uint32_t: SPD_NORMALNAT or 0, answered by
+														 * zknaptstat_t[] of every NAT rule of the table */
+
+#define ZKMSG_GETSESSST		(ZKMSG_TYPE_SESSION | 0x00)	/* zk_sess_stat_t */
+
+/* Groups of notifications (ZKMSG_SUBSCRIBE) */
+
+#define ZKCTL_GRP_GEN		0x00000001	/* ZKMSG_NOTIFYGEN */
+
+/* zkmsggen_t
+ * :Generation of the static SPD (ZKMSG_TXCOMMIT, ZKMSG_NOTIFYGEN)
+ */
+
+typedef struct zkmsggen {
+	uint32_t		zmg_gen;		/* generation */
+	int32_t			zmg_error;		/* 0, or the error of a failed background rebuild */
+} zkmsggen_t;
+
+#ifdef __KERNEL__
+#include <linux/fs.h>				/* struct file */
+#include <linux/poll.h>				/* poll_table */
+#include <asm/semaphore.h>			/* struct semaphore */
+
+#define ZKCTL_BUFSIZE		PAGE_SIZE			/**< Size of a response buffer */
+#define ZKCTL_MAXQUEUE		(4 * 1024 * 1024)	/**< Bytes queued on one channel */
+#define ZKCTL_DONERESERVE	(64 * ZKMSG_ALIGN(sizeof(zkmsghdr_t)))	/**< Room for ZKMSG_DONE beyond ZKCTL_MAXQUEUE */
+#define ZKCTL_MAXDATA		(ZKCTL_BUFSIZE - sizeof(zkctlbuf_t) - sizeof(zkmsghdr_t))
+
+/* zkctlbuf_t
+ * :A buffer of responses waiting for read(). Messages never straddle two
+ *  buffers.
+ */
+
+typedef struct zkctlbuf {
+	struct zkctlbuf	*cb_next;		/* next buffer */
+	uint32_t		cb_len;			/* bytes filled */
+	uint32_t		cb_off;			/* bytes already read */
+} zkctlbuf_t;
+
+#define ZKCTLBUF_DATA(cb)	((char *)(cb) + sizeof(zkctlbuf_t))
+
+/* zkctl_t
+ * :A control channel, one per open() of DEV_CTL
+ */
+
+typedef struct zkctl {
+	spinlock_t			zc_lock;	/* lock of the queue */
+	wait_queue_head_t	zc_wait;	/* readers */
+	struct semaphore	zc_sem;		/* serializes readers */
+
+	zkctlbuf_t		*zc_head;		/* the oldest buffer */
+	zkctlbuf_t		*zc_tail;		/* the newest buffer */
+	uint32_t		zc_queued;		/* bytes queued */
+
+	uint32_t		zc_groups;		/* ZKCTL_GRP_* subscribed */
+	int				zc_overrun;		/* notifications have been lost */
+
+	struct zkctl	*zc_next;		/* next channel (zkctl_list) */
+} zkctl_t;
+
+/*
+ * Function declarations
+ */
+
+int zkctl_open(struct file *file);
+int zkctl_release(struct file *file);
+ssize_t zkctl_read(struct file *file, char *buf, size_t nbytes);
+ssize_t zkctl_write(struct file *file, const char *buf, size_t nbytes);
+unsigned int zkctl_poll(struct file *file, poll_table *wait);
+
+int zkctl_put(zkctl_t *ctl, zkmsghdr_t *req, uint16_t type, uint16_t flags, void *data, uint32_t len);
+void zkctl_notifygen(uint32_t gen, int error);
+
+/* (in ioctl.c) */
+int zelkova_msg_filter(zkctl_t *ctl, zkmsghdr_t *req, void *data, uint32_t len);
+int zelkova_msg_session(zkctl_t *ctl, zkmsghdr_t *req, void *data, uint32_t len);
+
+#endif	/* __KERNEL__ */
+
+#endif	/* __ZKCTL_H__ */
@@ -33,7 +33,40 @@
 #include <asm/uaccess.h>			/* copy_to_user(), copy_from_user() */
 #include <linux/netfilter_ipv4/lockhelp.h>	/* *_LOCK, *_UNLOCK */
 
+#include <linux/smp.h>				/* smp_processor_id() */
+#include <linux/skbuff.h>			/* sk_buff */
+#include <linux/ip.h>				/* iphdr */
+#include <linux/netdevice.h>		/* net_device */
+#include <linux/netfilter.h>		/* NF_ACCEPT, NF_DROP */
+#include <linux/net.h>				/* net_ratelimit() */
+
 #include "zelkova.h"
+#include "zkfilter.h"
+#include "zknat.h"
+#include "zksession.h"
+#include "zkpktinfo.h"
+#include "zkstat.h"
+#include "zkflow.h"
+#include "zkfrag.h"
+
+/* zkearly_t
+ * :Classification of the last packet seen by the pre-routing hook of a
+ *  CPU, handed to the input or forward hook on the same CPU. The header
+ *  fields guard against an sk_buff reused at the same address.
+ */
+
+typedef struct zkearly {
+	struct sk_buff	*ec_skb;		/* packet */
+	int				ec_ifindex;		/* ingress interface */
+	uint32_t		ec_saddr;		/* source address */
+	uint32_t		ec_daddr;		/* destination address */
+	uint32_t		ec_ipid;		/* IP id. */
+	uint32_t		ec_gen;			/* policy generation of ec_rule */
+	uint32_t		ec_dfgen;		/* dfrule_gen, a dynamic ec_rule may be freed */
+	fisrule_t		*ec_rule;		/* selected rule */
+} ____cacheline_aligned zkearly_t;
+
+static zkearly_t	zkearly[NR_CPUS];	/**< Pre-routing classifications per CPU */
 
 static fisrule_t	defaultrule[2];	/* the default rules
 									 * (used when FIS-tree lookup fails) */
@@ -43,6 +76,28 @@ DECLARE_RWLOCK(spd_lock);	/* A lock with SPD root and static SPD */
 zkspd_t	staticspd;		/* static Security Policy Database */
 void	*spdroot;		/* FIS-tree root */
 
+/* zkfilter_log(): Write a log message of a packet whose rule has ACT_LOG.
+ * Messages are rate limited by net_ratelimit(), so that a flood of
+ * logged packets can not flood the kernel log as well.
+ */
+
+static void zkfilter_log(zkpktinfo_t *pi, uint32_t pid, int allow)
+{
+	uint32_t	saddr = htonl(pi->zpi_i.id[DIM_SRCADDR]);
+	uint32_t	daddr = htonl(pi->zpi_i.id[DIM_DSTADDR]);
+
+	if (!net_ratelimit()) {
+		return;
+	}
+
+	printk(KERN_INFO "zelkova: %s %s pid=%u if=%u src=%u.%u.%u.%u dst=%u.%u.%u.%u "
+			"proto=%u sport=%u dport=%u\n",
+			allow ? "ALLOW" : "DROP", pi->zpi_out ? "OUT" : "IN", pid,
+			pi->zpi_i.id[DIM_IFID], NIPQUAD(saddr), NIPQUAD(daddr),
+			pi->zpi_i.id[DIM_SRCPORT] >> DIM_PROTOSHIFT,
+			pi->zpi_i.id[DIM_SRCPORT] & 0xffff, pi->zpi_i.id[DIM_DSTPORT] & 0xffff);
+}
+
 /**
  *---------------------------------------------------------------------------
  *
@@ -68,11 +123,15 @@ void filter_init(void)
 	/* Initialize spdroot of the FIS-tree */
 	spdroot = NULL;
 
-	/* Initialize staticspd */
+	/* Initialize staticspd and staticnat */
 	memset(&staticspd, 0x00, sizeof(staticspd));
+	memset(staticnat, 0x00, sizeof(staticnat));
 
 	WRITE_UNLOCK(&spd_lock);
 
+	/* Initialize the dynamic rules */
+	zkdfrule_init();
+
 	/* Initialize the default rule and the default action */
 	memset(defaultrule, 0x00, sizeof(defaultrule));
 	memset(action, 0x00, sizeof(action));
@@ -111,22 +170,344 @@ void filter_init(void)
 
 void filter_clean(void)
 {
+	zkspd_t			oldspd;
+	zknatmap_t		*map[2];
+	void			*oldroot;
+	int				i;
+
 	WRITE_LOCK(&spd_lock);
 
-	if (spdroot != NULL) {
-		FISTREE_CLEAN(spdroot);
-		spdroot = NULL;
-	}
+	oldroot = spdroot;
+	spdroot = NULL;
+
+	zkdfrule_clean();
 
-	if (staticspd.spd_nelem > 0) {
-		KFREES(staticspd.spd_table);
-		KFREES(staticspd.spd_act);
+	memcpy(&oldspd, &staticspd, sizeof(zkspd_t));
+	memset(&staticspd, 0x00, sizeof(zkspd_t));
 
-		staticspd.spd_table		= NULL;
-		staticspd.spd_act		= NULL;
-		staticspd.spd_nelem		= 0;
-		staticspd.spd_precnt	= 0;
+	for (i = 0; i < SIZEOFARR(natmap); i++) {
+		map[i] = natmap[i];
+		natmap[i] = NULL;
 	}
 
 	WRITE_UNLOCK(&spd_lock);
+
+	/* The FIS-tree and the rules are cleaned out of the lock, since the
+	 * tree, the policy ID index, the port allocators and the 1:1 mappings
+	 * are released with vfree() */
+
+	if (oldroot != NULL) {
+		FISTREE_CLEAN(oldroot);
+	}
+
+	zkspd_clean(&oldspd);
+	for (i = 0; i < SIZEOFARR(staticnat); i++) {
+		zknatmap_clean(map[i]);
+		zkspd_clean(&staticnat[i]);
+		memset(&staticnat[i], 0x00, sizeof(zkspd_t));
+	}
+}
+
+
+/**
+ *---------------------------------------------------------------------------
+ *
+ * @fn     void *zkfilter_makeroot(zkspd_t *spd, zkspd_t *nat[2])
+ * @brief  Make the FIS-tree of the filter rules and the NAT rules
+ * @param  spd: filter rules
+ * @param  nat: redirect NAT rules and normal NAT rules
+ * @return Returns a pointer to FIS-tree if normal, NULL if abnormal.
+ * @date   18 Oct, 2026
+ * @see    FISTREE_QUERYMULTI()
+ *
+ *  Make one FIS-tree out of the filter rules and both kinds of NAT rules,
+ *  to be assigned to spdroot. The rules of each table are selected by
+ *  SPD_MASK(SPD_FILTER) and SPD_MASK(SPD_NATTABLE(n)) on query.
+ *
+ *---------------------------------------------------------------------------
+ */
+
+void *zkfilter_makeroot(zkspd_t *spd, zkspd_t *nat[2])
+{
+	fisrule_t		*table[SPD_NTABLE];
+	int				nelem[SPD_NTABLE];
+	int				i;
+
+	table[SPD_FILTER] = spd->spd_table;
+	nelem[SPD_FILTER] = spd->spd_nelem;
+
+	for (i = NAT_REDIR; i <= NAT_NORMAL; i++) {
+		table[SPD_NATTABLE(i)] = nat[i]->spd_table;
+		nelem[SPD_NATTABLE(i)] = nat[i]->spd_nelem;
+	}
+
+	return FISTREE_MAKEMULTI(table, nelem, SPD_NTABLE);
+}
+
+
+/**
+ *---------------------------------------------------------------------------
+ *
+ * @fn     unsigned int zkfilter_early(struct sk_buff *skb, const struct net_device *in)
+ * @brief  Classify an inbound packet before routing
+ * @param  skb: packet
+ * @param  in: ingress interface
+ * @return NF_DROP if the packet is denied, NF_ACCEPT otherwise.
+ * @date   18 Oct, 2026
+ * @see    zkfilter_earlyrule(), zkpktinfo_parse()
+ *
+ *  Classify an inbound packet on the pre-routing hook, so that denied
+ *  traffic is dropped before the routing decision is spent on it.
+ *  Inbound filter rules match the ingress interface, never the output
+ *  one, so the verdict is the same one the input and forward hooks would
+ *  reach. Nevertheless the packet is left to them when
+ *    - a redirect NAT rule matches, since the destination will change,
+ *    - a session exists, since responses pass regardless of the rules,
+ *    - no rule matches.
+ *  An allowed packet carries its rule to the later hook through a per-CPU
+ *  cache, so that the FIS-tree is not queried twice.
+ *
+ *---------------------------------------------------------------------------
+ */
+
+unsigned int zkfilter_early(struct sk_buff *skb, const struct net_device *in)
+{
+	zkearly_t		*ec = &zkearly[smp_processor_id()];
+	zkpktinfo_t		pi;
+	zkipsess_t		*is;
+	fisrule_t		*found[SPD_NTABLE];
+	fisrule_t		*rule;
+	zkact_t			*act;
+	uint32_t		pass, pid, gen, dfgen;
+	struct iphdr	*iph = skb->nh.iph;
+
+	ec->ec_skb = NULL;
+
+	/* Non-first fragments have no ports and are left to the later hooks */
+	if (zkpktinfo_parse(&pi, skb, in, 0) < 0 || (pi.zpi_flags & ZPI_FRAGMENT)) {
+		return NF_ACCEPT;
+	}
+
+	READ_LOCK(&spd_lock);
+
+	/* The filter rule and the redirect NAT rule in one traversal */
+	if (spdroot == NULL) {
+		READ_UNLOCK(&spd_lock);
+		return NF_ACCEPT;
+	}
+
+	FISTREE_QUERYMULTI(spdroot, pi.zpi_i.id, found,
+			SPD_MASK(SPD_FILTER) | SPD_MASK(SPD_NATTABLE(NAT_REDIR)));
+
+	/* Dynamic rules are not in the FIS-tree */
+	rule = zkdfrule_query(pi.zpi_i.id, found[SPD_FILTER]);
+
+	if (found[SPD_NATTABLE(NAT_REDIR)] != NULL || rule == NULL) {
+		READ_UNLOCK(&spd_lock);
+		return NF_ACCEPT;
+	}
+
+	act = (zkact_t *)rule->action;
+
+	if ((act->act_pass & ACT_ALLOW)) {
+		ec->ec_skb		= skb;
+		ec->ec_ifindex	= in->ifindex;
+		ec->ec_saddr	= iph->saddr;
+		ec->ec_daddr	= iph->daddr;
+		ec->ec_ipid		= iph->id;
+		ec->ec_gen		= ipsess_gen;
+		ec->ec_dfgen	= dfrule_gen;
+		ec->ec_rule		= rule;
+
+		READ_UNLOCK(&spd_lock);
+
+		return NF_ACCEPT;
+	}
+
+	pass = act->act_pass;
+	pid = act->act_pid;
+	gen = ipsess_gen;
+	dfgen = dfrule_gen;
+
+	READ_UNLOCK(&spd_lock);
+
+	/* A response of a session passes even if the rules deny it */
+	if ((is = zkipsess_lookup(&pi)) != NULL) {
+		ipsess_release(is);
+		return NF_ACCEPT;
+	}
+
+	/* Only a dropped packet is a hit of the deny rule. The rule is
+	 * looked at again only if the policy has not changed meanwhile. */
+	READ_LOCK(&spd_lock);
+
+	if (ipsess_gen == gen && dfrule_gen == dfgen) {
+		zkstat_hit(act);
+	}
+
+	READ_UNLOCK(&spd_lock);
+
+	if ((pass & ACT_LOG)) {
+		zkfilter_log(&pi, pid, 0);
+	}
+
+	zkstat_verdict(0, 0);
+
+	return NF_DROP;
+}
+
+
+/**
+ *---------------------------------------------------------------------------
+ *
+ * @fn     fisrule_t *zkfilter_earlyrule(struct sk_buff *skb, const struct net_device *in)
+ * @brief  Take the rule selected for a packet on the pre-routing hook
+ * @param  skb: packet
+ * @param  in: ingress interface
+ * @return the rule, NULL if the packet has to be classified again.
+ * @date   18 Oct, 2026
+ * @see    zkfilter_early(), zkfilter_check()
+ *
+ *  Take the rule selected for a packet on the pre-routing hook, if the
+ *  packet was classified there on this CPU and the policy has not changed
+ *  since. The cache is emptied, so a rule is handed over only once.
+ *  NOTE: The caller has to hold spd_lock for reading.
+ *
+ *---------------------------------------------------------------------------
+ */
+
+fisrule_t *zkfilter_earlyrule(struct sk_buff *skb, const struct net_device *in)
+{
+	zkearly_t		*ec = &zkearly[smp_processor_id()];
+	struct iphdr	*iph = skb->nh.iph;
+
+	if (ec->ec_skb != skb) {
+		return NULL;
+	}
+
+	ec->ec_skb = NULL;
+
+	if (ec->ec_ifindex != in->ifindex || ec->ec_saddr != iph->saddr ||
+			ec->ec_daddr != iph->daddr || ec->ec_ipid != iph->id ||
+			ec->ec_gen != ipsess_gen || ec->ec_dfgen != dfrule_gen) {
+		return NULL;
+	}
+
+	return ec->ec_rule;
+}
+
+
+/**
+ *---------------------------------------------------------------------------
+ *
+ * @fn     unsigned int zkfilter_check(struct sk_buff *skb, const struct net_device *dev, int out)
+ * @brief  Classify a packet on the input, forward or output hook
+ * @param  skb: packet
+ * @param  dev: ingress interface if inbound, egress one if outbound
+ * @param  out: 1 on the output hook, 0 on the input and forward hooks
+ * @return NF_ACCEPT or NF_DROP
+ * @date   18 Oct, 2026
+ * @see    zkflow_check(), zkipsess_lookup(), zkipsess_create()
+ *
+ *  The slow path of the filter. A packet of a session follows the action
+ *  of the session. Otherwise the rule selected on the pre-routing hook is
+ *  taken, or the FIS-tree and the dynamic rules select a rule, or the
+ *  default rule of the direction if none matches, and a session is made
+ *  when the rule allows the packet. TCP segments move the
+ *  state of their session, and those which do not fit it are dropped.
+ *  An inbound packet of an established session offloads its flow, so that the next packets
+ *  are handled by zkflow_check(). Non-first fragments take the verdict
+ *  of the first fragment of their datagram (zkfrag_check()), and wait
+ *  for it on the queue if it has not been classified yet.
+ *
+ *---------------------------------------------------------------------------
+ */
+
+unsigned int zkfilter_check(struct sk_buff *skb, const struct net_device *dev, int out)
+{
+	zkpktinfo_t		pi;
+	zkipsess_t		*is;
+	fisrule_t		*found[SPD_NTABLE];
+	fisrule_t		*rule;
+	zkact_t			*act;
+	uint32_t		pass;
+	unsigned int	verdict;
+
+	if (zkpktinfo_parse(&pi, skb, dev, out) < 0) {
+		zkstat_verdict(out, 0);
+		return NF_DROP;
+	}
+
+	/* Non-first fragments follow the first one of their datagram.
+	 * Queued ones are counted when zkfrag_resume() gives them back. */
+	if (zkfrag_check(&pi, &verdict)) {
+		if (verdict != NF_QUEUE) {
+			zkstat_verdict(out, verdict == NF_ACCEPT);
+		}
+		return verdict;
+	}
+
+	if ((is = zkipsess_lookup(&pi)) == NULL) {
+		READ_LOCK(&spd_lock);
+
+		/* The pre-routing hook may have classified the packet already */
+		rule = out ? NULL : zkfilter_earlyrule(skb, dev);
+
+		if (rule == NULL) {
+			if (spdroot != NULL) {
+				FISTREE_QUERYMULTI(spdroot, pi.zpi_i.id, found, SPD_MASK(SPD_FILTER));
+				rule = found[SPD_FILTER];
+			}
+
+			/* Dynamic rules are not in the FIS-tree */
+			if ((rule = zkdfrule_query(pi.zpi_i.id, rule)) == NULL) {
+				rule = &defaultrule[out];
+			}
+		}
+
+		act = (zkact_t *)rule->action;
+		pass = act->act_pass;
+
+		zkstat_hit(act);
+
+		/* Only the packet which makes a session is logged */
+		if ((pass & ACT_LOG)) {
+			zkfilter_log(&pi, act->act_pid, (pass & ACT_ALLOW) != 0);
+		}
+
+		/* Counters of a session are folded into its rule later */
+		if ((pass & ACT_ALLOW)) {
+			is = zkipsess_create(&pi, rule);
+		}
+
+		if (is == NULL) {
+			zkstat_rule(act, 1, skb->len);
+		}
+
+		READ_UNLOCK(&spd_lock);
+	}
+
+	if (is != NULL) {
+		pass = is->zis_pass;
+
+		/* Segments out of the TCP state or the windows are dropped */
+		if (ipsess_track(is, pi.zpi_dir, skb) < 0) {
+			pass &= ~ACT_ALLOW;
+		}
+
+		/* zkflow_check() runs on the input and forward hooks only */
+		if (!out && (pass & ACT_ALLOW)) {
+			zkflow_offload(&pi, is);
+		}
+	}
+
+	verdict = zkfrag_record(&pi, pass, is);
+
+	if (is != NULL) {
+		ipsess_release(is);
+	}
+
+	zkstat_verdict(out, verdict == NF_ACCEPT);
+
+	return verdict;
 }
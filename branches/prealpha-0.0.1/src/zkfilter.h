@@ -33,5 +33,18 @@
 #include "zelkova.h"
 
 extern void	*spdroot;	/* FIS-tree roto */
+extern zkspd_t	staticspd;	/* static SPD */
+
+#ifdef __KERNEL__
+DECLARE_RWLOCK_EXTERN(spd_lock);	/* R/W lock with SPD root and static SPD */
+
+struct sk_buff;
+struct net_device;
+
+void *zkfilter_makeroot(zkspd_t *spd, zkspd_t *nat[2]);
+unsigned int zkfilter_early(struct sk_buff *skb, const struct net_device *in);
+fisrule_t *zkfilter_earlyrule(struct sk_buff *skb, const struct net_device *in);
+unsigned int zkfilter_check(struct sk_buff *skb, const struct net_device *dev, int out);
+#endif	/* __KERNEL__ */
 
 #endif	/* __ZKFILTER_H__ */
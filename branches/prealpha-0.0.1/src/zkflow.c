@@ -0,0 +1,387 @@
+/*
+ *----------------------------------------------------------------------------
+ *
+ * Zelkova - A Firewall and Intrusion Prevention System on Linux Kernel
+ *
+ * Copyright (C) 2005 Dongsu Park <advance@dongsu.pe.kr>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111, USA.
+ *
+ * $Id$
+ *----------------------------------------------------------------------------
+ */
+
+/** @file zkflow.c
+ * Offloads established flows so that their packets skip classification
+ *
+ * Every CPU has its own direct-mapped table, which is only touched from
+ * the input and forward hooks of that CPU. Those run in softirq context,
+ * so the table takes no lock. Only a TCP segment takes the lock of its
+ * session, to advance the windows the slow path checks against. An
+ * entry is trusted only while its session is alive, and neither the
+ * policy generation nor the dynamic rules (dfrule_gen) have moved since
+ * it was offloaded; otherwise the packet takes the slow path, which
+ * offloads the flow again.
+ */
+
+#define __NO_VERSION__
+
+#include <linux/kernel.h>			/* printk() */
+#include <linux/sched.h>			/* jiffies */
+#include <linux/smp.h>				/* smp_processor_id() */
+#include <linux/vmalloc.h>			/* vmalloc(), vfree() */
+#include <linux/skbuff.h>			/* sk_buff */
+#include <linux/ip.h>				/* iphdr */
+#include <linux/tcp.h>				/* tcphdr */
+#include <linux/udp.h>				/* udphdr */
+#include <linux/netdevice.h>		/* net_device */
+#include <linux/netfilter.h>		/* NF_ACCEPT, NF_DROP */
+#include <linux/interrupt.h>		/* local_bh_disable() */
+
+#include "zelkova.h"
+#include "zkpktinfo.h"
+#include "zkflow.h"
+#include "zktcp.h"				/* zktcp_advance() */
+
+
+static zkflow_t		*zkflow_table[NR_CPUS];	/**< Offload tables per CPU */
+
+#define ZKFLOW_SLOT(key) \
+	(zkhash_3words((key)->fk_saddr, (key)->fk_daddr, \
+		(((key)->fk_sport << 16) | (key)->fk_dport) ^ ((key)->fk_proto << 8) ^ (key)->fk_ifindex) \
+	 & (ZKFLOW_SIZE - 1))
+
+
+/* zkflow_keycmp(): Do two keys match? */
+
+static inline int zkflow_keycmp(const zkflowkey_t *a, const zkflowkey_t *b)
+{
+	return (a->fk_saddr == b->fk_saddr && a->fk_daddr == b->fk_daddr &&
+			a->fk_sport == b->fk_sport && a->fk_dport == b->fk_dport &&
+			a->fk_proto == b->fk_proto && a->fk_ifindex == b->fk_ifindex);
+}
+
+/* zkflow_fold(): Add the counters of an entry to its session.
+ * The session is updated under its own lock, once per ZKFLOW_FOLD
+ * packets.
+ */
+
+static inline void zkflow_fold(zkflow_t *fl)
+{
+	if (fl->zfl_pkts == 0) {
+		return;
+	}
+
+	ipsess_account(fl->zfl_sess, fl->zfl_dir, fl->zfl_pkts, fl->zfl_bytes);
+
+	fl->zfl_pkts = 0;
+	fl->zfl_bytes = 0;
+}
+
+/* zkflow_drop(): Fold and forget the session of an entry */
+
+static inline void zkflow_drop(zkflow_t *fl)
+{
+	if (fl->zfl_sess != NULL) {
+		zkflow_fold(fl);
+		ipsess_release(fl->zfl_sess);
+		fl->zfl_sess = NULL;
+	}
+}
+
+
+/**
+ *---------------------------------------------------------------------------
+ *
+ * @fn     static int zkflow_key(struct sk_buff *skb, const struct net_device *in, zkflowkey_t *key)
+ * @brief  Extract the key of a packet
+ * @param  skb: packet
+ * @param  in: ingress interface
+ * @param  key: (out) key
+ * @return 0 if the packet may be offloaded, -1 if not.
+ * @date   18 Oct, 2026
+ * @see    zkflow_check(), zkflow_offload()
+ *
+ *  Extract the key of a packet with the minimum of checks. Fragments,
+ *  protocols other than TCP and UDP, headers not in the linear area, and
+ *  TCP segments which change the connection state (SYN, FIN and RST) are
+ *  left to the slow path.
+ *
+ *---------------------------------------------------------------------------
+ */
+
+static int zkflow_key(struct sk_buff *skb, const struct net_device *in, zkflowkey_t *key)
+{
+	struct iphdr	*iph = skb->nh.iph;
+	struct tcphdr	*th;
+	struct udphdr	*uh;
+	uint32_t		hlen = iph->ihl << 2;
+
+	if ((iph->frag_off & htons(IP_MF | IP_OFFSET))) {
+		return -1;
+	}
+
+	switch (iph->protocol) {
+	case IPPROTO_TCP:
+		if (skb_headlen(skb) < hlen + sizeof(struct tcphdr)) {
+			return -1;
+		}
+
+		th = (struct tcphdr *)((uint8_t *)iph + hlen);
+
+		if (th->syn || th->fin || th->rst) {
+			return -1;
+		}
+
+		key->fk_sport = th->source;
+		key->fk_dport = th->dest;
+		break;
+
+	case IPPROTO_UDP:
+		if (skb_headlen(skb) < hlen + sizeof(struct udphdr)) {
+			return -1;
+		}
+
+		uh = (struct udphdr *)((uint8_t *)iph + hlen);
+
+		key->fk_sport = uh->source;
+		key->fk_dport = uh->dest;
+		break;
+
+	default:
+		return -1;
+	}
+
+	key->fk_saddr	= iph->saddr;
+	key->fk_daddr	= iph->daddr;
+	key->fk_proto	= iph->protocol;
+	key->fk_ifindex	= in->ifindex;
+
+	return 0;
+}
+
+
+/**
+ *---------------------------------------------------------------------------
+ *
+ * @fn     int zkflow_init(void)
+ * @brief  Allocate the offload tables
+ * @param  NONE
+ * @return 0 if normal, <0 if abnormal.
+ * @date   18 Oct, 2026
+ * @see    zkflow_clean()
+ *
+ *  Allocate an offload table for every CPU. If this is not called,
+ *  no flow is ever offloaded.
+ *
+ *---------------------------------------------------------------------------
+ */
+
+int zkflow_init(void)
+{
+	int		i, cpu;
+
+	for (i = 0; i < smp_num_cpus; i++) {
+		cpu = cpu_logical_map(i);
+
+		zkflow_table[cpu] = (zkflow_t *)vmalloc(sizeof(zkflow_t) * ZKFLOW_SIZE);
+		if (zkflow_table[cpu] == NULL) {
+			zkflow_clean();
+			return -ENOMEM;
+		}
+
+		memset(zkflow_table[cpu], 0x00, sizeof(zkflow_t) * ZKFLOW_SIZE);
+	}
+
+	return 0;
+}
+
+
+/**
+ *---------------------------------------------------------------------------
+ *
+ * @fn     void zkflow_clean(void)
+ * @brief  Free the offload tables
+ * @param  NONE
+ * @return NONE
+ * @date   18 Oct, 2026
+ * @see    zkflow_init()
+ *
+ *  Release the sessions held by the offload tables and free them.
+ *  The hooks must have been unregistered, and this has to be done before
+ *  the session table is cleaned.
+ *
+ *---------------------------------------------------------------------------
+ */
+
+void zkflow_clean(void)
+{
+	zkflow_t	*tbl;
+	int			cpu, i;
+
+	for (cpu = 0; cpu < NR_CPUS; cpu++) {
+		if ((tbl = zkflow_table[cpu]) == NULL) {
+			continue;
+		}
+
+		for (i = 0; i < ZKFLOW_SIZE; i++) {
+			zkflow_drop(&tbl[i]);
+		}
+
+		vfree(tbl);
+		zkflow_table[cpu] = NULL;
+	}
+}
+
+
+/**
+ *---------------------------------------------------------------------------
+ *
+ * @fn     int zkflow_check(struct sk_buff *skb, const struct net_device *in, unsigned int *verdict)
+ * @brief  Give the verdict of an offloaded flow
+ * @param  skb: packet
+ * @param  in: ingress interface
+ * @param  verdict: (out) NF_ACCEPT or NF_DROP
+ * @return 1 if the packet belongs to an offloaded flow, 0 if it has to
+ *         take the slow path.
+ * @date   18 Oct, 2026
+ * @see    zkflow_offload()
+ *
+ *  Look a packet up in the offload table of this CPU. On a hit, the
+ *  counters are updated and the session is kept from expiring, without
+ *  classifying the packet. Called at the start of the input and forward
+ *  hooks.
+ *
+ *---------------------------------------------------------------------------
+ */
+
+int zkflow_check(struct sk_buff *skb, const struct net_device *in, unsigned int *verdict)
+{
+	zkflow_t		*tbl = zkflow_table[smp_processor_id()];
+	zkflow_t		*fl;
+	zkipsess_t		*is;
+	zkflowkey_t		key;
+
+	if (tbl == NULL || zkflow_key(skb, in, &key) < 0) {
+		return 0;
+	}
+
+	fl = &tbl[ZKFLOW_SLOT(&key)];
+
+	if ((is = fl->zfl_sess) == NULL || !zkflow_keycmp(&fl->zfl_key, &key)) {
+		return 0;
+	}
+
+	/* The session has been deleted, or the policy has changed. A
+	 * dynamic rule taken out may be the one of the session, which the
+	 * slow path finds stale; zis_rule is not read here without the
+	 * shard lock. */
+	if ((is->zis_flag & IS_DEAD) || fl->zfl_gen != ipsess_gen ||
+			fl->zfl_dfgen != dfrule_gen) {
+		zkflow_drop(fl);
+		return 0;
+	}
+
+	/* A single word store, which the expiry sweeper only reads; the
+	 * counters and the flags are left to zkflow_fold() */
+	if (is->zis_age != jiffies) {
+		is->zis_age = jiffies;
+	}
+
+	/* Keep the windows up to date for the slow path, which checks the
+	 * other direction against them under the same lock */
+	if (key.fk_proto == IPPROTO_TCP) {
+		spin_lock(&is->zis_lock);
+		zktcp_advance(is, fl->zfl_dir, skb);
+		spin_unlock(&is->zis_lock);
+	}
+
+	fl->zfl_bytes += skb->len;
+
+	if (++fl->zfl_pkts >= ZKFLOW_FOLD) {
+		zkflow_fold(fl);
+	}
+
+	*verdict = (fl->zfl_pass & ACT_ALLOW) ? NF_ACCEPT : NF_DROP;
+
+	return 1;
+}
+
+
+/**
+ *---------------------------------------------------------------------------
+ *
+ * @fn     int zkflow_offload(zkpktinfo_t *pi, zkipsess_t *is)
+ * @brief  Offload the flow of a packet
+ * @param  pi: packet information (zpi_buff and zpi_ifp are filled)
+ * @param  is: session of the packet (zpi_dir is its direction)
+ * @return 0 if offloaded, -1 if not.
+ * @date   18 Oct, 2026
+ * @see    zkflow_check()
+ *
+ *  Offload the direction of a session which the packet belongs to, so
+ *  that later packets of that direction on the same interface are handled
+ *  by zkflow_check(). Only established sessions which need no logging and
+ *  no address translation are offloaded. Called by the slow path of the
+ *  input and forward hooks after
+ *  the session has been updated; an entry already in the slot is replaced.
+ *
+ *---------------------------------------------------------------------------
+ */
+
+int zkflow_offload(zkpktinfo_t *pi, zkipsess_t *is)
+{
+	zkflow_t		*tbl, *fl;
+	zkflowkey_t		key;
+	int				ret = -1;
+
+	if (!(is->zis_flag & IS_ESTABLISHED) || (is->zis_flag & (IS_DEAD | IS_NAT))) {
+		return -1;
+	}
+
+	if ((is->zis_pass & ACT_LOG) || ipsess_isstale(is)) {
+		return -1;
+	}
+
+	local_bh_disable();
+
+	tbl = zkflow_table[smp_processor_id()];
+
+	if (tbl == NULL || zkflow_key(pi->zpi_buff, pi->zpi_ifp, &key) < 0) {
+		goto out;
+	}
+
+	fl = &tbl[ZKFLOW_SLOT(&key)];
+
+	zkflow_drop(fl);
+
+	atomic_inc(&is->zis_refcnt);
+
+	fl->zfl_key		= key;
+	fl->zfl_sess	= is;
+	fl->zfl_gen		= ipsess_gen;
+	fl->zfl_dfgen	= dfrule_gen;
+	fl->zfl_pass	= is->zis_pass;
+	fl->zfl_dir		= pi->zpi_dir;
+	fl->zfl_pkts	= 0;
+	fl->zfl_bytes	= 0;
+
+	ret = 0;
+
+out:
+	local_bh_enable();
+
+	return ret;
+}
@@ -0,0 +1,84 @@
+/*
+ *----------------------------------------------------------------------------
+ *
+ * Zelkova - A Firewall and Intrusion Prevention System on Linux Kernel
+ *
+ * Copyright (C) 2005 Dongsu Park <advance@dongsu.pe.kr>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111, USA.
+ *
+ * $Id$
+ *----------------------------------------------------------------------------
+ */
+
+/** @file zkflow.h
+ * Define variables, constants, structures, and function declarations
+ * for the established-flow offload table.
+ */
+
+#ifndef __ZKFLOW_H__
+#define __ZKFLOW_H__
+
+#include "zksession.h"
+
+struct zkpktinfo;
+
+/* zkflowkey_t
+ * :Key of an offloaded flow, taken from the headers as they are
+ *  (network byte order). One direction of a session on one interface.
+ */
+
+typedef struct zkflowkey {
+	uint32_t		fk_saddr;		/* source address */
+	uint32_t		fk_daddr;		/* destination address */
+	uint16_t		fk_sport;		/* source port */
+	uint16_t		fk_dport;		/* destination port */
+	uint32_t		fk_proto;		/* protocol */
+	int				fk_ifindex;		/* ingress interface */
+} zkflowkey_t;
+
+/* zkflow_t
+ * :An entry of the offload table. It holds a reference of the session,
+ *  which stays valid as long as the session is alive and the policy
+ *  generation has not changed.
+ */
+
+typedef struct zkflow {
+	zkflowkey_t		zfl_key;		/* key */
+
+	zkipsess_t		*zfl_sess;		/* session (a reference is held) */
+	uint32_t		zfl_gen;		/* policy generation at the offload */
+	uint32_t		zfl_dfgen;		/* dfrule_gen at the offload */
+	uint32_t		zfl_pass;		/* filtering action (zis_pass) */
+	uint32_t		zfl_dir;		/* direction on the session */
+
+	uint32_t		zfl_pkts;		/* packets not yet folded into the session */
+	uint32_t		zfl_bytes;		/* bytes not yet folded into the session */
+} zkflow_t;
+
+#define ZKFLOW_SIZE		4096	/**< Entries per CPU (power of 2) */
+#define ZKFLOW_FOLD		64		/**< Packets between counter folds */
+
+#ifdef __KERNEL__
+struct sk_buff;
+struct net_device;
+
+int zkflow_init(void);
+void zkflow_clean(void);
+int zkflow_check(struct sk_buff *skb, const struct net_device *in, unsigned int *verdict);
+int zkflow_offload(struct zkpktinfo *pi, zkipsess_t *is);
+#endif	/* __KERNEL__ */
+
+#endif	/* __ZKFLOW_H__ */
@@ -0,0 +1,599 @@
+/*
+ *----------------------------------------------------------------------------
+ *
+ * Zelkova - A Firewall and Intrusion Prevention System on Linux Kernel
+ *
+ * Copyright (C) 2005 Dongsu Park <advance@dongsu.pe.kr>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111, USA.
+ *
+ * $Id$
+ *----------------------------------------------------------------------------
+ */
+
+/** @file zkfrag.c
+ * Gives fragments the verdict of their first fragment without reassembly
+ *
+ * The first fragment of a datagram carries the L4 header, so it is the
+ * only one which can be classified. Its verdict and session are kept
+ * here under (src, dst, proto, IP ID), and the other fragments of the
+ * datagram simply take them over. Fragments which arrive before the
+ * first one are queued (NF_QUEUE) to zkfrag_hold(), which keeps them on
+ * their entry until the verdict is known, and then resumes them with
+ * nf_reinject() so that they still go through the hooks behind this one.
+ * Entries and held fragments are bounded, and expire after
+ * ZKFRAG_TIMEOUT.
+ *
+ * zkfrag_hold() has to be the queue handler of PF_INET, and there is
+ * only one. If another module (ip_queue) already is, the early
+ * fragments are dropped instead. Either way the fragments which could
+ * not wait are counted (zkfrag_getstat()).
+ */
+
+#define __NO_VERSION__
+
+#include <linux/kernel.h>			/* printk() */
+#include <linux/sched.h>			/* jiffies */
+#include <linux/slab.h>				/* kmalloc(), kfree() */
+#include <linux/timer.h>			/* timer_list */
+#include <linux/interrupt.h>		/* tasklet_struct */
+#include <linux/skbuff.h>			/* sk_buff */
+#include <linux/ip.h>				/* iphdr */
+#include <linux/netfilter.h>		/* NF_ACCEPT, NF_DROP, nf_reinject() */
+#include <linux/netfilter_ipv4.h>	/* NF_IP_LOCAL_OUT */
+#include <linux/netfilter_ipv4/lockhelp.h>	/* *_LOCK, *_UNLOCK */
+
+#include "zelkova.h"
+#include "zkpktinfo.h"
+#include "zksession.h"
+#include "zkfrag.h"
+#include "zkstat.h"
+
+
+static DECLARE_LOCK(zkfrag_lock);		/**< Guards every entry */
+
+static zkfrag_t		**zkfrag_hash;		/**< Hash table of entries */
+static int			zkfrag_nent;		/**< Number of entries */
+
+static struct timer_list	zkfrag_timer;	/**< Expiry sweeper */
+
+static int			zkfrag_queue = 0;	/**< Is zkfrag_hold() the queue handler? */
+static int			zkfrag_nheld;		/**< Number of fragments held */
+static int			zkfrag_heldbytes;	/**< Memory of them (truesize) */
+static uint32_t		zkfrag_nhold;		/**< Fragments queued so far */
+static uint32_t		zkfrag_ndrop;		/**< Fragments dropped before their first one */
+
+static zkfraghold_t	*zkfrag_ready = NULL;				/**< Held fragments with a verdict */
+static zkfraghold_t	**zkfrag_readytail = &zkfrag_ready;	/**< zfh_next of the last one */
+
+static void zkfrag_expire(unsigned long data);
+static int zkfrag_hold(struct sk_buff *skb, struct nf_info *info, void *data);
+static void zkfrag_resume(unsigned long data);
+
+static DECLARE_TASKLET(zkfrag_tasklet, zkfrag_resume, 0);
+
+#define ZKFRAG_BUCKET(iph) \
+	(zkhash_3words((iph)->saddr, (iph)->daddr, \
+		((uint32_t)(iph)->id << 16) | (iph)->protocol) % ZKFRAG_HASHSIZE)
+
+/* zkfrag_find(): Look up the entry of a fragment, creating it if asked.
+ * NULL is returned if there is none, or if the table is full.
+ * NOTE: zkfrag_lock has to be held.
+ */
+
+static zkfrag_t *zkfrag_find(struct iphdr *iph, int create)
+{
+	zkfrag_t	**bp = &zkfrag_hash[ZKFRAG_BUCKET(iph)];
+	zkfrag_t	*fr;
+
+	for (fr = *bp; fr != NULL; fr = fr->zf_next) {
+		if (fr->zf_saddr == iph->saddr && fr->zf_daddr == iph->daddr &&
+				fr->zf_ipid == iph->id && fr->zf_proto == iph->protocol) {
+			return fr;
+		}
+	}
+
+	if (!create || zkfrag_nent >= ZKFRAG_MAXENT) {
+		return NULL;
+	}
+
+	KMALLOCS(fr, zkfrag_t *, sizeof(zkfrag_t));
+	if (fr == NULL) {
+		return NULL;
+	}
+
+	memset(fr, 0x00, sizeof(zkfrag_t));
+
+	fr->zf_saddr	= iph->saddr;
+	fr->zf_daddr	= iph->daddr;
+	fr->zf_ipid		= iph->id;
+	fr->zf_proto	= iph->protocol;
+	fr->zf_expire	= jiffies + ZKFRAG_TIMEOUT;
+	fr->zf_holdtail	= &fr->zf_hold;
+
+	fr->zf_next = *bp;
+	*bp = fr;
+
+	zkfrag_nent++;
+
+	return fr;
+}
+
+/* zkfrag_release(): Give the fragments held on an entry a verdict, and
+ * pass them on to zkfrag_resume(). Accepted ones are counted on the
+ * session of the first fragment.
+ * NOTE: zkfrag_lock has to be held.
+ */
+
+static void zkfrag_release(zkfrag_t *fr, unsigned int verdict)
+{
+	zkfraghold_t	*fh;
+
+	if (fr->zf_hold == NULL) {
+		return;
+	}
+
+	for (fh = fr->zf_hold; fh != NULL; fh = fh->zfh_next) {
+		fh->zfh_verdict = verdict;
+
+		zkfrag_nheld--;
+		zkfrag_heldbytes -= fh->zfh_skb->truesize;
+
+		if (verdict == NF_ACCEPT && fr->zf_sess != NULL) {
+			ipsess_touch(fr->zf_sess, fr->zf_dir, fh->zfh_skb->len);
+		}
+	}
+
+	*zkfrag_readytail = fr->zf_hold;
+	zkfrag_readytail = fr->zf_holdtail;
+
+	fr->zf_hold		= NULL;
+	fr->zf_holdtail	= &fr->zf_hold;
+	fr->zf_nhold	= 0;
+
+	tasklet_schedule(&zkfrag_tasklet);
+}
+
+/* zkfrag_destroy(): Free an entry already out of the table.
+ * zkfrag_release() has been run on it.
+ */
+
+static void zkfrag_destroy(zkfrag_t *fr)
+{
+	if (fr->zf_sess != NULL) {
+		ipsess_release(fr->zf_sess);
+	}
+
+	KFREES(fr);
+}
+
+
+/**
+ *---------------------------------------------------------------------------
+ *
+ * @fn     int zkfrag_init(void)
+ * @brief  Initialize the fragment verdict cache
+ * @param  NONE
+ * @return 0 if normal, <0 if abnormal.
+ * @date   18 Oct, 2026
+ * @see    zkfrag_clean()
+ *
+ *  Allocate the hash table and start the expiry sweeper.
+ *
+ *---------------------------------------------------------------------------
+ */
+
+int zkfrag_init(void)
+{
+	KMALLOCS(zkfrag_hash, zkfrag_t **, sizeof(zkfrag_t *) * ZKFRAG_HASHSIZE);
+	if (zkfrag_hash == NULL) {
+		return -ENOMEM;
+	}
+
+	memset(zkfrag_hash, 0x00, sizeof(zkfrag_t *) * ZKFRAG_HASHSIZE);
+
+	zkfrag_nent = 0;
+
+	init_timer(&zkfrag_timer);
+
+	zkfrag_timer.expires	= jiffies + ZKFRAG_INTERVAL;
+	zkfrag_timer.data		= 0;
+	zkfrag_timer.function	= &zkfrag_expire;
+
+	add_timer(&zkfrag_timer);
+
+	/* Without the queue handler early fragments are dropped */
+	if (nf_register_queue_handler(PF_INET, zkfrag_hold, NULL) == 0) {
+		zkfrag_queue = 1;
+	}
+	else {
+		printk(KERN_INFO "zelkova: queue handler busy, fragments "
+				"before the first one will be dropped\n");
+	}
+
+	return 0;
+}
+
+
+/**
+ *---------------------------------------------------------------------------
+ *
+ * @fn     void zkfrag_clean(void)
+ * @brief  Destroy the fragment verdict cache
+ * @param  NONE
+ * @return NONE
+ * @date   18 Oct, 2026
+ * @see    zkfrag_init()
+ *
+ *  Stop the expiry sweeper and the queue handler, drop every fragment
+ *  still held, and free every entry.
+ *
+ *---------------------------------------------------------------------------
+ */
+
+void zkfrag_clean(void)
+{
+	zkfrag_t	*fr;
+	int			i;
+
+	if (zkfrag_hash == NULL) {
+		return;
+	}
+
+	del_timer_sync(&zkfrag_timer);
+
+	if (zkfrag_queue) {
+		nf_unregister_queue_handler(PF_INET);
+		zkfrag_queue = 0;
+	}
+
+	tasklet_kill(&zkfrag_tasklet);
+
+	LOCK_BH(&zkfrag_lock);
+
+	for (i = 0; i < ZKFRAG_HASHSIZE; i++) {
+		while ((fr = zkfrag_hash[i]) != NULL) {
+			zkfrag_hash[i] = fr->zf_next;
+			zkfrag_release(fr, NF_DROP);
+			zkfrag_destroy(fr);
+		}
+	}
+
+	zkfrag_nent = 0;
+
+	UNLOCK_BH(&zkfrag_lock);
+
+	/* Let the tasklet zkfrag_release() scheduled run, and resume the rest */
+	tasklet_kill(&zkfrag_tasklet);
+	zkfrag_resume(0);
+
+	KFREES(zkfrag_hash);
+	zkfrag_hash = NULL;
+}
+
+
+/**
+ *---------------------------------------------------------------------------
+ *
+ * @fn     int zkfrag_check(zkpktinfo_t *pi, unsigned int *verdict)
+ * @brief  Give a fragment the verdict of its first fragment
+ * @param  pi: packet information (zkpktinfo_parse() has been run)
+ * @param  verdict: (out) NF_ACCEPT, NF_DROP, or NF_QUEUE
+ * @return 1 if the verdict is set, 0 if the packet has to be classified.
+ * @date   18 Oct, 2026
+ * @see    zkfrag_record(), zkfrag_hold()
+ *
+ *  Give a non-first fragment the verdict of the first fragment of its
+ *  datagram, and count it on the session of that one. If the first
+ *  fragment has not been classified yet, the fragment is queued to
+ *  zkfrag_hold() (NF_QUEUE), or dropped when that is not the queue
+ *  handler. The first fragment and unfragmented packets are left to the
+ *  classifier.
+ *
+ *---------------------------------------------------------------------------
+ */
+
+int zkfrag_check(zkpktinfo_t *pi, unsigned int *verdict)
+{
+	struct sk_buff	*skb = pi->zpi_buff;
+	zkfrag_t		*fr;
+
+	if (!(pi->zpi_flags & ZPI_FRAGMENT) || zkfrag_hash == NULL) {
+		return 0;
+	}
+
+	LOCK_BH(&zkfrag_lock);
+
+	fr = zkfrag_find(skb->nh.iph, 0);
+
+	if (fr != NULL && (fr->zf_flag & ZF_DECIDED)) {
+		*verdict = fr->zf_verdict;
+
+		if (*verdict == NF_ACCEPT && fr->zf_sess != NULL) {
+			ipsess_touch(fr->zf_sess, fr->zf_dir, skb->len);
+		}
+	}
+	else if (zkfrag_queue) {
+		*verdict = NF_QUEUE;
+	}
+	else {
+		*verdict = NF_DROP;
+		zkfrag_ndrop++;
+	}
+
+	UNLOCK_BH(&zkfrag_lock);
+
+	return 1;
+}
+
+
+/**
+ *---------------------------------------------------------------------------
+ *
+ * @fn     unsigned int zkfrag_record(zkpktinfo_t *pi, uint32_t pass, zkipsess_t *is)
+ * @brief  Record the verdict of a first fragment
+ * @param  pi: packet information (zpi_dir is filled)
+ * @param  pass: action given to the packet by the classifier (ACT_*)
+ * @param  is: session of the packet, NULL if none
+ * @return NF_ACCEPT or NF_DROP
+ * @date   18 Oct, 2026
+ * @see    zkfrag_check()
+ *
+ *  Turn the action of a packet into its verdict. For the first fragment
+ *  of a datagram, the verdict and the session are also recorded for the
+ *  fragments which follow. An action without ACT_ALLOWFRAG does not let
+ *  fragmented datagrams through at all, so the first fragment is dropped
+ *  as well. Fragments held before the first one are released with the
+ *  verdict.
+ *
+ *---------------------------------------------------------------------------
+ */
+
+unsigned int zkfrag_record(zkpktinfo_t *pi, uint32_t pass, zkipsess_t *is)
+{
+	unsigned int	verdict = (pass & ACT_ALLOW) ? NF_ACCEPT : NF_DROP;
+	zkfrag_t		*fr;
+
+	if (!(pi->zpi_flags & ZPI_MOREFRAG) || (pi->zpi_flags & ZPI_FRAGMENT) ||
+			zkfrag_hash == NULL) {
+		return verdict;
+	}
+
+	if (!(pass & ACT_ALLOWFRAG)) {
+		verdict = NF_DROP;
+	}
+
+	LOCK_BH(&zkfrag_lock);
+
+	/* Without an entry the other fragments are dropped as overflow */
+	if ((fr = zkfrag_find(pi->zpi_buff->nh.iph, 1)) == NULL) {
+		UNLOCK_BH(&zkfrag_lock);
+		return verdict;
+	}
+
+	/* A retransmitted first fragment keeps the verdict of the original */
+	if ((fr->zf_flag & ZF_DECIDED)) {
+		verdict = fr->zf_verdict;
+		UNLOCK_BH(&zkfrag_lock);
+		return verdict;
+	}
+
+	fr->zf_flag		|= ZF_DECIDED;
+	fr->zf_verdict	= verdict;
+	fr->zf_expire	= jiffies + ZKFRAG_TIMEOUT;
+
+	if (is != NULL && verdict == NF_ACCEPT) {
+		atomic_inc(&is->zis_refcnt);
+		fr->zf_sess	= is;
+		fr->zf_dir	= pi->zpi_dir;
+	}
+
+	zkfrag_release(fr, verdict);
+
+	UNLOCK_BH(&zkfrag_lock);
+
+	return verdict;
+}
+
+
+/**
+ *---------------------------------------------------------------------------
+ *
+ * @fn     static void zkfrag_expire(unsigned long data)
+ * @brief  Expire old entries of the fragment verdict cache
+ * @param  data: NOT USED
+ * @return NONE
+ * @date   18 Oct, 2026
+ * @see    zkfrag_init()
+ *
+ *  Timer handler of the expiry sweeper. Expired entries are unlinked
+ *  with the lock held, and freed after it is dropped. Fragments still
+ *  held on them never saw their first fragment, and are dropped.
+ *
+ *---------------------------------------------------------------------------
+ */
+
+static void zkfrag_expire(unsigned long data)
+{
+	zkfrag_t	**bp, *fr, *reap = NULL;
+	int			i;
+
+	LOCK_BH(&zkfrag_lock);
+
+	for (i = 0; i < ZKFRAG_HASHSIZE; i++) {
+		bp = &zkfrag_hash[i];
+
+		while ((fr = *bp) != NULL) {
+			if (time_before(jiffies, fr->zf_expire)) {
+				bp = &fr->zf_next;
+				continue;
+			}
+
+			*bp = fr->zf_next;
+
+			zkfrag_nent--;
+
+			zkfrag_ndrop += fr->zf_nhold;
+			zkfrag_release(fr, NF_DROP);
+
+			fr->zf_next = reap;
+			reap = fr;
+		}
+	}
+
+	UNLOCK_BH(&zkfrag_lock);
+
+	while ((fr = reap) != NULL) {
+		reap = fr->zf_next;
+		zkfrag_destroy(fr);
+	}
+
+	mod_timer(&zkfrag_timer, jiffies + ZKFRAG_INTERVAL);
+}
+
+
+/**
+ *---------------------------------------------------------------------------
+ *
+ * @fn     static int zkfrag_hold(struct sk_buff *skb, struct nf_info *info, void *data)
+ * @brief  Hold a fragment until the first fragment of its datagram is classified
+ * @param  skb: fragment queued by zkfrag_check()
+ * @param  info: hook to resume it from
+ * @param  data: NOT USED
+ * @return 0 if the fragment is taken, <0 to have nf_queue() drop it.
+ * @date   18 Oct, 2026
+ * @see    zkfrag_check(), zkfrag_resume()
+ *
+ *  Queue handler of PF_INET. The fragment is kept on the entry of its
+ *  datagram. If the first fragment has been classified meanwhile, it is
+ *  released at once. Past the limits on held fragments it is dropped.
+ *
+ *---------------------------------------------------------------------------
+ */
+
+static int zkfrag_hold(struct sk_buff *skb, struct nf_info *info, void *data)
+{
+	zkfraghold_t	*fh;
+	zkfrag_t		*fr;
+	int				out = (info->hook == NF_IP_LOCAL_OUT);
+
+	KMALLOCS(fh, zkfraghold_t *, sizeof(zkfraghold_t));
+
+	LOCK_BH(&zkfrag_lock);
+
+	fr = (fh != NULL) ? zkfrag_find(skb->nh.iph, 1) : NULL;
+
+	if (fr == NULL || (!(fr->zf_flag & ZF_DECIDED) &&
+			(fr->zf_nhold >= ZKFRAG_MAXHOLD || zkfrag_nheld >= ZKFRAG_MAXHELD ||
+			 zkfrag_heldbytes + skb->truesize > ZKFRAG_MAXHELDBYTES))) {
+		zkfrag_ndrop++;
+		UNLOCK_BH(&zkfrag_lock);
+
+		if (fh != NULL) {
+			KFREES(fh);
+		}
+
+		zkstat_verdict(out, 0);
+		return -ENOBUFS;
+	}
+
+	fh->zfh_next	= NULL;
+	fh->zfh_skb		= skb;
+	fh->zfh_info	= info;
+	fh->zfh_verdict	= NF_DROP;
+	fh->zfh_out		= out;
+
+	*fr->zf_holdtail = fh;
+	fr->zf_holdtail = &fh->zfh_next;
+	fr->zf_nhold++;
+
+	zkfrag_nheld++;
+	zkfrag_heldbytes += skb->truesize;
+	zkfrag_nhold++;
+
+	if ((fr->zf_flag & ZF_DECIDED)) {
+		zkfrag_release(fr, fr->zf_verdict);
+	}
+
+	UNLOCK_BH(&zkfrag_lock);
+
+	return 0;
+}
+
+
+/**
+ *---------------------------------------------------------------------------
+ *
+ * @fn     static void zkfrag_resume(unsigned long data)
+ * @brief  Resume the held fragments which have their verdict
+ * @param  data: NOT USED
+ * @return NONE
+ * @date   18 Oct, 2026
+ * @see    zkfrag_hold()
+ *
+ *  Tasklet run after zkfrag_release(). The ready list is taken with the
+ *  lock held, and each fragment is counted and handed back to netfilter
+ *  after it is dropped.
+ *
+ *---------------------------------------------------------------------------
+ */
+
+static void zkfrag_resume(unsigned long data)
+{
+	zkfraghold_t	*fh, *list;
+
+	LOCK_BH(&zkfrag_lock);
+
+	list = zkfrag_ready;
+
+	zkfrag_ready		= NULL;
+	zkfrag_readytail	= &zkfrag_ready;
+
+	UNLOCK_BH(&zkfrag_lock);
+
+	while ((fh = list) != NULL) {
+		list = fh->zfh_next;
+
+		zkstat_verdict(fh->zfh_out, fh->zfh_verdict == NF_ACCEPT);
+		nf_reinject(fh->zfh_skb, fh->zfh_info, fh->zfh_verdict);
+
+		KFREES(fh);
+	}
+}
+
+
+/**
+ *---------------------------------------------------------------------------
+ *
+ * @fn     void zkfrag_getstat(uint32_t *nhold, uint32_t *ndrop)
+ * @brief  Get the counters of fragments which came before their first one
+ * @param  nhold: (out) fragments held so far
+ * @param  ndrop: (out) fragments dropped because they could not be held
+ * @return NONE
+ * @date   18 Oct, 2026
+ * @see    zkfrag_hold()
+ *
+ *---------------------------------------------------------------------------
+ */
+
+void zkfrag_getstat(uint32_t *nhold, uint32_t *ndrop)
+{
+	LOCK_BH(&zkfrag_lock);
+
+	*nhold = zkfrag_nhold;
+	*ndrop = zkfrag_ndrop;
+
+	UNLOCK_BH(&zkfrag_lock);
+}
@@ -0,0 +1,98 @@
+/*
+ *----------------------------------------------------------------------------
+ *
+ * Zelkova - A Firewall and Intrusion Prevention System on Linux Kernel
+ *
+ * Copyright (C) 2005 Dongsu Park <advance@dongsu.pe.kr>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111, USA.
+ *
+ * $Id$
+ *----------------------------------------------------------------------------
+ */
+
+/** @file zkfrag.h
+ * Define variables, constants, structures, and function declarations
+ * for the fragment verdict cache.
+ */
+
+#ifndef __ZKFRAG_H__
+#define __ZKFRAG_H__
+
+#include "zelkova.h"
+
+#define ZKFRAG_HASHSIZE		1024			/**< Buckets of the fragment table */
+#define ZKFRAG_MAXENT		4096			/**< Ceiling of the number of entries */
+
+#define ZKFRAG_MAXHOLD		16				/**< Fragments held for one datagram */
+#define ZKFRAG_MAXHELD		256				/**< Fragments held in all */
+#define ZKFRAG_MAXHELDBYTES	(512 * 1024)	/**< Memory of the fragments held (truesize) */
+
+#define ZKFRAG_TIMEOUT		(30 * HZ)		/**< Lifetime of an entry */
+#define ZKFRAG_INTERVAL		HZ				/**< Interval between expiry ticks */
+
+#ifdef __KERNEL__
+struct sk_buff;
+struct nf_info;
+struct zkpktinfo;
+struct zkipsess;
+
+/* zkfraghold_t
+ * :A fragment held until the first fragment of its datagram is classified
+ */
+
+typedef struct zkfraghold {
+	struct zkfraghold	*zfh_next;		/* The next held fragment */
+	struct sk_buff		*zfh_skb;		/* fragment */
+	struct nf_info		*zfh_info;		/* hook to resume it from (nf_reinject()) */
+	unsigned int		zfh_verdict;	/* verdict given, once it is known */
+	int					zfh_out;		/* held on the output hook? */
+} zkfraghold_t;
+
+/* zkfrag_t
+ * :A datagram seen in fragments, keyed by (src, dst, proto, IP ID)
+ */
+
+typedef struct zkfrag {
+	struct zkfrag	*zf_next;			/* The next node of hash chain */
+
+	uint32_t		zf_saddr;			/* source address (network order) */
+	uint32_t		zf_daddr;			/* destination address (network order) */
+	uint16_t		zf_ipid;			/* IP ID */
+	uint8_t			zf_proto;			/* protocol */
+	uint8_t			zf_flag;			/* ZF_* */
+
+	unsigned int	zf_verdict;			/* verdict of the first fragment */
+	struct zkipsess	*zf_sess;			/* session of the first fragment */
+	int				zf_dir;				/* direction on zf_sess */
+	unsigned long	zf_expire;			/* jiffies when the entry expires */
+
+	zkfraghold_t	*zf_hold;			/* fragments which came before the first one */
+	zkfraghold_t	**zf_holdtail;		/* zfh_next of the last one */
+	int				zf_nhold;			/* number of them */
+} zkfrag_t;
+
+/* zkfrag_t::zf_flag */
+
+#define ZF_DECIDED		0x01	/**< The first fragment has been classified */
+
+int zkfrag_init(void);
+void zkfrag_clean(void);
+int zkfrag_check(struct zkpktinfo *pi, unsigned int *verdict);
+unsigned int zkfrag_record(struct zkpktinfo *pi, uint32_t pass, struct zkipsess *is);
+void zkfrag_getstat(uint32_t *nhold, uint32_t *ndrop);
+#endif	/* __KERNEL__ */
+
+#endif	/* __ZKFRAG_H__ */
@@ -0,0 +1,114 @@
+/*
+ *----------------------------------------------------------------------------
+ *
+ * Zelkova - A Firewall and Intrusion Prevention System on Linux Kernel
+ *
+ * Copyright (C) 2005 Dongsu Park <advance@dongsu.pe.kr>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111, USA.
+ *
+ * $Id$
+ *----------------------------------------------------------------------------
+ */
+
+/** @file zkhash.h
+ * Keyed hash functions shared by the session, NAT and fragment tables
+ */
+
+#ifndef __ZKHASH_H__
+#define __ZKHASH_H__
+
+#include "fistree.h"		/* DIM_* */
+
+/*
+ * The mixing function is the one of Bob Jenkins' lookup2 hash
+ * ("jhash"), which is fast on 32-bit words and, with a secret seed,
+ * does not let a remote host predict which bucket a flow falls into.
+ */
+
+#define ZKHASH_GOLDEN	0x9e3779b9	/**< The golden ratio; an arbitrary value */
+
+#define __ZKHASH_MIX(a, b, c) \
+{ \
+	a -= b; a -= c; a ^= (c >> 13); \
+	b -= c; b -= a; b ^= (a << 8); \
+	c -= a; c -= b; c ^= (b >> 13); \
+	a -= b; a -= c; a ^= (c >> 12); \
+	b -= c; b -= a; b ^= (a << 16); \
+	c -= a; c -= b; c ^= (b >> 5); \
+	a -= b; a -= c; a ^= (c >> 3); \
+	b -= c; b -= a; b ^= (a << 10); \
+	c -= a; c -= b; c ^= (b >> 15); \
+}
+
+extern uint32_t		zk_hashseed;	/**< Random seed chosen at module load */
+
+/* zkhash_3words(): Hash three 32-bit words with the boot seed */
+
+static inline uint32_t zkhash_3words(uint32_t a, uint32_t b, uint32_t c)
+{
+	a += ZKHASH_GOLDEN;
+	b += ZKHASH_GOLDEN;
+	c += zk_hashseed;
+
+	__ZKHASH_MIX(a, b, c);
+
+	return c;
+}
+
+/* zkhash_tuple(): Hash the 5-tuple of a classification id.
+ * Addresses and ports are put in order before mixing so that both
+ * directions of a flow give the same value. The interface id is left out
+ * because the two directions of a forwarded flow arrive on different
+ * interfaces.
+ */
+
+static inline uint32_t zkhash_tuple(const uint32_t id[])
+{
+	uint32_t	a, b, c;
+
+	if (id[DIM_SRCADDR] < id[DIM_DSTADDR]) {
+		a = id[DIM_SRCADDR];
+		b = id[DIM_DSTADDR];
+	}
+	else {
+		a = id[DIM_DSTADDR];
+		b = id[DIM_SRCADDR];
+	}
+
+	a += ZKHASH_GOLDEN;
+	b += ZKHASH_GOLDEN;
+	c = zk_hashseed;
+
+	__ZKHASH_MIX(a, b, c);
+
+	/* id[DIM_*PORT] carry the protocol in the high half */
+	if (id[DIM_SRCPORT] < id[DIM_DSTPORT]) {
+		a += id[DIM_SRCPORT];
+		b += id[DIM_DSTPORT];
+	}
+	else {
+		a += id[DIM_DSTPORT];
+		b += id[DIM_SRCPORT];
+	}
+
+	c += 16;	/* length of the key in bytes */
+
+	__ZKHASH_MIX(a, b, c);
+
+	return c;
+}
+
+#endif	/* __ZKHASH_H__ */
@@ -29,22 +29,870 @@
 
 #define __NO_VERSION__
 
-DECLARE_RWLOCK(nat_lock);	/* A lock with NAT root and static NAT rule */
+#include <linux/kernel.h>			/* printk() */
+#include <linux/errno.h>			/* ENOMEM, ENOSPC */
+#include <linux/smp.h>				/* smp_processor_id() */
+#include <linux/interrupt.h>		/* local_bh_disable() */
+#include <linux/vmalloc.h>			/* vmalloc(), vfree() */
+#include <linux/skbuff.h>			/* sk_buff */
+#include <linux/ip.h>				/* iphdr */
+#include <linux/tcp.h>				/* tcphdr */
+#include <linux/udp.h>				/* udphdr */
+#include <linux/icmp.h>				/* icmphdr, ICMP_* */
+#include <linux/in.h>				/* IPPROTO_* */
+#include <linux/netfilter.h>		/* NF_ACCEPT, NF_DROP */
+#include <linux/netfilter_ipv4/lockhelp.h>	/* *_LOCK, *_UNLOCK */
+#include <asm/bitops.h>				/* ffz() */
+
+#include "zelkova.h"
+#include "zkfilter.h"				/* spd_lock */
+#include "zknat.h"
+
+zkspd_t		staticnat[2];	/* static NAT rule (guarded by spd_lock) */
+zknatmap_t	*natmap[2];		/* 1:1 NAT mappings per table (guarded by spd_lock) */
+
+static void zknapt_reserve(zknapt_t *np, zknaptcpu_t *pc);
+
+
+/**
+ *---------------------------------------------------------------------------
+ *
+ * @fn     int zknapt_init(zknat_t *nat)
+ * @brief  Make the NAPT port allocator of a NAT rule
+ * @param  nat: NAT rule with nat_xaddr[] and nat_xport[] ranges
+ * @return 0 if normal, <0 if abnormal.
+ * @date   18 Oct, 2026
+ * @see    zknapt_clean(), zknapt_alloc()
+ *
+ *  Make a free port bitmap for every address of nat_xaddr[] over the ports
+ *  of nat_xport[]. A rule without a port range (1:1 NAT or address only
+ *  NAT) gets no allocator and nat_napt stays NULL.
+ *
+ *---------------------------------------------------------------------------
+ */
+
+int zknapt_init(zknat_t *nat)
+{
+	zknapt_t		*np;
+	uint32_t		naddr, nport;
+	uint32_t		w, b;
+
+	nat->nat_napt = NULL;
+
+	if ((nat->nat_flag & NAT_ONETOONE) || nat->nat_xport[0] == 0 ||
+			nat->nat_xport[1] < nat->nat_xport[0] || nat->nat_xaddr[1] < nat->nat_xaddr[0]) {
+		return 0;
+	}
+
+	naddr = nat->nat_xaddr[1] - nat->nat_xaddr[0] + 1;
+	nport = nat->nat_xport[1] - nat->nat_xport[0] + 1;
+
+	if (naddr == 0 || naddr > ZKNAPT_MAXADDR) {
+		return -EINVAL;
+	}
+
+	if ((np = (zknapt_t *)vmalloc(sizeof(zknapt_t))) == NULL) {
+		return -ENOMEM;
+	}
+
+	memset(np, 0x00, sizeof(zknapt_t));
+
+	spin_lock_init(&np->np_lock);
+
+	np->np_addr		= nat->nat_xaddr[0];
+	np->np_port		= nat->nat_xport[0];
+	np->np_nport	= nport;
+	np->np_naddr	= naddr;
+	np->np_wpa		= (nport + ZKNAPT_WORDBITS - 1) / ZKNAPT_WORDBITS;
+	np->np_nword	= np->np_wpa * naddr;
+
+	if ((np->np_map = (uint32_t *)vmalloc(sizeof(uint32_t) * np->np_nword)) == NULL) {
+		vfree(np);
+		return -ENOMEM;
+	}
+
+	memset(np->np_map, 0x00, sizeof(uint32_t) * np->np_nword);
+
+	/* Ports beyond the range in the last word of each address */
+
+	if ((nport % ZKNAPT_WORDBITS) != 0) {
+		for (w = np->np_wpa - 1; w < np->np_nword; w += np->np_wpa) {
+			for (b = nport % ZKNAPT_WORDBITS; b < ZKNAPT_WORDBITS; b++) {
+				np->np_map[w] |= (1U << b);
+			}
+		}
+	}
+
+	nat->nat_napt = np;
+
+	return 0;
+}
+
+
+/**
+ *---------------------------------------------------------------------------
+ *
+ * @fn     void zknapt_clean(zknat_t *nat)
+ * @brief  Destroy the NAPT port allocator of a NAT rule
+ * @param  nat: NAT rule
+ * @return NONE
+ * @date   18 Oct, 2026
+ * @see    zknapt_init()
+ *
+ *  Destroy the NAPT port allocator of a NAT rule.
+ *  NOTE: No packet may be translated with the rule any more.
+ *
+ *---------------------------------------------------------------------------
+ */
+
+void zknapt_clean(zknat_t *nat)
+{
+	zknapt_t		*np = nat->nat_napt;
+
+	if (np == NULL) {
+		return;
+	}
+
+	vfree(np->np_map);
+	vfree(np);
+
+	nat->nat_napt = NULL;
+}
+
+
+/**
+ *---------------------------------------------------------------------------
+ *
+ * @fn     static void zknapt_reserve(zknapt_t *np, zknaptcpu_t *pc)
+ * @brief  Reserve a block of free ports for a CPU
+ * @param  np: NAPT port allocator
+ * @param  pc: reservation block of the CPU, whose pc_free is 0
+ * @return NONE
+ * @date   18 Oct, 2026
+ * @see    zknapt_alloc()
+ *
+ *  Search the bitmap from the cursor for a word with a free port, and
+ *  move all the free ports of the word into the block of the CPU.
+ *  Full words are skipped a word at a time, and the cursor rotates so
+ *  that the search starts past the ports handed out recently.
+ *  pc_free stays 0 if the pool ran out.
+ *  NOTE: The caller has to hold np_lock.
+ *
+ *---------------------------------------------------------------------------
+ */
+
+static void zknapt_reserve(zknapt_t *np, zknaptcpu_t *pc)
+{
+	uint32_t		w = np->np_cursor;
+	uint32_t		n;
+
+	for (n = 0; n < np->np_nword; n++) {
+		if (np->np_map[w] != ~0U) {
+			pc->pc_word = w;
+			pc->pc_free = ~np->np_map[w];
+
+			np->np_map[w] = ~0U;
+			np->np_cursor = (w + 1 < np->np_nword) ? w + 1 : 0;
+
+			return;
+		}
+
+		if (++w == np->np_nword) {
+			w = 0;
+		}
+	}
+}
+
+
+/**
+ *---------------------------------------------------------------------------
+ *
+ * @fn     int zknapt_alloc(zknat_t *nat, uint32_t *addr, uint16_t *port)
+ * @brief  Allocate a translated address and port
+ * @param  nat: NAT rule
+ * @param  addr: (out) translated address (host order)
+ * @param  port: (out) translated port (host order)
+ * @return 0 if normal, -ENOSPC if the pool ran out.
+ * @date   18 Oct, 2026
+ * @see    zknapt_free()
+ *
+ *  Hand out a free port from the reservation block of this CPU. np_lock
+ *  is only taken when the block is empty and a new one is reserved, so
+ *  new flows on different CPUs do not contend for the bitmap.
+ *
+ *---------------------------------------------------------------------------
+ */
+
+int zknapt_alloc(zknat_t *nat, uint32_t *addr, uint16_t *port)
+{
+	zknapt_t		*np = nat->nat_napt;
+	zknaptcpu_t		*pc;
+	uint32_t		w, b;
+
+	if (np == NULL) {
+		return -ENOSPC;
+	}
+
+	local_bh_disable();
+
+	pc = &np->np_cpu[smp_processor_id()];
+
+	if (pc->pc_free == 0) {
+		spin_lock(&np->np_lock);
+
+		zknapt_reserve(np, pc);
+
+		if (pc->pc_free == 0) {
+			np->np_nexhaust++;
+			spin_unlock(&np->np_lock);
+			local_bh_enable();
+
+			return -ENOSPC;
+		}
+
+		spin_unlock(&np->np_lock);
+	}
+
+	b = ffz(~(unsigned long)pc->pc_free);
+	w = pc->pc_word;
+
+	pc->pc_free &= ~(1U << b);
+	pc->pc_nalloc++;
+
+	local_bh_enable();
+
+	*addr = np->np_addr + w / np->np_wpa;
+	*port = np->np_port + (w % np->np_wpa) * ZKNAPT_WORDBITS + b;
+
+	return 0;
+}
+
+
+/**
+ *---------------------------------------------------------------------------
+ *
+ * @fn     void zknapt_free(zknat_t *nat, uint32_t addr, uint16_t port)
+ * @brief  Return a translated address and port
+ * @param  nat: NAT rule
+ * @param  addr: translated address (host order)
+ * @param  port: translated port (host order)
+ * @return NONE
+ * @date   18 Oct, 2026
+ * @see    zknapt_alloc()
+ *
+ *  Clear the bit of a port handed out by zknapt_alloc(), so that it may
+ *  be reserved again. Ports out of the pool are ignored.
+ *
+ *---------------------------------------------------------------------------
+ */
+
+void zknapt_free(zknat_t *nat, uint32_t addr, uint16_t port)
+{
+	zknapt_t		*np = nat->nat_napt;
+	uint32_t		a, p;
+
+	if (np == NULL || addr < np->np_addr || port < np->np_port) {
+		return;
+	}
+
+	a = addr - np->np_addr;
+	p = port - np->np_port;
+
+	if (a >= np->np_naddr || p >= np->np_nport) {
+		return;
+	}
+
+	spin_lock_bh(&np->np_lock);
+
+	np->np_map[a * np->np_wpa + p / ZKNAPT_WORDBITS] &= ~(1U << (p % ZKNAPT_WORDBITS));
+	np->np_nfree++;
+
+	spin_unlock_bh(&np->np_lock);
+}
+
+
+/**
+ *---------------------------------------------------------------------------
+ *
+ * @fn     void zknapt_getstat(zknat_t *nat, zknaptstat_t *st)
+ * @brief  Get the counters of the NAPT port allocator of a NAT rule
+ * @param  nat: NAT rule
+ * @param  st: (out) counters, all 0 if the rule has no allocator
+ * @return NONE
+ * @date   18 Oct, 2026
+ * @see    zknapt_alloc(), zknapt_free()
+ *
+ *  Sum the allocations of every CPU. The ports in use are those handed
+ *  out and not returned yet; the ports reserved by a CPU but not handed
+ *  out are not counted.
+ *
+ *---------------------------------------------------------------------------
+ */
+
+void zknapt_getstat(zknat_t *nat, zknaptstat_t *st)
+{
+	zknapt_t		*np = nat->nat_napt;
+	int				i;
+
+	memset(st, 0x00, sizeof(zknaptstat_t));
+
+	if (np == NULL) {
+		return;
+	}
+
+	spin_lock_bh(&np->np_lock);
+
+	for (i = 0; i < NR_CPUS; i++) {
+		st->nps_nalloc += np->np_cpu[i].pc_nalloc;
+	}
+
+	st->nps_nport		= np->np_naddr * np->np_nport;
+	st->nps_inuse		= st->nps_nalloc - np->np_nfree;
+	st->nps_nexhaust	= np->np_nexhaust;
+
+	spin_unlock_bh(&np->np_lock);
+}
+
+
+/**
+ *---------------------------------------------------------------------------
+ *
+ * @fn     static int zknat_rewritesum(struct sk_buff *skb, int out, int snat, uint32_t addr, uint16_t port, uint32_t sum)
+ * @brief  Translate the address and the port of a packet
+ * @param  skb: packet
+ * @param  out: outbound = 1, inbound = 0
+ * @param  snat: rewrite the source if 1, the destination if 0
+ * @param  addr: translated address (network order)
+ * @param  port: translated port (network order), 0 to leave the port alone
+ * @param  sum: checksum difference of the address (zknat_csumdiff()),
+ *              computed in advance by the caller
+ * @return 0 if normal, -1 if the packet can not be rewritten.
+ * @date   18 Oct, 2026
+ * @see    zknat_csumadj()
+ *
+ *  Rewrite the address and the port, and adjust the checksums by the
+ *  differences of the rewritten words in the way of RFC 1624, so that
+ *  the payload is never summed again.
+ *  Outbound packets of CHECKSUM_HW have their TCP/UDP checksum filled by
+ *  the NIC, which sums the segment itself; the checksum field holds the
+ *  pseudo header sum until then, so only the address goes into it.
+ *  Inbound packets of CHECKSUM_HW keep the sum of the NIC in skb->csum,
+ *  which is adjusted for the rewritten words of the segment.
+ *
+ *---------------------------------------------------------------------------
+ */
+
+static int zknat_rewritesum(struct sk_buff *skb, int out, int snat, uint32_t addr, uint16_t port, uint32_t sum)
+{
+	struct iphdr	*iph = skb->nh.iph;
+	int				ihl = iph->ihl << 2;
+	uint16_t		*check = NULL, *pp = NULL;
+	uint16_t		ocheck, oport;
+	uint32_t		*ap;
+	uint32_t		l4sum;
+
+	/* The packet is shared with someone else */
+	if (skb_cloned(skb)) {
+		return -1;
+	}
+
+	/* Only the first fragment has the TCP/UDP header */
+	if ((iph->frag_off & htons(IP_OFFSET)) == 0) {
+		if (iph->protocol == IPPROTO_TCP) {
+			if (skb_headlen(skb) < ihl + sizeof(struct tcphdr)) {
+				return -1;
+			}
+
+			check = &((struct tcphdr *)((uint8_t *)iph + ihl))->check;
+			pp = snat ? &((struct tcphdr *)((uint8_t *)iph + ihl))->source :
+				&((struct tcphdr *)((uint8_t *)iph + ihl))->dest;
+		}
+		else if (iph->protocol == IPPROTO_UDP) {
+			if (skb_headlen(skb) < ihl + sizeof(struct udphdr)) {
+				return -1;
+			}
+
+			check = &((struct udphdr *)((uint8_t *)iph + ihl))->check;
+			pp = snat ? &((struct udphdr *)((uint8_t *)iph + ihl))->source :
+				&((struct udphdr *)((uint8_t *)iph + ihl))->dest;
+		}
+	}
+
+	/* IP header */
+
+	ap = snat ? &iph->saddr : &iph->daddr;
+
+	*ap = addr;
+	iph->check = zknat_csumadj(iph->check, zknat_csumfold(sum));
+
+	if (check == NULL) {
+		return 0;
+	}
+
+	/* TCP/UDP header */
+
+	ocheck	= *check;
+	oport	= *pp;
+
+	if (port == 0) {
+		port = oport;
+	}
+
+	l4sum = sum + zknat_csumdiff16(oport, port);
+
+	if (out && skb->ip_summed == CHECKSUM_HW) {
+		/* Left to the NIC: the field is not complemented yet */
+		*check = zknat_csumfold(*check + zknat_csumfold(sum));
+	}
+	else if (iph->protocol == IPPROTO_TCP || *check != 0) {
+		/* A UDP checksum of 0 means that there is no checksum */
+		*check = zknat_csumadj(*check, zknat_csumfold(l4sum));
+
+		if (iph->protocol == IPPROTO_UDP && *check == 0) {
+			*check = 0xffff;
+		}
+	}
+
+	*pp = port;
+
+	if (!out && skb->ip_summed == CHECKSUM_HW) {
+		skb->csum = zknat_csumadd(skb->csum,
+				zknat_csumdiff16(ocheck, *check) + zknat_csumdiff16(oport, port));
+	}
+
+	return 0;
+}
+
+
+/* zknatmap_pullable(): Whether a NAT rule is a 1:1 mapping which matches
+ * nothing but the address to be translated.
+ */
+
+static inline int zknatmap_pullable(fisrule_t *rule, zknat_t *zn)
+{
+	int		d;
+
+	if (rule->cost <= 0 || !(zn->nat_flag & NAT_ONETOONE) ||
+			(zn->nat_flag & NAT_ELIMINATED)) {
+		return 0;
+	}
+
+	/* Other fields can not be told from the address alone */
+	for (d = 0; d < MAX_FISTREE_DIM; d++) {
+		if (d != DIM_SRCADDR && !(rule->field[d].type & INTERVAL_ANYTOANY)) {
+			return 0;
+		}
+	}
+
+	return zn->nat_oaddr[1] >= zn->nat_oaddr[0] && zn->nat_xaddr[1] >= zn->nat_xaddr[0];
+}
+
+
+/**
+ *---------------------------------------------------------------------------
+ *
+ * @fn     zknatmap_t *zknatmap_make(zkspd_t *nat)
+ * @brief  Pull the 1:1 NAT mappings out of a table of NAT rules
+ * @param  nat: NAT rules, not installed yet
+ * @return Returns the mappings, NULL if there is none or abnormal.
+ * @date   18 Oct, 2026
+ * @see    zknatmap_clean(), zknat_onetoone()
+ *
+ *  Make hash tables of the NAT_ONETOONE rules which match nothing but the
+ *  address to be translated, so that they are translated by an address
+ *  lookup without the FIS-tree and without a session. Every address of
+ *  nat_oaddr[] is mapped to the address of nat_xaddr[] at the same offset.
+ *  Rules are visited by ascending cost, so the better rule wins when two
+ *  rules map the same address.
+ *  The pulled rules are removed from the table, so that the FIS-tree made
+ *  of it does not carry them as well. The table is left alone if NULL is
+ *  returned.
+ *
+ *---------------------------------------------------------------------------
+ */
+
+zknatmap_t *zknatmap_make(zkspd_t *nat)
+{
+	zknatmap_t		*nm;
+	zknatmapent_t	*ne, **pp;
+	zknat_t			*zn;
+	fisrule_t		*rule;
+	uint32_t		nmap = 0, n, size;
+	uint32_t		i, j, k;
+
+	/* Count the mappings first */
+
+	for (i = 0; i < nat->spd_nelem; i++) {
+		rule = &nat->spd_table[i];
+		zn = &nat->spd_nat[i];
+
+		if (!zknatmap_pullable(rule, zn)) {
+			continue;
+		}
+
+		n = min(zn->nat_oaddr[1] - zn->nat_oaddr[0], zn->nat_xaddr[1] - zn->nat_xaddr[0]) + 1;
+		nmap += min(n, ZKNATMAP_MAX);
+	}
+
+	if (nmap == 0) {
+		return NULL;
+	}
+
+	nmap = min(nmap, ZKNATMAP_MAX);
+
+	for (size = 1; size < nmap; size <<= 1)
+		;
+
+	if ((nm = (zknatmap_t *)vmalloc(sizeof(zknatmap_t))) == NULL) {
+		return NULL;
+	}
+
+	memset(nm, 0x00, sizeof(zknatmap_t));
+
+	nm->nm_mask		= size - 1;
+	nm->nm_hash[0]	= (zknatmapent_t **)vmalloc(sizeof(zknatmapent_t *) * size);
+	nm->nm_hash[1]	= (zknatmapent_t **)vmalloc(sizeof(zknatmapent_t *) * size);
+	nm->nm_ent		= (zknatmapent_t *)vmalloc(sizeof(zknatmapent_t) * nmap * 2);
+
+	if (nm->nm_hash[0] == NULL || nm->nm_hash[1] == NULL || nm->nm_ent == NULL) {
+		zknatmap_clean(nm);
+		return NULL;
+	}
+
+	memset(nm->nm_hash[0], 0x00, sizeof(zknatmapent_t *) * size);
+	memset(nm->nm_hash[1], 0x00, sizeof(zknatmapent_t *) * size);
+
+	/* Fill the entries in the same order as they were counted, and move
+	 * the rules which are kept down over the pulled ones */
+
+	for (i = 0, k = 0; i < nat->spd_nelem; i++) {
+		rule = &nat->spd_table[i];
+		zn = &nat->spd_nat[i];
+
+		n = 0;
+		if (zknatmap_pullable(rule, zn)) {
+			n = min(zn->nat_oaddr[1] - zn->nat_oaddr[0], zn->nat_xaddr[1] - zn->nat_xaddr[0]) + 1;
+		}
+
+		/* A rule whose mappings do not fit any more stays in the table */
+		if (n == 0 || n > nmap - nm->nm_nent / 2) {
+			if (k != i) {
+				nat->spd_table[k] = *rule;
+				nat->spd_nat[k] = *zn;
+			}
+
+			nat->spd_table[k].action = &nat->spd_nat[k];
+			nat->spd_nat[k].nat_rule = &nat->spd_table[k];
+			k++;
+			continue;
+		}
+
+		for (j = 0; j < n; j++) {
+			/* Outbound: the original address to the translated one */
+			ne = &nm->nm_ent[nm->nm_nent++];
+			ne->ne_from		= htonl(zn->nat_oaddr[0] + j);
+			ne->ne_to		= htonl(zn->nat_xaddr[0] + j);
+			ne->ne_delta	= zknat_csumfold(zknat_csumdiff(ne->ne_from, ne->ne_to));
+
+			pp = &nm->nm_hash[ZKNATMAP_OUT][ZKNATMAP_BUCKET(nm, ne->ne_from)];
+			ne->ne_next = *pp;
+			*pp = ne;
+
+			/* Inbound: the other way around */
+			ne = &nm->nm_ent[nm->nm_nent++];
+			ne->ne_from		= htonl(zn->nat_xaddr[0] + j);
+			ne->ne_to		= htonl(zn->nat_oaddr[0] + j);
+			ne->ne_delta	= zknat_csumfold(zknat_csumdiff(ne->ne_from, ne->ne_to));
+
+			pp = &nm->nm_hash[ZKNATMAP_IN][ZKNATMAP_BUCKET(nm, ne->ne_from)];
+			ne->ne_next = *pp;
+			*pp = ne;
+		}
+
+		/* The address set of the source is not needed any more */
+		if (rule->field[DIM_SRCADDR].type == INTERVAL_RANGESET &&
+				rule->field[DIM_SRCADDR].r.set.nelem > 0) {
+			KFREES(rule->field[DIM_SRCADDR].r.set.table);
+		}
+	}
+
+	nat->spd_nelem = k;
+
+	/* zkspd_clean() does not look at an empty table */
+	if (k == 0) {
+		KFREES(nat->spd_table);
+		KFREES(nat->spd_nat);
+		nat->spd_table	= NULL;
+		nat->spd_nat	= NULL;
+	}
+
+	/* Entries are pushed on the head of the chain, so the better rule
+	 * has to be found first: reverse every chain. */
+
+	for (k = 0; k < 2; k++) {
+		for (i = 0; i < size; i++) {
+			zknatmapent_t	*prev = NULL, *next;
+
+			for (ne = nm->nm_hash[k][i]; ne != NULL; ne = next) {
+				next = ne->ne_next;
+				ne->ne_next = prev;
+				prev = ne;
+			}
+
+			nm->nm_hash[k][i] = prev;
+		}
+	}
+
+	return nm;
+}
+
+
+/**
+ *---------------------------------------------------------------------------
+ *
+ * @fn     void zknatmap_clean(zknatmap_t *nm)
+ * @brief  Destroy 1:1 NAT mappings
+ * @param  nm: mappings made by zknatmap_make()
+ * @return NONE
+ * @date   18 Oct, 2026
+ * @see    zknatmap_make()
+ *
+ *  Destroy 1:1 NAT mappings
+ *
+ *---------------------------------------------------------------------------
+ */
+
+void zknatmap_clean(zknatmap_t *nm)
+{
+	if (nm == NULL) {
+		return;
+	}
+
+	if (nm->nm_hash[0] != NULL) {
+		vfree(nm->nm_hash[0]);
+	}
+
+	if (nm->nm_hash[1] != NULL) {
+		vfree(nm->nm_hash[1]);
+	}
+
+	if (nm->nm_ent != NULL) {
+		vfree(nm->nm_ent);
+	}
+
+	vfree(nm);
+}
+
+
+/* zknatmap_find(): Mapping of an address in the direction k (ZKNATMAP_*).
+ * The redirect NAT rules win over the normal ones.
+ * NOTE: spd_lock has to be held.
+ */
+
+static inline zknatmapent_t *zknatmap_find(int k, uint32_t addr)
+{
+	zknatmap_t		*nm;
+	zknatmapent_t	*ne;
+	int				i;
+
+	for (i = NAT_REDIR; i <= NAT_NORMAL; i++) {
+		if ((nm = natmap[i]) == NULL) {
+			continue;
+		}
+
+		for (ne = nm->nm_hash[k][ZKNATMAP_BUCKET(nm, addr)]; ne != NULL; ne = ne->ne_next) {
+			if (ne->ne_from == addr) {
+				return ne;
+			}
+		}
+	}
+
+	return NULL;
+}
+
+
+/* zknat_icmpinner(): IP header of the datagram quoted by an ICMP error,
+ * NULL if the packet is not an ICMP error or the header is not in the
+ * linear area.
+ */
+
+static struct iphdr *zknat_icmpinner(struct sk_buff *skb)
+{
+	struct iphdr	*iph = skb->nh.iph;
+	struct icmphdr	*icmph;
+	struct iphdr	*inner;
+	int				off = (iph->ihl << 2) + sizeof(struct icmphdr);
+
+	if (iph->protocol != IPPROTO_ICMP || (iph->frag_off & htons(IP_OFFSET)) != 0 ||
+			skb_headlen(skb) < ((uint8_t *)iph - skb->data) + off + sizeof(struct iphdr)) {
+		return NULL;
+	}
+
+	icmph = (struct icmphdr *)((uint8_t *)iph + (iph->ihl << 2));
+
+	switch (icmph->type) {
+	case ICMP_DEST_UNREACH:
+	case ICMP_SOURCE_QUENCH:
+	case ICMP_REDIRECT:
+	case ICMP_TIME_EXCEEDED:
+	case ICMP_PARAMETERPROB:
+		break;
+
+	default:
+		return NULL;
+	}
+
+	inner = (struct iphdr *)(icmph + 1);
+
+	if (inner->ihl < 5 ||
+			skb_headlen(skb) < ((uint8_t *)iph - skb->data) + off + (inner->ihl << 2)) {
+		return NULL;
+	}
+
+	return inner;
+}
 
-void	*natroot[2];	/* NAT FIS-tree root */
 
 /**
  *---------------------------------------------------------------------------
  *
- * @fn     int func1(void)
- * @brief  Modify checksums of outbound packets
- * @param  NONE
- * @return >=0 if normal, <0 if abnormal.
- * @date   25 Jul, 2005
- * @see    NONE
+ * @fn     static void zknat_rewriteinner(struct sk_buff *skb, struct iphdr *inner, int out, zknatmapent_t *ne)
+ * @brief  Translate the datagram quoted by an ICMP error
+ * @param  skb: ICMP error, not shared
+ * @param  inner: quoted IP header (zknat_icmpinner())
+ * @param  out: outbound = 1, inbound = 0
+ * @param  ne: mapping of the quoted address
+ * @return NONE
+ * @date   18 Oct, 2026
+ * @see    zknat_onetoone()
  *
- *  Detailed description
+ *  The quoted datagram went the other way, so its destination is
+ *  translated on the way out and its source on the way in, with the same
+ *  mappings as the header of the error. Its IP checksum is adjusted
+ *  along, which keeps the sum of the quoted header and so leaves the ICMP
+ *  checksum alone; only the change of a quoted TCP/UDP checksum has to be
+ *  carried into it. The sum of the ICMP message as a whole does not
+ *  change, so neither does skb->csum.
  *
  *---------------------------------------------------------------------------
  */
 
+static void zknat_rewriteinner(struct sk_buff *skb, struct iphdr *inner, int out, zknatmapent_t *ne)
+{
+	struct icmphdr	*icmph = (struct icmphdr *)inner - 1;
+	int				ihl = inner->ihl << 2;
+	int				avail = skb_headlen(skb) - ((uint8_t *)inner - skb->data) - ihl;
+	uint16_t		*check = NULL, ocheck;
+
+	/* ICMP errors quote only the first 8 bytes past the IP header,
+	 * which covers the UDP checksum but seldom the TCP one */
+	if ((inner->frag_off & htons(IP_OFFSET)) == 0) {
+		if (inner->protocol == IPPROTO_TCP &&
+				avail >= offsetof(struct tcphdr, check) + sizeof(uint16_t)) {
+			check = &((struct tcphdr *)((uint8_t *)inner + ihl))->check;
+		}
+		else if (inner->protocol == IPPROTO_UDP && avail >= sizeof(struct udphdr)) {
+			check = &((struct udphdr *)((uint8_t *)inner + ihl))->check;
+
+			/* A UDP checksum of 0 means that there is no checksum */
+			if (*check == 0) {
+				check = NULL;
+			}
+		}
+	}
+
+	if (out) {
+		inner->daddr = ne->ne_to;
+	}
+	else {
+		inner->saddr = ne->ne_to;
+	}
+
+	inner->check = zknat_csumadj(inner->check, ne->ne_delta);
+
+	if (check == NULL) {
+		return;
+	}
+
+	ocheck = *check;
+	*check = zknat_csumadj(*check, ne->ne_delta);
+
+	if (inner->protocol == IPPROTO_UDP && *check == 0) {
+		*check = 0xffff;
+	}
+
+	icmph->checksum = zknat_csumadj(icmph->checksum,
+			zknat_csumfold(zknat_csumdiff16(ocheck, *check)));
+}
+
+
+/**
+ *---------------------------------------------------------------------------
+ *
+ * @fn     unsigned int zknat_onetoone(struct sk_buff **pskb, int out)
+ * @brief  Translate a packet by the 1:1 NAT mappings
+ * @param  pskb: packet, which may be replaced by a private copy
+ * @param  out: outbound (source translation) = 1,
+ *              inbound (destination translation) = 0
+ * @return NF_ACCEPT, or NF_DROP if the packet could not be translated.
+ * @date   18 Oct, 2026
+ * @see    zknatmap_make(), zknat_rewritesum(), zknat_rewriteinner()
+ *
+ *  Look up the address in the hash table of the direction, and rewrite it
+ *  with the checksum difference of the entry. The datagram quoted by an
+ *  ICMP error is translated as well. The translation is stateless, so no
+ *  session is made for it.
+ *
+ *---------------------------------------------------------------------------
+ */
+
+unsigned int zknat_onetoone(struct sk_buff **pskb, int out)
+{
+	struct sk_buff	*skb = *pskb;
+	struct iphdr	*inner;
+	zknatmapent_t	*ne, *ie = NULL;
+	unsigned int	verdict = NF_ACCEPT;
+
+	/* Most systems have no 1:1 mapping: do not touch the lock for them */
+	if (natmap[NAT_REDIR] == NULL && natmap[NAT_NORMAL] == NULL) {
+		return NF_ACCEPT;
+	}
+
+	READ_LOCK(&spd_lock);
+
+	ne = zknatmap_find(!out, out ? skb->nh.iph->saddr : skb->nh.iph->daddr);
+
+	if ((inner = zknat_icmpinner(skb)) != NULL) {
+		ie = zknatmap_find(!out, out ? inner->daddr : inner->saddr);
+	}
+
+	if (ne == NULL && ie == NULL) {
+		READ_UNLOCK(&spd_lock);
+		return NF_ACCEPT;
+	}
+
+	/* The packet is shared with someone else, so take a copy */
+	if (skb_cloned(skb)) {
+		if ((skb = skb_copy(*pskb, GFP_ATOMIC)) == NULL) {
+			READ_UNLOCK(&spd_lock);
+			return NF_DROP;
+		}
+
+		kfree_skb(*pskb);
+		*pskb = skb;
+
+		inner = zknat_icmpinner(skb);
+	}
+
+	if (ne != NULL && zknat_rewritesum(skb, out, out, ne->ne_to, 0, ne->ne_delta) < 0) {
+		verdict = NF_DROP;
+	}
+
+	if (ie != NULL && inner != NULL) {
+		zknat_rewriteinner(skb, inner, out, ie);
+	}
+
+	READ_UNLOCK(&spd_lock);
+
+	return verdict;
+}
@@ -31,6 +31,7 @@
 #define __ZKNAT_H__
 
 #include "zelkova.h"
+#include "zkhash.h"
 
 /* zknat_t */
 
@@ -44,6 +45,8 @@ typedef struct zknat {
 	uint16_t		nat_xport[2];	/* Port num after trans. (BEGIN, END) (host order) */
 
 	uint32_t		nat_flag;		/* Flags */
+
+	struct zknapt	*nat_napt;		/* NAPT port allocator (kernel only) */
 } zknat_t;
 
 /* zknat_t::nat_flag */
@@ -54,18 +57,157 @@ typedef struct zknat {
 #define NAT_ELIMINATED	0x00000020	/* Rule in order to eliminate a NAT rule */
 #define NAT_REVERSE		0x00000040	/* Reverse NAT */
 
+/* zknaptstat_t
+ * :Counters of a NAPT port allocator
+ */
+
+typedef struct zknaptstat {
+	uint32_t		nps_nport;		/* ports of the pool (addresses * ports) */
+	uint32_t		nps_inuse;		/* ports handed out */
+	uint32_t		nps_nalloc;		/* successful allocations */
+	uint32_t		nps_nexhaust;	/* allocations refused since the pool ran out */
+} zknaptstat_t;
+
+/* zknat_csumdiff(): One's complement difference of two 32-bit words
+ * in the way of RFC 1624, not folded yet.
+ */
+
+static inline uint32_t zknat_csumdiff(uint32_t from, uint32_t to)
+{
+	return (uint16_t)~(from >> 16) + (uint16_t)~(from & 0xffff) +
+		(to >> 16) + (to & 0xffff);
+}
+
+/* zknat_csumdiff16(): One's complement difference of two 16-bit words */
+
+static inline uint32_t zknat_csumdiff16(uint16_t from, uint16_t to)
+{
+	return (uint16_t)~from + to;
+}
+
+/* zknat_csumfold(): Fold a 32-bit sum into 16 bits */
+
+static inline uint16_t zknat_csumfold(uint32_t sum)
+{
+	sum = (sum & 0xffff) + (sum >> 16);
+	sum = (sum & 0xffff) + (sum >> 16);
+
+	return (uint16_t)sum;
+}
+
+/* zknat_csumadj(): Apply a precomputed difference to a checksum */
+
+static inline uint16_t zknat_csumadj(uint16_t check, uint16_t delta)
+{
+	return (uint16_t)~zknat_csumfold((uint16_t)~check + delta);
+}
+
+/* zknat_csumadd(): Add a difference to an unfolded 32-bit sum (skb->csum) */
+
+static inline uint32_t zknat_csumadd(uint32_t sum, uint32_t delta)
+{
+	sum += delta;
+
+	return sum + (sum < delta);
+}
+
+#define ZKNAPT_MAXADDR		1024		/**< Translated addresses of a NAPT pool */
+#define ZKNAPT_WORDBITS		32			/**< Ports of a bitmap word (a reservation block) */
+
 #ifdef __KERNEL__
-DECLARE_RWLOCK_EXTERN(nat_lock);
+#include <linux/spinlock.h>			/* spinlock_t */
+
+/* zknaptcpu_t
+ * :Reservation block of one CPU. The ports of pc_free are marked in use in
+ *  the shared bitmap, so only this CPU hands them out, without the lock.
+ */
+
+typedef struct zknaptcpu {
+	uint32_t		pc_word;		/* bitmap word the block came from */
+	uint32_t		pc_free;		/* ports of the word not handed out yet */
+	uint32_t		pc_nalloc;		/* allocations on this CPU */
+} ____cacheline_aligned zknaptcpu_t;
+
+/* zknapt_t
+ * :Free port bitmap of a NAPT rule. Each translated address owns
+ *  np_wpa words, one bit per port; the bits beyond the port range stay set.
+ */
+
+typedef struct zknapt {
+	spinlock_t		np_lock;		/* A lock with np_map and np_cursor */
+	uint32_t		*np_map;		/* bitmap, a set bit is a port in use */
+	uint32_t		np_nword;		/* words of np_map */
+	uint32_t		np_wpa;			/* words per translated address */
+	uint32_t		np_cursor;		/* word where the next search starts */
+
+	uint32_t		np_addr;		/* the first translated address (host order) */
+	uint16_t		np_port;		/* the first translated port (host order) */
+	uint16_t		np_nport;		/* ports per address */
+	uint32_t		np_naddr;		/* number of translated addresses */
+
+	uint32_t		np_nfree;		/* ports returned (under np_lock) */
+	uint32_t		np_nexhaust;	/* refused allocations (under np_lock) */
+
+	zknaptcpu_t		np_cpu[NR_CPUS];	/* reservation blocks per CPU */
+} zknapt_t;
+
+/* zknatmapent_t
+ * :A mapping of 1:1 NAT. Every mapping has two entries, one keyed by
+ *  the original address for outbound packets and one keyed by the
+ *  translated address for inbound packets.
+ */
+
+typedef struct zknatmapent {
+	struct zknatmapent	*ne_next;	/* The next node of hash chain */
+	uint32_t		ne_from;		/* address to be translated (network order) */
+	uint32_t		ne_to;			/* address after trans. (network order) */
+	uint16_t		ne_delta;		/* checksum difference from ne_from to ne_to */
+	uint16_t		ne_reserved;	/* NOT USED */
+} zknatmapent_t;
+
+/* zknatmap_t
+ * :Hash tables of the 1:1 NAT mappings, pulled out of a table of NAT
+ *  rules by zknatmap_make(). Guarded by spd_lock.
+ */
+
+typedef struct zknatmap {
+	zknatmapent_t	**nm_hash[2];	/* buckets (ZKNATMAP_OUT, ZKNATMAP_IN) */
+	zknatmapent_t	*nm_ent;		/* entries */
+	uint32_t		nm_nent;		/* number of entries */
+	uint32_t		nm_mask;		/* number of buckets - 1 */
+} zknatmap_t;
+
+#define ZKNATMAP_OUT		0		/* keyed by the original address */
+#define ZKNATMAP_IN			1		/* keyed by the translated address */
+
+#define ZKNATMAP_MAX		65536	/**< Mappings of a zknatmap_t */
+
+#define ZKNATMAP_BUCKET(nm, addr)	(zkhash_3words((addr), 0, 0) & (nm)->nm_mask)
+
+extern zknatmap_t	*natmap[2];		/* 1:1 NAT mappings (NAT_REDIR, NAT_NORMAL) */
+
+struct sk_buff;
+
+zknatmap_t *zknatmap_make(zkspd_t *nat);
+void zknatmap_clean(zknatmap_t *nm);
+unsigned int zknat_onetoone(struct sk_buff **pskb, int out);
+int zknapt_init(zknat_t *nat);
+void zknapt_clean(zknat_t *nat);
+int zknapt_alloc(zknat_t *nat, uint32_t *addr, uint16_t *port);
+void zknapt_free(zknat_t *nat, uint32_t addr, uint16_t port);
+void zknapt_getstat(zknat_t *nat, zknaptstat_t *st);
 #endif	/* __KERNEL__ */
 
 
-/* natroot[0] : for redirect NAT
- * natroot[1] : for normal NAT
+/* staticnat[0] : for redirect NAT
+ * staticnat[1] : for normal NAT
+ * Both are looked up in the FIS-tree of spdroot (SPD_NATTABLE()),
+ * and guarded by spd_lock. Their 1:1 mappings are not in them but in
+ * natmap[] (zknatmap_make()).
  */
 #define NAT_REDIR		0	/* redirect NAT index */
 #define NAT_NORMAL		1	/* normal NAT index */
 
-extern void		*natroot[2];	/* NAT FIS-tree root */
 extern zkspd_t	staticnat[2];	/* static NAT rule */
 
 
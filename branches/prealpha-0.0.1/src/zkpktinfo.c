@@ -0,0 +1,201 @@
+/*
+ *----------------------------------------------------------------------------
+ *
+ * Zelkova - A Firewall and Intrusion Prevention System on Linux Kernel
+ *
+ * Copyright (C) 2005 Dongsu Park <advance@dongsu.pe.kr>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111, USA.
+ *
+ * $Id$
+ *----------------------------------------------------------------------------
+ */
+
+/** @file zkpktinfo.c
+ * Extracts the packet information which every stage of the datapath shares
+ */
+
+#define __NO_VERSION__
+
+#include <linux/kernel.h>			/* printk() */
+#include <linux/skbuff.h>			/* sk_buff, skb_copy_bits() */
+#include <linux/ip.h>				/* iphdr, IPOPT_* */
+#include <linux/in.h>				/* IPPROTO_* */
+#include <linux/netdevice.h>		/* net_device */
+
+#include "zelkova.h"
+#include "zkpktinfo.h"
+#include "zkhash.h"					/* zkhash_tuple() */
+
+/* zkpktinfo_ports(): Source and destination ports in network order.
+ * The ports are read in place when they are in the linear area, and
+ * copied out of the paged data otherwise. Both TCP and UDP keep them in
+ * the first four bytes of their headers.
+ */
+
+static inline uint16_t *zkpktinfo_ports(struct sk_buff *skb, int offset, uint16_t *buf)
+{
+	if (skb_headlen(skb) >= offset + 2 * sizeof(uint16_t)) {
+		return (uint16_t *)(skb->data + offset);
+	}
+
+	if (skb_copy_bits(skb, offset, buf, 2 * sizeof(uint16_t)) < 0) {
+		return NULL;
+	}
+
+	return buf;
+}
+
+
+/**
+ *---------------------------------------------------------------------------
+ *
+ * @fn     static int zkpktinfo_ipopt(const uint8_t *opt, int len, uint32_t *ipopt)
+ * @brief  Arrange the IP options of a packet
+ * @param  opt: first byte of the options
+ * @param  len: length of the options
+ * @param  ipopt: (out) ZPI_OPT_* of the options present
+ * @return 0 if normal, -1 if an option is malformed.
+ * @date   18 Oct, 2026
+ * @see    zkpktinfo_parse()
+ *
+ *  Walk the IP options once and record which of them are present, so
+ *  that no later stage has to look at them again.
+ *
+ *---------------------------------------------------------------------------
+ */
+
+static int zkpktinfo_ipopt(const uint8_t *opt, int len, uint32_t *ipopt)
+{
+	int		olen;
+
+	*ipopt = 0;
+
+	while (len > 0) {
+		switch (opt[0]) {
+		case IPOPT_END:
+			return 0;
+
+		case IPOPT_NOOP:
+			opt++;
+			len--;
+			continue;
+
+		case IPOPT_RR:		*ipopt |= ZPI_OPT_RR;		break;
+		case IPOPT_TS:		*ipopt |= ZPI_OPT_TS;		break;
+		case IPOPT_LSRR:	*ipopt |= ZPI_OPT_LSRR;		break;
+		case IPOPT_SSRR:	*ipopt |= ZPI_OPT_SSRR;		break;
+		case IPOPT_SEC:		*ipopt |= ZPI_OPT_SEC;		break;
+		case IPOPT_RA:		*ipopt |= ZPI_OPT_RA;		break;
+		default:			*ipopt |= ZPI_OPT_OTHER;	break;
+		}
+
+		if (len < 2 || (olen = opt[1]) < 2 || olen > len) {
+			return -1;
+		}
+
+		opt += olen;
+		len -= olen;
+	}
+
+	return 0;
+}
+
+
+/**
+ *---------------------------------------------------------------------------
+ *
+ * @fn     int zkpktinfo_parse(zkpktinfo_t *pi, struct sk_buff *skb, const struct net_device *dev, int out)
+ * @brief  Fill the packet information of a packet
+ * @param  pi: (out) packet information
+ * @param  skb: packet, whose IP header has been checked by the stack
+ * @param  dev: ingress interface if inbound, egress one if outbound
+ * @param  out: 1 if outbound, 0 if inbound
+ * @return 0 if normal, -1 if the headers are malformed.
+ * @date   18 Oct, 2026
+ * @see    zkipsess_lookup(), zkfilter_early()
+ *
+ *  Parse the IP and L4 headers of a packet in a single pass, and fill
+ *  zpi_i.id[], zpi_hlen, zpi_offset, zpi_flags, zpi_ipopt and zpi_hv. The
+ *  filter, session, NAT and fragment stages all work on the result, so a
+ *  packet is never parsed twice. Nothing is linearized; the few bytes of
+ *  the L4 header are read in place whenever they are in the linear area.
+ *  Non-first fragments carry no ports, so their port ids are left zero
+ *  and ZPI_FRAGMENT is set.
+ *
+ *---------------------------------------------------------------------------
+ */
+
+int zkpktinfo_parse(zkpktinfo_t *pi, struct sk_buff *skb,
+		const struct net_device *dev, int out)
+{
+	struct iphdr	*iph = skb->nh.iph;
+	uint16_t		*ports, buf[2];
+	uint16_t		frag = ntohs(iph->frag_off);
+	uint32_t		sport = 0, dport = 0;
+
+	pi->zpi_out		= out;
+	pi->zpi_dir		= 0;
+	pi->zpi_buff	= skb;
+	pi->zpi_rule	= NULL;
+	pi->zpi_sess	= NULL;
+	pi->zpi_ifp		= (struct net_device *)dev;
+	pi->zpi_fragbuff	= NULL;
+
+	pi->zpi_hlen	= iph->ihl << 2;
+	pi->zpi_offset	= (frag & IP_OFFSET) << 3;
+	pi->zpi_flags	= 0;
+
+	if ((frag & IP_MF)) {
+		pi->zpi_flags |= ZPI_MOREFRAG;
+	}
+
+	if (pi->zpi_offset != 0) {
+		pi->zpi_flags |= ZPI_FRAGMENT;
+	}
+
+	pi->zpi_ipopt = 0;
+	if (pi->zpi_hlen > sizeof(struct iphdr) &&
+			zkpktinfo_ipopt((uint8_t *)(iph + 1),
+				pi->zpi_hlen - sizeof(struct iphdr), &pi->zpi_ipopt) < 0) {
+		return -1;
+	}
+
+	if (!(pi->zpi_flags & ZPI_FRAGMENT)) {
+		switch (iph->protocol) {
+		case IPPROTO_TCP:
+		case IPPROTO_UDP:
+			ports = zkpktinfo_ports(skb,
+					(uint8_t *)iph - skb->data + pi->zpi_hlen, buf);
+			if (ports == NULL) {
+				return -1;
+			}
+
+			sport = ntohs(ports[0]);
+			dport = ntohs(ports[1]);
+			break;
+		}
+	}
+
+	pi->zpi_i.id[DIM_IFID]		= dev->ifindex;
+	pi->zpi_i.id[DIM_SRCADDR]	= ntohl(iph->saddr);
+	pi->zpi_i.id[DIM_DSTADDR]	= ntohl(iph->daddr);
+	pi->zpi_i.id[DIM_SRCPORT]	= (iph->protocol << DIM_PROTOSHIFT) | sport;
+	pi->zpi_i.id[DIM_DSTPORT]	= (iph->protocol << DIM_PROTOSHIFT) | dport;
+
+	pi->zpi_hv = zkhash_tuple(pi->zpi_i.id);
+
+	return 0;
+}
@@ -46,19 +46,43 @@ typedef struct zkpktinfo {
 	struct zkipsess	*zpi_sess;		/* selected session */
 
 	uint8_t			zpi_hlen;		/* IP header length */
-	uint8_t			zpi_reserved1;	/* Not Used */
-	uint16_t		zpi_offset;		/* fragment offset */
+	uint8_t			zpi_flags;		/* ZPI_* */
+	uint16_t		zpi_offset;		/* fragment offset (in bytes) */
 
 	union {
 		uint32_t	id[MAX_FISTREE_DIM];	/* classification id. */
 		uint16_t	pd[MAX_FISTREE_DIM << 1];	/* (protocol/port) */
 	} zpi_i;
 
-	uint32_t		zpi_hv;			/* session hash vector */
+	uint32_t		zpi_hv;			/* session hash vector (zkhash_tuple()),
+									 * computed once and shared by every table */
 
 	struct net_device	*zpi_ifp;	/* pointer to the network interface */
 	struct sk_buff	*zpi_fragbuff;	/* fragments with the same session */
-	uint32_t		zpi_ipopt;		/* arranged IP options */
+	uint32_t		zpi_ipopt;		/* arranged IP options (ZPI_OPT_*) */
 } zkpktinfo_t;
 
+/* zkpktinfo_t::zpi_flags */
+
+#define ZPI_MOREFRAG	0x01	/**< More fragments follow (IP_MF) */
+#define ZPI_FRAGMENT	0x02	/**< Not the first fragment, so no L4 header */
+
+/* zkpktinfo_t::zpi_ipopt */
+
+#define ZPI_OPT_RR		0x0001	/**< Record route */
+#define ZPI_OPT_TS		0x0002	/**< Timestamp */
+#define ZPI_OPT_LSRR	0x0004	/**< Loose source route */
+#define ZPI_OPT_SSRR	0x0008	/**< Strict source route */
+#define ZPI_OPT_SEC		0x0010	/**< Security */
+#define ZPI_OPT_RA		0x0020	/**< Router alert */
+#define ZPI_OPT_OTHER	0x8000	/**< Any other option */
+
+#ifdef __KERNEL__
+struct sk_buff;
+struct net_device;
+
+int zkpktinfo_parse(zkpktinfo_t *pi, struct sk_buff *skb,
+		const struct net_device *dev, int out);
+#endif	/* __KERNEL__ */
+
 #endif	/* __ZKPKTINFO_H__ */
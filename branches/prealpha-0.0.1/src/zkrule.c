@@ -32,13 +32,147 @@
 #include <linux/kernel.h>			/* printk() */
 #include <asm/uaccess.h>			/* copy_to_user(), copy_from_user() */
 #include <linux/netfilter_ipv4/lockhelp.h>	/* *_LOCK, *_UNLOCK */
+#include <linux/vmalloc.h>			/* vmalloc(), vfree() */
 
 #include "zelkova.h"
+#include "zkhash.h"					/* zkhash_3words() */
+#include "zkfilter.h"				/* spd_lock, staticspd */
+#include "zknat.h"					/* zknapt_clean() */
+#include "zkstat.h"					/* zkstat_free() */
 
 static DECLARE_RWLOCK(rule_lock);	/**< A lock with the dynamic rule list */
 
 zkdfrule_t		rule_g_head;	/**< Pointer to the global linked list for dynamic rules */
 
+static zkdfrule_t	*dfrule_hash[ZKDFRULE_HASHSIZE];	/**< Overlay of exact pinholes */
+static zkdfrule_t	*dfrule_wild;	/**< Overlay of the other dynamic rules */
+static int			dfrule_count;	/**< Number of dynamic rules */
+static uint32_t		dfrule_lastid;	/**< Handle given to the last dynamic rule */
+
+uint32_t			dfrule_gen;		/**< Moves on whenever a dynamic rule is taken out */
+
+#define DFRULE_BUCKET(daddr, dport)	(zkhash_3words((daddr), (dport), 0) & (ZKDFRULE_HASHSIZE - 1))
+
+/* dfrule_ispoint(): Is the interval a single point? */
+
+static inline int dfrule_ispoint(fistree_interval_t *i)
+{
+	return (i->type == INTERVAL_RANGEONE && i->r.one.end == i->r.one.begin + 1);
+}
+
+/* dfrule_inside(): Is the value inside the interval?
+ * End points are exclusive, and an end point of 0 is past the top.
+ */
+
+static inline int dfrule_inside(fistree_interval_t *i, uint32_t v)
+{
+	size_t		n;
+
+	switch (i->type) {
+	case INTERVAL_ANYTOANY:
+		return 1;
+	case INTERVAL_RANGEONE:
+		return (i->r.one.begin <= v && (i->r.one.end == 0 || v < i->r.one.end));
+	case INTERVAL_RANGESET:
+		for (n = 0; n < i->r.set.nelem; n++) {
+			if (i->r.set.table[n].begin <= v &&
+					(i->r.set.table[n].end == 0 || v < i->r.set.table[n].end)) {
+				return 1;
+			}
+		}
+		return 0;
+	default:
+		return 0;
+	}
+}
+
+/* dfrule_match(): Does the rule (or its inverse rule) match the values? */
+
+static inline int dfrule_match(fisrule_t *rule, uint32_t id[])
+{
+	int		d;
+
+	for (d = 0; d < MAX_FISTREE_DIM; d++) {
+		if (!dfrule_inside(&rule->field[d], id[d])) {
+			break;
+		}
+	}
+
+	if (d == MAX_FISTREE_DIM) {
+		return 1;
+	}
+
+	if (!rule->is_bidirect) {
+		return 0;
+	}
+
+	for (d = 0; d < MAX_FISTREE_DIM; d++) {
+		if (!dfrule_inside(&rule->inversefield[d], id[d])) {
+			return 0;
+		}
+	}
+
+	return 1;
+}
+
+
+/**
+ *---------------------------------------------------------------------------
+ *
+ * @fn     void zkdfrule_init(void)
+ * @brief  Initialize the dynamic rule list and the overlay
+ * @param  NONE
+ * @return NONE
+ * @date   18 Oct, 2026
+ * @see    zkdfrule_clean()
+ *
+ *  Initialize the dynamic rule list and the overlay
+ *
+ *---------------------------------------------------------------------------
+ */
+
+void zkdfrule_init(void)
+{
+	WRITE_LOCK(&rule_lock);
+
+	rule_g_head.dfrule_next = &rule_g_head;
+	rule_g_head.dfrule_prev = &rule_g_head;
+
+	memset(dfrule_hash, 0x00, sizeof(dfrule_hash));
+	dfrule_wild = NULL;
+	dfrule_count = 0;
+
+	WRITE_UNLOCK(&rule_lock);
+}
+
+
+/**
+ *---------------------------------------------------------------------------
+ *
+ * @fn     void zkdfrule_clean(void)
+ * @brief  Delete all dynamic rules
+ * @param  NONE
+ * @return NONE
+ * @date   18 Oct, 2026
+ * @see    zkdfrule_init()
+ *
+ *  Delete all dynamic rules.
+ *  NOTE: The caller has to hold spd_lock for writing.
+ *
+ *---------------------------------------------------------------------------
+ */
+
+void zkdfrule_clean(void)
+{
+	WRITE_LOCK(&rule_lock);
+
+	while (rule_g_head.dfrule_next != &rule_g_head) {
+		zkdfrule_delete(rule_g_head.dfrule_next);
+	}
+
+	WRITE_UNLOCK(&rule_lock);
+}
+
 /**
  *---------------------------------------------------------------------------
  *
@@ -49,7 +183,9 @@ zkdfrule_t		rule_g_head;	/**< Pointer to the global linked list for dynamic rule
  * @date   27 Jul, 2005
  * @see    NONE
  *
- *   Insert a dynamic rule into a new FIS-tree
+ *   Relink dynamic rules to their parent rules of a new SPD, and delete
+ *   the ones whose parent rule is gone. Dynamic rules stay in the overlay
+ *   and are never inserted into the FIS-tree itself.
  *---------------------------------------------------------------------------
  */
 
@@ -72,11 +208,11 @@ void zkdfrule_syncrule(zkspd_t *spd)
 
 		if ((paction = zkspd_getactbyid(spd, action->act_pid)) == NULL) {
 			zkdfrule_delete(dfrule);
-
-			action->act_parent = NULL;
 			goto next;
 		}
 
+		action->act_parent = paction;
+
 next:
 		dfrule = next;
 	}
@@ -93,9 +229,12 @@ next:
  * @param  dfrule: Dynamic rule to be deleted
  * @return NONE
  * @date   27 Jul, 2005
- * @see    NONE
+ * @see    zkdfrule_put()
  *
  *   Deletes a dynamic rule and deallocate the memory it had before.
+ *   Sessions on the rule keep it in memory until they move to another
+ *   rule or go away; they see dfrule_dead and are revalidated on their
+ *   next packet.
  *---------------------------------------------------------------------------
  */
 
@@ -109,11 +248,261 @@ void zkdfrule_delete(zkdfrule_t *dfrule)
 	dfrule->dfrule_prev->dfrule_next = dfrule->dfrule_next;
 	dfrule->dfrule_next->dfrule_prev = dfrule->dfrule_prev;
 
+	/* Unlink it from the overlay */
+
+	if (dfrule->dfrule_hnext != NULL) {
+		dfrule->dfrule_hnext->dfrule_hpprev = dfrule->dfrule_hpprev;
+	}
+
+	*dfrule->dfrule_hpprev = dfrule->dfrule_hnext;
+
+	dfrule_count--;
+
 	/* NOTE: In case of spdroot, you have to lock before calling
-	 * zkdfrule_delete() */
+	 * zkdfrule_delete(), and rule_lock has to be held for writing. */
+
+	/* The rule cached by the pre-routing hook is not taken any more */
+	dfrule->dfrule_dead = 1;
+	dfrule_gen++;
+
+	/* Drop the reference of the overlay */
+	zkdfrule_put(dfrule);
+}
+
+
+/**
+ *---------------------------------------------------------------------------
+ *
+ * @fn     void zkdfrule_put(zkdfrule_t *dfrule)
+ * @brief  Drop a reference to a dynamic rule
+ * @param  dfrule: Dynamic rule
+ * @return NONE
+ * @date   18 Oct, 2026
+ * @see    zkdfrule_delete(), zkipsess_create()
+ *
+ *  Drop a reference to a dynamic rule, and free it with the last one.
+ *  The overlay holds one reference, and each session on the rule holds
+ *  another one, so that the counters of a session can still be folded
+ *  into the rule after it is taken out.
+ *
+ *---------------------------------------------------------------------------
+ */
+
+void zkdfrule_put(zkdfrule_t *dfrule)
+{
+	if (atomic_dec_and_test(&dfrule->dfrule_refcnt)) {
+		KFREES(dfrule);
+	}
+}
+
+
+/**
+ *---------------------------------------------------------------------------
+ *
+ * @fn     int zkdfrule_insert(zkdfrule_t *dfrule, uint32_t *id)
+ * @brief  Add a dynamic rule
+ * @param  dfrule: Dynamic rule, allocated by KMALLOCS(), with dfrule_rule,
+ *                 act_pass and act_pid (the parent policy) filled in
+ * @param  id: (out) handle of the rule, for zkdfrule_removeid()
+ * @return 0 if normal, <0 if abnormal.
+ * @date   18 Oct, 2026
+ * @see    zkdfrule_remove(), zkdfrule_query()
+ *
+ *  Link a dynamic rule to its parent rule and put it into the overlay.
+ *  The FIS-tree is not touched, so a pinhole is opened at once.
+ *
+ *---------------------------------------------------------------------------
+ */
+
+int zkdfrule_insert(zkdfrule_t *dfrule, uint32_t *id)
+{
+	fisrule_t		*rule = &dfrule->dfrule_rule;
+	zkact_t			*action = &dfrule->dfrule_act;
+	zkdfrule_t		**head;
+
+	if (rule->cost <= 0) {
+		return -EINVAL;
+	}
+
+	rule->action		= action;
+	rule->refcnt		= 0;
+	action->act_rule	= rule;
+	action->act_stat	= NULL;
+
+	/* The reference of the overlay */
+	dfrule->dfrule_dead = 0;
+	atomic_set(&dfrule->dfrule_refcnt, 1);
+
+	READ_LOCK(&spd_lock);
+
+	if ((action->act_parent = zkspd_getactbyid(&staticspd, action->act_pid)) == NULL) {
+		READ_UNLOCK(&spd_lock);
+		return -ENOENT;
+	}
+
+	WRITE_LOCK(&rule_lock);
+
+	/* Handles are never 0 */
+	if (++dfrule_lastid == 0) {
+		dfrule_lastid++;
+	}
+
+	dfrule->dfrule_id = *id = dfrule_lastid;
+
+	/* The global list */
+
+	dfrule->dfrule_next = &rule_g_head;
+	dfrule->dfrule_prev = rule_g_head.dfrule_prev;
+	rule_g_head.dfrule_prev->dfrule_next = dfrule;
+	rule_g_head.dfrule_prev = dfrule;
+
+	/* The overlay */
+
+	if (!rule->is_bidirect && dfrule_ispoint(&rule->field[DIM_DSTADDR]) &&
+			dfrule_ispoint(&rule->field[DIM_DSTPORT])) {
+		head = &dfrule_hash[DFRULE_BUCKET(rule->field[DIM_DSTADDR].r.one.begin,
+				rule->field[DIM_DSTPORT].r.one.begin)];
+	}
+	else {
+		head = &dfrule_wild;
+	}
+
+	dfrule->dfrule_hnext = *head;
+	dfrule->dfrule_hpprev = head;
+
+	if (*head != NULL) {
+		(*head)->dfrule_hpprev = &dfrule->dfrule_hnext;
+	}
+
+	*head = dfrule;
+
+	dfrule_count++;
+
+	WRITE_UNLOCK(&rule_lock);
+	READ_UNLOCK(&spd_lock);
+
+	return 0;
+}
+
+
+/**
+ *---------------------------------------------------------------------------
+ *
+ * @fn     void zkdfrule_remove(zkdfrule_t *dfrule)
+ * @brief  Remove a dynamic rule
+ * @param  dfrule: Dynamic rule added by zkdfrule_insert()
+ * @return NONE
+ * @date   18 Oct, 2026
+ * @see    zkdfrule_insert(), zkdfrule_removeid()
+ *
+ *  Take a dynamic rule out of the overlay. Only the sessions on the rule
+ *  are affected: they find it dead and are revalidated on their next
+ *  packet, while the other sessions keep their generation.
+ *
+ *---------------------------------------------------------------------------
+ */
+
+void zkdfrule_remove(zkdfrule_t *dfrule)
+{
+	/* spd_lock keeps the rule from being taken out between
+	 * zkdfrule_query() and the session made on it */
+	WRITE_LOCK(&spd_lock);
+	WRITE_LOCK(&rule_lock);
+
+	zkdfrule_delete(dfrule);
+
+	WRITE_UNLOCK(&rule_lock);
+	WRITE_UNLOCK(&spd_lock);
+}
+
+
+/**
+ *---------------------------------------------------------------------------
+ *
+ * @fn     int zkdfrule_removeid(uint32_t id)
+ * @brief  Remove a dynamic rule by its handle
+ * @param  id: handle given by zkdfrule_insert()
+ * @return 0 if normal, -ENOENT if there is no such rule.
+ * @date   18 Oct, 2026
+ * @see    zkdfrule_remove()
+ *
+ *  Look up a dynamic rule by its handle on the global list, and take it
+ *  out in the way of zkdfrule_remove().
+ *
+ *---------------------------------------------------------------------------
+ */
+
+int zkdfrule_removeid(uint32_t id)
+{
+	zkdfrule_t		*dfrule;
+	int				ret = -ENOENT;
+
+	WRITE_LOCK(&spd_lock);
+	WRITE_LOCK(&rule_lock);
+
+	for (dfrule = rule_g_head.dfrule_next; dfrule != &rule_g_head; dfrule = dfrule->dfrule_next) {
+		if (dfrule->dfrule_id == id) {
+			zkdfrule_delete(dfrule);
+			ret = 0;
+			break;
+		}
+	}
+
+	WRITE_UNLOCK(&rule_lock);
+	WRITE_UNLOCK(&spd_lock);
 
-	/* Deallocate memories */
-	KFREES(dfrule);
+	return ret;
+}
+
+
+/**
+ *---------------------------------------------------------------------------
+ *
+ * @fn     fisrule_t *zkdfrule_query(uint32_t id[], fisrule_t *rule)
+ * @brief  Query the dynamic rules alongside the FIS-tree
+ * @param  id: classification id. (5-tuple)
+ * @param  rule: rule found in the FIS-tree, NULL if none
+ * @return the better one of 'rule' and the best matching dynamic rule
+ * @date   18 Oct, 2026
+ * @see    zkdfrule_insert()
+ *
+ *  Look up the bucket of the destination and the wildcard list, and
+ *  choose the rule with the lowest cost.
+ *  NOTE: The caller has to hold spd_lock for reading, which keeps the
+ *        returned dynamic rule from being freed.
+ *
+ *---------------------------------------------------------------------------
+ */
+
+fisrule_t *zkdfrule_query(uint32_t id[], fisrule_t *rule)
+{
+	zkdfrule_t		*dfrule;
+
+	if (dfrule_count == 0) {
+		return rule;
+	}
+
+	READ_LOCK(&rule_lock);
+
+	dfrule = dfrule_hash[DFRULE_BUCKET(id[DIM_DSTADDR], id[DIM_DSTPORT])];
+
+	for (; dfrule != NULL; dfrule = dfrule->dfrule_hnext) {
+		if ((rule == NULL || dfrule->dfrule_rule.cost < rule->cost) &&
+				dfrule_match(&dfrule->dfrule_rule, id)) {
+			rule = &dfrule->dfrule_rule;
+		}
+	}
+
+	for (dfrule = dfrule_wild; dfrule != NULL; dfrule = dfrule->dfrule_hnext) {
+		if ((rule == NULL || dfrule->dfrule_rule.cost < rule->cost) &&
+				dfrule_match(&dfrule->dfrule_rule, id)) {
+			rule = &dfrule->dfrule_rule;
+		}
+	}
+
+	READ_UNLOCK(&rule_lock);
+
+	return rule;
 }
 
 
@@ -155,15 +544,39 @@ void zkspd_clean(zkspd_t *spd)
 		}
 	}
 
-	KFREES(spd->spd_table);
+	if ((spd->spd_flag & SPD_VMALLOC)) {
+		vfree(spd->spd_table);
+	}
+	else {
+		KFREES(spd->spd_table);
+	}
 
 	if ((spd->spd_flag & SPD_NAT)) {
+		for (i = 0; i < spd->spd_nelem; i++) {
+			zknapt_clean(&spd->spd_nat[i]);
+		}
+
 		KFREES(spd->spd_nat);
 		KFREES(spd->spd_policy);
 	}
 	else {
-		KFREES(spd->spd_act);
-		KFREES(spd->spd_policy);
+		/* Tables of a chunked upload or a transaction are from vmalloc() */
+		if ((spd->spd_flag & SPD_VMALLOC)) {
+			vfree(spd->spd_act);
+			vfree(spd->spd_policy);
+		}
+		else {
+			KFREES(spd->spd_act);
+			KFREES(spd->spd_policy);
+		}
+
+		zkstat_free(spd->spd_stat);
+		spd->spd_stat = NULL;
+
+		if (spd->spd_pidhash != NULL) {
+			vfree(spd->spd_pidhash);
+			spd->spd_pidhash = NULL;
+		}
 
 		/* Clean up the spd_prerule list */
 
@@ -200,10 +613,25 @@ void zkspd_clean(zkspd_t *spd)
 
 zkact_t *zkspd_getactbyid(zkspd_t *spd, uint32_t id)
 {
+	uint32_t	slot;
 	int			i;
 
 	/* NOTE: Do not lock here. Instead we lock before calling this func. */
 
+	if (spd->spd_pidhash != NULL) {
+		slot = zkhash_3words(id, 0, 0) & spd->spd_pidmask;
+
+		while ((i = spd->spd_pidhash[slot]) != 0) {
+			if (spd->spd_act[i - 1].act_pid == id) {
+				return &spd->spd_act[i - 1];
+			}
+
+			slot = (slot + 1) & spd->spd_pidmask;
+		}
+
+		return NULL;
+	}
+
 	for (i = spd->spd_precnt; i < spd->spd_nelem; i++) {
 		if (spd->spd_act[i].act_pid == id) {
 			return &spd->spd_act[i];
@@ -212,3 +640,60 @@ zkact_t *zkspd_getactbyid(zkspd_t *spd, uint32_t id)
 
 	return NULL;
 }
+
+
+/**
+ *---------------------------------------------------------------------------
+ *
+ * @fn     int zkspd_makeindex(zkspd_t *spd)
+ * @brief  Make the index of actions by policy IDs
+ * @param  spd: SPD with spd_act[] filled in
+ * @return 0 if normal, <0 if abnormal.
+ * @date   18 Oct, 2026
+ * @see    zkspd_getactbyid()
+ *
+ *  Make an open addressing hash table from act_pid to the index of
+ *  spd_act[], at most half full, so that zkspd_getactbyid() does not scan
+ *  the whole SPD. Actions are inserted by ascending index, so the first
+ *  action of a policy ID is found first like the linear scan does.
+ *  If the table can not be allocated, zkspd_getactbyid() falls back to
+ *  the linear scan.
+ *
+ *---------------------------------------------------------------------------
+ */
+
+int zkspd_makeindex(zkspd_t *spd)
+{
+	uint32_t	size, slot;
+	int			i;
+
+	spd->spd_pidhash = NULL;
+	spd->spd_pidmask = 0;
+
+	if (spd->spd_nelem <= spd->spd_precnt) {
+		return 0;
+	}
+
+	for (size = 2; size < (spd->spd_nelem - spd->spd_precnt) * 2; size <<= 1)
+		;
+
+	if ((spd->spd_pidhash = (uint32_t *)vmalloc(sizeof(uint32_t) * size)) == NULL) {
+		return -ENOMEM;
+	}
+
+	memset(spd->spd_pidhash, 0x00, sizeof(uint32_t) * size);
+
+	spd->spd_pidmask = size - 1;
+
+	for (i = spd->spd_precnt; i < spd->spd_nelem; i++) {
+		slot = zkhash_3words(spd->spd_act[i].act_pid, 0, 0) & spd->spd_pidmask;
+
+		while (spd->spd_pidhash[slot] != 0) {
+			slot = (slot + 1) & spd->spd_pidmask;
+		}
+
+		spd->spd_pidhash[slot] = i + 1;
+	}
+
+	return 0;
+}
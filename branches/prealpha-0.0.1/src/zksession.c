@@ -30,96 +30,1105 @@
 #define __NO_VERSION__
 
 #include <linux/kernel.h>			/* printk() */
+#include <linux/sched.h>			/* jiffies */
+#include <linux/timer.h>			/* timer_list */
+#include <linux/skbuff.h>			/* sk_buff */
+#include <linux/ip.h>				/* iphdr */
+#include <asm/bitops.h>				/* set_bit(), clear_bit() */
 #include <asm/uaccess.h>			/* copy_to_user(), copy_from_user() */
 #include <linux/netfilter_ipv4/lockhelp.h>	/* *_LOCK, *_UNLOCK */
 
 #include "zkfilter.h"
 #include "zknat.h"
 #include "zksession.h"
+#include "zkpktinfo.h"
+#include "zkstat.h"					/* zkstat_rule() */
 
 
-static DECLARE_RWLOCK(ipsess_lock);	/**< A lock with the session table */
+#include <linux/smp.h>				/* smp_processor_id(), smp_num_cpus */
+#include <linux/vmalloc.h>			/* vmalloc(), vfree() */
 
-static zkipsess_t	zis_g_head;	/**< Pointer to the global linked list for IP session */
-static zkipsess_t	zns_g_head;	/**< Pointer to the global linked list for NAT session */
+DECLARE_RWLOCK_EXTERN(spd_lock);	/* R/W lock with SPD root and static SPD */
 
-static zkipsess_t	*zis_hash[MAX_ZKIPSESS];	/**< IP session hash table */
+/* The filtering sessions are split into ipsess_nshard shards by their hash
+ * vector. The shards are hash-striped locks, not CPU-local tables: a flow
+ * lands on the shard its hash picks, whichever CPU handles the packet.
+ * Every shard has its own lock, list and hash table, so CPUs working on
+ * flows of different shards never touch the same cache lines.
+ * NAT sessions live in one shared shard, ipsess_nat. Its lock is always
+ * taken inside the lock of a filtering shard, never the other way round.
+ */
+
+static zkipsess_shard_t	ipsess_shard[NR_CPUS];	/**< Shards for filtering sessions */
+static zkipsess_shard_t	ipsess_nat;				/**< Shard for NAT sessions */
+
+static int			ipsess_nshard = 1;	/**< Number of shards in use */
+
+static atomic_t		nlongchain;	/**< Lookups which walked a long hash chain */
+
+uint32_t			ipsess_gen = 0;	/**< Current policy generation */
+static uint32_t		ipsess_rulegen = 0;	/**< Oldest generation whose rules are alive */
+
+static struct timer_list	ipsess_synctimer;	/**< Background revalidation walker */
+
+static int ipsess_substituterule(zkipsess_t *is, fisrule_t *found[], int mask);
+static void ipsess_syncslice(unsigned long data);
+static int ipsess_evict(zkipsess_shard_t *sh, uint32_t hv);
+
+/* IPSESS_SHARD(): the shard a hash vector belongs to.
+ * The hash is keyed, so its high half spreads flows over the shards as
+ * evenly as the whole of it spreads them over the buckets of a shard.
+ */
+#define IPSESS_SHARD(hv)	(&ipsess_shard[((hv) >> 16) % ipsess_nshard])
+
+static struct timer_list	ipsess_expiretimer;	/**< Expiry sweeper */
+
+static void ipsess_expireslice(unsigned long data);
+
+
+/* ipsess_fold(): Add the packets and bytes of a session counted since
+ * the last fold to its rule. Rule counters are thus written once per
+ * batch instead of once per packet. A stale session is folded as long as
+ * the SPD of its generation has not been freed. The caller has to hold
+ * spd_lock for reading, and the shard lock for writing. The counters
+ * themselves are read under the lock of the session.
+ */
+
+static inline void ipsess_fold(zkipsess_t *is)
+{
+	uint32_t	pkts;
+	uint64_t	bytes;
+
+	spin_lock(&is->zis_lock);
+	pkts = is->zis_pkts[0] + is->zis_pkts[1];
+	bytes = is->zis_bytes[0] + is->zis_bytes[1];
+	spin_unlock(&is->zis_lock);
+
+	/* zis_rule of a session older than ipsess_rulegen is freed already,
+	 * unless it is a dynamic rule, which the session holds */
+	if (pkts == is->zis_foldpkts || is->zis_rule == NULL ||
+			(!(is->zis_flag & IS_DFRULE) && (int32_t)(is->zis_gen - ipsess_rulegen) < 0)) {
+		return;
+	}
+
+	zkstat_rule((zkact_t *)is->zis_rule->action,
+			pkts - is->zis_foldpkts, bytes - is->zis_foldbytes);
+
+	is->zis_foldpkts = pkts;
+	is->zis_foldbytes = bytes;
+}
+
+/* ipsess_count(): Add packets to a session and refresh its age.
+ * A packet in the response direction marks a non-TCP session as
+ * established, which protects it from early eviction; TCP sessions are
+ * established by zktcp_track(). The caller has to hold the lock of the
+ * session.
+ */
+
+static inline void ipsess_count(zkipsess_t *is, int dir, uint32_t pkts, uint64_t bytes)
+{
+	is->zis_age = jiffies;
+	is->zis_pkts[dir] += pkts;
+	is->zis_bytes[dir] += bytes;
+
+	if (dir && !(is->zis_flag & IS_ESTABLISHED) && !ipsess_istcp(is)) {
+		set_bit(IS_ESTABLISHED_B, &is->zis_flag);
+	}
+}
+
+/* ipsess_hlink(): Insert a session at the head of its hash chain */
+
+static inline void ipsess_hlink(zkipsess_shard_t *sh, zkipsess_t *is)
+{
+	zkipsess_t	**bucket = &sh->iss_hash[IPSESS_BUCKET(sh, is->zis_hv)];
+
+	if ((is->zis_hnext = *bucket) != NULL) {
+		is->zis_hnext->zis_hpprev = &is->zis_hnext;
+	}
+
+	*bucket = is;
+	is->zis_hpprev = bucket;
+}
+
+/* ipsess_hunlink(): Remove a session from its hash chain in O(1) */
+
+static inline void ipsess_hunlink(zkipsess_t *is)
+{
+	*is->zis_hpprev = is->zis_hnext;
+
+	if (is->zis_hnext != NULL) {
+		is->zis_hnext->zis_hpprev = is->zis_hpprev;
+	}
+
+	is->zis_hnext	= NULL;
+	is->zis_hpprev	= NULL;
+}
+
+
+/**
+ *---------------------------------------------------------------------------
+ *
+ * @fn     static int ipsess_initshard(zkipsess_shard_t *sh, uint32_t max, uint32_t nbucket)
+ * @brief  Initialize a shard of the session table
+ * @param  sh: shard to be initialized
+ * @param  max: ceiling of the number of sessions in the shard
+ * @param  nbucket: number of buckets of the hash table
+ * @return 0 if normal, <0 if abnormal.
+ * @date   18 Oct, 2026
+ * @see    ipsess_init()
+ *
+ *  Allocate the hash table of a shard and initialize the list head.
+ *
+ *---------------------------------------------------------------------------
+ */
+
+static int ipsess_initshard(zkipsess_shard_t *sh, uint32_t max, uint32_t nbucket)
+{
+	rwlock_init(&sh->iss_lock);
+
+	sh->iss_head.zis_next = sh->iss_head.zis_prev = &sh->iss_head;
+	sh->iss_cursor = NULL;
+	sh->iss_expcursor = NULL;
+
+	atomic_set(&sh->iss_nsess, 0);
+
+	sh->iss_max			= max;
+	sh->iss_nevict		= 0;
+	sh->iss_nevictfail	= 0;
+
+	/* The hash table is too large for kmalloc() */
+	sh->iss_nbucket = nbucket;
+	sh->iss_hash = (zkipsess_t **)vmalloc(sizeof(zkipsess_t *) * nbucket);
+	if (sh->iss_hash == NULL) {
+		return -ENOMEM;
+	}
+
+	memset(sh->iss_hash, 0x00, sizeof(zkipsess_t *) * nbucket);
+
+	return 0;
+}
+
+
+/**
+ *---------------------------------------------------------------------------
+ *
+ * @fn     int ipsess_init(int percpu, int maxsess)
+ * @brief  Initialize the session table
+ * @param  percpu: split the table into as many hash-striped shards as
+ *                 there are CPUs if nonzero
+ * @param  maxsess: ceiling of the number of filtering sessions
+ * @return 0 if normal, <0 if abnormal.
+ * @date   18 Oct, 2026
+ * @see    ipsess_clean()
+ *
+ *  Initialize the shards of the session table and the revalidation walker.
+ *
+ *---------------------------------------------------------------------------
+ */
+
+int ipsess_init(int percpu, int maxsess)
+{
+	uint32_t	max, nbucket;
+	int			i;
+
+	ipsess_nshard = (percpu && smp_num_cpus > 1) ? smp_num_cpus : 1;
+
+	/* Every shard gets an equal part of the ceiling, so that the check
+	 * does not need a counter shared among CPUs.
+	 */
+	if (maxsess <= 0) {
+		maxsess = MAX_ZKIPSESS;
+	}
+
+	max = maxsess / ipsess_nshard;
+
+	if (max == 0) {
+		max = 1;
+	}
+
+	/* The buckets are split the same way, so that the vmalloc() area
+	 * taken by the hash tables does not grow with the number of CPUs */
+	nbucket = MAX_ZKIPSESS / ipsess_nshard;
+
+	for (i = 0; i < ipsess_nshard; i++) {
+		if (ipsess_initshard(&ipsess_shard[i], max, nbucket) < 0) {
+			goto cleanup;
+		}
+	}
+
+	if (ipsess_initshard(&ipsess_nat, maxsess, MAX_ZKIPSESS) < 0) {
+		goto cleanup;
+	}
+
+	atomic_set(&nlongchain, 0);
+
+	ipsess_gen = 0;
+
+	init_timer(&ipsess_synctimer);
+
+	ipsess_synctimer.data		= 0;
+	ipsess_synctimer.function	= &ipsess_syncslice;
+
+	init_timer(&ipsess_expiretimer);
+
+	ipsess_expiretimer.expires	= jiffies + IPSESS_EXPIRE_INTERVAL;
+	ipsess_expiretimer.data		= 0;
+	ipsess_expiretimer.function	= &ipsess_expireslice;
+
+	add_timer(&ipsess_expiretimer);
+
+	return 0;
+
+cleanup:
+	while (--i >= 0) {
+		vfree(ipsess_shard[i].iss_hash);
+		ipsess_shard[i].iss_hash = NULL;
+	}
+
+	return -ENOMEM;
+}
+
+
+/**
+ *---------------------------------------------------------------------------
+ *
+ * @fn     void ipsess_clean(void)
+ * @brief  Destroy the whole session table
+ * @param  NONE
+ * @return NONE
+ * @date   18 Oct, 2026
+ * @see    ipsess_init()
+ *
+ *  Stop the revalidation walker and delete every session entry.
+ *
+ *---------------------------------------------------------------------------
+ */
+
+void ipsess_clean(void)
+{
+	zkipsess_shard_t	*sh;
+	int					i;
+
+	del_timer_sync(&ipsess_synctimer);
+	del_timer_sync(&ipsess_expiretimer);
+
+	for (i = 0; i < ipsess_nshard; i++) {
+		sh = &ipsess_shard[i];
+
+		READ_LOCK(&spd_lock);
+		write_lock_bh(&sh->iss_lock);
+
+		sh->iss_cursor = NULL;
+		sh->iss_expcursor = NULL;
+
+		while (sh->iss_head.zis_next != &sh->iss_head) {
+			ipsess_fold(sh->iss_head.zis_next);
+			zkipsess_delete(sh->iss_head.zis_next);
+		}
+
+		write_unlock_bh(&sh->iss_lock);
+		READ_UNLOCK(&spd_lock);
+
+		vfree(sh->iss_hash);
+		sh->iss_hash = NULL;
+	}
+
+	vfree(ipsess_nat.iss_hash);
+	ipsess_nat.iss_hash = NULL;
+}
+
+
+/**
+ *---------------------------------------------------------------------------
+ *
+ * @fn     static zkipsess_t *ipsess_find(zkipsess_shard_t *sh, uint32_t id[], uint32_t hv, uint32_t natflag, int *dir)
+ * @brief  Find a session entry in the hash table
+ * @param  sh: shard which hv belongs to
+ * @param  id: classification id. of the packet
+ * @param  hv: hash vector of id (zkhash_tuple())
+ * @param  natflag: 0 for filtering sessions, IS_REDIRECTNAT or IS_NORMALNAT
+ * @param  dir: (out) 0 if id is a request of the session, 1 if a response
+ * @return the session entry if found, NULL if not found.
+ * @date   18 Oct, 2026
+ * @see    zkipsess_lookup(), zkipsess_create()
+ *
+ *  Walk the hash chain of hv and compare the tuple in both directions.
+ *  NOTE: The caller has to hold the lock of the shard.
+ *
+ *---------------------------------------------------------------------------
+ */
+
+static zkipsess_t *ipsess_find(zkipsess_shard_t *sh, uint32_t id[], uint32_t hv, uint32_t natflag, int *dir)
+{
+	zkipsess_t		*is;
+	int				depth = 0;
+
+	for (is = sh->iss_hash[IPSESS_BUCKET(sh, hv)]; is != NULL; is = is->zis_hnext) {
+		depth++;
+
+		if (is->zis_hv != hv || (is->zis_flag & IS_NAT) != natflag) {
+			continue;
+		}
+
+		if (is->zis_id[DIM_SRCADDR] == id[DIM_SRCADDR]
+				&& is->zis_id[DIM_DSTADDR] == id[DIM_DSTADDR]
+				&& is->zis_id[DIM_SRCPORT] == id[DIM_SRCPORT]
+				&& is->zis_id[DIM_DSTPORT] == id[DIM_DSTPORT]) {
+			*dir = 0;
+			break;
+		}
+
+		if (is->zis_id[DIM_SRCADDR] == id[DIM_DSTADDR]
+				&& is->zis_id[DIM_DSTADDR] == id[DIM_SRCADDR]
+				&& is->zis_id[DIM_SRCPORT] == id[DIM_DSTPORT]
+				&& is->zis_id[DIM_DSTPORT] == id[DIM_SRCPORT]) {
+			*dir = 1;
+			break;
+		}
+	}
+
+	/* A keyed hash should never give long chains. If it does,
+	 * somebody is trying to guess the seed or the table is overloaded.
+	 */
+	if (depth > IPSESS_LONGCHAIN) {
+		atomic_inc(&nlongchain);
+	}
+
+	return is;
+}
+
+
+/**
+ *---------------------------------------------------------------------------
+ *
+ * @fn     zkipsess_t *zkipsess_lookup(zkpktinfo_t *pi)
+ * @brief  Look up the filtering session of a packet
+ * @param  pi: packet information (zpi_i and zpi_hv are filled)
+ * @return the session entry with a reference held, NULL if not found.
+ * @date   18 Oct, 2026
+ * @see    zkipsess_create(), ipsess_release()
+ *
+ *  Look up the filtering session of a packet, and set pi->zpi_dir.
+ *  A stale session is revalidated against the current FIS-tree first.
+ *  The caller has to call ipsess_release() when it is done with it.
+ *
+ *---------------------------------------------------------------------------
+ */
+
+zkipsess_t *zkipsess_lookup(zkpktinfo_t *pi)
+{
+	zkipsess_shard_t	*sh = IPSESS_SHARD(pi->zpi_hv);
+	zkipsess_t			*is;
+
+	read_lock_bh(&sh->iss_lock);
+
+	is = ipsess_find(sh, pi->zpi_i.id, pi->zpi_hv, 0, &pi->zpi_dir);
+
+	if (is != NULL && !ipsess_isstale(is)) {
+		atomic_inc(&is->zis_refcnt);
+		read_unlock_bh(&sh->iss_lock);
+
+		return is;
+	}
+
+	read_unlock_bh(&sh->iss_lock);
+
+	if (is == NULL) {
+		return NULL;
+	}
+
+	/* The session was classified on an older policy. Take the locks
+	 * for writing and look it up again since it may be gone meanwhile.
+	 */
+
+	READ_LOCK(&spd_lock);
+	write_lock_bh(&sh->iss_lock);
+
+	is = ipsess_find(sh, pi->zpi_i.id, pi->zpi_hv, 0, &pi->zpi_dir);
+
+	if (is != NULL && ipsess_revalidate(is)) {
+		atomic_inc(&is->zis_refcnt);
+	}
+	else {
+		is = NULL;
+	}
+
+	write_unlock_bh(&sh->iss_lock);
+	READ_UNLOCK(&spd_lock);
+
+	return is;
+}
+
+
+/**
+ *---------------------------------------------------------------------------
+ *
+ * @fn     zkipsess_t *zkipsess_create(zkpktinfo_t *pi, fisrule_t *rule)
+ * @brief  Create a filtering session for a packet
+ * @param  pi: packet information (zpi_i and zpi_hv are filled)
+ * @param  rule: the rule selected for the packet
+ * @return the session entry with a reference held, NULL if out of memory
+ *         or if the shard is full.
+ * @date   18 Oct, 2026
+ * @see    zkipsess_lookup(), ipsess_release(), ipsess_evict()
+ *
+ *  Create a filtering session and insert it into the session table.
+ *  If another CPU has inserted the same session meanwhile, that one is
+ *  returned instead. If the shard has reached its ceiling, a session
+ *  near the new one is evicted first.
+ *  NOTE: The caller has to hold spd_lock for reading, as rule belongs
+ *        to the current SPD.
+ *
+ *---------------------------------------------------------------------------
+ */
+
+zkipsess_t *zkipsess_create(zkpktinfo_t *pi, fisrule_t *rule)
+{
+	zkipsess_shard_t	*sh = IPSESS_SHARD(pi->zpi_hv);
+	zkipsess_t			*is, *hold;
+	zkact_t				*action = rule->action;
+	zkdfrule_t			*dfrule;
+	int					dir;
+
+	KMALLOCS(is, zkipsess_t *, sizeof(zkipsess_t));
+	if (is == NULL) {
+		return NULL;
+	}
+
+	memset(is, 0x00, sizeof(zkipsess_t));
+	memcpy(is->zis_id, pi->zpi_i.id, sizeof(is->zis_id));
+
+	/* The hash vector has been computed once when the packet was parsed */
+	is->zis_hv		= pi->zpi_hv;
+	is->zis_shard	= sh - ipsess_shard;
+
+	is->zis_pass	= action->act_pass;
+	is->zis_rule	= rule;
+	is->zis_ruleid	= action->act_pid;
+	is->zis_age		= jiffies;
+
+	spin_lock_init(&is->zis_lock);
+
+	/* One reference for the session table, another one for the caller */
+	atomic_set(&is->zis_refcnt, 2);
+
+	write_lock_bh(&sh->iss_lock);
+
+	if ((hold = ipsess_find(sh, is->zis_id, is->zis_hv, 0, &dir)) != NULL) {
+		atomic_inc(&hold->zis_refcnt);
+		write_unlock_bh(&sh->iss_lock);
+
+		KFREES(is);
+		pi->zpi_dir = dir;
+
+		return hold;
+	}
+
+	/* Make room by evicting a cheap session nearby, or refuse the new
+	 * one. Either way memory and chain lengths stay bounded.
+	 */
+	if (atomic_read(&sh->iss_nsess) >= sh->iss_max) {
+		if (ipsess_evict(sh, is->zis_hv) < 0) {
+			sh->iss_nevictfail++;
+			write_unlock_bh(&sh->iss_lock);
+
+			KFREES(is);
+
+			return NULL;
+		}
+
+		sh->iss_nevict++;
+	}
+
+	is->zis_gen = ipsess_gen;
+
+	/* A dynamic rule stays in memory as long as a session is on it */
+	if ((dfrule = ZKDFRULE(rule)) != NULL) {
+		atomic_inc(&dfrule->dfrule_refcnt);
+		is->zis_flag |= IS_DFRULE;
+	}
+
+	/* Append to the linked list of the shard */
+	is->zis_next = &sh->iss_head;
+	is->zis_prev = sh->iss_head.zis_prev;
+	sh->iss_head.zis_prev->zis_next = is;
+	sh->iss_head.zis_prev = is;
+
+	/* Insert into the hash chain */
+	ipsess_hlink(sh, is);
+
+	atomic_inc(&sh->iss_nsess);
+
+	write_unlock_bh(&sh->iss_lock);
+
+	pi->zpi_dir = 0;
+
+	return is;
+}
+
+
+/**
+ *---------------------------------------------------------------------------
+ *
+ * @fn     void ipsess_account(zkipsess_t *is, int dir, uint32_t pkts, uint64_t bytes)
+ * @brief  Record packets on a session
+ * @param  is: filtering session
+ * @param  dir: 0 for the request direction, 1 for the response direction
+ * @param  pkts: number of packets
+ * @param  bytes: number of bytes of the packets
+ * @return NONE
+ * @date   18 Oct, 2026
+ * @see    ipsess_touch(), ipsess_fold()
+ *
+ *  Add packets to the counters of a session and refresh its age.
+ *  Only the lock of the session is taken, so packets of different
+ *  sessions never wait for each other even when they share a shard.
+ *  The flags are changed with set_bit() against the walker and the
+ *  unlink path, and ipsess_fold() reads the counters under the same
+ *  lock.
+ *
+ *---------------------------------------------------------------------------
+ */
+
+void ipsess_account(zkipsess_t *is, int dir, uint32_t pkts, uint64_t bytes)
+{
+	spin_lock_bh(&is->zis_lock);
+	ipsess_count(is, dir, pkts, bytes);
+	spin_unlock_bh(&is->zis_lock);
+}
+
+
+/**
+ *---------------------------------------------------------------------------
+ *
+ * @fn     int ipsess_track(zkipsess_t *is, int dir, struct sk_buff *skb)
+ * @brief  Track a packet on its session
+ * @param  is: filtering session
+ * @param  dir: 0 for the request direction, 1 for the response direction
+ * @param  skb: packet
+ * @return 0 if normal, -1 if the packet does not fit the TCP state or
+ *         the windows of the session, and has to be dropped.
+ * @date   18 Oct, 2026
+ * @see    zktcp_track(), ipsess_account()
+ *
+ *  Move the TCP state of a session by a segment, and count the packet
+ *  on the session if it fits. Non-first fragments have no TCP header and
+ *  are only counted. Both are done under the lock of the session, which
+ *  serializes the packets of both directions on the TCP state without
+ *  holding up other sessions of the shard.
+ *
+ *---------------------------------------------------------------------------
+ */
+
+int ipsess_track(zkipsess_t *is, int dir, struct sk_buff *skb)
+{
+	spin_lock_bh(&is->zis_lock);
+
+	if (ipsess_istcp(is) && !(skb->nh.iph->frag_off & htons(IP_OFFSET)) &&
+			zktcp_track(is, dir, skb) < 0) {
+		spin_unlock_bh(&is->zis_lock);
+		return -1;
+	}
+
+	ipsess_count(is, dir, 1, skb->len);
+
+	spin_unlock_bh(&is->zis_lock);
+
+	return 0;
+}
+
+
+/**
+ *---------------------------------------------------------------------------
+ *
+ * @fn     static int ipsess_evict(zkipsess_shard_t *sh, uint32_t hv)
+ * @brief  Evict a session near hv to make room for a new session
+ * @param  sh: shard which is full
+ * @param  hv: hash vector of the new session
+ * @return 0 if a session has been evicted, <0 if none could be evicted.
+ * @date   18 Oct, 2026
+ * @see    zkipsess_create()
+ *
+ *  Search IPSESS_EVICT_SPAN buckets from the bucket of hv, which gives
+ *  an approximate LRU without a global list ordered by age.
+ *  Unestablished sessions are evicted first, the oldest one among them.
+ *  Otherwise the oldest session idle longer than IPSESS_IDLE_TIMEOUT is
+ *  evicted. Live established sessions are never evicted, so a SYN flood
+ *  can only push out its own kind.
+ *  NOTE: The caller has to hold the lock of the shard for writing.
+ *
+ *---------------------------------------------------------------------------
+ */
+
+static int ipsess_evict(zkipsess_shard_t *sh, uint32_t hv)
+{
+	zkipsess_t		*is, *victim = NULL;
+	uint32_t		bucket = IPSESS_BUCKET(sh, hv);
+	int				vclass = 0, class;
+	int				i;
+
+	for (i = 0; i < IPSESS_EVICT_SPAN; i++) {
+		for (is = sh->iss_hash[bucket]; is != NULL; is = is->zis_hnext) {
+			if (!(is->zis_flag & IS_ESTABLISHED)) {
+				class = 2;
+			}
+			else if (time_after(jiffies, is->zis_age + IPSESS_IDLE_TIMEOUT)) {
+				class = 1;
+			}
+			else {
+				continue;
+			}
+
+			if (class > vclass || (class == vclass && time_before(is->zis_age, victim->zis_age))) {
+				victim = is;
+				vclass = class;
+			}
+		}
+
+		if (++bucket == sh->iss_nbucket) {
+			bucket = 0;
+		}
+	}
+
+	if (victim == NULL) {
+		return -1;
+	}
+
+	ipsess_fold(victim);
+	zkipsess_delete(victim);
+
+	return 0;
+}
+
+
+/**
+ *---------------------------------------------------------------------------
+ *
+ * @fn     void ipsess_getstat(zk_sess_stat_t *st)
+ * @brief  Get statistics and the chain length histogram of the session table
+ * @param  st: (out) statistics
+ * @return NONE
+ * @date   18 Oct, 2026
+ * @see    zelkova_ioctl_session()
+ *
+ *  Count the chain length of every bucket of every shard. A histogram
+ *  with a long tail tells that flows are piled into a few buckets.
+ *
+ *---------------------------------------------------------------------------
+ */
+
+void ipsess_getstat(zk_sess_stat_t *st)
+{
+	zkipsess_shard_t	*sh;
+	zkipsess_t			*is;
+	uint32_t			len;
+	int					i, j;
+
+	memset(st, 0x00, sizeof(zk_sess_stat_t));
+
+	for (j = 0; j < ipsess_nshard; j++) {
+		sh = &ipsess_shard[j];
+
+		read_lock_bh(&sh->iss_lock);
+
+		for (i = 0; i < sh->iss_nbucket; i++) {
+			len = 0;
+
+			for (is = sh->iss_hash[i]; is != NULL; is = is->zis_hnext) {
+				len++;
+			}
+
+			if (len > st->zss_maxchain) {
+				st->zss_maxchain = len;
+			}
+
+			st->zss_hist[min(len, IPSESS_NCHAINHIST - 1)]++;
+		}
+
+		st->zss_nsess		+= atomic_read(&sh->iss_nsess);
+		st->zss_maxsess		+= sh->iss_max;
+		st->zss_nevict		+= sh->iss_nevict;
+		st->zss_nevictfail	+= sh->iss_nevictfail;
 
-static atomic_t		nipsess;	/**< Total number of sessions in zis_hash */
+		read_unlock_bh(&sh->iss_lock);
+	}
 
-int					ns_num = 0;	/**< Total number of NAT sessions */
+	st->zss_nshard		= ipsess_nshard;
+	st->zss_nlongchain	= atomic_read(&nlongchain);
+}
 
-static void ipsess_substituterule(zkipsess_t *is, fisrule_t *rule);
 
 /**
  *---------------------------------------------------------------------------
  *
- * @fn     void ipsess_syncrule(void)
- * @brief  Make the IP session table be compatible with the rule table
+ * @fn     void ipsess_foldstat(void)
+ * @brief  Flush the counters of every session into the rule counters
+ * @param  NONE
+ * @return NONE
+ * @date   18 Oct, 2026
+ * @see    ipsess_fold(), ipsess_expireslice()
+ *
+ *  Flush the counters of every session into the rule counters at once,
+ *  for a reader which needs them up to date. The expiry sweeper does the
+ *  same bit by bit in the background. Shards are walked
+ *  IPSESS_EXPIRE_SLICE buckets at a time, and the locks are dropped
+ *  between slices to let packets through.
+ *
+ *---------------------------------------------------------------------------
+ */
+
+void ipsess_foldstat(void)
+{
+	zkipsess_shard_t	*sh;
+	zkipsess_t			*is;
+	uint32_t			begin, end, bucket;
+	int					i;
+
+	for (i = 0; i < ipsess_nshard; i++) {
+		sh = &ipsess_shard[i];
+
+		for (begin = 0; begin < sh->iss_nbucket; begin = end) {
+			end = min(begin + IPSESS_EXPIRE_SLICE, sh->iss_nbucket);
+
+			READ_LOCK(&spd_lock);
+			write_lock_bh(&sh->iss_lock);
+
+			for (bucket = begin; bucket < end; bucket++) {
+				for (is = sh->iss_hash[bucket]; is != NULL; is = is->zis_hnext) {
+					ipsess_fold(is);
+				}
+			}
+
+			write_unlock_bh(&sh->iss_lock);
+			READ_UNLOCK(&spd_lock);
+		}
+	}
+}
+
+
+/**
+ *---------------------------------------------------------------------------
+ *
+ * @fn     int ipsess_nshards(void)
+ * @brief  Get the number of shards of the session table
+ * @param  NONE
+ * @return the number of shards for filtering sessions
+ * @date   18 Oct, 2026
+ * @see    ipsess_foreach()
+ *
+ *  Get the number of shards of the session table
+ *
+ *---------------------------------------------------------------------------
+ */
+
+int ipsess_nshards(void)
+{
+	return ipsess_nshard;
+}
+
+
+/**
+ *---------------------------------------------------------------------------
+ *
+ * @fn     uint32_t ipsess_nbuckets(int shard)
+ * @brief  Get the number of buckets of a shard
+ * @param  shard: index of the shard
+ * @return the number of buckets of the hash table of the shard
+ * @date   18 Oct, 2026
+ * @see    ipsess_foreach()
+ *
+ *  Get the number of buckets of a shard, which bounds the range walked
+ *  by ipsess_foreach().
+ *
+ *---------------------------------------------------------------------------
+ */
+
+uint32_t ipsess_nbuckets(int shard)
+{
+	return ipsess_shard[shard].iss_nbucket;
+}
+
+
+/**
+ *---------------------------------------------------------------------------
+ *
+ * @fn     uint32_t ipsess_nsess(void)
+ * @brief  Get the number of filtering sessions
  * @param  NONE
+ * @return the number of filtering sessions
+ * @date   18 Oct, 2026
+ * @see    ipsess_snapshot()
+ *
+ *  Add up the session counters of the shards without taking any lock or
+ *  walking any chain, so the result is only a close estimate.
+ *
+ *---------------------------------------------------------------------------
+ */
+
+uint32_t ipsess_nsess(void)
+{
+	uint32_t	n = 0;
+	int			i;
+
+	for (i = 0; i < ipsess_nshard; i++) {
+		n += atomic_read(&ipsess_shard[i].iss_nsess);
+	}
+
+	return n;
+}
+
+
+/**
+ *---------------------------------------------------------------------------
+ *
+ * @fn     void ipsess_foreach(int shard, uint32_t begin, uint32_t end, void (*fn)(zkipsess_t *, void *), void *arg)
+ * @brief  Call a function on the sessions of a range of buckets
+ * @param  shard: index of the shard
+ * @param  begin: the first bucket
+ * @param  end: the bucket after the last one (at most ipsess_nbuckets())
+ * @param  fn: function to be called on each session
+ * @param  arg: argument passed to fn
+ * @return NONE
+ * @date   18 Oct, 2026
+ * @see    ipsess_nshards()
+ *
+ *  Call fn on every session hashed into [begin, end) of a shard, with the
+ *  lock of the shard held for reading. Bucket numbers stay valid after
+ *  the lock is dropped, so a long walk can be split into bounded slices
+ *  without leaving a cursor on an entry that may be freed meanwhile.
+ *
+ *---------------------------------------------------------------------------
+ */
+
+void ipsess_foreach(int shard, uint32_t begin, uint32_t end, void (*fn)(zkipsess_t *, void *), void *arg)
+{
+	zkipsess_shard_t	*sh = &ipsess_shard[shard];
+	zkipsess_t			*is;
+	uint32_t			i;
+
+	if (end > sh->iss_nbucket) {
+		end = sh->iss_nbucket;
+	}
+
+	read_lock_bh(&sh->iss_lock);
+
+	for (i = begin; i < end; i++) {
+		for (is = sh->iss_hash[i]; is != NULL; is = is->zis_hnext) {
+			fn(is, arg);
+		}
+	}
+
+	read_unlock_bh(&sh->iss_lock);
+}
+
+
+/**
+ *---------------------------------------------------------------------------
+ *
+ * @fn     void ipsess_syncrule(int freerule)
+ * @brief  Make the IP session table be compatible with the rule table
+ * @param  freerule: 1 if the rules the sessions point to are going to be
+ *                   freed, 0 if they stay (only actions have changed)
  * @return NONE
  * @date   27 Jul, 2005
- * @see    NONE
+ * @see    ipsess_revalidate(), ipsess_syncslice()
  *
- *  Make the IP session table be compatible with the rule table
+ *  Make the IP session table be compatible with the rule table.
+ *  Sessions are not walked here. We only move on to a new policy
+ *  generation, and each session is rechecked either on its next packet
+ *  or by the background walker, whichever comes first. If the old rules
+ *  are going to be freed, the counters of the sessions are no longer
+ *  folded into them.
  *
  *---------------------------------------------------------------------------
  */
 
-void ipsess_syncrule(void)
+void ipsess_syncrule(int freerule)
 {
-	zkipsess_t		*is;
-	zkipsess_t		*next;
-	fisrule_t		*rule = NULL;
+	zkipsess_shard_t	*sh;
+	int					i;
+
+	/* NOTE: spd_lock is held for writing by the caller, so no session
+	 * can be revalidated against the new generation before every
+	 * cursor below has been reset.
+	 */
+
+	ipsess_gen++;
+
+	if (freerule) {
+		ipsess_rulegen = ipsess_gen;
+	}
+
+	for (i = 0; i < ipsess_nshard; i++) {
+		sh = &ipsess_shard[i];
+
+		write_lock_bh(&sh->iss_lock);
+
+		/* Restart the walk from the head even if the previous walk is not
+		 * finished yet, since every session has become stale again.
+		 */
+		sh->iss_cursor = sh->iss_head.zis_next;
+
+		write_unlock_bh(&sh->iss_lock);
+	}
+
+	mod_timer(&ipsess_synctimer, jiffies + IPSESS_SYNC_INTERVAL);
+}
+
+
+/**
+ *---------------------------------------------------------------------------
+ *
+ * @fn     int ipsess_revalidate(zkipsess_t *is)
+ * @brief  Recheck a stale session against the current FIS-tree
+ * @param  is: session table entry to be rechecked
+ * @return 1 if the session is still alive, 0 if it was deleted.
+ * @date   18 Oct, 2026
+ * @see    ipsess_syncrule(), ipsess_syncslice()
+ *
+ *  Query the current FIS-tree with the session key, and substitute the
+ *  rule of the session or delete the session.
+ *  NOTE: The caller has to hold spd_lock for reading and the lock of
+ *        the shard of the session for writing.
+ *
+ *---------------------------------------------------------------------------
+ */
+
+int ipsess_revalidate(zkipsess_t *is)
+{
+	fisrule_t		*found[SPD_NTABLE];
+	int				mask = SPD_MASK(SPD_FILTER);
+
+	if (!ipsess_isstale(is)) {
+		return 1;
+	}
+
+	/* The counts so far belong to the old rule, whether the session is
+	 * deleted or moves to another rule below */
+	ipsess_fold(is);
+
+	/* The normal NAT rule matches the outbound interface, so it comes
+	 * with the same traversal only if both interfaces are the same one.
+	 */
+	if (is->zis_oifid == is->zis_id[DIM_IFID]) {
+		mask |= SPD_MASK(SPD_NATTABLE(NAT_NORMAL));
+	}
+
+	if (spdroot == NULL) {
+		memset(found, 0x00, sizeof(found));
+	}
+	else {
+		FISTREE_QUERYMULTI(spdroot, is->zis_id, found, mask);
+	}
+
+	/* Dynamic rules are not in the FIS-tree */
+	found[SPD_FILTER] = zkdfrule_query(is->zis_id, found[SPD_FILTER]);
+
+	if (found[SPD_FILTER] == NULL) {
+		/* Delete this session since the matching rule is destroyed */
+		zkipsess_delete(is);
+		return 0;
+	}
+
+	/* NOTE: The old zis_rule may have been freed with the old SPD,
+	 * so we never compare it with the new rule.
+	 */
+	if (ipsess_substituterule(is, found, mask) < 0) {
+		return 0;
+	}
+
+	is->zis_gen = ipsess_gen;
+
+	return 1;
+}
+
+
+/**
+ *---------------------------------------------------------------------------
+ *
+ * @fn     static void ipsess_syncslice(unsigned long data)
+ * @brief  Revalidate a bounded slice of stale sessions
+ * @param  data: NOT USED
+ * @return NONE
+ * @date   18 Oct, 2026
+ * @see    ipsess_syncrule(), ipsess_revalidate()
+ *
+ *  Timer handler of the background walker. At most IPSESS_SYNC_SLICE
+ *  sessions of each shard are visited with the locks held, then the
+ *  walker reschedules itself so that the datapath gets the locks back
+ *  in between.
+ *
+ *---------------------------------------------------------------------------
+ */
+
+static void ipsess_syncslice(unsigned long data)
+{
+	zkipsess_shard_t	*sh;
+	zkipsess_t			*is;
+	int					pending = 0;
+	int					i, n;
 
-	WRITE_LOCK(&ipsess_lock);
+	READ_LOCK(&spd_lock);
 
-	is = zis_g_head.zis_next;
+	for (i = 0; i < ipsess_nshard; i++) {
+		sh = &ipsess_shard[i];
 
-	/* NOTE: The lock with spdroot is enabled before calling ipsess_syncrule()*/
-	while (is != &zis_g_head) {
-		next = is->zis_next;
+		write_lock_bh(&sh->iss_lock);
 
-		rule = FISTREE_QUERY(spdroot, is->zis_id);
+		for (n = 0; n < IPSESS_SYNC_SLICE; n++) {
+			is = sh->iss_cursor;
 
-		if (rule != NULL) {
-			if (rule != is->zis_rule) {
-				ipsess_substituterule(is, rule);
+			if (is == NULL || is == &sh->iss_head) {
+				sh->iss_cursor = NULL;
+				break;
 			}
+
+			/* zkipsess_delete() moves the cursor forward by itself */
+			sh->iss_cursor = is->zis_next;
+
+			ipsess_revalidate(is);
 		}
-		else {
-			/* Delete this session since the matching rule is destroyed */
-			zkipsess_delete(is);
+
+		if (sh->iss_cursor != NULL) {
+			pending++;
 		}
 
-		is = next;
+		write_unlock_bh(&sh->iss_lock);
 	}
 
-	WRITE_UNLOCK(&ipsess_lock);
+	READ_UNLOCK(&spd_lock);
+
+	if (pending) {
+		mod_timer(&ipsess_synctimer, jiffies + IPSESS_SYNC_INTERVAL);
+	}
 }
 
 
 /**
  *---------------------------------------------------------------------------
  *
- * @fn     static void ipsess_substituterule(zkipsess_t *is, fisrule_t *rule)
+ * @fn     static int ipsess_substituterule(zkipsess_t *is, fisrule_t *found[], int mask)
  * @brief  Substitute the rule in 'is' with a new rule
  * @param  is: session table entry to be substituted
- * @param  rule: rule to be inserted
- * @return NONE
+ * @param  found: rules found by FISTREE_QUERYMULTI(), found[SPD_FILTER] is inserted
+ * @param  mask: tables queried for found[]
+ * @return 0 if substituted, <0 if the session has been deleted.
  * @date   28 Jul, 2005
  * @see    NONE
  *
- *  Substitute the rule linked within 'is' with a new rule
+ *  Substitute the rule linked within 'is' with a new rule.
+ *  The normal NAT rule is queried again unless it is in the mask.
  *
  *---------------------------------------------------------------------------
  */
 
-static void ipsess_substituterule(zkipsess_t *is, fisrule_t *rule)
+static int ipsess_substituterule(zkipsess_t *is, fisrule_t *found[], int mask)
 {
+	fisrule_t	*rule = found[SPD_FILTER];
 	zkact_t		*action = rule->action;
+	fisrule_t	*natfound[SPD_NTABLE];
 	fisrule_t	*natrule;
-	void		*root;
+	zkdfrule_t	*dfrule;
 	int			needtolog = 0;
 	uint32_t	ifid;
 
@@ -137,21 +1146,41 @@ static void ipsess_substituterule(zkipsess_t *is, fisrule_t *rule)
 	 */
 
 	if (!(is->zis_pass & ACT_ALLOW) && (action->act_pass & ACT_ALLOW)) {
-		if ((root = natroot[NAT_NORMAL]) != NULL) {
+		if ((mask & SPD_MASK(SPD_NATTABLE(NAT_NORMAL)))) {
+			natrule = found[SPD_NATTABLE(NAT_NORMAL)];
+		}
+		else {
 			ifid = is->zis_id[DIM_IFID];
 			is->zis_id[DIM_IFID] = is->zis_oifid;
 
-			if ((natrule = FISTREE_QUERY(root, is->zis_id)) != NULL) {
-				if (!(((zknat_t *)natrule->action)->nat_flag & NAT_ELIMINATED)) {
-					zkipsess_delete(is);
-					return;
-				}
+			natfound[SPD_NATTABLE(NAT_NORMAL)] = NULL;
+
+			if (spdroot != NULL) {
+				FISTREE_QUERYMULTI(spdroot, is->zis_id, natfound, SPD_MASK(SPD_NATTABLE(NAT_NORMAL)));
 			}
 
+			natrule = natfound[SPD_NATTABLE(NAT_NORMAL)];
+
 			/* Restore the network interface field value */
 
 			is->zis_id[DIM_IFID] = ifid;
 		}
+
+		if (natrule != NULL && !(((zknat_t *)natrule->action)->nat_flag & NAT_ELIMINATED)) {
+			zkipsess_delete(is);
+			return -1;
+		}
+	}
+
+	/* Move the reference of a dynamic rule over to the new rule */
+
+	if ((is->zis_flag & IS_DFRULE)) {
+		clear_bit(IS_DFRULE_B, &is->zis_flag);
+		zkdfrule_put((zkdfrule_t *)is->zis_rule);
+	}
+
+	if ((dfrule = ZKDFRULE(rule)) != NULL) {
+		atomic_inc(&dfrule->dfrule_refcnt);
 	}
 
 	/* Now we have found a new rule, so assign appropriate fields to vars. */
@@ -160,33 +1189,40 @@ static void ipsess_substituterule(zkipsess_t *is, fisrule_t *rule)
 	is->zis_rule	= rule;
 	is->zis_ruleid	= action->act_pid;
 
+	if (dfrule != NULL) {
+		set_bit(IS_DFRULE_B, &is->zis_flag);
+	}
+
 	/* Write logs */
 	if (needtolog) {
 /*        sweeplog_session(is, " (CHANGED)");*/
 	}
+
+	return 0;
 }
 
 
 /**
  *---------------------------------------------------------------------------
  *
- * @fn     void zkipsess_delete(zkipsess_t *is)
- * @brief  Delete an IP session entry
- * @param  is: session table entry to be deleted
+ * @fn     static void ipsess_unlink(zkipsess_t *is)
+ * @brief  Unlink an IP session entry from the session table
+ * @param  is: session table entry to be unlinked
  * @return NONE
- * @date   28 Jul, 2005
- * @see    NONE
+ * @date   18 Oct, 2026
+ * @see    zkipsess_delete(), ipsess_expireslice()
  *
- *  Delete an IP session entry. If the reference count value is not 0, 
- *  Do not delete the entry really and just release hash table connections
- *  and update statistics.
+ *  Unlink an IP session entry from the list and the hash chain of its
+ *  shard and from its NAT sessions, without releasing the reference of
+ *  the session table. Both links are doubly linked, so this is O(1).
+ *  NOTE: The caller has to hold the lock of the shard of the session.
  *
  *---------------------------------------------------------------------------
  */
 
-void zkipsess_delete(zkipsess_t *is)
+static void ipsess_unlink(zkipsess_t *is)
 {
-	zkipsess_t	*hold;
+	zkipsess_shard_t	*sh = &ipsess_shard[is->zis_shard];
 
 	/* Write logs */
 
@@ -194,26 +1230,26 @@ void zkipsess_delete(zkipsess_t *is)
 /*        sweeplog_session_delete(is);*/
 /*    }*/
 
-	/* Fetch a session entry from the global linked list */
+	/* Do not leave the walkers on a dead entry */
+	if (sh->iss_cursor == is) {
+		sh->iss_cursor = is->zis_next;
+	}
+
+	if (sh->iss_expcursor == is) {
+		sh->iss_expcursor = is->zis_next;
+	}
+
+	/* Fetch a session entry from the linked list of the shard */
 	is->zis_prev->zis_next = is->zis_next;
 	is->zis_next->zis_prev = is->zis_prev;
 
 	/* Remove from the hash table */
+	ipsess_hunlink(is);
 
-	hold = zis_hash[is->zis_hv];
+	atomic_dec(&sh->iss_nsess);
 
-	if (hold == is) {
-		zis_hash[is->zis_hv] = is->zis_hnext;
-	}
-	else {
-		while (hold->zis_hnext != is) {
-			hold = hold->zis_hnext;
-		}
-
-		hold->zis_hnext = is->zis_hnext;
-	}
-
-	atomic_dec(&nipsess);
+	/* Let the offload tables drop their references */
+	set_bit(IS_DEAD_B, &is->zis_flag);
 
 	/* Delete NAT sessions */
 	if (is->zis_natsess[NAT_REDIR] != NULL) {
@@ -223,9 +1259,30 @@ void zkipsess_delete(zkipsess_t *is)
 	if (is->zis_natsess[NAT_NORMAL] != NULL) {
 		zkipsess_deletenat(is->zis_natsess[NAT_NORMAL]);
 	}
+}
+
 
-	/* */
+/**
+ *---------------------------------------------------------------------------
+ *
+ * @fn     void zkipsess_delete(zkipsess_t *is)
+ * @brief  Delete an IP session entry
+ * @param  is: session table entry to be deleted
+ * @return NONE
+ * @date   28 Jul, 2005
+ * @see    ipsess_unlink()
+ *
+ *  Delete an IP session entry. If the reference count value is not 0, 
+ *  Do not delete the entry really and just release hash table connections
+ *  and update statistics.
+ *  NOTE: The caller has to hold the lock of the shard of the session.
+ *
+ *---------------------------------------------------------------------------
+ */
 
+void zkipsess_delete(zkipsess_t *is)
+{
+	ipsess_unlink(is);
 	ipsess_release(is);
 }
 
@@ -247,29 +1304,93 @@ void zkipsess_delete(zkipsess_t *is)
 
 void zkipsess_deletenat(zkipsess_t *is)
 {
-	zkipsess_t		*hold;
+	write_lock_bh(&ipsess_nat.iss_lock);
 
-	ns_num--;
+	atomic_dec(&ipsess_nat.iss_nsess);
 
 	/* Fetch a NAT session from the global linked list */
 	is->zis_prev->zis_next = is->zis_next;
 	is->zis_next->zis_prev = is->zis_prev;
 
 	/* Fetch a NAT session from the hash table */
+	ipsess_hunlink(is);
 
-	hold = zis_hash[is->zis_hv];
+	write_unlock_bh(&ipsess_nat.iss_lock);
+}
 
-	if (hold == is) {
-		zis_hash[is->zis_hv] = is->zis_hnext;
-	}
-	else {
-		while (hold->zis_hnext != is) {
-			hold = hold->zis_hnext;
+
+/**
+ *---------------------------------------------------------------------------
+ *
+ * @fn     static void ipsess_expireslice(unsigned long data)
+ * @brief  Remove expired sessions, a bounded slice at a time
+ * @param  data: NOT USED
+ * @return NONE
+ * @date   18 Oct, 2026
+ * @see    ipsess_unlink(), ipsess_timeout()
+ *
+ *  Timer handler of the expiry sweeper. IPSESS_EXPIRE_SLICE sessions of
+ *  each shard are checked per tick. Expired sessions are unlinked with
+ *  the lock held and chained on a private reap list through zis_hnext,
+ *  which is free once a session is out of its hash chain. The whole list
+ *  is released in one pass after the lock is dropped, so freeing memory
+ *  never extends the critical section.
+ *
+ *---------------------------------------------------------------------------
+ */
+
+static void ipsess_expireslice(unsigned long data)
+{
+	zkipsess_shard_t	*sh;
+	zkipsess_t			*is, *reap = NULL;
+	int					i, n;
+
+	for (i = 0; i < ipsess_nshard; i++) {
+		sh = &ipsess_shard[i];
+
+		READ_LOCK(&spd_lock);
+		write_lock_bh(&sh->iss_lock);
+
+		if (sh->iss_expcursor == NULL) {
+			sh->iss_expcursor = sh->iss_head.zis_next;
+		}
+
+		for (n = 0; n < IPSESS_EXPIRE_SLICE; n++) {
+			is = sh->iss_expcursor;
+
+			if (is == &sh->iss_head) {
+				/* Start over from the head on the next tick */
+				sh->iss_expcursor = NULL;
+				break;
+			}
+
+			sh->iss_expcursor = is->zis_next;
+
+			/* Flush counters of live sessions as well, so that rule
+			 * counters lag at most one sweep behind */
+			ipsess_fold(is);
+
+			if (time_before(jiffies, is->zis_age + ipsess_timeout(is))) {
+				continue;
+			}
+
+			ipsess_unlink(is);
+
+			is->zis_hnext = reap;
+			reap = is;
 		}
 
-		hold->zis_hnext = is->zis_hnext;
+		write_unlock_bh(&sh->iss_lock);
+		READ_UNLOCK(&spd_lock);
 	}
 
+	/* Drop the references of the session table */
+	while ((is = reap) != NULL) {
+		reap = is->zis_hnext;
+		ipsess_release(is);
+	}
+
+	mod_timer(&ipsess_expiretimer, jiffies + IPSESS_EXPIRE_INTERVAL);
 }
 
 
@@ -304,6 +1425,11 @@ void zkipsess_destroy(zkipsess_t *is)
 		}
 	}
 
+	/* Drop the reference to a dynamic rule */
+	if ((is->zis_flag & IS_DFRULE)) {
+		zkdfrule_put((zkdfrule_t *)is->zis_rule);
+	}
+
 	/* Deallocate memories */
 	KFREES(is);
 }
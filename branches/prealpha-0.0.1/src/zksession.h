@@ -31,7 +31,13 @@
 #ifndef __ZKSESSION_H__
 #define __ZKSESSION_H__
 
+#include <linux/in.h>				/* IPPROTO_TCP */
+
 #include "zelkova.h"
+#include "zkhash.h"
+#include "zktcp.h"
+
+struct zkpktinfo;
 
 /* zkipsess_t */
 
@@ -40,17 +46,20 @@ typedef struct zkipsess {
 	struct zkipsess		*zis_next;	/* The next node of linked list */
 
 	struct zkipsess		*zis_hnext;	/* The next node of hash chain */
+	struct zkipsess		**zis_hpprev;	/* zis_hnext of the previous node
+									 * (or the bucket) pointing to this node */
 
 	union {
 		uint32_t		id[MAX_FISTREE_DIM];	/* classification id. */
 		uint16_t		pd[MAX_FISTREE_DIM << 1];	/* (protocol/port) */
 	} zis_i;
 
-	uint32_t			zis_hv;		/* session hash vector */
+	uint32_t			zis_hv;		/* session hash vector (zkhash_tuple()) */
 
-	uint32_t			zis_flag;	/* flags */
+	unsigned long		zis_flag;	/* flags (set_bit() once in the table) */
 	uint32_t			zis_pass;	/* filtering action */
-	uint32_t			zis_age;	/* age value of session table entry */
+	uint32_t			zis_age;	/* age value of session table entry
+									 * (jiffies of the last packet) */
 
 	fisrule_t			*zis_rule;	/* The selected rule */
 
@@ -60,6 +69,20 @@ typedef struct zkipsess {
 
 	uint32_t			zis_ruleid;	/* rule id. (32bit integer) */
 
+	uint32_t			zis_gen;	/* policy generation zis_rule was validated on */
+
+	uint32_t			zis_shard;	/* index of the shard which owns this entry */
+
+	uint32_t			zis_pkts[2];	/* packet counts (request, response) */
+	uint64_t			zis_bytes[2];	/* byte counts (request, response) */
+	uint32_t			zis_foldpkts;	/* packets already added to the rule */
+	uint64_t			zis_foldbytes;	/* bytes already added to the rule */
+
+	uint32_t			zis_tcpstate;	/* TCP state (TCP_S_*) */
+	zktcpdir_t			zis_tcp[2];	/* TCP windows (request, response) */
+
+	spinlock_t			zis_lock;	/* lock of the counters and the TCP state */
+
 	atomic_t			zis_refcnt;	/* reference count.(for filtering session) */
 } zkipsess_t;
 
@@ -69,23 +92,186 @@ typedef struct zkipsess {
 /* zkipsess_t::zis_flag */
 
 #define IS_ISTOTRUSTED		0x00000001	/**< ? */
+#define IS_ESTABLISHED		0x00000002	/**< Has a response been seen? */
+#define IS_DEAD				0x00000004	/**< Has it been removed from the table? */
+#define IS_DFRULE			0x00000008	/**< Does zis_rule hold a dynamic rule? */
 #define IS_REDIRECTNAT		0x00000010	/**< Is it a redirect NAT session? */
 #define IS_NORMALNAT		0x00000020	/**< Is it a normal NAT session? */
 #define IS_NAT				0x00000030	/**< Is it a normal NAT session? */
 
+/* Bit numbers of the flags which change while the session is in the
+ * table. Packets update sessions under the read lock of the shard or
+ * none, so these are only changed with set_bit() and clear_bit().
+ */
+
+#define IS_ESTABLISHED_B	1			/**< IS_ESTABLISHED */
+#define IS_DEAD_B			2			/**< IS_DEAD */
+#define IS_DFRULE_B			3			/**< IS_DFRULE */
+
 
 #define MAX_ZKIPSESS	262139		/**< IP session table size. (< 256K) */
 
+#define IPSESS_BUCKET(sh, hv)	((hv) % (sh)->iss_nbucket)	/**< Hash vector to iss_hash index */
+
+#define IPSESS_LONGCHAIN	8			/**< Chains longer than this are suspicious */
+#define IPSESS_NCHAINHIST	16			/**< Number of chain length histogram slots */
+
+#define IPSESS_EVICT_SPAN	8			/**< Buckets searched for an eviction victim */
+#define IPSESS_IDLE_TIMEOUT	(60 * HZ)	/**< Established sessions idle longer may be evicted */
+
+#define IPSESS_TIMEOUT			(30 * 60 * HZ)	/**< Lifetime of an idle established session */
+#define IPSESS_EMBRYONIC_TIMEOUT	(30 * HZ)	/**< Lifetime of an unestablished session */
+
+#define IPSESS_EXPIRE_SLICE		4096		/**< Sessions checked for expiry per tick */
+#define IPSESS_EXPIRE_INTERVAL	(HZ / 10)	/**< Interval between expiry ticks */
+
+#define IPSESS_SYNC_SLICE		1024		/**< Sessions revalidated per walker tick */
+#define IPSESS_SYNC_INTERVAL	(HZ / 10)	/**< Interval between walker ticks */
+
+extern uint32_t	ipsess_gen;		/**< Current policy generation */
+
+/* zk_sess_stat_t
+ * :Session table statistics (SIOCGETSESSST)
+ */
+
+typedef struct zk_sess_stat {
+	uint32_t		zss_nsess;			/* Number of sessions */
+	uint32_t		zss_nshard;			/* Number of session table shards */
+	uint32_t		zss_maxsess;		/* Ceiling of the number of sessions */
+	uint32_t		zss_nevict;			/* Sessions evicted to make room */
+	uint32_t		zss_nevictfail;		/* New sessions refused since nothing could be evicted */
+	uint32_t		zss_nlongchain;		/* Lookups walking more than IPSESS_LONGCHAIN */
+	uint32_t		zss_maxchain;		/* The longest chain at the time of the query */
+	uint32_t		zss_hist[IPSESS_NCHAINHIST];	/* Buckets per chain length
+												 * (the last slot counts longer ones) */
+	uint32_t		zss_nfraghold;		/* Fragments held until their first one */
+	uint32_t		zss_nfragdrop;		/* Fragments dropped before their first one */
+} zk_sess_stat_t;
+
+/* zksessrec_t
+ * :A session record of the snapshot mapped by DEV_SESSION.
+ *  Fixed at 64 bytes, so that a page holds a whole number of records.
+ */
+
+typedef struct zksessrec {
+	uint32_t		zsr_id[MAX_FISTREE_DIM];	/* 5-tuple (classification id.) */
+	uint32_t		zsr_pass;		/* filtering action */
+	uint32_t		zsr_ruleid;		/* rule id. */
+	uint32_t		zsr_age;		/* seconds since the last packet */
+	uint32_t		zsr_flag;		/* zis_flag */
+	uint32_t		zsr_pkts[2];	/* packet counts (request, response) */
+	uint32_t		zsr_tcpstate;	/* TCP state (TCP_S_*) */
+	uint64_t		zsr_bytes[2];	/* byte counts (request, response) */
+} zksessrec_t;
+
+/* zksesssnap_t
+ * :Header on the first page of the snapshot (SIOCSNAPSESS).
+ *  Records start on the second page and never straddle a page.
+ */
+
+typedef struct zksesssnap {
+	uint32_t		zsn_magic;		/* ZKSESSSNAP_MAGIC */
+	uint32_t		zsn_recsize;	/* sizeof(zksessrec_t) */
+	uint32_t		zsn_nrec;		/* number of records */
+	uint32_t		zsn_npage;		/* number of pages including this one */
+	uint32_t		zsn_gen;		/* policy generation at the snapshot */
+	uint32_t		zsn_time;		/* jiffies at the snapshot */
+} zksesssnap_t;
+
+#define ZKSESSSNAP_MAGIC	0x7a6b7373	/* "zkss" */
+
+#ifdef __KERNEL__
+
+/* zkipsess_shard_t
+ * :A slice of the session table with its own lock, list and hash table
+ */
+
+typedef struct zkipsess_shard {
+	rwlock_t			iss_lock;	/* A lock with this shard */
+	zkipsess_t			iss_head;	/* Head of the linked list of sessions */
+	zkipsess_t			**iss_hash;	/* Hash table */
+	uint32_t			iss_nbucket;	/* Number of buckets of iss_hash */
+	atomic_t			iss_nsess;	/* Number of sessions in this shard */
+	uint32_t			iss_max;	/* Ceiling of iss_nsess */
+	uint32_t			iss_nevict;	/* Number of evicted sessions */
+	uint32_t			iss_nevictfail;	/* Number of refused sessions */
+	zkipsess_t			*iss_cursor;	/* Next session to be revalidated */
+	zkipsess_t			*iss_expcursor;	/* Next session to be checked for expiry */
+} ____cacheline_aligned zkipsess_shard_t;
+
+#endif	/* __KERNEL__ */
+
 
 /*
  * Function Declarations
  */
-void ipsess_syncrule(void);
+int ipsess_init(int percpu, int maxsess);
+void ipsess_clean(void);
+void ipsess_syncrule(int freerule);
+int ipsess_revalidate(zkipsess_t *is);
+void ipsess_getstat(zk_sess_stat_t *st);
+void ipsess_foldstat(void);
+int ipsess_nshards(void);
+uint32_t ipsess_nbuckets(int shard);
+uint32_t ipsess_nsess(void);
+void ipsess_foreach(int shard, uint32_t begin, uint32_t end, void (*fn)(zkipsess_t *, void *), void *arg);
+zkipsess_t *zkipsess_lookup(struct zkpktinfo *pi);
+zkipsess_t *zkipsess_create(struct zkpktinfo *pi, fisrule_t *rule);
+void ipsess_account(zkipsess_t *is, int dir, uint32_t pkts, uint64_t bytes);
 void zkipsess_delete(zkipsess_t *is);
 void zkipsess_deletenat(zkipsess_t *is);
 void zkipsess_destroy(zkipsess_t *is);
 
+/* (in zksnap.c) */
+int ipsess_snapshot(zksesssnap_t *hdr);
+void ipsess_snapclean(void);
+
 #ifdef __KERNEL__
+struct file;
+struct vm_area_struct;
+struct sk_buff;
+
+int ipsess_track(zkipsess_t *is, int dir, struct sk_buff *skb);
+
+int ipsess_snapmmap(struct file *file, struct vm_area_struct *vma);
+
+/* ipsess_isstale(): Is the session classified on an older policy, or on
+ * a dynamic rule taken out since? zis_rule of a stale session may point
+ * into a freed SPD, so callers have to run ipsess_revalidate() before
+ * looking at it. A dynamic rule is held by its sessions and may always
+ * be looked at.
+ */
+
+static inline int ipsess_isstale(zkipsess_t *is)
+{
+	return (is->zis_gen != ipsess_gen ||
+			((is->zis_flag & IS_DFRULE) && ((zkdfrule_t *)is->zis_rule)->dfrule_dead));
+}
+
+/* ipsess_istcp(): Is it a TCP session? */
+
+static inline int ipsess_istcp(zkipsess_t *is)
+{
+	return (is->zis_id[DIM_SRCPORT] >> 16) == IPPROTO_TCP;
+}
+
+/* ipsess_touch(): Record a packet of len bytes on a session */
+
+static inline void ipsess_touch(zkipsess_t *is, int dir, uint32_t len)
+{
+	ipsess_account(is, dir, 1, len);
+}
+
+/* ipsess_timeout(): Lifetime of a session after its last packet */
+
+static inline unsigned long ipsess_timeout(zkipsess_t *is)
+{
+	if (is->zis_tcpstate != TCP_S_NONE) {
+		return zktcp_timeout[is->zis_tcpstate];
+	}
+
+	return (is->zis_flag & IS_ESTABLISHED) ? IPSESS_TIMEOUT : IPSESS_EMBRYONIC_TIMEOUT;
+}
 
 /* ipsess_release(): Decrement the reference count by one
  * If the reference count has reached 0, destroy the session entry.
@@ -0,0 +1,384 @@
+/*
+ *----------------------------------------------------------------------------
+ *
+ * Zelkova - A Firewall and Intrusion Prevention System on Linux Kernel
+ *
+ * Copyright (C) 2005 Dongsu Park <advance@dongsu.pe.kr>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111, USA.
+ *
+ * $Id$
+ *----------------------------------------------------------------------------
+ */
+
+/** @file zksnap.c
+ * Exports snapshots of the session table through mmap()
+ */
+
+#define __NO_VERSION__
+
+#include <linux/kernel.h>			/* printk() */
+#include <linux/sched.h>			/* jiffies */
+#include <linux/mm.h>				/* vm_area_struct, get_zeroed_page() */
+#include <linux/vmalloc.h>			/* vmalloc(), vfree() */
+#include <asm/semaphore.h>			/* DECLARE_MUTEX() */
+
+#include "zksession.h"
+
+
+/* zksnap_t
+ * :A snapshot. Every page is allocated on its own, so that a large
+ *  snapshot never needs physically contiguous memory.
+ */
+
+typedef struct zksnap {
+	atomic_t		snap_refcnt;	/* the current snapshot + mappings */
+	uint32_t		snap_npage;		/* number of pages */
+	uint32_t		snap_nrec;		/* number of records filled */
+	uint32_t		snap_maxrec;	/* number of records allocated */
+	unsigned long	*snap_page;		/* addresses of pages */
+} zksnap_t;
+
+#define SNAP_RECPERPAGE		(PAGE_SIZE / sizeof(zksessrec_t))
+#define SNAP_SLICE			4096	/**< Buckets copied per lock hold */
+
+static DECLARE_MUTEX(snap_sem);		/**< Serializes snapshots and mmap() */
+
+static zksnap_t		*ipsess_snap = NULL;	/**< The latest snapshot */
+
+static void snap_put(zksnap_t *snap);
+static void snap_vmopen(struct vm_area_struct *vma);
+static void snap_vmclose(struct vm_area_struct *vma);
+static struct page *snap_vmnopage(struct vm_area_struct *vma, unsigned long address, int write_access);
+
+static struct vm_operations_struct snap_vmops = {
+	.open		= snap_vmopen,
+	.close		= snap_vmclose,
+	.nopage		= snap_vmnopage,
+};
+
+
+/**
+ *---------------------------------------------------------------------------
+ *
+ * @fn     static zksnap_t *snap_alloc(uint32_t nrec)
+ * @brief  Allocate a snapshot
+ * @param  nrec: number of records to be allocated
+ * @return a snapshot if normal, NULL if out of memory.
+ * @date   18 Oct, 2026
+ * @see    snap_put()
+ *
+ *  Allocate a header page and enough pages for nrec records.
+ *
+ *---------------------------------------------------------------------------
+ */
+
+static zksnap_t *snap_alloc(uint32_t nrec)
+{
+	zksnap_t	*snap;
+	uint32_t	i;
+
+	if ((snap = (zksnap_t *)kmalloc(sizeof(zksnap_t), GFP_KERNEL)) == NULL) {
+		return NULL;
+	}
+
+	snap->snap_npage	= 1 + (nrec + SNAP_RECPERPAGE - 1) / SNAP_RECPERPAGE;
+	snap->snap_maxrec	= (snap->snap_npage - 1) * SNAP_RECPERPAGE;
+	snap->snap_nrec		= 0;
+
+	atomic_set(&snap->snap_refcnt, 1);
+
+	snap->snap_page = (unsigned long *)vmalloc(sizeof(unsigned long) * snap->snap_npage);
+	if (snap->snap_page == NULL) {
+		kfree(snap);
+		return NULL;
+	}
+
+	for (i = 0; i < snap->snap_npage; i++) {
+		if ((snap->snap_page[i] = get_zeroed_page(GFP_KERNEL)) == 0) {
+			snap->snap_npage = i;
+			snap_put(snap);
+
+			return NULL;
+		}
+	}
+
+	return snap;
+}
+
+
+/**
+ *---------------------------------------------------------------------------
+ *
+ * @fn     static void snap_put(zksnap_t *snap)
+ * @brief  Drop a reference of a snapshot
+ * @param  snap: snapshot
+ * @return NONE
+ * @date   18 Oct, 2026
+ * @see    snap_alloc()
+ *
+ *  Drop a reference of a snapshot, and free it with the last reference.
+ *
+ *---------------------------------------------------------------------------
+ */
+
+static void snap_put(zksnap_t *snap)
+{
+	uint32_t	i;
+
+	if (snap == NULL || !atomic_dec_and_test(&snap->snap_refcnt)) {
+		return;
+	}
+
+	for (i = 0; i < snap->snap_npage; i++) {
+		free_page(snap->snap_page[i]);
+	}
+
+	vfree(snap->snap_page);
+	kfree(snap);
+}
+
+
+/**
+ *---------------------------------------------------------------------------
+ *
+ * @fn     static void snap_record(zkipsess_t *is, void *arg)
+ * @brief  Copy a session into the next record of a snapshot
+ * @param  is: session
+ * @param  arg: snapshot
+ * @return NONE
+ * @date   18 Oct, 2026
+ * @see    ipsess_snapshot()
+ *
+ *  Copy a session into the next record of a snapshot. Sessions which
+ *  do not fit are skipped.
+ *
+ *---------------------------------------------------------------------------
+ */
+
+static void snap_record(zkipsess_t *is, void *arg)
+{
+	zksnap_t		*snap = (zksnap_t *)arg;
+	zksessrec_t		*rec;
+	uint32_t		n = snap->snap_nrec;
+
+	if (n >= snap->snap_maxrec) {
+		return;
+	}
+
+	rec = (zksessrec_t *)snap->snap_page[1 + n / SNAP_RECPERPAGE] + n % SNAP_RECPERPAGE;
+
+	memcpy(rec->zsr_id, is->zis_id, sizeof(rec->zsr_id));
+
+	rec->zsr_pass		= is->zis_pass;
+	rec->zsr_ruleid		= is->zis_ruleid;
+	rec->zsr_age		= (jiffies - is->zis_age) / HZ;
+	rec->zsr_flag		= is->zis_flag;
+
+	/* Packets update these under the lock of the session only */
+	spin_lock(&is->zis_lock);
+	rec->zsr_tcpstate	= is->zis_tcpstate;
+	rec->zsr_pkts[0]	= is->zis_pkts[0];
+	rec->zsr_pkts[1]	= is->zis_pkts[1];
+	rec->zsr_bytes[0]	= is->zis_bytes[0];
+	rec->zsr_bytes[1]	= is->zis_bytes[1];
+	spin_unlock(&is->zis_lock);
+
+	snap->snap_nrec++;
+}
+
+
+/**
+ *---------------------------------------------------------------------------
+ *
+ * @fn     int ipsess_snapshot(zksesssnap_t *hdr)
+ * @brief  Take a snapshot of the session table
+ * @param  hdr: (out) header of the new snapshot
+ * @return 0 if normal, <0 if abnormal.
+ * @date   18 Oct, 2026
+ * @see    ipsess_snapmmap()
+ *
+ *  Take a snapshot of the session table into fixed-size records, which
+ *  monitoring tools read through mmap() on DEV_SESSION.
+ *  Shards are copied SNAP_SLICE buckets at a time with only the read
+ *  lock held, so the datapath keeps going while millions of entries are
+ *  exported. The snapshot is therefore not atomic; sessions created
+ *  during the copy may or may not appear in it.
+ *
+ *---------------------------------------------------------------------------
+ */
+
+int ipsess_snapshot(zksesssnap_t *hdr)
+{
+	zksnap_t		*snap, *old;
+	uint32_t		nrec, bucket;
+	int				i;
+
+	/* Size the snapshot from the shard counters with some headroom */
+	nrec = ipsess_nsess();
+	nrec += (nrec >> 3) + SNAP_RECPERPAGE;
+
+	down(&snap_sem);
+
+	if ((snap = snap_alloc(nrec)) == NULL) {
+		up(&snap_sem);
+		return -ENOMEM;
+	}
+
+	for (i = 0; i < ipsess_nshards(); i++) {
+		for (bucket = 0; bucket < ipsess_nbuckets(i); bucket += SNAP_SLICE) {
+			ipsess_foreach(i, bucket, bucket + SNAP_SLICE, snap_record, snap);
+		}
+	}
+
+	hdr->zsn_magic		= ZKSESSSNAP_MAGIC;
+	hdr->zsn_recsize	= sizeof(zksessrec_t);
+	hdr->zsn_nrec		= snap->snap_nrec;
+	hdr->zsn_npage		= snap->snap_npage;
+	hdr->zsn_gen		= ipsess_gen;
+	hdr->zsn_time		= jiffies;
+
+	memcpy((void *)snap->snap_page[0], hdr, sizeof(zksesssnap_t));
+
+	/* Replace the latest snapshot. Mappings of the old one stay valid
+	 * until they are unmapped.
+	 */
+	old = ipsess_snap;
+	ipsess_snap = snap;
+
+	up(&snap_sem);
+
+	snap_put(old);
+
+	return 0;
+}
+
+
+/**
+ *---------------------------------------------------------------------------
+ *
+ * @fn     void ipsess_snapclean(void)
+ * @brief  Release the latest snapshot
+ * @param  NONE
+ * @return NONE
+ * @date   18 Oct, 2026
+ * @see    ipsess_snapshot()
+ *
+ *  Release the latest snapshot
+ *
+ *---------------------------------------------------------------------------
+ */
+
+void ipsess_snapclean(void)
+{
+	zksnap_t	*old;
+
+	down(&snap_sem);
+
+	old = ipsess_snap;
+	ipsess_snap = NULL;
+
+	up(&snap_sem);
+
+	snap_put(old);
+}
+
+
+/**
+ *---------------------------------------------------------------------------
+ *
+ * @fn     int ipsess_snapmmap(struct file *file, struct vm_area_struct *vma)
+ * @brief  Map the latest snapshot into user space
+ * @param  file: file of DEV_SESSION
+ * @param  vma: area to be mapped
+ * @return 0 if normal, <0 if abnormal.
+ * @date   18 Oct, 2026
+ * @see    ipsess_snapshot()
+ *
+ *  Map the latest snapshot read-only. Pages are handed out on demand by
+ *  snap_vmnopage(), so nothing is copied.
+ *
+ *---------------------------------------------------------------------------
+ */
+
+int ipsess_snapmmap(struct file *file, struct vm_area_struct *vma)
+{
+	zksnap_t		*snap;
+	unsigned long	npage = (vma->vm_end - vma->vm_start) >> PAGE_SHIFT;
+
+	if ((vma->vm_flags & VM_WRITE)) {
+		return -EPERM;
+	}
+
+	/* Nor may it be made writable later with mprotect() */
+	vma->vm_flags &= ~VM_MAYWRITE;
+
+	down(&snap_sem);
+
+	if ((snap = ipsess_snap) == NULL) {
+		up(&snap_sem);
+		return -ENXIO;
+	}
+
+	if (vma->vm_pgoff + npage > snap->snap_npage) {
+		up(&snap_sem);
+		return -EINVAL;
+	}
+
+	atomic_inc(&snap->snap_refcnt);
+
+	up(&snap_sem);
+
+	vma->vm_ops				= &snap_vmops;
+	vma->vm_private_data	= snap;
+	vma->vm_flags			|= VM_RESERVED;
+
+	return 0;
+}
+
+
+/* snap_vmopen(): A mapping has been duplicated (fork) */
+
+static void snap_vmopen(struct vm_area_struct *vma)
+{
+	atomic_inc(&((zksnap_t *)vma->vm_private_data)->snap_refcnt);
+}
+
+/* snap_vmclose(): A mapping has been removed */
+
+static void snap_vmclose(struct vm_area_struct *vma)
+{
+	snap_put((zksnap_t *)vma->vm_private_data);
+}
+
+/* snap_vmnopage(): Hand out a page of the snapshot */
+
+static struct page *snap_vmnopage(struct vm_area_struct *vma, unsigned long address, int write_access)
+{
+	zksnap_t		*snap = (zksnap_t *)vma->vm_private_data;
+	unsigned long	pgoff;
+	struct page		*page;
+
+	pgoff = ((address - vma->vm_start) >> PAGE_SHIFT) + vma->vm_pgoff;
+
+	if (pgoff >= snap->snap_npage) {
+		return NOPAGE_SIGBUS;
+	}
+
+	page = virt_to_page((void *)snap->snap_page[pgoff]);
+	get_page(page);
+
+	return page;
+}
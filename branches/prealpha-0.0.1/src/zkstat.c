@@ -0,0 +1,220 @@
+/*
+ *----------------------------------------------------------------------------
+ *
+ * Zelkova - A Firewall and Intrusion Prevention System on Linux Kernel
+ *
+ * Copyright (C) 2005 Dongsu Park <advance@dongsu.pe.kr>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111, USA.
+ *
+ * $Id$
+ *----------------------------------------------------------------------------
+ */
+
+/** @file zkstat.c
+ * Keeps packet, byte and verdict counters per CPU
+ */
+
+#define __NO_VERSION__
+
+#include <linux/kernel.h>			/* printk() */
+#include <linux/smp.h>				/* smp_num_cpus, cpu_logical_map() */
+#include <linux/vmalloc.h>			/* vmalloc(), vfree() */
+#include <linux/interrupt.h>		/* local_bh_disable() */
+
+#include "zelkova.h"
+#include "zkstat.h"
+
+
+zkstatcpu_t		zkstat_cpu[NR_CPUS];	/**< Counters per CPU */
+
+/* zkstat_readbegin(): Start reading the counters of a CPU */
+
+static inline uint32_t zkstat_readbegin(zkstatcpu_t *sc)
+{
+#if BITS_PER_LONG == 32
+	uint32_t	seq;
+
+	while (((seq = sc->zsc_seq) & 1)) {
+		barrier();
+	}
+
+	smp_rmb();
+
+	return seq;
+#else
+	return 0;
+#endif
+}
+
+/* zkstat_readretry(): Has the CPU updated its counters while reading? */
+
+static inline int zkstat_readretry(zkstatcpu_t *sc, uint32_t seq)
+{
+#if BITS_PER_LONG == 32
+	smp_rmb();
+
+	return sc->zsc_seq != seq;
+#else
+	return 0;
+#endif
+}
+
+
+/**
+ *---------------------------------------------------------------------------
+ *
+ * @fn     zkactstat_t *zkstat_alloc(uint32_t nelem)
+ * @brief  Allocate rule counters of every CPU
+ * @param  nelem: number of rules
+ * @return counters if normal, NULL if out of memory.
+ * @date   18 Oct, 2026
+ * @see    zkstat_free()
+ *
+ *  Allocate rule counters of every CPU. The counters of a CPU are laid
+ *  out together, so that no two CPUs write the same cache line.
+ *
+ *---------------------------------------------------------------------------
+ */
+
+zkactstat_t *zkstat_alloc(uint32_t nelem)
+{
+	zkactstat_t		*stat;
+	size_t			size = sizeof(zkactstat_t) * nelem * smp_num_cpus;
+
+	if ((stat = (zkactstat_t *)vmalloc(size)) == NULL) {
+		return NULL;
+	}
+
+	memset(stat, 0x00, size);
+
+	return stat;
+}
+
+
+/**
+ *---------------------------------------------------------------------------
+ *
+ * @fn     void zkstat_free(zkactstat_t *stat)
+ * @brief  Free rule counters
+ * @param  stat: counters allocated by zkstat_alloc()
+ * @return NONE
+ * @date   18 Oct, 2026
+ * @see    zkstat_alloc()
+ *
+ *  Free rule counters
+ *
+ *---------------------------------------------------------------------------
+ */
+
+void zkstat_free(zkactstat_t *stat)
+{
+	if (stat != NULL) {
+		vfree(stat);
+	}
+}
+
+
+/**
+ *---------------------------------------------------------------------------
+ *
+ * @fn     void zkstat_sumfilter(uint64_t nallow[2], uint64_t ndrop[2])
+ * @brief  Sum the verdict counters of all CPUs
+ * @param  nallow: (out) allowed packets (inbound, outbound)
+ * @param  ndrop: (out) dropped packets (inbound, outbound)
+ * @return NONE
+ * @date   18 Oct, 2026
+ * @see    zkstat_verdict()
+ *
+ *  Sum the verdict counters of all CPUs
+ *
+ *---------------------------------------------------------------------------
+ */
+
+void zkstat_sumfilter(uint64_t nallow[2], uint64_t ndrop[2])
+{
+	zkstatcpu_t		*sc;
+	uint64_t		a0, a1, d0, d1;
+	uint32_t		seq;
+	int				i;
+
+	nallow[0] = nallow[1] = 0;
+	ndrop[0] = ndrop[1] = 0;
+
+	for (i = 0; i < smp_num_cpus; i++) {
+		sc = &zkstat_cpu[cpu_logical_map(i)];
+
+		do {
+			seq = zkstat_readbegin(sc);
+
+			a0 = sc->zsc_nallow[0];
+			a1 = sc->zsc_nallow[1];
+			d0 = sc->zsc_ndrop[0];
+			d1 = sc->zsc_ndrop[1];
+		} while (zkstat_readretry(sc, seq));
+
+		nallow[0] += a0;
+		nallow[1] += a1;
+		ndrop[0] += d0;
+		ndrop[1] += d1;
+	}
+}
+
+
+/**
+ *---------------------------------------------------------------------------
+ *
+ * @fn     void zkstat_sumrule(zkact_t *act, zkactstat_t *sum)
+ * @brief  Sum the counters of a rule over all CPUs
+ * @param  act: action of the rule
+ * @param  sum: (out) counters
+ * @return NONE
+ * @date   18 Oct, 2026
+ * @see    zkstat_hit(), zkstat_rule()
+ *
+ *  Sum the counters of a rule over all CPUs. Rules without per-CPU
+ *  counters (dynamic rules) report zero.
+ *
+ *---------------------------------------------------------------------------
+ */
+
+void zkstat_sumrule(zkact_t *act, zkactstat_t *sum)
+{
+	zkstatcpu_t		*sc;
+	zkactstat_t		*as, tmp;
+	uint32_t		seq;
+	int				i;
+
+	memset(sum, 0x00, sizeof(zkactstat_t));
+
+	if (act->act_stat == NULL) {
+		return;
+	}
+
+	for (i = 0; i < smp_num_cpus; i++) {
+		sc = &zkstat_cpu[cpu_logical_map(i)];
+		as = act->act_stat + i * act->act_nstat;
+
+		do {
+			seq = zkstat_readbegin(sc);
+
+			tmp = *as;
+		} while (zkstat_readretry(sc, seq));
+
+		sum->as_hits	+= tmp.as_hits;
+		sum->as_pkts	+= tmp.as_pkts;
+		sum->as_bytes	+= tmp.as_bytes;
+	}
+}
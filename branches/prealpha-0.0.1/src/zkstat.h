@@ -0,0 +1,183 @@
+/*
+ *----------------------------------------------------------------------------
+ *
+ * Zelkova - A Firewall and Intrusion Prevention System on Linux Kernel
+ *
+ * Copyright (C) 2005 Dongsu Park <advance@dongsu.pe.kr>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111, USA.
+ *
+ * $Id$
+ *----------------------------------------------------------------------------
+ */
+
+/** @file zkstat.h
+ * Define variables, constants, structures, and function declarations
+ * for per-CPU packet, byte and verdict counters.
+ */
+
+#ifndef __ZKSTAT_H__
+#define __ZKSTAT_H__
+
+#include "zelkova.h"
+
+/* zkactstat_t
+ * :Counters of a rule on one CPU (zkact_t::act_stat)
+ */
+
+typedef struct zkactstat {
+	uint32_t		as_hits;		/* hit counts of FIS-tree queries */
+	uint32_t		as_pkts;		/* packet counts */
+	uint64_t		as_bytes;		/* byte counts */
+} zkactstat_t;
+
+/* zkrulestat_t
+ * :Counters of a rule summed over all CPUs (SIOCGETRULEST)
+ */
+
+typedef struct zkrulestat {
+	uint32_t		zrs_pid;		/* policy id. */
+	uint32_t		zrs_hits;		/* hit counts of FIS-tree queries */
+	uint32_t		zrs_pkts;		/* packet counts */
+	uint32_t		zrs_reserved;	/* NOT USED */
+	uint64_t		zrs_bytes;		/* byte counts */
+} zkrulestat_t;
+
+/* zkrulestatreq_t
+ * :Argument of SIOCGETRULEST. zrq_nelem is the size of zrq_table on the
+ *  call, and the number of rules filled on the return.
+ */
+
+typedef struct zkrulestatreq {
+	uint32_t		zrq_nelem;		/* number of entries */
+	zkrulestat_t	*zrq_table;		/* counters of static rules */
+} zkrulestatreq_t;
+
+#ifdef __KERNEL__
+#include <linux/smp.h>				/* smp_processor_id() */
+#include <linux/interrupt.h>		/* local_bh_disable() */
+
+/* zkstatcpu_t
+ * :Counters of one CPU. Only that CPU writes them, so they need no lock
+ *  and never bounce between caches. zsc_seq is odd while an update is in
+ *  progress, which lets readers on 32-bit hosts see 64-bit counters
+ *  consistently. It also guards the zkactstat_t entries of the CPU.
+ */
+
+typedef struct zkstatcpu {
+	uint32_t		zsc_seq;		/* update sequence */
+	uint64_t		zsc_nallow[2];	/* allowed packets (inbound, outbound) */
+	uint64_t		zsc_ndrop[2];	/* dropped packets (inbound, outbound) */
+} ____cacheline_aligned zkstatcpu_t;
+
+extern zkstatcpu_t	zkstat_cpu[NR_CPUS];
+
+zkactstat_t *zkstat_alloc(uint32_t nelem);
+void zkstat_free(zkactstat_t *stat);
+void zkstat_sumfilter(uint64_t nallow[2], uint64_t ndrop[2]);
+void zkstat_sumrule(zkact_t *act, zkactstat_t *sum);
+
+/* zkstat_begin(): Start updating the counters of this CPU.
+ * Bottom halves are kept off so that the output hook, which runs in
+ * process context, is not interrupted by the other hooks on the same CPU.
+ */
+
+static inline zkstatcpu_t *zkstat_begin(void)
+{
+	zkstatcpu_t		*sc;
+
+	local_bh_disable();
+
+	sc = &zkstat_cpu[smp_processor_id()];
+
+#if BITS_PER_LONG == 32
+	sc->zsc_seq++;
+	smp_wmb();
+#endif
+
+	return sc;
+}
+
+/* zkstat_end(): Finish updating the counters of this CPU */
+
+static inline void zkstat_end(zkstatcpu_t *sc)
+{
+#if BITS_PER_LONG == 32
+	smp_wmb();
+	sc->zsc_seq++;
+#endif
+
+	local_bh_enable();
+}
+
+/* zkstat_actstat(): Counters of a rule on this CPU, NULL if it has none */
+
+static inline zkactstat_t *zkstat_actstat(zkact_t *act)
+{
+	if (act->act_stat == NULL) {
+		return NULL;
+	}
+
+	return act->act_stat + cpu_number_map(smp_processor_id()) * act->act_nstat;
+}
+
+/* zkstat_verdict(): Count a verdict */
+
+static inline void zkstat_verdict(int out, int allow)
+{
+	zkstatcpu_t		*sc = zkstat_begin();
+
+	if (allow) {
+		sc->zsc_nallow[out]++;
+	}
+	else {
+		sc->zsc_ndrop[out]++;
+	}
+
+	zkstat_end(sc);
+}
+
+/* zkstat_hit(): Count a FIS-tree query which selected a rule */
+
+static inline void zkstat_hit(zkact_t *act)
+{
+	zkstatcpu_t		*sc = zkstat_begin();
+	zkactstat_t		*as = zkstat_actstat(act);
+
+	if (as != NULL) {
+		as->as_hits++;
+	}
+
+	zkstat_end(sc);
+}
+
+/* zkstat_rule(): Count packets and bytes on a rule */
+
+static inline void zkstat_rule(zkact_t *act, uint32_t pkts, uint64_t bytes)
+{
+	zkstatcpu_t		*sc = zkstat_begin();
+	zkactstat_t		*as = zkstat_actstat(act);
+
+	if (as != NULL) {
+		as->as_pkts += pkts;
+		as->as_bytes += bytes;
+	}
+
+	zkstat_end(sc);
+}
+
+#endif	/* __KERNEL__ */
+
+#endif	/* __ZKSTAT_H__ */
@@ -0,0 +1,378 @@
+/*
+ *----------------------------------------------------------------------------
+ *
+ * Zelkova - A Firewall and Intrusion Prevention System on Linux Kernel
+ *
+ * Copyright (C) 2005 Dongsu Park <advance@dongsu.pe.kr>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111, USA.
+ *
+ * $Id$
+ *----------------------------------------------------------------------------
+ */
+
+/** @file zktcp.c
+ * Tracks TCP states and sequence windows of sessions
+ *
+ * The state of a session moves by a single lookup into a transition
+ * table indexed by the direction, the class of the TCP flags and the
+ * current state. Sequence numbers are checked against the windows seen
+ * in both directions in the way of "Real Stateful TCP Packet Filtering
+ * in IP Filter" (G. van Rooij).
+ */
+
+#define __NO_VERSION__
+
+#include <linux/kernel.h>			/* printk() */
+#include <linux/sched.h>			/* HZ */
+#include <linux/skbuff.h>			/* sk_buff */
+#include <linux/ip.h>				/* iphdr */
+#include <linux/tcp.h>				/* tcphdr */
+#include <asm/bitops.h>				/* set_bit(), clear_bit() */
+
+#include "zksession.h"
+#include "zktcp.h"
+
+
+#define fSY		TCP_F_SYN
+#define fSA		TCP_F_SYNACK
+#define fFI		TCP_F_FIN
+#define fAC		TCP_F_ACK
+#define fRS		TCP_F_RST
+#define fNO		TCP_F_NONE
+
+/* zktcp_flagclass[]
+ * :Class of the flag bits FIN, SYN, RST, PSH, ACK and URG (the lower 6
+ *  bits of the 13th byte of the header). Combinations which no sane
+ *  stack sends (SYN+FIN, SYN+RST, FIN without ACK, no flag) are fNO.
+ */
+
+static const uint8_t zktcp_flagclass[64] = {
+/*		  ---	 F		S		SF		R		RF		RS		RSF */
+/* -- */	fNO,	fNO,	fSY,	fNO,	fRS,	fNO,	fNO,	fNO,
+/* P- */	fNO,	fNO,	fSY,	fNO,	fRS,	fNO,	fNO,	fNO,
+/* -A */	fAC,	fFI,	fSA,	fNO,	fRS,	fNO,	fNO,	fNO,
+/* PA */	fAC,	fFI,	fSA,	fNO,	fRS,	fNO,	fNO,	fNO,
+/* U- */	fNO,	fNO,	fSY,	fNO,	fRS,	fNO,	fNO,	fNO,
+/* UP */	fNO,	fNO,	fSY,	fNO,	fRS,	fNO,	fNO,	fNO,
+/* UA */	fAC,	fFI,	fSA,	fNO,	fRS,	fNO,	fNO,	fNO,
+/* UPA */	fAC,	fFI,	fSA,	fNO,	fRS,	fNO,	fNO,	fNO,
+};
+
+#define sNO		TCP_S_NONE
+#define sSS		TCP_S_SYNSENT
+#define sSR		TCP_S_SYNRECV
+#define sES		TCP_S_ESTABLISHED
+#define sFW		TCP_S_FINWAIT
+#define sCW		TCP_S_CLOSEWAIT
+#define sLA		TCP_S_LASTACK
+#define sTW		TCP_S_TIMEWAIT
+#define sCL		TCP_S_CLOSE
+#define sIV		TCP_S_INVALID
+
+/* zktcp_trans[dir][class][state]
+ * :The next state. A session found in the middle of a connection (an ACK
+ *  on sNO) is picked up as established; a SYN on a closed one starts over.
+ */
+
+static const uint8_t zktcp_trans[2][TCP_F_MAX][TCP_S_MAX] = {
+	{
+/* request	  sNO	sSS	sSR	sES	sFW	sCW	sLA	sTW	sCL */
+/* SYN */	{ sSS,	sSS,	sIV,	sIV,	sIV,	sIV,	sIV,	sSS,	sSS },
+/* SYNACK */	{ sIV,	sIV,	sIV,	sIV,	sIV,	sIV,	sIV,	sIV,	sIV },
+/* FIN */	{ sIV,	sIV,	sFW,	sFW,	sFW,	sLA,	sLA,	sTW,	sCL },
+/* ACK */	{ sES,	sIV,	sES,	sES,	sFW,	sCW,	sTW,	sTW,	sCL },
+/* RST */	{ sIV,	sCL,	sCL,	sCL,	sCL,	sCL,	sCL,	sCL,	sCL },
+/* NONE */	{ sIV,	sIV,	sIV,	sIV,	sIV,	sIV,	sIV,	sIV,	sIV },
+	},
+	{
+/* response	  sNO	sSS	sSR	sES	sFW	sCW	sLA	sTW	sCL */
+/* SYN */	{ sIV,	sIV,	sIV,	sIV,	sIV,	sIV,	sIV,	sIV,	sIV },
+/* SYNACK */	{ sIV,	sSR,	sSR,	sES,	sIV,	sIV,	sIV,	sIV,	sIV },
+/* FIN */	{ sIV,	sIV,	sIV,	sCW,	sLA,	sCW,	sLA,	sTW,	sCL },
+/* ACK */	{ sIV,	sIV,	sSR,	sES,	sFW,	sCW,	sTW,	sTW,	sCL },
+/* RST */	{ sIV,	sCL,	sCL,	sCL,	sCL,	sCL,	sCL,	sCL,	sCL },
+/* NONE */	{ sIV,	sIV,	sIV,	sIV,	sIV,	sIV,	sIV,	sIV,	sIV },
+	},
+};
+
+/* zktcp_timeout[]
+ * :Lifetime of a session after its last packet, per state. Half-open
+ *  and closing sessions go away quickly to keep the table small.
+ */
+
+const unsigned long zktcp_timeout[TCP_S_MAX] = {
+	IPSESS_EMBRYONIC_TIMEOUT,	/* sNO */
+	20 * HZ,					/* sSS */
+	20 * HZ,					/* sSR */
+	IPSESS_TIMEOUT,				/* sES */
+	2 * 60 * HZ,				/* sFW */
+	60 * HZ,					/* sCW */
+	30 * HZ,					/* sLA */
+	2 * 60 * HZ,				/* sTW */
+	10 * HZ,					/* sCL */
+};
+
+
+/**
+ *---------------------------------------------------------------------------
+ *
+ * @fn     static int zktcp_wscale(struct tcphdr *th, uint8_t *wscale)
+ * @brief  Find the window scale option of a SYN
+ * @param  th: TCP header (options included are in the linear area)
+ * @param  wscale: (out) shift count
+ * @return 1 if found, 0 if not.
+ * @date   18 Oct, 2026
+ * @see    zktcp_track()
+ *
+ *  Find the window scale option of a SYN
+ *
+ *---------------------------------------------------------------------------
+ */
+
+static int zktcp_wscale(struct tcphdr *th, uint8_t *wscale)
+{
+	uint8_t		*opt = (uint8_t *)(th + 1);
+	uint8_t		*end = (uint8_t *)th + (th->doff << 2);
+
+	while (opt < end) {
+		switch (opt[0]) {
+		case 0:		/* TCPOPT_EOL */
+			return 0;
+		case 1:		/* TCPOPT_NOP */
+			opt++;
+			continue;
+		}
+
+		if (opt + 1 >= end || opt[1] < 2 || opt + opt[1] > end) {
+			return 0;
+		}
+
+		if (opt[0] == 3 && opt[1] == 3) {	/* TCPOPT_WINDOW */
+			*wscale = (opt[2] > 14) ? 14 : opt[2];
+			return 1;
+		}
+
+		opt += opt[1];
+	}
+
+	return 0;
+}
+
+/* zktcp_header(): TCP header of a packet if it is in the linear area */
+
+static inline struct tcphdr *zktcp_header(struct sk_buff *skb)
+{
+	struct iphdr	*iph = skb->nh.iph;
+	struct tcphdr	*th;
+	uint32_t		hlen = iph->ihl << 2;
+
+	if (skb_headlen(skb) < hlen + sizeof(struct tcphdr)) {
+		return NULL;
+	}
+
+	th = (struct tcphdr *)((uint8_t *)iph + hlen);
+
+	if (th->doff < 5 || skb_headlen(skb) < hlen + (th->doff << 2)) {
+		return NULL;
+	}
+
+	return th;
+}
+
+/* zktcp_end(): Sequence number right after a segment */
+
+static inline uint32_t zktcp_end(struct iphdr *iph, struct tcphdr *th)
+{
+	return ntohl(th->seq) + ntohs(iph->tot_len) - (iph->ihl << 2) - (th->doff << 2)
+		+ th->syn + th->fin;
+}
+
+
+/**
+ *---------------------------------------------------------------------------
+ *
+ * @fn     int zktcp_track(zkipsess_t *is, int dir, struct sk_buff *skb)
+ * @brief  Track a TCP segment on its session
+ * @param  is: session
+ * @param  dir: 0 if the segment is a request of the session, 1 if a response
+ * @param  skb: segment
+ * @return 0 if normal, -1 if the segment does not fit the session.
+ * @date   18 Oct, 2026
+ * @see    zktcp_advance(), ipsess_timeout()
+ *
+ *  Move the TCP state of a session and check the sequence numbers of a
+ *  segment against the windows of both directions. A segment which is
+ *  invalid for the state or out of the window leaves the session as it
+ *  is, and should be dropped by the caller.
+ *  NOTE: The caller has to hold the lock of the session (zis_lock).
+ *
+ *---------------------------------------------------------------------------
+ */
+
+int zktcp_track(zkipsess_t *is, int dir, struct sk_buff *skb)
+{
+	struct iphdr	*iph = skb->nh.iph;
+	struct tcphdr	*th;
+	zktcpdir_t		*snd = &is->zis_tcp[dir];
+	zktcpdir_t		*rcv = &is->zis_tcp[!dir];
+	uint32_t		seq, ack, end, win, maxack;
+	uint8_t			class, state;
+
+	if ((th = zktcp_header(skb)) == NULL) {
+		return -1;
+	}
+
+	class = zktcp_flagclass[((uint8_t *)th)[13] & 0x3f];
+	state = zktcp_trans[dir][class][is->zis_tcpstate];
+
+	if (state == TCP_S_INVALID) {
+		return -1;
+	}
+
+	seq = ntohl(th->seq);
+	ack = ntohl(th->ack_seq);
+	end = zktcp_end(iph, th);
+	win = ntohs(th->window);
+
+	switch (class) {
+	case TCP_F_SYN:
+		/* A new connection; forget the old one */
+		memset(is->zis_tcp, 0x00, sizeof(is->zis_tcp));
+
+		/* fall through */
+
+	case TCP_F_SYNACK:
+		/* Windows of SYNs are never scaled */
+		snd->td_end		= end;
+		snd->td_maxend	= end;
+		snd->td_maxwin	= win ? win : 1;
+		snd->td_flags	= TD_INIT;
+
+		if (zktcp_wscale(th, &snd->td_wscale)) {
+			snd->td_flags |= TD_WSCALE;
+		}
+
+		if (class == TCP_F_SYN) {
+			break;
+		}
+
+		/* Scaling is on only if both sides have offered it */
+		if (!(snd->td_flags & rcv->td_flags & TD_WSCALE)) {
+			snd->td_wscale = 0;
+			rcv->td_wscale = 0;
+		}
+
+		if (TCP_SEQ_AFTER(ack + win, rcv->td_maxend)) {
+			rcv->td_maxend = ack + win;
+		}
+		break;
+
+	default:
+		win <<= snd->td_wscale;
+
+		if (!(snd->td_flags & TD_INIT)) {
+			/* The first segment of a direction picked up midstream */
+			snd->td_end		= end;
+			snd->td_maxend	= end;
+			snd->td_maxwin	= win ? win : 1;
+			snd->td_flags	|= TD_INIT;
+		}
+		else if ((rcv->td_flags & TD_INIT)) {
+			if (!th->ack) {
+				ack = rcv->td_end;
+			}
+
+			maxack = snd->td_maxwin ? snd->td_maxwin : TCP_MAXACKWINDOW;
+
+			if (TCP_SEQ_AFTER(seq, snd->td_maxend) ||
+					TCP_SEQ_BEFORE(end, snd->td_end - rcv->td_maxwin) ||
+					TCP_SEQ_AFTER(ack, rcv->td_end) ||
+					TCP_SEQ_BEFORE(ack, rcv->td_end - maxack)) {
+				return -1;
+			}
+		}
+
+		if (snd->td_maxwin < win) {
+			snd->td_maxwin = win;
+		}
+
+		if (TCP_SEQ_AFTER(end, snd->td_end)) {
+			snd->td_end = end;
+		}
+
+		if (th->ack && TCP_SEQ_AFTER(ack + win, rcv->td_maxend)) {
+			rcv->td_maxend = ack + win;
+		}
+		break;
+	}
+
+	is->zis_tcpstate = state;
+
+	/* Closing sessions lose the protection from early eviction */
+	if (state == TCP_S_ESTABLISHED) {
+		set_bit(IS_ESTABLISHED_B, &is->zis_flag);
+	}
+	else if (state >= TCP_S_TIMEWAIT) {
+		clear_bit(IS_ESTABLISHED_B, &is->zis_flag);
+	}
+
+	return 0;
+}
+
+
+/**
+ *---------------------------------------------------------------------------
+ *
+ * @fn     void zktcp_advance(zkipsess_t *is, int dir, struct sk_buff *skb)
+ * @brief  Advance the windows of a session by a segment
+ * @param  is: session
+ * @param  dir: direction of the segment
+ * @param  skb: segment without SYN, FIN and RST
+ * @return NONE
+ * @date   18 Oct, 2026
+ * @see    zktcp_track(), zkflow_check()
+ *
+ *  Advance the window edges of a session without any check, so that they
+ *  are still right when a segment of an offloaded flow takes the slow
+ *  path again.
+ *  NOTE: The caller has to hold the lock of the session (zis_lock).
+ *
+ *---------------------------------------------------------------------------
+ */
+
+void zktcp_advance(zkipsess_t *is, int dir, struct sk_buff *skb)
+{
+	struct iphdr	*iph = skb->nh.iph;
+	struct tcphdr	*th = (struct tcphdr *)((uint8_t *)iph + (iph->ihl << 2));
+	zktcpdir_t		*snd = &is->zis_tcp[dir];
+	zktcpdir_t		*rcv = &is->zis_tcp[!dir];
+	uint32_t		end, win;
+
+	end = zktcp_end(iph, th);
+	win = ntohs(th->window) << snd->td_wscale;
+
+	if (TCP_SEQ_AFTER(end, snd->td_end)) {
+		snd->td_end = end;
+	}
+
+	if (snd->td_maxwin < win) {
+		snd->td_maxwin = win;
+	}
+
+	if (th->ack && TCP_SEQ_AFTER(ntohl(th->ack_seq) + win, rcv->td_maxend)) {
+		rcv->td_maxend = ntohl(th->ack_seq) + win;
+	}
+}
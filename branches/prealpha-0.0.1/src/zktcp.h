@@ -0,0 +1,95 @@
+/*
+ *----------------------------------------------------------------------------
+ *
+ * Zelkova - A Firewall and Intrusion Prevention System on Linux Kernel
+ *
+ * Copyright (C) 2005 Dongsu Park <advance@dongsu.pe.kr>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111, USA.
+ *
+ * $Id$
+ *----------------------------------------------------------------------------
+ */
+
+/** @file zktcp.h
+ * Define variables, constants, structures, and function declarations
+ * for TCP state tracking of sessions.
+ */
+
+#ifndef __ZKTCP_H__
+#define __ZKTCP_H__
+
+struct zkipsess;
+
+/* zktcpdir_t
+ * :TCP tracking of one direction of a session
+ */
+
+typedef struct zktcpdir {
+	uint32_t		td_end;			/* highest seq + len sent */
+	uint32_t		td_maxend;		/* highest ack + window of the peer */
+	uint32_t		td_maxwin;		/* largest window advertised (scaled) */
+	uint8_t			td_wscale;		/* window scale factor */
+	uint8_t			td_flags;		/* TD_* */
+	uint16_t		td_reserved;	/* NOT USED */
+} zktcpdir_t;
+
+/* zktcpdir_t::td_flags */
+
+#define TD_WSCALE		0x01	/**< Window scale option was sent */
+#define TD_INIT			0x02	/**< Window edges have been set */
+
+/* TCP states of a session (zkipsess_t::zis_tcpstate) */
+
+#define TCP_S_NONE			0	/**< No packet seen yet (or not TCP) */
+#define TCP_S_SYNSENT		1	/**< SYN seen */
+#define TCP_S_SYNRECV		2	/**< SYN/ACK seen */
+#define TCP_S_ESTABLISHED	3	/**< Handshake done */
+#define TCP_S_FINWAIT		4	/**< FIN from the originator */
+#define TCP_S_CLOSEWAIT		5	/**< FIN from the responder */
+#define TCP_S_LASTACK		6	/**< FINs from both sides */
+#define TCP_S_TIMEWAIT		7	/**< The last FIN was acknowledged */
+#define TCP_S_CLOSE			8	/**< RST seen */
+#define TCP_S_MAX			9
+
+#define TCP_S_INVALID		0xff	/**< (transition) The packet does not fit the state */
+
+/* Classes of TCP flag combinations (rows of the transition table) */
+
+#define TCP_F_SYN			0
+#define TCP_F_SYNACK		1
+#define TCP_F_FIN			2
+#define TCP_F_ACK			3
+#define TCP_F_RST			4
+#define TCP_F_NONE			5	/**< No flag or a bogus combination */
+#define TCP_F_MAX			6
+
+/* Sequence number comparisons which survive the wrap around */
+
+#define TCP_SEQ_BEFORE(a, b)	((int32_t)((a) - (b)) < 0)
+#define TCP_SEQ_AFTER(a, b)		TCP_SEQ_BEFORE(b, a)
+
+#define TCP_MAXACKWINDOW	66000	/**< Slack of acks when no window is known */
+
+extern const unsigned long	zktcp_timeout[TCP_S_MAX];	/**< Lifetime per state */
+
+#ifdef __KERNEL__
+struct sk_buff;
+
+int zktcp_track(struct zkipsess *is, int dir, struct sk_buff *skb);
+void zktcp_advance(struct zkipsess *is, int dir, struct sk_buff *skb);
+#endif	/* __KERNEL__ */
+
+#endif	/* __ZKTCP_H__ */